@@ -56,6 +56,28 @@
  *
  * History:
  *
+ *  2026-10-16  The sampling pattern cache is locked, and the patterns are
+ *              reference counted: lensy_pattern_cone() and
+ *              lensy_pattern_beam() are paired with lensy_pattern_release().
+ *  2026-10-16  lensy_cone_count() skips the empty rings of a cone wider
+ *              than 360 degrees, as lensy_cone_directions() does.
+ *  2026-10-16  The lensy_intersect_X() functions are made of the
+ *              lensy_hit_t_X() and lensy_normal_X() functions, so the
+ *              surface math is in one place.
+ *  2026-10-16  A borrowed bundle (a mapped ray file) is copied before it
+ *              grows, and its columns are not freed.
+ *  2026-10-16  Added the ray weights of a bundle; lensy_ccd_add() adds
+ *              the counts of a ray times its weight.
+ *  2026-10-16  Added lensy_fresnel_reflectance().
+ *  2026-10-16  Added the lensy_hit_t_X() functions, for where along a ray
+ *              a surface is intersected without the surface normal, and
+ *              the lensy_normal_X() functions for the normal on demand.
+ *  2026-10-16  Added ray bundles, and lensy_cone_bundle(). The cone rotation
+ *              is now set up once per cone, instead of for every ray.
+ *  2026-10-16  Added the sampling pattern cache used by lensy_cone() and
+ *              lensy_beam().
+ *  2026-10-16  Added lensy_bundle_clone(), lensy_ccd_pixel() and
+ *              lensy_ccd_add().
  *  2015-06-09  Reorganize into library functions
  *  2013-11-14  Added a lensy_ccd_struct type for (flat) CCD type detector.
  *  2011-03-13  Added functions lensy_cone() and lensy_beam().
@@ -84,6 +106,7 @@
 #include <float.h>
 #include <limits.h>
 #include <math.h>
+#include <pthread.h>
 #include <search.h>
 #include <string.h>
 #include <stdbool.h>
@@ -106,23 +129,21 @@
 //--------------------------------------------------- lensy_inner3
 double lensy_inner3(double a[3], double b[3])
 {
-	return (a[0]*b[0] + a[1]*b[1] + a[2]*b[2]);
+	return lensy_dot3(a, b);
 }
 
 
 //--------------------------------------------------- lensy_mag3
 double lensy_mag3(double a[3])
 {
-	return (sqrt(lensy_inner3(a, a)));
+	return lensy_norm3(a);
 }
 
 
 //--------------------------------------------------- lensy_cross3
 void lensy_cross3(double a[3], double b[3], double r[3])
 {
-	r[0] =   a[1]*b[2] - b[1]*a[2];
-	r[1] = -(a[0]*b[2] - b[0]*a[2]);
-	r[2] =   a[0]*b[1] - b[0]*a[1];
+	lensy_vcross3(a, b, r);
 }
 
 
@@ -142,20 +163,218 @@ void lensy_cross3(double a[3], double b[3], double r[3])
  * A return value of -1 means that the ray is outside the aperture.
  * A return value of -2 means that there is no intersect point.
  *
+ * The intersect point is found by lensy_hit_t_paraboloid(), and the normal
+ * by lensy_normal_paraboloid().
  */
 int32_t lensy_intersect_paraboloid(struct lensy_ray_struct *r,
 					struct lensy_paraboloid_struct *p,
 					double q[3], double n[3])
 {
-	double d0, d1, d2, d3, d4, d5, d6, d7, d8, d9, d10;
-	double w0[3], w1[3], w2[3];
+	double t;
+	int32_t rc;
+
+	q[0] = r->p[0];
+	q[1] = r->p[1];
+	q[2] = r->p[2];
+
+	rc = lensy_hit_t_paraboloid(r, p, &t);
+	if (rc == -2) return -2;
+
+	lensy_ray_at(r, t, q);
+	if (lensy_normal_paraboloid(p, q, n) < 0) return -2;
+	return rc;
+}
+
+
+/*------------------------------------------------ lensy_intersect_sphere
+ * Calculate where a ray intersects a sphere.
+ *
+ * The ray structure 'r' and the sphere structure 's' passed to this function
+ * must be initialized with values such that the ray will intersect the sphere,
+ * starting from the start position 'p', by multiplying it (the ray) by a
+ * positive value.
+ *
+ * The return vector q[3] is the calculated intersect point.
+ * The return vector n[3] is the unit (outward) normal vector to the surface
+ * at the intersect point.
+ *
+ * A return value of zero means OK.
+ * A return value of -1 means that the ray is outside the aperture.
+ * A return value of -2 means that there is no intersect point.
+ *
+ * The intersect point is found by lensy_hit_t_sphere(), and the normal
+ * by lensy_normal_sphere().
+ */
+int32_t lensy_intersect_sphere(struct lensy_ray_struct *r,
+						struct lensy_sphere_struct *s,
+						double q[3], double n[3])
+{
+	double t;
+	int32_t rc;
+
+	q[0] = r->p[0];
+	q[1] = r->p[1];
+	q[2] = r->p[2];
+
+	rc = lensy_hit_t_sphere(r, s, &t);
+	if (rc == -2) return -2;
+
+	lensy_ray_at(r, t, q);
+	if (lensy_normal_sphere(s, q, n) < 0) return -2;
+	return rc;
+}
+
+
+/*---------------------------------------------- lensy_intersect_cylinder
+ * Calculate where a ray intersects a cylinder.
+ *
+ * The ray structure 'r' and the cylinder structure 'c' passed to this function
+ * must be initialized with values such that the ray will intersect the
+ * cylinder, starting from the start position 'p', by multiplying it (the ray)
+ * by a positive value.
+ *
+ * The return vector q[3] is the calculated intersect point.
+ * The return vector n[3] is the unit (outward) normal vector to the surface
+ * at the intersect point.
+ *
+ * A return value of zero means OK.
+ * A return value of -1 means that the ray is outside the aperture.
+ * A return value of -2 means that there is no intersect point.
+ *
+ * The intersect point is found by lensy_hit_t_cylinder(), and the normal
+ * by lensy_normal_cylinder().
+ */
+int32_t lensy_intersect_cylinder(struct lensy_ray_struct *r,
+					struct lensy_cylinder_struct *c,
+					double q[3], double n[3])
+{
+	double t;
+	int32_t rc;
+
+	q[0] = r->p[0];
+	q[1] = r->p[1];
+	q[2] = r->p[2];
+
+	rc = lensy_hit_t_cylinder(r, c, &t);
+	if (rc == -2) return -2;
+
+	lensy_ray_at(r, t, q);
+	if (lensy_normal_cylinder(c, q, n) < 0) return -2;
+	return rc;
+}
+
+
+/*---------------------------------------------- lensy_intersect_plane
+ * Calculate where a ray intersects a plane.
+ *
+ * The ray structure 'r' and the plane structure 'p' passed to this function
+ * must be initialized with values such that the ray will intersect the plane,
+ * starting from the start position 'p', by multiplying it (the ray) by a
+ * positive value.
+ *
+ * The return vector q[3] is the calculated intersect point.
+ * The return vector n[3] is the unit normal vector to the surface.
+ *
+ * A return value of zero means OK.
+ * A return value of -1 means that the ray is outside the aperture.
+ * A return value of -2 means that there is no intersect point.
+ *
+ * The intersect point is found by lensy_hit_t_plane(), and the normal
+ * by lensy_normal_plane().
+ */
+int32_t lensy_intersect_plane(struct lensy_ray_struct *r,
+						struct lensy_plane_struct *p,
+						double q[3], double n[3])
+{
+	double t;
+	int32_t rc;
+
+	q[0] = r->p[0];
+	q[1] = r->p[1];
+	q[2] = r->p[2];
+
+	rc = lensy_hit_t_plane(r, p, &t);
+	if (rc == -2) return -2;
+
+	lensy_ray_at(r, t, q);
+	if (lensy_normal_plane(p, q, n) < 0) return -2;
+	return rc;
+}
+
+
+/*------------------------------------------- lensy_intersect_hyperboloid
+ * Calculate where a ray intersects a hyperboloid.
+ *
+ * The ray structure 'r' and the hyperboloid structure 'h' passed to this
+ * function must be initialized with values such that the ray will intersect
+ * the hyperboloid, starting from the start position 'p', by multiplying it
+ * (the ray) by a positive value.
+ *
+ * The return vector q[3] is the calculated intersect point.
+ * The return vector n[3] is the unit (outward) normal vector to the surface
+ * at the intersect point.
+ *
+ * A return value of zero means OK.
+ * A return value of -1 means that the ray is outside the aperture.
+ * A return value of -2 means that there is no intersect point.
+ *
+ * The intersect point is found by lensy_hit_t_hyperboloid(), and the normal
+ * by lensy_normal_hyperboloid().
+ */
+int32_t lensy_intersect_hyperboloid(struct lensy_ray_struct *r,
+					struct lensy_hyperboloid_struct *h,
+					double q[3], double n[3])
+{
+	double t;
+	int32_t rc;
 
 	q[0] = r->p[0];
 	q[1] = r->p[1];
 	q[2] = r->p[2];
 
+	rc = lensy_hit_t_hyperboloid(r, h, &t);
+	if (rc == -2) return -2;
+
+	lensy_ray_at(r, t, q);
+	if (lensy_normal_hyperboloid(h, q, n) < 0) return -2;
+	return rc;
+}
+
+
+/*----------------------------------------------------------- lensy_ray_at
+ * The point q[3] at the distance 't' along the ray 'r' (in units of the
+ * length of the ray direction vector).
+ */
+void lensy_ray_at(struct lensy_ray_struct *r, double t, double q[3])
+{
+	q[0] = r->p[0] + t * r->d[0];
+	q[1] = r->p[1] + t * r->d[1];
+	q[2] = r->p[2] + t * r->d[2];
+}
+
+
+/*--------------------------------------------------- lensy_hit_t_paraboloid
+ * Calculate only where along the ray a paraboloid is intersected, for
+ * the same intersect point as lensy_intersect_paraboloid(), but without
+ * the surface normal. The intersect point is lensy_ray_at(r, *t), and
+ * the normal there, if it is needed, is lensy_normal_paraboloid().
+ *
+ * The return value is that of lensy_intersect_paraboloid(). When there is
+ * no intersect point, *t is zero.
+ *
+ * The same is true of the other lensy_hit_t_X() functions.
+ */
+int32_t lensy_hit_t_paraboloid(struct lensy_ray_struct *r,
+					struct lensy_paraboloid_struct *p,
+					double *t)
+{
+	double d0, d1, d2, d3, d4, d5, d6, d9, d10;
+	double w0[3], w1[3], w2[3];
+
+	*t = 0.0;
+
 	//--------- w0 (unit vector parallel to p->f)
-	d0 = lensy_mag3(p->f);
+	d0 = lensy_norm3(p->f);
 	w0[0] = p->f[0] / d0;
 	w0[1] = p->f[1] / d0;
 	w0[2] = p->f[2] / d0;
@@ -166,14 +385,12 @@ int32_t lensy_intersect_paraboloid(struct lensy_ray_struct *r,
 	w1[2] = r->p[2] - p->v[2] - p->f[2];
 
 	//------ solve a*x^2 + b*x + c = 0 for x
-	d1 = lensy_inner3(r->d, r->d) - pow(lensy_inner3(r->d, w0), 2.0); // a
-	d4 = 2 * lensy_mag3(p->f) + lensy_inner3(w1, w0);
-	d2 = 2 * lensy_inner3(r->d, w1) - 2 * lensy_inner3(r->d, w0) * d4; // b
-	d3 = lensy_inner3(w1, w1) - d4 * d4;			// c
+	d1 = lensy_dot3(r->d, r->d) - pow(lensy_dot3(r->d, w0), 2.0); // a
+	d4 = 2 * d0 + lensy_dot3(w1, w0);
+	d2 = 2 * lensy_dot3(r->d, w1) - 2 * lensy_dot3(r->d, w0) * d4; // b
+	d3 = lensy_dot3(w1, w1) - d4 * d4;			// c
 	if (d1 == 0.0) {
 		d5 = -d3 / d2;
-//	} else if (fabs(d1) < 1e-6) {		// is this needed?
-//		return -2;
 	} else {
 		d10 = (d2 * d2) - (4 * d1 * d3);
 		if (d10 < 0.0) return -2;
@@ -182,73 +399,36 @@ int32_t lensy_intersect_paraboloid(struct lensy_ray_struct *r,
 		if ((d5 < 0.0) || ((d9 > 0.0) && (d9 < d5))) d5 = d9;
 		if (d5 < 0.0) return -2;
 	}
-	q[0] = r->p[0] + d5 * r->d[0];
-	q[1] = r->p[1] + d5 * r->d[1];
-	q[2] = r->p[2] + d5 * r->d[2];
+	*t = d5;
 
-	w2[0] = q[0] - p->v[0];
-	w2[1] = q[1] - p->v[1];
-	w2[2] = q[2] - p->v[2];
+	//------- the distance of the intersect point from the axis
+	lensy_ray_at(r, d5, w2);
+	w2[0] -= p->v[0];
+	w2[1] -= p->v[1];
+	w2[2] -= p->v[2];
 
-	d6 = lensy_inner3(w2, w0);
+	d6 = lensy_dot3(w2, w0);
 	w2[0] += -d6 * w0[0];
 	w2[1] += -d6 * w0[1];
 	w2[2] += -d6 * w0[2];
 
-	d7 = lensy_mag3(w2);
-	if ((d7 == 0.0) /* || (fabs (d7) < 1e-6) */ ) {
-		n[0] = w0[0];
-		n[1] = w0[1];
-		n[2] = w0[2];
-	} else {
-		w2[0] /= d7;
-		w2[1] /= d7;
-		w2[2] /= d7;
-
-		n[0] = -d7/(2*d0) * w2[0] + w0[0];
-		n[1] = -d7/(2*d0) * w2[1] + w0[1];
-		n[2] = -d7/(2*d0) * w2[2] + w0[2];
-
-		d8 = lensy_mag3(n);
-		n[0] /= d8;
-		n[1] /= d8;
-		n[2] /= d8;
-	}
-
-	if (d7 > p->aperture / 2.0) return -1;
+	if (lensy_norm3(w2) > p->aperture / 2.0) return -1;
 	return 0;
 }
 
 
-/*------------------------------------------------ lensy_intersect_sphere
- * Calculate where a ray intersects a sphere.
- *
- * The ray structure 'r' and the sphere structure 's' passed to this function
- * must be initialized with values such that the ray will intersect the sphere,
- * starting from the start position 'p', by multiplying it (the ray) by a
- * positive value.
- *
- * The return vector q[3] is the calculated intersect point.
- * The return vector n[3] is the unit (outward) normal vector to the surface
- * at the intersect point.
- *
- * A return value of zero means OK.
- * A return value of -1 means that the ray is outside the aperture.
- * A return value of -2 means that there is no intersect point.
- *
- *
+/*------------------------------------------------------ lensy_hit_t_sphere
+ * Calculate only where along the ray a sphere is intersected (see
+ * lensy_hit_t_paraboloid()).
  */
-int32_t lensy_intersect_sphere(struct lensy_ray_struct *r,
-						struct lensy_sphere_struct *s,
-						double q[3], double n[3])
+int32_t lensy_hit_t_sphere(struct lensy_ray_struct *r,
+					struct lensy_sphere_struct *s,
+					double *t)
 {
-	double d0, d1, d2, d3, d4, d5, d7, d8, d9;
+	double d1, d2, d3, d4, d5, d7, d8;
 	double w0[3], w1[3], w2[3], w3[3], q1[3], w4[3];
 
-
-	q[0] = r->p[0];
-	q[1] = r->p[1];
-	q[2] = r->p[2];
+	*t = 0.0;
 
 	//--------- w1 = s->v + s->vr (sphere center vector)
 	w1[0] = s->v[0] + s->vr[0];
@@ -261,121 +441,79 @@ int32_t lensy_intersect_sphere(struct lensy_ray_struct *r,
 	w0[2] = r->p[2] - w1[2];
 
 	//------ solve a*x^2 + b*x + c = 0 for x
-	d1 = lensy_inner3(r->d, r->d);			// a
-	d2 = 2 * lensy_inner3(r->d, w0);			// b
-	d3 = lensy_inner3(w0, w0) - lensy_inner3(s->vr, s->vr);	// c
+	d1 = lensy_dot3(r->d, r->d);			// a
+	d2 = 2 * lensy_dot3(r->d, w0);			// b
+	d3 = lensy_dot3(w0, w0) - lensy_dot3(s->vr, s->vr);	// c
 	if (d1 == 0.0) {
 		d4 = -d3 / d2;
-//	} else if (fabs(d1) < 1e-6) {	// is this needed?
-//		return -2;
 	} else {
-		/*
-		 * Select the correct intersect point, from the two possible
-		 * intersect points, by choosing the one on the 'vertex' side
-		 * of the center of the sphere.
-		 */
+		//------- the intersect point on the 'vertex' side of the center
 		d5 = (d2 * d2) - (4 * d1 * d3);
 		if (d5 < 0.0) return -2;
 
 		d4 = (-d2 + sqrt(d5)) / (2 * d1);
-		q1[0] = r->p[0] + d4 * r->d[0];
-		q1[1] = r->p[1] + d4 * r->d[1];
-		q1[2] = r->p[2] + d4 * r->d[2];
-
+		lensy_ray_at(r, d4, q1);
 		w4[0] = q1[0] - w1[0];
 		w4[1] = q1[1] - w1[1];
 		w4[2] = q1[2] - w1[2];
 
-		if (lensy_inner3(w4, s->vr) >= 0.0)
+		if (lensy_dot3(w4, s->vr) >= 0.0)
 			d4 = (-d2 - sqrt(d5)) / (2 * d1);
 	}
-	q1[0] = r->p[0] + d4 * r->d[0];
-	q1[1] = r->p[1] + d4 * r->d[1];
-	q1[2] = r->p[2] + d4 * r->d[2];
-
+	lensy_ray_at(r, d4, q1);
 	w4[0] = q1[0] - w1[0];
 	w4[1] = q1[1] - w1[1];
 	w4[2] = q1[2] - w1[2];
 
-	if (lensy_inner3(w4, s->vr) >= 0.0) return -2;
-
-	q[0] = q1[0];
-	q[1] = q1[1];
-	q[2] = q1[2];
+	if (lensy_dot3(w4, s->vr) >= 0.0) return -2;
+	*t = d4;
 
-	n[0] = q[0] - w1[0];
-	n[1] = q[1] - w1[1];
-	n[2] = q[2] - w1[2];
+	//------- the distance of the intersect point from the axis
+	w2[0] = q1[0] - s->v[0];
+	w2[1] = q1[1] - s->v[1];
+	w2[2] = q1[2] - s->v[2];
 
-	d0 = lensy_mag3(n);
-	if (d0 > 0.0) {
-		n[0] /= d0;
-		n[1] /= d0;
-		n[2] /= d0;
-	}
-
-	w2[0] = q[0] - s->v[0];
-	w2[1] = q[1] - s->v[1];
-	w2[2] = q[2] - s->v[2];
-
-	d7 = lensy_mag3(s->vr);
+	d7 = lensy_norm3(s->vr);
 	w3[0] = s->vr[0] / d7;
 	w3[1] = s->vr[1] / d7;
 	w3[2] = s->vr[2] / d7;
 
-	d8 = lensy_inner3(w2, w3);
+	d8 = lensy_dot3(w2, w3);
 	w2[0] += -d8 * w3[0];
 	w2[1] += -d8 * w3[1];
 	w2[2] += -d8 * w3[2];
 
-	d9 = lensy_mag3(w2);
-	if (d9 > s->aperture / 2.0) return -1;
+	if (lensy_norm3(w2) > s->aperture / 2.0) return -1;
 	return 0;
 }
 
 
-/*---------------------------------------------- lensy_intersect_cylinder
- * Calculate where a ray intersects a cylinder.
- *
- * The ray structure 'r' and the cylinder structure 'c' passed to this function
- * must be initialized with values such that the ray will intersect the
- * cylinder, starting from the start position 'p', by multiplying it (the ray)
- * by a positive value.
- *
- * The return vector q[3] is the calculated intersect point.
- * The return vector n[3] is the unit (outward) normal vector to the surface
- * at the intersect point.
- *
- * A return value of zero means OK.
- * A return value of -1 means that the ray is outside the aperture.
- * A return value of -2 means that there is no intersect point.
- *
+/*---------------------------------------------------- lensy_hit_t_cylinder
+ * Calculate only where along the ray a cylinder is intersected (see
+ * lensy_hit_t_paraboloid()).
  */
-int32_t lensy_intersect_cylinder(struct lensy_ray_struct *r,
+int32_t lensy_hit_t_cylinder(struct lensy_ray_struct *r,
 					struct lensy_cylinder_struct *c,
-					double q[3], double n[3])
+					double *t)
 {
-	double d0, d1, d2, d3, d4, d5, d6, d7, d8, d9, d10, da, db, dc;
+	double d0, d1, d2, d3, d4, d5, d6, d9, da, db, dc;
 	double a[3], w0[3], w1[3], w2[3], w3[3], q1[3], w4[3], w5[3], w6[3];
 
-	q[0] = r->p[0];
-	q[1] = r->p[1];
-	q[2] = r->p[2];
+	*t = 0.0;
 
-	/*------- Make the vector 'a' parallel to the cylinder axis and ensure
-	 * it is perpendicular to c->va and has unit length.
-	 */
-	d0 = lensy_mag3(c->va);
+	//------- the unit vector 'a' along the cylinder axis (see
+	// lensy_normal_cylinder())
+	d0 = lensy_norm3(c->va);
 	if (d0 == 0.0) return -2;
 	w0[0] = c->va[0] / d0;
 	w0[1] = c->va[1] / d0;
 	w0[2] = c->va[2] / d0;
 
-	d1 = lensy_inner3(c->a, w0);
+	d1 = lensy_dot3(c->a, w0);
 	a[0] =  c->a[0] - d1 * w0[0];
 	a[1] =  c->a[1] - d1 * w0[1];
 	a[2] =  c->a[2] - d1 * w0[2];
-	d2 = lensy_mag3(a);
+	d2 = lensy_norm3(a);
 	if (d2 == 0.0) return -2;
 	a[0] /= d2;
 	a[1] /= d2;
@@ -392,8 +530,8 @@ int32_t lensy_intersect_cylinder(struct lensy_ray_struct *r,
 	w2[2] = r->p[2] - w1[2];
 
 	//------ solve a*x^2 + b*x + c = 0 for x
-	d3 = lensy_inner3(w2, a);
-	d4 = lensy_inner3(r->d, a);
+	d3 = lensy_dot3(w2, a);
+	d4 = lensy_dot3(r->d, a);
 	w3[0] = r->d[0] - d4 * a[0];
 	w3[1] = r->d[1] - d4 * a[1];
 	w3[2] = r->d[2] - d4 * a[2];
@@ -402,155 +540,87 @@ int32_t lensy_intersect_cylinder(struct lensy_ray_struct *r,
 	w4[1] = w2[1] - d3 * a[1];
 	w4[2] = w2[2] - d3 * a[2];
 
-	da = lensy_inner3(w3, w3);
-	db = 2 * lensy_inner3(w3, w4);
-	dc = lensy_inner3(w4, w4) - lensy_inner3(c->va, c->va);
+	da = lensy_dot3(w3, w3);
+	db = 2 * lensy_dot3(w3, w4);
+	dc = lensy_dot3(w4, w4) - lensy_dot3(c->va, c->va);
 
 	if (da == 0.0) {
 		d5 = -dc / db;
-//	} else if (fabs(da) < 1e-6) {	// is this needed?
-//		return -2;
 	} else {
-		/*
-		 * Select the correct intersect point, from the two possible
-		 * intersect points, by choosing the one on the 'vertex' side
-		 * of the center of the cylinder.
-		 */
+		//------- the intersect point on the 'vertex' side of the center
 		d6 = (db * db) - (4 * da * dc);
 		if (d6 < 0.0) return -2;
 
 		d5 = (-db + sqrt(d6)) / (2 * da);
-		q1[0] = r->p[0] + d5 * r->d[0];
-		q1[1] = r->p[1] + d5 * r->d[1];
-		q1[2] = r->p[2] + d5 * r->d[2];
-
+		lensy_ray_at(r, d5, q1);
 		w5[0] = q1[0] - w1[0];
 		w5[1] = q1[1] - w1[1];
 		w5[2] = q1[2] - w1[2];
 
-		if (lensy_inner3(w5, c->va) >= 0.0)
+		if (lensy_dot3(w5, c->va) >= 0.0)
 			d5 = (-db - sqrt(d6)) / (2 * da);
 	}
-	q1[0] = r->p[0] + d5 * r->d[0];
-	q1[1] = r->p[1] + d5 * r->d[1];
-	q1[2] = r->p[2] + d5 * r->d[2];
-
+	lensy_ray_at(r, d5, q1);
 	w5[0] = q1[0] - w1[0];
 	w5[1] = q1[1] - w1[1];
 	w5[2] = q1[2] - w1[2];
 
-	if (lensy_inner3(w5, c->va) >= 0.0) return -2;
-
-	q[0] = q1[0];
-	q[1] = q1[1];
-	q[2] = q1[2];
-
-	//--------------------- compute the surface normal
-	d7 = lensy_inner3(w5, a);
-	n[0] = w5[0] - d7 * a[0];
-	n[1] = w5[1] - d7 * a[1];
-	n[2] = w5[2] - d7 * a[2];
-
-	d8 = lensy_mag3(n);
-	if (d8 == 0.0) return -2;
-	n[0] /= d8;
-	n[1] /= d8;
-	n[2] /= d8;
+	if (lensy_dot3(w5, c->va) >= 0.0) return -2;
+	*t = d5;
 
 	//------- determine if the intersect point is inside the aperture
-	d9 = lensy_inner3(w5, w0);
+	d9 = lensy_dot3(w5, w0);
 	w6[0] = w5[0] - d9 * w0[0];
 	w6[1] = w5[1] - d9 * w0[1];
 	w6[2] = w5[2] - d9 * w0[2];
 
-	d10 = lensy_mag3(w6);
-	if (d10 > c->aperture / 2.0) return -1;
+	if (lensy_norm3(w6) > c->aperture / 2.0) return -1;
 	return 0;
 }
 
 
-/*---------------------------------------------- lensy_intersect_plane
- * Calculate where a ray intersects a plane.
- *
- * The ray structure 'r' and the plane structure 'p' passed to this function
- * must be initialized with values such that the ray will intersect the plane,
- * starting from the start position 'p', by multiplying it (the ray) by a
- * positive value.
- *
- * The return vector q[3] is the calculated intersect point.
- * The return vector n[3] is the unit normal vector to the surface.
- *
- * A return value of zero means OK.
- * A return value of -1 means that the ray is outside the aperture.
- * A return value of -2 means that there is no intersect point.
- *
+/*------------------------------------------------------- lensy_hit_t_plane
+ * Calculate only where along the ray a plane is intersected (see
+ * lensy_hit_t_paraboloid()).
  */
-int32_t lensy_intersect_plane(struct lensy_ray_struct *r,
-						struct lensy_plane_struct *p,
-						double q[3], double n[3])
+int32_t lensy_hit_t_plane(struct lensy_ray_struct *r,
+					struct lensy_plane_struct *p,
+					double *t)
 {
-	double d0, d1, d2, d3;
+	double d0, d1;
 	double w[3];
 
-	q[0] = r->p[0];
-	q[1] = r->p[1];
-	q[2] = r->p[2];
+	*t = 0.0;
 
-	d0 = lensy_inner3(r->d, p->n);
-	if ((d0 == 0.0) /* || (fabs (d0) < 1e-6) */) return -2;
+	d0 = lensy_dot3(r->d, p->n);
+	if (d0 == 0.0) return -2;
 
-	d1 = (lensy_inner3(p->v, p->n) - lensy_inner3(r->p, p->n)) / d0;
+	d1 = (lensy_dot3(p->v, p->n) - lensy_dot3(r->p, p->n)) / d0;
 	if (d1 < 0.0) return -2;
+	*t = d1;
 
-	q[0] = r->p[0] + d1 * r->d[0];
-	q[1] = r->p[1] + d1 * r->d[1];
-	q[2] = r->p[2] + d1 * r->d[2];
-
-	d3 = lensy_mag3(p->n);
-	if (d3 == 0.0) return -2;
-	n[0] = p->n[0] / d3;
-	n[1] = p->n[1] / d3;
-	n[2] = p->n[2] / d3;
-
-	w[0] = q[0] - p->v[0];
-	w[1] = q[1] - p->v[1];
-	w[2] = q[2] - p->v[2];
-	d2 = lensy_mag3(w);
-
-	if (d2 > p->aperture / 2.0) return -1;
+	lensy_ray_at(r, d1, w);
+	w[0] -= p->v[0];
+	w[1] -= p->v[1];
+	w[2] -= p->v[2];
 
+	if (lensy_norm3(w) > p->aperture / 2.0) return -1;
 	return 0;
 }
 
 
-/*------------------------------------------- lensy_intersect_hyperboloid
- * Calculate where a ray intersects a hyperboloid.
- *
- * The ray structure 'r' and the hyperboloid structure 'h' passed to this
- * function must be initialized with values such that the ray will intersect
- * the hyperboloid, starting from the start position 'p', by multiplying it
- * (the ray) by a positive value.
- *
- * The return vector q[3] is the calculated intersect point.
- * The return vector n[3] is the unit (outward) normal vector to the surface
- * at the intersect point.
- *
- * A return value of zero means OK.
- * A return value of -1 means that the ray is outside the aperture.
- * A return value of -2 means that there is no intersect point.
- *
+/*-------------------------------------------------- lensy_hit_t_hyperboloid
+ * Calculate only where along the ray a hyperboloid is intersected (see
+ * lensy_hit_t_paraboloid()).
  */
-int32_t lensy_intersect_hyperboloid(struct lensy_ray_struct *r,
+int32_t lensy_hit_t_hyperboloid(struct lensy_ray_struct *r,
 					struct lensy_hyperboloid_struct *h,
-					double q[3], double n[3])
+					double *t)
 {
-	double d0, d1, d2, d3, d4, d5, d7, d8, d9;
+	double d0, d1, d2, d3, d4, d5, d6, d8;
 	double f[3], w0[3], w1[3], w2[3], w3[3], w4[3], q1[3];
 
-
-	q[0] = r->p[0];
-	q[1] = r->p[1];
-	q[2] = r->p[2];
+	*t = 0.0;
 
 	//--------- w1 = h->v + h->a (hyperboloid center)
 	w1[0] = h->v[0] + h->a[0];
@@ -563,7 +633,7 @@ int32_t lensy_intersect_hyperboloid(struct lensy_ray_struct *r,
 	f[2] = w1[2] + (h->e * -h->a[2]);
 
 	//---------
-	d8 = lensy_mag3(h->a);
+	d8 = lensy_norm3(h->a);
 	w2[0] = -h->a[0] / d8;
 	w2[1] = -h->a[1] / d8;
 	w2[2] = -h->a[2] / d8;
@@ -578,61 +648,216 @@ int32_t lensy_intersect_hyperboloid(struct lensy_ray_struct *r,
 
 	//------ solve a*x^2 + b*x + c = 0 for x
 	d0 = h->e * h->e;
-	d4 = lensy_inner3(w2, r->d);
-	d5 = lensy_inner3(w2, w3);
+	d4 = lensy_dot3(w2, r->d);
+	d5 = lensy_dot3(w2, w3);
 
-	d1 = lensy_inner3(r->d, r->d) - (d0 * d4 * d4);		// a
-	d2 = 2 * (lensy_inner3(r->d, w4) - (d0 * d4 * d5));	// b
-	d3 = lensy_inner3(w4, w4) - (d0 * d5 * d5);		// c
+	d1 = lensy_dot3(r->d, r->d) - (d0 * d4 * d4);		// a
+	d2 = 2 * (lensy_dot3(r->d, w4) - (d0 * d4 * d5));	// b
+	d3 = lensy_dot3(w4, w4) - (d0 * d5 * d5);		// c
 
 	if (d1 == 0.0) {
 		d4 = -d3 / d2;
-//	} else if (fabs (d1) < 1e-6) {	// is this needed?
-//		return -2;
 	} else {
-		/*
-		 * Select the correct intersect point, from the two possible
-		 * intersect points.
-		 */
+		//------- the intersect point on the 'vertex' side of the center
 		d5 = (d2 * d2) - (4 * d1 * d3);
 		if (d5 < 0.0) return -2;
 
 		d4 = (-d2 + sqrt(d5)) / (2 * d1);
-		q1[0] = r->p[0] + d4 * r->d[0];
-		q1[1] = r->p[1] + d4 * r->d[1];
-		q1[2] = r->p[2] + d4 * r->d[2];
-
+		lensy_ray_at(r, d4, q1);
 		w4[0] = q1[0] - w1[0];
 		w4[1] = q1[1] - w1[1];
 		w4[2] = q1[2] - w1[2];
 
-		if (lensy_inner3(w4, h->a) >= 0.0)
+		if (lensy_dot3(w4, h->a) >= 0.0)
 			d4 = (-d2 - sqrt(d5))/(2 * d1);
 	}
-	q1[0] = r->p[0] + d4 * r->d[0];
-	q1[1] = r->p[1] + d4 * r->d[1];
-	q1[2] = r->p[2] + d4 * r->d[2];
-
+	lensy_ray_at(r, d4, q1);
 	w4[0] = q1[0] - w1[0];
 	w4[1] = q1[1] - w1[1];
 	w4[2] = q1[2] - w1[2];
 
-	if (lensy_inner3(w4, h->a) >= 0.0) return -2;
+	if (lensy_dot3(w4, h->a) >= 0.0) return -2;
+	*t = d4;
+
+	//------- the distance of the intersect point from the axis
+	w0[0] = q1[0] - h->v[0];
+	w0[1] = q1[1] - h->v[1];
+	w0[2] = q1[2] - h->v[2];
+
+	d6 = lensy_dot3(w0, w2);
+	w0[0] += -d6 * w2[0];
+	w0[1] += -d6 * w2[1];
+	w0[2] += -d6 * w2[2];
+
+	if (lensy_norm3(w0) > h->aperture / 2.0) return -1;
+	return 0;
+}
+
+
+/*-------------------------------------------------- lensy_normal_paraboloid
+ * Calculate the unit normal vector n[3] to a paraboloid at the point q[3]
+ * on its surface, as lensy_intersect_paraboloid() does. This is the normal
+ * for an intersect point found with lensy_hit_t_paraboloid().
+ *
+ * A return value of zero means OK.
+ * A return value of -2 means that there is no normal at q[3] (where
+ * lensy_intersect_X() would return -2).
+ *
+ * The same is true of the other lensy_normal_X() functions.
+ */
+int32_t lensy_normal_paraboloid(struct lensy_paraboloid_struct *p,
+					double q[3], double n[3])
+{
+	double d0, d6, d7, d8;
+	double w0[3], w2[3];
+
+	d0 = lensy_norm3(p->f);
+	w0[0] = p->f[0] / d0;
+	w0[1] = p->f[1] / d0;
+	w0[2] = p->f[2] / d0;
+
+	w2[0] = q[0] - p->v[0];
+	w2[1] = q[1] - p->v[1];
+	w2[2] = q[2] - p->v[2];
+
+	d6 = lensy_dot3(w2, w0);
+	w2[0] += -d6 * w0[0];
+	w2[1] += -d6 * w0[1];
+	w2[2] += -d6 * w0[2];
+
+	d7 = lensy_norm3(w2);
+	if (d7 == 0.0) {
+		n[0] = w0[0];
+		n[1] = w0[1];
+		n[2] = w0[2];
+		return 0;
+	}
+	w2[0] /= d7;
+	w2[1] /= d7;
+	w2[2] /= d7;
+
+	n[0] = -d7/(2*d0) * w2[0] + w0[0];
+	n[1] = -d7/(2*d0) * w2[1] + w0[1];
+	n[2] = -d7/(2*d0) * w2[2] + w0[2];
+
+	d8 = lensy_norm3(n);
+	n[0] /= d8;
+	n[1] /= d8;
+	n[2] /= d8;
+	return 0;
+}
+
+
+/*------------------------------------------------------ lensy_normal_sphere
+ * Calculate the unit (outward) normal vector to a sphere at a point on its
+ * surface (see lensy_normal_paraboloid()).
+ */
+int32_t lensy_normal_sphere(struct lensy_sphere_struct *s,
+					double q[3], double n[3])
+{
+	double d0;
+
+	n[0] = q[0] - (s->v[0] + s->vr[0]);
+	n[1] = q[1] - (s->v[1] + s->vr[1]);
+	n[2] = q[2] - (s->v[2] + s->vr[2]);
+
+	d0 = lensy_norm3(n);
+	if (d0 > 0.0) {
+		n[0] /= d0;
+		n[1] /= d0;
+		n[2] /= d0;
+	}
+	return 0;
+}
+
+
+/*---------------------------------------------------- lensy_normal_cylinder
+ * Calculate the unit (outward) normal vector to a cylinder at a point on
+ * its surface (see lensy_normal_paraboloid()).
+ */
+int32_t lensy_normal_cylinder(struct lensy_cylinder_struct *c,
+					double q[3], double n[3])
+{
+	double d0, d1, d2, d7, d8;
+	double a[3], w0[3], w5[3];
+
+	d0 = lensy_norm3(c->va);
+	if (d0 == 0.0) return -2;
+	w0[0] = c->va[0] / d0;
+	w0[1] = c->va[1] / d0;
+	w0[2] = c->va[2] / d0;
+
+	d1 = lensy_dot3(c->a, w0);
+	a[0] =  c->a[0] - d1 * w0[0];
+	a[1] =  c->a[1] - d1 * w0[1];
+	a[2] =  c->a[2] - d1 * w0[2];
+	d2 = lensy_norm3(a);
+	if (d2 == 0.0) return -2;
+	a[0] /= d2;
+	a[1] /= d2;
+	a[2] /= d2;
+
+	w5[0] = q[0] - (c->v[0] + c->va[0]);
+	w5[1] = q[1] - (c->v[1] + c->va[1]);
+	w5[2] = q[2] - (c->v[2] + c->va[2]);
+
+	d7 = lensy_dot3(w5, a);
+	n[0] = w5[0] - d7 * a[0];
+	n[1] = w5[1] - d7 * a[1];
+	n[2] = w5[2] - d7 * a[2];
+
+	d8 = lensy_norm3(n);
+	if (d8 == 0.0) return -2;
+	n[0] /= d8;
+	n[1] /= d8;
+	n[2] /= d8;
+	return 0;
+}
+
+
+/*------------------------------------------------------- lensy_normal_plane
+ * Calculate the unit normal vector to a plane (see
+ * lensy_normal_paraboloid()).
+ */
+int32_t lensy_normal_plane(struct lensy_plane_struct *p,
+					double q[3], double n[3])
+{
+	double d3;
+
+	d3 = lensy_norm3(p->n);
+	if (d3 == 0.0) return -2;
+	n[0] = p->n[0] / d3;
+	n[1] = p->n[1] / d3;
+	n[2] = p->n[2] / d3;
+	return 0;
+}
+
 
-	q[0] = q1[0];
-	q[1] = q1[1];
-	q[2] = q1[2];
+/*-------------------------------------------------- lensy_normal_hyperboloid
+ * Calculate the unit (outward) normal vector to a hyperboloid at a point
+ * on its surface (see lensy_normal_paraboloid()).
+ */
+int32_t lensy_normal_hyperboloid(struct lensy_hyperboloid_struct *h,
+					double q[3], double n[3])
+{
+	double d0, d1, d7, d8, d9;
+	double w0[3], w2[3];
+
+	d8 = lensy_norm3(h->a);
+	w2[0] = -h->a[0] / d8;
+	w2[1] = -h->a[1] / d8;
+	w2[2] = -h->a[2] / d8;
 
 	w0[0] = q[0] - h->v[0];
 	w0[1] = q[1] - h->v[1];
 	w0[2] = q[2] - h->v[2];
 
-	d0 = lensy_inner3(w0, w2);
+	d0 = lensy_dot3(w0, w2);
 	w0[0] += -d0 * w2[0];
 	w0[1] += -d0 * w2[1];
 	w0[2] += -d0 * w2[2];
 
-	d9 = lensy_mag3(w0);
+	d9 = lensy_norm3(w0);
 	if (d0 == 0.0) {
 		n[0] = w2[0];
 		n[1] = w2[1];
@@ -650,16 +875,11 @@ int32_t lensy_intersect_hyperboloid(struct lensy_ray_struct *r,
 		n[2] = w2[2] - d1 * w0[2];
 	}
 
-	d7 = lensy_mag3(n);
-	if (d7 > 0.0) {
-		n[0] /= d7;
-		n[1] /= d7;
-		n[2] /= d7;
-	} else {
-		return -2;
-	}
-
-	if (d9 > h->aperture / 2.0) return -1;
+	d7 = lensy_norm3(n);
+	if (d7 == 0.0) return -2;
+	n[0] /= d7;
+	n[1] /= d7;
+	n[2] /= d7;
 	return 0;
 }
 
@@ -678,7 +898,7 @@ void lensy_redirect_reflect(struct lensy_ray_struct *r,
 	r->p[1] = q[1];
 	r->p[2]	= q[2];
 
-	d0 = lensy_inner3(r->d, n);
+	d0 = lensy_dot3(r->d, n);
 	r->d[0] += -2 * d0 * n[0];
 	r->d[1] += -2 * d0 * n[1];
 	r->d[2] += -2 * d0 * n[2];
@@ -706,7 +926,7 @@ int32_t lensy_redirect_refract(struct lensy_ray_struct *r,
 	r->p[1]	=  q[1];
 	r->p[2]	=  q[2];
 
-	d0 = lensy_mag3(r->d);
+	d0 = lensy_norm3(r->d);
 	if (d0 == 0.0) return -2;
 
 	u[0] = -r->d[0] / d0;
@@ -716,15 +936,15 @@ int32_t lensy_redirect_refract(struct lensy_ray_struct *r,
 	n1[0] = n[0];
 	n1[1] = n[1];
 	n1[2] = n[2];
-//	if (fabs(lensy_inner3(n1, n1) - 1.0) > 1e-6) return -2;
+//	if (fabs(lensy_dot3(n1, n1) - 1.0) > 1e-6) return -2;
 
-	if (lensy_inner3(u, n1) < 0.0) {
+	if (lensy_dot3(u, n1) < 0.0) {
 		n1[0] = -n1[0];
 		n1[1] = -n1[1];
 		n1[2] = -n1[2];
 	}
-	lensy_cross3(u, n1, w);
-	d1 = lensy_mag3(w);
+	lensy_vcross3(u, n1, w);
+	d1 = lensy_norm3(w);
 	d2 = m * d1;
 	if (fabs(d2) >= 1.0) return -1;
 	d3 = asin(d2);	// angle of transmission w.r.t. the surface normal
@@ -734,7 +954,7 @@ int32_t lensy_redirect_refract(struct lensy_ray_struct *r,
 		w1[1] = w[1] / d1;
 		w1[2] = w[2] / d1;
 
-		lensy_cross3(w1, n1, v);
+		lensy_vcross3(w1, n1, v);
 		r->d[0] = d0 * (cos(d3) * (-n1[0]) + sin(d3) * v[0]);
 		r->d[1] = d0 * (cos(d3) * (-n1[1]) + sin(d3) * v[1]);
 		r->d[2] = d0 * (cos(d3) * (-n1[2]) + sin(d3) * v[2]);
@@ -747,6 +967,30 @@ int32_t lensy_redirect_refract(struct lensy_ray_struct *r,
 }
 
 
+/*--------------------------------------------------- lensy_fresnel_reflectance
+ * The fraction of (unpolarized) light reflected where the ray 'r' meets a
+ * surface with the unit normal 'n', for the index of refraction ratio 'm'
+ * (as for lensy_redirect_refract()). It is the mean of the s and p
+ * reflectances of the Fresnel equations, and 1 past the critical angle.
+ */
+double lensy_fresnel_reflectance(struct lensy_ray_struct *r, double n[3], double m)
+{
+	double d0, ci, ct, st2, rs, rp;
+
+	d0 = lensy_norm3(r->d);
+	if (d0 == 0.0) return 0.0;
+	ci = fabs(lensy_dot3(r->d, n)) / d0;	// cosine of the angle of incidence
+
+	st2 = m * m * (1.0 - ci * ci);
+	if (st2 >= 1.0) return 1.0;
+	ct = sqrt(1.0 - st2);
+
+	rs = (m * ci - ct) / (m * ci + ct);
+	rp = (ci - m * ct) / (ci + m * ct);
+	return 0.5 * (rs * rs + rp * rp);
+}
+
+
 /*--------------------------------------------------- lensy_redirect_diffract
  * Diffract 'ray' from a grating. If the ray direction inner product with
  * the surface normal is negative, 'ray' is reflected. Otherwise, it is
@@ -781,35 +1025,35 @@ int32_t lensy_redirect_diffract(struct lensy_ray_struct *r,
 	r->p[1]	=  q[1];
 	r->p[2]	=  q[2];
 
-	d3 = lensy_mag3(n);
+	d3 = lensy_norm3(n);
 	if (d3 == 0.0) return -2;
 	n1[0] = n[0] / d3;
 	n1[1] = n[1] / d3;
 	n1[2] = n[2] / d3;
 
-	d0 = lensy_mag3(r->d);
+	d0 = lensy_norm3(r->d);
 	if (d0 == 0.0) return -2;
 	w0[0] = r->d[0] / d0;
 	w0[1] = r->d[1] / d0;
 	w0[2] = r->d[2] / d0;
 
-	d1 = lensy_mag3(a);			// the ruling spacing
-	d2 = lensy_inner3(a, n1);
+	d1 = lensy_norm3(a);			// the ruling spacing
+	d2 = lensy_dot3(a, n1);
 	a1[0] = a[0] - d2 * n1[0];	// ensure a1 is perpendicular to n
 	a1[1] = a[1] - d2 * n1[1];
 	a1[2] = a[2] - d2 * n1[2];
 
-	d2 = lensy_mag3(a1);
+	d2 = lensy_norm3(a1);
 	if (d2 == 0.0) return -2;
 	a1[0] /= d2;
 	a1[1] /= d2;
 	a1[2] /= d2;
 
-	lensy_cross3(a1, n1, t1);
+	lensy_vcross3(a1, n1, t1);
 
-	d4 = lensy_inner3(w0, n1);	// (-) for transmit, (+) for reflect
-	d5 = lensy_inner3(w0, a1);
-	d6 = lensy_inner3(w0, t1);
+	d4 = lensy_dot3(w0, n1);	// (-) for transmit, (+) for reflect
+	d5 = lensy_dot3(w0, a1);
+	d6 = lensy_dot3(w0, t1);
 
 	if (d4 == 0.0) return -2;
 	if (d6 == 1.0) return -2;
@@ -943,113 +1187,379 @@ double lensy_index_sellmeier(double wl, struct lensy_sellmeier_struct *a)
 }
 
 
-/*----------------------------------------------------- lensy_cone
- * Create a cone of rays in a list 'pl', centered around the ray 'pr'.
+/*----------------------------------------------------- lensy_bundle_init
+ * Allocate the columns of a ray bundle for 'nmax' rays. The bundle is
+ * initially empty (b->n = 0).
  *
- * Input parameters:
+ * A return value of zero means OK.
+ * A return value of -1 means that malloc failed.
+ */
+int32_t lensy_bundle_init(struct lensy_bundle_struct *b, int32_t nmax)
+{
+	memset(b, 0, sizeof(*b));
+	return lensy_bundle_reserve(b, nmax);
+}
+
+
+/*----------------------------------------------------- lensy_bundle_reserve
+ * Make sure that the bundle has room for at least 'nmax' rays. Existing
+ * rays are kept. The rays of a borrowed bundle are copied to new columns,
+ * which belong to the bundle.
  *
- *	cone_dia	- The diameter of a cone of rays, in degrees.
- *	cone_step	- The angular spacing of rays in the cone, in degrees.
+ * A return value of zero means OK.
+ * A return value of -1 means that realloc failed.
+ */
+int32_t lensy_bundle_reserve(struct lensy_bundle_struct *b, int32_t nmax)
+{
+	struct lensy_bundle_struct b0;
+	int32_t k;
+	void *pv;
+
+	if (nmax <= b->nmax) return 0;
+
+	//------ never realloc the columns of a mapped file
+	if (b->borrowed) {
+		memcpy(&b0, b, sizeof(b0));
+		memset(b, 0, sizeof(*b));
+		if ((lensy_bundle_reserve(b, nmax) < 0) ||
+		    (lensy_bundle_clone(b, &b0) < 0)) {
+			lensy_bundle_free(b);
+			memcpy(b, &b0, sizeof(*b));
+			return -1;
+		}
+		return 0;
+	}
+
+	if (nmax < 2 * b->nmax) nmax = 2 * b->nmax;
+	if (nmax < 64) nmax = 64;
+
+	for (k = 0; k < 3; k++) {
+		pv = realloc(b->p[k], nmax * sizeof(double));
+		if (pv == NULL) return -1;
+		b->p[k] = (double *) pv;
+
+		pv = realloc(b->d[k], nmax * sizeof(double));
+		if (pv == NULL) return -1;
+		b->d[k] = (double *) pv;
+	}
+
+	pv = realloc(b->wavelength, nmax * sizeof(double));
+	if (pv == NULL) return -1;
+	b->wavelength = (double *) pv;
+
+	pv = realloc(b->path, nmax * sizeof(uint64_t));
+	if (pv == NULL) return -1;
+	b->path = (uint64_t *) pv;
+
+	pv = realloc(b->weight, nmax * sizeof(double));
+	if (pv == NULL) return -1;
+	b->weight = (double *) pv;
+
+	pv = realloc(b->red, nmax);
+	if (pv == NULL) return -1;
+	b->red = (char *) pv;
+
+	pv = realloc(b->green, nmax);
+	if (pv == NULL) return -1;
+	b->green = (char *) pv;
+
+	pv = realloc(b->blue, nmax);
+	if (pv == NULL) return -1;
+	b->blue = (char *) pv;
+
+	b->nmax = nmax;
+	return 0;
+}
+
+
+/*----------------------------------------------------- lensy_bundle_free
+ * Free the columns of a ray bundle. The columns of a borrowed bundle are
+ * only forgotten.
+ */
+void lensy_bundle_free(struct lensy_bundle_struct *b)
+{
+	int32_t k;
+
+	if (b->borrowed) {
+		memset(b, 0, sizeof(*b));
+		return;
+	}
+	for (k = 0; k < 3; k++) {
+		free(b->p[k]);
+		free(b->d[k]);
+	}
+	free(b->wavelength);
+	free(b->path);
+	free(b->weight);
+	free(b->red);
+	free(b->green);
+	free(b->blue);
+	memset(b, 0, sizeof(*b));
+}
+
+
+/*----------------------------------------------------- lensy_bundle_add
+ * Append a copy of the ray 'r' to the bundle, with the path identifier
+ * 'path' and a weight of 1.
  *
+ * A return value of zero means OK.
+ * A return value of -1 means that realloc failed.
+ */
+int32_t lensy_bundle_add(struct lensy_bundle_struct *b,
+				struct lensy_ray_struct *r, uint64_t path)
+{
+	if (lensy_bundle_reserve(b, b->n + 1) < 0) return -1;
+	lensy_bundle_set(b, b->n, r);
+	b->path[b->n] = path;
+	b->weight[b->n] = 1.0;
+	b->n++;
+	return 0;
+}
+
+
+/*----------------------------------------------------- lensy_bundle_get
+ * Copy ray 'i' of the bundle into the ray structure 'r'. The pathkey
+ * and list pointers of 'r' are not changed (the ray structure has no
+ * weight).
+ */
+void lensy_bundle_get(struct lensy_bundle_struct *b, int32_t i,
+				struct lensy_ray_struct *r)
+{
+	r->p[0] = b->p[0][i];
+	r->p[1] = b->p[1][i];
+	r->p[2] = b->p[2][i];
+	r->d[0] = b->d[0][i];
+	r->d[1] = b->d[1][i];
+	r->d[2] = b->d[2][i];
+	r->wavelength = b->wavelength[i];
+	r->red = b->red[i];
+	r->green = b->green[i];
+	r->blue = b->blue[i];
+}
+
+
+/*----------------------------------------------------- lensy_bundle_set
+ * Copy the ray structure 'r' into slot 'i' of the bundle. The path
+ * identifier and the weight of the slot are not changed.
+ */
+void lensy_bundle_set(struct lensy_bundle_struct *b, int32_t i,
+				struct lensy_ray_struct *r)
+{
+	b->p[0][i] = r->p[0];
+	b->p[1][i] = r->p[1];
+	b->p[2][i] = r->p[2];
+	b->d[0][i] = r->d[0];
+	b->d[1][i] = r->d[1];
+	b->d[2][i] = r->d[2];
+	b->wavelength[i] = r->wavelength;
+	b->red[i] = r->red;
+	b->green[i] = r->green;
+	b->blue[i] = r->blue;
+}
+
+
+/*----------------------------------------------------- lensy_bundle_copy
+ * Copy ray 'i0' of bundle 'b0' (including the path and the weight) into
+ * slot 'i' of bundle 'b'. The bundles may be the same.
+ */
+void lensy_bundle_copy(struct lensy_bundle_struct *b, int32_t i,
+				struct lensy_bundle_struct *b0, int32_t i0)
+{
+	b->p[0][i] = b0->p[0][i0];
+	b->p[1][i] = b0->p[1][i0];
+	b->p[2][i] = b0->p[2][i0];
+	b->d[0][i] = b0->d[0][i0];
+	b->d[1][i] = b0->d[1][i0];
+	b->d[2][i] = b0->d[2][i0];
+	b->wavelength[i] = b0->wavelength[i0];
+	b->path[i] = b0->path[i0];
+	b->weight[i] = b0->weight[i0];
+	b->red[i] = b0->red[i0];
+	b->green[i] = b0->green[i0];
+	b->blue[i] = b0->blue[i0];
+}
+
+
+/*----------------------------------------------------- lensy_bundle_clone
+ * Make bundle 'b' a copy of bundle 'b0'. The bundle 'b' must have been
+ * initialized.
  *
+ * A return value of zero means OK.
+ * A return value of -1 means that realloc failed.
  */
-int32_t lensy_cone(struct list_head *pl, struct lensy_ray_struct *pr,
-				double cone_dia, double cone_step)
+int32_t lensy_bundle_clone(struct lensy_bundle_struct *b,
+				struct lensy_bundle_struct *b0)
 {
-	int32_t j, k, m, n, rc;
-	double d0, d1, d2, d3, d4, d5, d10;
-	struct lensy_ray_struct *pray;
-	double w0[3], w1[3], w2[3], w3[3], u0[3], u1[3], u2[3];
+	int32_t k, n;
 
-	rc = 0;
+	n = b0->n;
+	if (lensy_bundle_reserve(b, n) < 0) return -1;
 
-	d10 = lensy_mag3(pr->d);
-	if (d10 == 0.0) {
-		fprintf(stderr, "%s: lensy_mag3(d) == 0.0 (ray direction is null)\n", __func__);
-		return rc;
+	for (k = 0; k < 3; k++) {
+		memcpy(b->p[k], b0->p[k], n * sizeof(double));
+		memcpy(b->d[k], b0->d[k], n * sizeof(double));
 	}
+	memcpy(b->wavelength, b0->wavelength, n * sizeof(double));
+	memcpy(b->path, b0->path, n * sizeof(uint64_t));
+	memcpy(b->weight, b0->weight, n * sizeof(double));
+	memcpy(b->red, b0->red, n);
+	memcpy(b->green, b0->green, n);
+	memcpy(b->blue, b0->blue, n);
+	b->n = n;
 
-	//--- Add the center ray to the list first
-	pray = (struct lensy_ray_struct *) malloc(sizeof(struct lensy_ray_struct));
-	if (pray != NULL) {
-		pray->p[0] = pr->p[0];
-		pray->p[1] = pr->p[1];
-		pray->p[2] = pr->p[2];
-		pray->d[0] = pr->d[0];
-		pray->d[1] = pr->d[1];
-		pray->d[2] = pr->d[2];
-		pray->wavelength = pr->wavelength;
-		snprintf(pray->pathkey, sizeof(pray->pathkey), "%e%e%e%e",
-			pray->p[0], pray->p[1], pray->p[2], pray->wavelength);
-		list_add(&(pray->raylist), pl);
+	return 0;
+}
+
+
+/*----------------------------------------------------- lensy_ccd_pixel
+ * Find the pixel (*i, *j) of the CCD where the point 'p' (on the CCD
+ * plane) lands.
+ *
+ * The return value is true if the pixel is on the detector.
+ */
+bool lensy_ccd_pixel(struct lensy_ccd_struct *ccd, double p[3],
+				int32_t *i, int32_t *j)
+{
+	double w1[3];
+
+	w1[0] = p[0] - ccd->v[0];
+	w1[1] = p[1] - ccd->v[1];
+	w1[2] = p[2] - ccd->v[2];
+
+	*i = floor(lensy_dot3(w1, ccd->vx) / lensy_dot3(ccd->vx, ccd->vx));
+	*j = floor(lensy_dot3(w1, ccd->vy) / lensy_dot3(ccd->vy, ccd->vy));
+
+	*i += ccd->x_nmax/2;
+	*j += ccd->y_nmax/2;
+
+	return (*i >= 0) && (*i < ccd->x_nmax) && (*j >= 0) && (*j < ccd->y_nmax);
+}
+
+
+/*----------------------------------------------------- lensy_ccd_add
+ * Add the impact positions of the rays of bundle 'b' to the CCD image
+ * buffer, 'value' counts per ray times the weight of the ray (rounded to
+ * the nearest count). The pixel values stop at 65000.
+ *
+ * The return value is the number of rays that landed on the detector.
+ */
+int32_t lensy_ccd_add(struct lensy_ccd_struct *ccd, struct lensy_bundle_struct *b,
+				int32_t value)
+{
+	int32_t i, j, k, n, rc;
+	double p[3];
+
+	rc = 0;
+	for (n = 0; n < b->n; n++) {
+		p[0] = b->p[0][n];
+		p[1] = b->p[1][n];
+		p[2] = b->p[2][n];
+		if (!lensy_ccd_pixel(ccd, p, &i, &j)) continue;
+
+		k = ccd->b[j * ccd->x_nmax + i];
+		k += (k < 65000) ? (int32_t) lrint(value * b->weight[n]) : 0;
+		ccd->b[j * ccd->x_nmax + i] = k;
 		rc++;
 	}
+	return rc;
+}
+
+
+/*----------------------------------------------------- lensy_cone_count
+ * Return the number of rays that lensy_cone() will create for the
+ * parameters 'cone_dia' and 'cone_step' (in degrees), including the
+ * center ray.
+ */
+int32_t lensy_cone_count(double cone_dia, double cone_step)
+{
+	int32_t j, m, n, rc;
+	double d0;
 
-	//------------- Now add rays inside a cone to the raylist
+	rc = 1;
+	d0 = DEG2RAD * cone_step;
+	n = floor((DEG2RAD * cone_dia / 2) / d0);
+	for (j = 1; j <= n; j++) {
+		m = floor(sin(j * d0) * 2 * PI / d0);
+		if (m > 0) rc += m;	// past 180 degrees, as lensy_cone_directions()
+	}
+	return rc;
+}
+
+
+/*----------------------------------------------------- lensy_cone_directions
+ * Write the direction vectors for a cone of rays around the direction
+ * 'd' into the columns dx[], dy[], dz[], starting with the center ray.
+ * The columns must have room for lensy_cone_count() entries.
+ *
+ * The rotation from the 'unprimed' coordinates (cone around the z axis)
+ * to the 'primed' coordinates (cone around 'd') depends only on 'd', so
+ * it is set up once here, as the three column vectors e0, e1, and e2
+ * (e2 is the unit vector parallel to 'd'). A ray at the angle d1 from the
+ * axis, and the angle d2 around it, is then
+ *
+ *	d * cos(d1) + |d| * sin(d1) * (cos(d2) * e0 + sin(d2) * e1),
+ *
+ * and the cos(d2), sin(d2) values around each ring are generated with a
+ * rotation recurrence instead of calling cos() and sin() for every ray.
+ */
+static int32_t lensy_cone_directions(double d[3], double d10,
+				double cone_dia, double cone_step,
+				double *dx, double *dy, double *dz)
+{
+	int32_t j, k, m, n, rc;
+	double d0, d1, d2, d3, c1, s1, ca, sa, cb, sb;
+	double e0[3], e1[3];
+
+	//------ the rotation to 'primed' coordinates
+	d0 = hypot(d[0], d[1]);
+	if (d0 > 0.0) {
+		cb = d[0] / d0;		// cos, sin of the azimuth of 'd'
+		sb = d[1] / d0;
+	} else {
+		cb = 1.0;
+		sb = 0.0;
+	}
+	d1 = d0 / d10;			// cos, sin of the elevation of 'd'
+	d2 = d[2] / d10;
+
+	e0[0] =  sb;
+	e0[1] = -cb;
+	e0[2] =  0.0;
+
+	e1[0] =  cb * d2;
+	e1[1] =  sb * d2;
+	e1[2] = -d1;
+
+	//--- the center ray first
+	dx[0] = d[0];
+	dy[0] = d[1];
+	dz[0] = d[2];
+	rc = 1;
+
+	//------------- the rings of the cone
 	d0 = DEG2RAD * cone_step;
 	n = floor((DEG2RAD * cone_dia / 2) / d0);
 	for (j = 1; j <= n; j++) {
 		d1 = j * d0;
 		m = floor(sin(d1) * 2 * PI / d0);
+		if (m <= 0) continue;
+
+		c1 = cos(d1);
+		s1 = d10 * sin(d1);
+		ca = cos(2 * PI / m);
+		sa = sin(2 * PI / m);
+
+		cb = 1.0;
+		sb = 0.0;
 		for (k = 0; k < m; k++) {
-			d2 = k * (2 * PI / m);
-			d3 = PI / 2 - d1;
-
-			//------ w0, w1, w2 are in 'unprimed' coordinates
-			w0[0] = 0.0;
-			w0[1] = 0.0;
-			w0[2] = 1.0;
-
-			w1[0] = cos(d3) * cos(d2);
-			w1[1] = cos(d3) * sin(d2);
-			w1[2] = sin(d3);
-
-			w2[0] = w1[0] - w0[0];
-			w2[1] = w1[1] - w0[1];
-			w2[2] = w1[2] - w0[2];
-
-			d4 = atan2(pr->d[1], pr->d[0]);
-			d5 = asin(pr->d[2]);
-
-			//------- unit vectors in the 'primed' coordinates
-			u0[0] = cos(PI / 2 - d4);
-			u0[1] = cos(d4) * cos(PI / 2 - d5);
-			u0[2] = cos(d4) * sin(PI / 2 - d5);
-
-			u1[0] = sin(-(PI / 2 - d4));
-			u1[1] = cos(-(PI / 2 - d4)) * cos(PI / 2 - d5);
-			u1[2] = cos(-(PI / 2 - d4)) * sin(PI / 2 - d5);
-
-			u2[0] = 0.0;
-			u2[1] = sin(-(PI / 2 - d5));
-			u2[2] = cos(-(PI / 2 - d5));
-
-			w3[0] = pr->d[0] + d10 * lensy_inner3(w2, u0);
-			w3[1] = pr->d[1] + d10 * lensy_inner3(w2, u1);
-			w3[2] = pr->d[2] + d10 * lensy_inner3(w2, u2);
-
-			//--- Add the ray to the list
-			pray = (struct lensy_ray_struct *) malloc(sizeof(struct lensy_ray_struct));
-			if (pray != NULL) {
-				pray->p[0] = pr->p[0];
-				pray->p[1] = pr->p[1];
-				pray->p[2] = pr->p[2];
-
-				pray->d[0] = w3[0];
-				pray->d[1] = w3[1];
-				pray->d[2] = w3[2];
-
-				pray->wavelength = pr->wavelength;
-
-				pray->red = pr->red;
-				pray->green = pr->green;
-				pray->blue = pr->blue;
-
-				snprintf(pray->pathkey, sizeof(pray->pathkey), "%e%e%e%e",
-					pray->p[0], pray->p[1], pray->p[2], pray->wavelength);
-				list_add(&(pray->raylist), pl);
-				rc++;
-			}
+			dx[rc] = c1 * d[0] + s1 * (cb * e0[0] + sb * e1[0]);
+			dy[rc] = c1 * d[1] + s1 * (cb * e0[1] + sb * e1[1]);
+			dz[rc] = c1 * d[2] + s1 * (cb * e0[2] + sb * e1[2]);
+			rc++;
+
+			d3 = cb * ca - sb * sa;
+			sb = sb * ca + cb * sa;
+			cb = d3;
 		}
 	}
 
@@ -1057,77 +1567,462 @@ int32_t lensy_cone(struct list_head *pl, struct lensy_ray_struct *pr,
 }
 
 
-
-/*----------------------------------------------------- lensy_beam
- * Create a circular beam of parallel rays in a list 'pl', centered around the
- * ray 'pr'.
- *
- * Input parameters:
- *
- *	beam_dia	- The beam diameter in meters.
- *	beam_step	- The spacing between rays in the beam, in meters.
+/*----------------------------------------------------- lensy_beam_offsets
+ * Write the position offsets (from the center ray) of a circular beam of
+ * parallel rays with the direction 'd' into the columns px[], py[], pz[].
+ * If the columns are NULL, only count the rays.
  *
+ * The return value is the number of rays.
  */
-int32_t lensy_beam(struct list_head *pl, struct lensy_ray_struct *pr,
-				double beam_dia, double beam_step)
+static int32_t lensy_beam_offsets(double d[3], double d10,
+				double beam_dia, double beam_step,
+				double *px, double *py, double *pz)
 {
 	int32_t rc;
-	double d0, d1, d2, d10;
-	struct lensy_ray_struct *pray;
+	double d0, d1, d2;
 	double w0[3], u0[3], u1[3];
 
 	rc = 0;
 
-	d10 = lensy_mag3(pr->d);
-	if (d10 == 0.0) {
-		fprintf(stderr, "%s: lensy_mag3(d) == 0.0 (ray direction is null)\n", __func__);
-		return rc;
-	}
-
-	w0[0] = pr->d[0] / d10;
-	w0[1] = pr->d[1] / d10;
-	w0[2] = pr->d[2] / d10;
+	w0[0] = d[0] / d10;
+	w0[1] = d[1] / d10;
+	w0[2] = d[2] / d10;
 
 	u0[0] = w0[1] / sqrt(w0[0] * w0[0] + w0[1] * w0[1]);
 	u0[1] = sqrt(1 - u0[0] * u0[0]);
 	u0[2] = 0.0;
 
-	lensy_cross3(w0, u0, u1);
+	lensy_vcross3(w0, u0, u1);
 
 	for (d0 = -beam_dia / 2; d0 < +beam_dia / 2; d0 += beam_step) {
 		for (d1 = -beam_dia / 2; d1 < +beam_dia / 2; d1 += beam_step) {
 			d2 = sqrt(d0 * d0 + d1 * d1);
 			if (d2 > beam_dia / 2) continue;
 
-			//--- Add a ray to the list
-			pray = (struct lensy_ray_struct *) malloc(sizeof(struct lensy_ray_struct));
-			if (pray != NULL) {
-				pray->p[0] = pr->p[0] + d0 * u0[0] + d1 * u1[0];
-				pray->p[1] = pr->p[1] + d0 * u0[1] + d1 * u1[1];
-				pray->p[2] = pr->p[2] + d0 * u0[2] + d1 * u1[2];
+			if (px != NULL) {
+				px[rc] = d0 * u0[0] + d1 * u1[0];
+				py[rc] = d0 * u0[1] + d1 * u1[1];
+				pz[rc] = d0 * u0[2] + d1 * u1[2];
+			}
+			rc++;
+		}
+	}
+
+	return rc;
+}
+
+
+/*
+ * The sampling pattern cache. Most recently used patterns are kept at the
+ * head of the list, and the least recently used one is dropped when there
+ * are more than LENSY_NMAX_PATTERNS. The cache holds one reference to each
+ * pattern, and each caller of lensy_pattern_cone() or lensy_pattern_beam()
+ * another, so a pattern is only freed when it has been dropped and all of
+ * its callers have released it. The list and the reference counts are
+ * changed under pattern_lock.
+ */
+static LIST_HEAD(pattern_list);
+static int32_t n_patterns;
+static pthread_mutex_t pattern_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*----------------------------------------------------- lensy_pattern_unref
+ * Drop a reference to a pattern, and free it if it was the last one.
+ * Called with pattern_lock held.
+ */
+static void lensy_pattern_unref(struct lensy_pattern_struct *pp)
+{
+	if (--pp->refs > 0) return;
+	free(pp->w[0]);
+	free(pp);
+}
+
+
+/*----------------------------------------------------- lensy_pattern_find
+ * Look up a pattern in the cache, move it to the head of the list, and
+ * take a reference to it. Called with pattern_lock held.
+ */
+static struct lensy_pattern_struct *lensy_pattern_find(int32_t type,
+				double d[3], double dia, double step)
+{
+	struct list_head *pos;
+	struct lensy_pattern_struct *pp;
+
+	list_for_each(pos, &pattern_list) {
+		pp = list_entry(pos, struct lensy_pattern_struct, pattern_list);
+
+		if ((pp->type == type) && (pp->dia == dia) &&
+		    (pp->step == step) && (pp->d[0] == d[0]) &&
+		    (pp->d[1] == d[1]) && (pp->d[2] == d[2])) {
+			list_move(pos, &pattern_list);
+			pp->refs++;
+			return pp;
+		}
+	}
+	return NULL;
+}
+
+
+/*----------------------------------------------------- lensy_pattern_new
+ * Allocate a pattern for 'n' rays and add it to the head of the cache,
+ * with a reference for the caller, dropping the least recently used
+ * pattern if the cache is full. Called with pattern_lock held.
+ */
+static struct lensy_pattern_struct *lensy_pattern_new(int32_t type,
+				double d[3], double dia, double step, int32_t n)
+{
+	struct lensy_pattern_struct *pp;
+
+	if (n_patterns >= LENSY_NMAX_PATTERNS) {
+		pp = list_entry(pattern_list.prev, struct lensy_pattern_struct, pattern_list);
+		list_del(&(pp->pattern_list));
+		lensy_pattern_unref(pp);
+		n_patterns--;
+	}
 
-				pray->d[0] = pr->d[0];
-				pray->d[1] = pr->d[1];
-				pray->d[2] = pr->d[2];
+	pp = (struct lensy_pattern_struct *) malloc(sizeof(struct lensy_pattern_struct));
+	if (pp == NULL) return NULL;
 
-				pray->wavelength = pr->wavelength;
+	pp->w[0] = (double *) malloc(3 * (n > 0 ? n : 1) * sizeof(double));
+	if (pp->w[0] == NULL) {
+		free(pp);
+		return NULL;
+	}
+	pp->w[1] = pp->w[0] + n;
+	pp->w[2] = pp->w[0] + 2 * n;
+
+	pp->type = type;
+	pp->d[0] = d[0];
+	pp->d[1] = d[1];
+	pp->d[2] = d[2];
+	pp->dia = dia;
+	pp->step = step;
+	pp->n = n;
+	pp->refs = 2;		// the cache, and the caller
+
+	list_add(&(pp->pattern_list), &pattern_list);
+	n_patterns++;
+	return pp;
+}
+
+
+/*----------------------------------------------------- lensy_pattern_cone
+ * Return the (cached) sampling pattern for a cone of rays around the
+ * direction 'd'. The pattern holds the ray direction vectors, and must be
+ * given back with lensy_pattern_release().
+ */
+struct lensy_pattern_struct *lensy_pattern_cone(double d[3],
+				double cone_dia, double cone_step)
+{
+	double d10;
+	struct lensy_pattern_struct *pp;
+
+	d10 = lensy_norm3(d);
+	if (d10 == 0.0) {
+		fprintf(stderr, "%s: lensy_norm3(d) == 0.0 (ray direction is null)\n", __func__);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&pattern_lock);
+	pp = lensy_pattern_find(LENSY_PATTERN_CONE, d, cone_dia, cone_step);
+	if (pp == NULL) {
+		pp = lensy_pattern_new(LENSY_PATTERN_CONE, d, cone_dia, cone_step,
+					lensy_cone_count(cone_dia, cone_step));
+		if (pp != NULL)
+			pp->n = lensy_cone_directions(d, d10, cone_dia, cone_step,
+							pp->w[0], pp->w[1], pp->w[2]);
+	}
+	pthread_mutex_unlock(&pattern_lock);
+
+	if (pp == NULL) fprintf(stderr, "%s: malloc failed\n", __func__);
+	return pp;
+}
 
-				pray->red = pr->red;
-				pray->green = pr->green;
-				pray->blue = pr->blue;
 
-				snprintf(pray->pathkey, sizeof(pray->pathkey), "%e%e%e%e",
-					pray->d[0], pray->d[1], pray->d[2], pray->wavelength);
-				list_add(&(pray->raylist), pl);
-				rc++;
+/*----------------------------------------------------- lensy_pattern_beam
+ * Return the (cached) sampling pattern for a beam of parallel rays with
+ * the direction 'd'. The pattern holds the ray position offsets from the
+ * center of the beam, and must be given back with lensy_pattern_release().
+ */
+struct lensy_pattern_struct *lensy_pattern_beam(double d[3],
+				double beam_dia, double beam_step)
+{
+	double d10;
+	struct lensy_pattern_struct *pp;
+
+	d10 = lensy_norm3(d);
+	if (d10 == 0.0) {
+		fprintf(stderr, "%s: lensy_norm3(d) == 0.0 (ray direction is null)\n", __func__);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&pattern_lock);
+	pp = lensy_pattern_find(LENSY_PATTERN_BEAM, d, beam_dia, beam_step);
+	if (pp == NULL) {
+		pp = lensy_pattern_new(LENSY_PATTERN_BEAM, d, beam_dia, beam_step,
+			lensy_beam_offsets(d, d10, beam_dia, beam_step, NULL, NULL, NULL));
+		if (pp != NULL)
+			lensy_beam_offsets(d, d10, beam_dia, beam_step,
+						pp->w[0], pp->w[1], pp->w[2]);
+	}
+	pthread_mutex_unlock(&pattern_lock);
+
+	if (pp == NULL) fprintf(stderr, "%s: malloc failed\n", __func__);
+	return pp;
+}
+
+
+/*----------------------------------------------------- lensy_pattern_release
+ * Give back a pattern from lensy_pattern_cone() or lensy_pattern_beam().
+ */
+void lensy_pattern_release(struct lensy_pattern_struct *pp)
+{
+	if (pp == NULL) return;
+	pthread_mutex_lock(&pattern_lock);
+	lensy_pattern_unref(pp);
+	pthread_mutex_unlock(&pattern_lock);
+}
+
+
+/*----------------------------------------------------- lensy_pattern_flush
+ * Drop all of the cached sampling patterns. The patterns that callers
+ * still hold are freed when they are released.
+ */
+void lensy_pattern_flush(void)
+{
+	struct list_head *pos, *pos0;
+	struct lensy_pattern_struct *pp;
+
+	pthread_mutex_lock(&pattern_lock);
+	list_for_each_safe(pos, pos0, &pattern_list) {
+		pp = list_entry(pos, struct lensy_pattern_struct, pattern_list);
+		list_del(pos);
+		lensy_pattern_unref(pp);
+	}
+	n_patterns = 0;
+	pthread_mutex_unlock(&pattern_lock);
+}
+
+
+/*----------------------------------------------------- lensy_pattern_bundle
+ * Append the rays of the sampling pattern 'pp' to the bundle 'b', taking
+ * the start position, wavelength and colors from the ray 'pr'. For a cone
+ * pattern, all rays start at pr->p; for a beam pattern, all rays have the
+ * direction pr->d. All of the rays are given the path identifier 'path'.
+ *
+ * The return value is the number of rays added.
+ */
+int32_t lensy_pattern_bundle(struct lensy_bundle_struct *b,
+				struct lensy_pattern_struct *pp,
+				struct lensy_ray_struct *pr, uint64_t path)
+{
+	int32_t i, k, i0, n;
+	double *w[3], *v[3];
+
+	if (pp == NULL) return 0;
+
+	n = pp->n;
+	if (lensy_bundle_reserve(b, b->n + n) < 0) {
+		fprintf(stderr, "%s: realloc failed\n", __func__);
+		return 0;
+	}
+	i0 = b->n;
+
+	// w[] are the columns copied from the pattern, v[] are broadcast
+	for (k = 0; k < 3; k++) {
+		if (pp->type == LENSY_PATTERN_CONE) {
+			w[k] = b->d[k] + i0;
+			v[k] = b->p[k] + i0;
+		} else {
+			w[k] = b->p[k] + i0;
+			v[k] = b->d[k] + i0;
+		}
+		memcpy(w[k], pp->w[k], n * sizeof(double));
+	}
+
+	for (k = 0; k < 3; k++) {
+		if (pp->type == LENSY_PATTERN_CONE) {
+			for (i = 0; i < n; i++)
+				v[k][i] = pr->p[k];
+		} else {
+			for (i = 0; i < n; i++) {
+				w[k][i] += pr->p[k];
+				v[k][i] = pr->d[k];
+			}
+		}
+	}
+
+	for (i = i0; i < i0 + n; i++) {
+		b->wavelength[i] = pr->wavelength;
+		b->path[i] = path;
+		b->weight[i] = 1.0;
+	}
+	memset(b->red + i0, pr->red, n);
+	memset(b->green + i0, pr->green, n);
+	memset(b->blue + i0, pr->blue, n);
+
+	b->n += n;
+	return n;
+}
+
+
+/*----------------------------------------------------- lensy_pattern_list
+ * Add the rays of the sampling pattern 'pp' to the list 'pl', in the same
+ * way as lensy_pattern_bundle(). Every ray is given the path key 'pathkey'.
+ *
+ * The return value is the number of rays added.
+ */
+static int32_t lensy_pattern_list(struct list_head *pl,
+				struct lensy_pattern_struct *pp,
+				struct lensy_ray_struct *pr, char *pathkey)
+{
+	int32_t i, k, rc;
+	struct lensy_ray_struct *pray;
+
+	rc = 0;
+	if (pp == NULL) return rc;
+
+	for (i = 0; i < pp->n; i++) {
+		pray = (struct lensy_ray_struct *) malloc(sizeof(struct lensy_ray_struct));
+		if (pray == NULL) continue;
+
+		for (k = 0; k < 3; k++) {
+			if (pp->type == LENSY_PATTERN_CONE) {
+				pray->p[k] = pr->p[k];
+				pray->d[k] = pp->w[k][i];
+			} else {
+				pray->p[k] = pr->p[k] + pp->w[k][i];
+				pray->d[k] = pr->d[k];
 			}
 		}
+
+		pray->wavelength = pr->wavelength;
+
+		pray->red = pr->red;
+		pray->green = pr->green;
+		pray->blue = pr->blue;
+
+		memcpy(pray->pathkey, pathkey, sizeof(pray->pathkey));
+		list_add(&(pray->raylist), pl);
+		rc++;
 	}
 
 	return rc;
 }
 
 
+/*----------------------------------------------------- lensy_cone
+ * Create a cone of rays in a list 'pl', centered around the ray 'pr'.
+ *
+ * Input parameters:
+ *
+ *	cone_dia	- The diameter of a cone of rays, in degrees.
+ *	cone_step	- The angular spacing of rays in the cone, in degrees.
+ *
+ * The ray directions come from the sampling pattern cache, so repeated
+ * cones with the same direction and parameters (for example, for several
+ * wavelengths) are only calculated once.
+ */
+int32_t lensy_cone(struct list_head *pl, struct lensy_ray_struct *pr,
+				double cone_dia, double cone_step)
+{
+	char pathkey[sizeof(pr->pathkey)];
+	struct lensy_pattern_struct *pp;
+	int32_t rc;
+
+	// all of the rays in the cone have the same path key
+	snprintf(pathkey, sizeof(pathkey), "%e%e%e%e",
+		pr->p[0], pr->p[1], pr->p[2], pr->wavelength);
+
+	pp = lensy_pattern_cone(pr->d, cone_dia, cone_step);
+	rc = lensy_pattern_list(pl, pp, pr, pathkey);
+	lensy_pattern_release(pp);
+	return rc;
+}
+
+
+/*----------------------------------------------------- lensy_cone_bundle
+ * Create a cone of rays centered around the ray 'pr', and append them to
+ * the bundle 'b'. This is the same as lensy_cone(), but the rays are
+ * copied into the bundle columns, which are grown (once) as required.
+ * All of the rays are given the path identifier 'path'.
+ *
+ * Input parameters:
+ *
+ *	cone_dia	- The diameter of a cone of rays, in degrees.
+ *	cone_step	- The angular spacing of rays in the cone, in degrees.
+ *
+ * The return value is the number of rays added.
+ */
+int32_t lensy_cone_bundle(struct lensy_bundle_struct *b,
+				struct lensy_ray_struct *pr,
+				double cone_dia, double cone_step, uint64_t path)
+{
+	struct lensy_pattern_struct *pp;
+	int32_t rc;
+
+	pp = lensy_pattern_cone(pr->d, cone_dia, cone_step);
+	rc = lensy_pattern_bundle(b, pp, pr, path);
+	lensy_pattern_release(pp);
+	return rc;
+}
+
+
+
+/*----------------------------------------------------- lensy_beam
+ * Create a circular beam of parallel rays in a list 'pl', centered around the
+ * ray 'pr'.
+ *
+ * Input parameters:
+ *
+ *	beam_dia	- The beam diameter in meters.
+ *	beam_step	- The spacing between rays in the beam, in meters.
+ *
+ * The ray positions come from the sampling pattern cache.
+ */
+int32_t lensy_beam(struct list_head *pl, struct lensy_ray_struct *pr,
+				double beam_dia, double beam_step)
+{
+	char pathkey[sizeof(pr->pathkey)];
+	struct lensy_pattern_struct *pp;
+	int32_t rc;
+
+	snprintf(pathkey, sizeof(pathkey), "%e%e%e%e",
+		pr->d[0], pr->d[1], pr->d[2], pr->wavelength);
+
+	pp = lensy_pattern_beam(pr->d, beam_dia, beam_step);
+	rc = lensy_pattern_list(pl, pp, pr, pathkey);
+	lensy_pattern_release(pp);
+	return rc;
+}
+
+
+/*----------------------------------------------------- lensy_beam_bundle
+ * Create a circular beam of parallel rays centered around the ray 'pr',
+ * and append them to the bundle 'b'. All of the rays are given the path
+ * identifier 'path'.
+ *
+ * Input parameters:
+ *
+ *	beam_dia	- The beam diameter in meters.
+ *	beam_step	- The spacing between rays in the beam, in meters.
+ *
+ * The return value is the number of rays added.
+ */
+int32_t lensy_beam_bundle(struct lensy_bundle_struct *b,
+				struct lensy_ray_struct *pr,
+				double beam_dia, double beam_step, uint64_t path)
+{
+	struct lensy_pattern_struct *pp;
+	int32_t rc;
+
+	pp = lensy_pattern_beam(pr->d, beam_dia, beam_step);
+	rc = lensy_pattern_bundle(b, pp, pr, path);
+	lensy_pattern_release(pp);
+	return rc;
+}
+
+
 /*------------------------------------------ lensy_init_ccd
  * This function fills in the values for the associated plane structure,
  * and allocates space for an image buffer.
@@ -1139,9 +2034,9 @@ void lensy_init_ccd(struct lensy_ccd_struct *ccd) {
 	ccd->p.v[1] = ccd->v[1];
 	ccd->p.v[2] = ccd->v[2];
 
-	lensy_cross3(ccd->vx, ccd->vy, w0);
+	lensy_vcross3(ccd->vx, ccd->vy, w0);
 
-	d0 = lensy_mag3(w0);
+	d0 = lensy_norm3(w0);
 	if (d0 == 0.0) {
 		fprintf(stderr, "%s: invalid ccd parameters vx, vy\n", __func__);
 		exit(-1);
@@ -1158,6 +2053,6 @@ void lensy_init_ccd(struct lensy_ccd_struct *ccd) {
 		exit(-1);
 	}
 
-	ccd->p.aperture = 2 * (ccd->x_nmax * lensy_mag3(ccd->vx) +
-				 ccd->y_nmax * lensy_mag3(ccd->vy));
+	ccd->p.aperture = 2 * (ccd->x_nmax * lensy_norm3(ccd->vx) +
+				 ccd->y_nmax * lensy_norm3(ccd->vy));
 }
@@ -50,6 +50,7 @@
 #include <unistd.h>
 
 #include <list.h>
+#include <lensy_vec3.h>
 
 #ifndef PI
  #define PI		3.14159265
@@ -123,7 +124,60 @@ struct lensy_ray_struct {
 };
 
 
+/*----------------------------- ray bundle structure
+ * A bundle holds rays in columns (structure of arrays), rather than in a
+ * linked list, so that a whole set of rays is allocated at once and the
+ * rays can be processed in simple loops. The column p[0] is the array of
+ * x positions, p[1] the y positions, and so on.
+ *
+ * The 'path' identifier plays the role of the ray 'pathkey': rays with
+ * identical parameters (start position, wavelength, grating reflection
+ * order) have the same path, for the spot size calculation.
+ *
+ * A 'borrowed' bundle uses columns that belong to something else, such as
+ * a mapped ray file. lensy_bundle_free() leaves them alone, and
+ * lensy_bundle_reserve() moves the rays to columns of the bundle's own
+ * before it grows, so a borrowed bundle can be traced like any other.
+ */
+struct lensy_bundle_struct {
+	int32_t n;		// number of rays in the bundle
+	int32_t nmax;		// number of rays allocated
+	double *p[3];		// ray positions
+	double *d[3];		// ray direction vectors
+	double *wavelength;	// wavelength in vacuum (meters)
+	uint64_t *path;		// ray path identifier, for spot size calculation
+	double *weight;		// ray intensity weight, 1 at the source
+	char *red, *green, *blue;
+	bool borrowed;		// the columns are not ours (a mapped file, a view)
+};
+
+
+/*----------------------------- sampling pattern structure
+ * A sampling pattern is the set of ray directions for a cone of rays
+ * (lensy_cone), or the set of ray position offsets for a beam of parallel
+ * rays (lensy_beam). The patterns are cached, keyed by the direction of
+ * the center ray and the diameter and step parameters, so that sources
+ * which differ only in position or wavelength share one pattern.
+ */
+#define LENSY_PATTERN_CONE	1
+#define LENSY_PATTERN_BEAM	2
+
+#define LENSY_NMAX_PATTERNS	64	// patterns kept in the cache
+
+struct lensy_pattern_struct {
+	int32_t type;		// LENSY_PATTERN_CONE or LENSY_PATTERN_BEAM
+	double d[3];		// direction vector of the center ray
+	double dia, step;	// cone_dia, cone_step or beam_dia, beam_step
+	int32_t n;		// number of rays in the pattern
+	double *w[3];		// directions (cone), or position offsets (beam)
+	int32_t refs;		// references: the cache, and each caller
+	struct list_head pattern_list;
+};
+
+
 //--------------------------------------------------- vector functions
+// (the inline versions lensy_dot3, lensy_norm3 and lensy_vcross3 are in
+// lensy_vec3.h)
 double lensy_inner3(double a[3], double b[3]);
 
 double lensy_mag3(double a[3]);
@@ -240,6 +294,59 @@ int32_t lensy_intersect_hyperboloid(struct lensy_ray_struct *r,
 					double q[3], double n[3]);
 
 
+/*----------------------------------------------------------- lensy_ray_at
+ * The point q[3] at the distance 't' along the ray 'r' (in units of the
+ * length of the ray direction vector).
+ */
+void lensy_ray_at(struct lensy_ray_struct *r, double t, double q[3]);
+
+
+/*--------------------------------------------------- lensy_hit_t_X
+ * Calculate only where along the ray a surface is intersected, for the
+ * same intersect point as lensy_intersect_X(), but without the surface
+ * normal. The intersect point is lensy_ray_at(r, *t), and the normal there,
+ * if it is needed, is lensy_normal_X().
+ *
+ * The return value is that of lensy_intersect_X(). When there is no
+ * intersect point, *t is zero.
+ */
+int32_t lensy_hit_t_paraboloid(struct lensy_ray_struct *r,
+					struct lensy_paraboloid_struct *p,
+					double *t);
+int32_t lensy_hit_t_sphere(struct lensy_ray_struct *r,
+					struct lensy_sphere_struct *s,
+					double *t);
+int32_t lensy_hit_t_cylinder(struct lensy_ray_struct *r,
+					struct lensy_cylinder_struct *c,
+					double *t);
+int32_t lensy_hit_t_plane(struct lensy_ray_struct *r,
+					struct lensy_plane_struct *p,
+					double *t);
+int32_t lensy_hit_t_hyperboloid(struct lensy_ray_struct *r,
+					struct lensy_hyperboloid_struct *h,
+					double *t);
+
+
+/*--------------------------------------------------- lensy_normal_X
+ * Calculate the unit normal vector n[3] to a surface at the point q[3] on
+ * the surface, as lensy_intersect_X() does.
+ *
+ * A return value of zero means OK.
+ * A return value of -2 means that there is no normal at q[3] (where
+ * lensy_intersect_X() would return -2).
+ */
+int32_t lensy_normal_paraboloid(struct lensy_paraboloid_struct *p,
+					double q[3], double n[3]);
+int32_t lensy_normal_sphere(struct lensy_sphere_struct *s,
+					double q[3], double n[3]);
+int32_t lensy_normal_cylinder(struct lensy_cylinder_struct *c,
+					double q[3], double n[3]);
+int32_t lensy_normal_plane(struct lensy_plane_struct *p,
+					double q[3], double n[3]);
+int32_t lensy_normal_hyperboloid(struct lensy_hyperboloid_struct *h,
+					double q[3], double n[3]);
+
+
 /*-------------------------------------------------- lensy_redirect_reflect
  * 'r' is the ray to be reflected.
  * 'q' is the 3-D intersect point.
@@ -263,6 +370,14 @@ int32_t lensy_redirect_refract(struct lensy_ray_struct *r,
 					double q[3], double n[3], double m);
 
 
+/*------------------------------------------------ lensy_fresnel_reflectance
+ * The fraction of (unpolarized) light reflected where the ray 'r' meets a
+ * surface with the unit normal 'n', for the index of refraction ratio 'm'
+ * (as for lensy_redirect_refract()). It is 1 past the critical angle.
+ */
+double lensy_fresnel_reflectance(struct lensy_ray_struct *r, double n[3], double m);
+
+
 /*-------------------------------------------------- lensy_redirect_diffract
  * Diffract 'ray' from a grating. If the ray direction inner product with
  * the surface normal is negative, 'ray' is reflected. Otherwise, it is
@@ -338,38 +453,1580 @@ double lensy_index_sellmeier(double wl, struct lensy_sellmeier_struct *a);
 
 
 
-/*----------------------------------------------------- lensy_cone
- * Create a cone of rays in a list 'pl', centered around the ray 'pr'.
+/*----------------------------- optical system structures
+ * An optical system is a sequence of elements. Each element is a surface,
+ * together with what happens to a ray at the surface: the 'type' selects
+ * the member of the surface union 's', and 'redirect' selects one of the
+ * lensy_redirect_Y() functions.
  *
- * Input parameters:
+ * A refracting element has an incident medium 'm0' and a transmission
+ * medium 'm1'. A medium has a constant index of refraction 'n', unless the
+ * coefficients 'a' (for lensy_index_of_refraction) or 's' (for
+ * lensy_index_sellmeier) are given.
  *
- *	cone_dia	- The diameter of a cone of rays, in degrees.
- *	cone_step	- The angular spacing of rays in the cone, in degrees.
+ * A diffracting element has the ruling vector 'a' and the orders order0
+ * to order1. If there is more than one order, each ray is replaced by
+ * one ray for each order, and the order is added to the ray path
+ * identifier with LENSY_PATH_ORDER().
+ *
+ * The weight of a ray is multiplied at each element by the 'efficiency'
+ * curve of the element (the reflectivity of a mirror coating, the
+ * transmission of an AR coating, or the efficiency of a grating, the same
+ * for each order), and by the internal transmittance exp(-alpha L) of the
+ * medium that the ray crossed to reach the element, where 'alpha' is the
+ * 'absorption' curve of the medium (see lensy_throughput.c).
  *
+ * The rays are taken through all of the elements 'chunk' rays at a time,
+ * so that they stay in the processor cache (see lensy_trace_range() in
+ * lensy_trace.c). A chunk of zero takes the whole bundle through one
+ * element at a time.
  *
+ * The kernel tier (sys->tier) trades accuracy for speed (see lensy_tier.c):
+ * LENSY_TIER_REFERENCE is the math of lensy.c, LENSY_TIER_FAST replaces
+ * the trigonometry of refraction and diffraction with the vector forms,
+ * and LENSY_TIER_FASTEST traces in single precision (lensy_trace_float()).
  */
-int32_t lensy_cone(struct list_head *pl, struct lensy_ray_struct *pr,
-				double cone_dia, double cone_step);
+#define LENSY_PARABOLOID	1
+#define LENSY_SPHERE		2
+#define LENSY_CYLINDER		3
+#define LENSY_PLANE		4
+#define LENSY_HYPERBOLOID	5
 
+#define LENSY_REFLECT		1
+#define LENSY_REFRACT		2
+#define LENSY_DIFFRACT		3
+#define LENSY_IMPACT		4
 
-/*----------------------------------------------------- lensy_beam
- * Create a circular beam of parallel rays in a list 'pl', centered around
- * the ray 'pr'.
+#define LENSY_NMAX_ELEMENTS	64
+#define LENSY_TRACE_CHUNK	1024	// default rays per chunk (sys->chunk)
+
+#define LENSY_TIER_REFERENCE	0
+#define LENSY_TIER_FAST		1
+#define LENSY_TIER_FASTEST	2
+#define LENSY_NMAX_TIERS	3
+
+#define LENSY_PATH_ORDER(path, m)	(((path) << 8) | ((uint64_t) (m) & 0xff))
+
+#define LENSY_CURVE_NTABLE	256	// cells of the segment table of a curve
+
+/*
+ * A value tabulated against the wavelength (meters), linear between the
+ * points and constant outside of them. The cells of the segment table
+ * divide the wavelength range evenly, so that the segment of a wavelength
+ * is found without a search (see lensy_curve_init()).
+ */
+struct lensy_curve_struct {
+	int32_t n;				// number of points
+	double *wl;				// wavelengths, increasing
+	double *v;				// values at the wavelengths
+	double wl0, scale;			// cell = (wavelength - wl0) * scale
+	int32_t seg[LENSY_CURVE_NTABLE];	// first segment of each cell
+};
+
+struct lensy_medium_struct {
+	double n;				// constant index of refraction
+	double *a;				// lensy_index_of_refraction() coefficients
+	struct lensy_sellmeier_struct *s;	// Sellmeier coefficients
+	struct lensy_curve_struct *absorption;	// absorption coefficient (1/m), or NULL
+};
+
+/*
+ * The clear aperture of a surface lies in a cylinder of radius r around
+ * the surface axis, between the plane of the vertex and the plane of the
+ * rim of the aperture, 'sag' from it (see lensy_element_bound()). A ray
+ * that does not pass through the cylinder is outside the aperture, and
+ * is rejected before the intersection is calculated.
+ */
+struct lensy_bound_struct {
+	double v[3];		// vertex position
+	double a[3];		// unit surface axis
+	double r;		// aperture radius
+	double sag;		// distance of the rim plane from the vertex plane
+};
+
+/*
+ * The rays that reached each element of a system, and the rays that the
+ * bound test rejected there (counted by lensy_trace(), if sys->reject is
+ * not NULL; the counts are not locked, so the system must not be traced
+ * by several threads at once).
+ */
+struct lensy_reject_struct {
+	int64_t n[LENSY_NMAX_ELEMENTS];		// rays tested
+	int64_t rejected[LENSY_NMAX_ELEMENTS];	// rays rejected by the bound
+};
+
+/*
+ * The sums of the ray weights at each element of a system (summed by
+ * lensy_trace(), if sys->budget is not NULL). The sums, like the reject
+ * counts, are not locked. lensy_stream_pipeline() and lensy_tolerance()
+ * trace copies of the system in several threads, and the server traces
+ * each job on a changed copy from the first changed element on, so none
+ * of them sum a budget or count rejects. What is neither lost nor passed
+ * on, in - lost - out, was absorbed by the medium before the element or by
+ * its coating. The orders of a fanned out grating share the weight of a
+ * ray evenly: each passes on its share times the efficiency, and out is
+ * the sum over the orders, while the share of an order that cannot leave
+ * the grating is lost.
+ */
+struct lensy_budget_struct {
+	double in[LENSY_NMAX_ELEMENTS];		// weight that reached the element
+	double lost[LENSY_NMAX_ELEMENTS];	// of rays that missed, or were not redirected
+	double out[LENSY_NMAX_ELEMENTS];	// weight passed on
+};
+
+/*
+ * The throughput of one element of a system (see lensy_throughput_init()),
+ * with the values for the last wavelength kept, since consecutive rays
+ * usually have the same wavelength.
+ */
+struct lensy_throughput_struct {
+	struct lensy_curve_struct *efficiency;	// of the element, or NULL
+	struct lensy_curve_struct *absorption;	// of the medium before it, or NULL
+	bool on;				// false if both are NULL
+	double wl;				// the last wavelength
+	double f, alpha;			// its efficiency and absorption
+};
+
+struct lensy_element_struct {
+	int32_t type;			// LENSY_PARABOLOID, LENSY_SPHERE, ...
+	union {
+		struct lensy_paraboloid_struct paraboloid;
+		struct lensy_sphere_struct sphere;
+		struct lensy_cylinder_struct cylinder;
+		struct lensy_plane_struct plane;
+		struct lensy_hyperboloid_struct hyperboloid;
+	} s;
+	int32_t redirect;		// LENSY_REFLECT, LENSY_REFRACT, ...
+	struct lensy_medium_struct *m0;	// incident medium (refract)
+	struct lensy_medium_struct *m1;	// transmission medium (refract)
+	double a[3];			// grating ruling vector (diffract)
+	int32_t order0, order1;		// grating orders (diffract)
+	struct lensy_curve_struct *efficiency;	// fraction of the light passed on, or NULL
+};
+
+struct lensy_system_struct {
+	int32_t n;			// number of elements
+	struct lensy_element_struct e[LENSY_NMAX_ELEMENTS];
+	int32_t chunk;			// rays taken through all elements at a time
+	int32_t tier;			// LENSY_TIER_REFERENCE, LENSY_TIER_FAST, ...
+	struct lensy_reject_struct *reject;	// if not NULL, early rejection counts
+	struct lensy_budget_struct *budget;	// if not NULL, sums of the ray weights
+
+	// if not NULL, called to draw each ray segment
+	void (*line)(double p0[3], double p1[3], char red, char green, char blue);
+};
+
+
+//------------------------------ surface-local frame structures
+struct lensy_frame_struct {
+	double o[3];			// origin, in world coordinates
+	double r[3][3];			// the x, y and z axes of the frame
+};
+
+struct lensy_local_struct {
+	int32_t frame;			// the frame of the element, or -1
+	bool canonical;			// intersected as a z axis surface
+	double z0;			// the vertex z
+	double s;			// +1 or -1, the surface axis along z
+	double k;			// |vr|, |f|, |a| or |n| of the surface
+	double e2;			// e^2 - 1 for a hyperboloid
+	double r2;			// (aperture / 2)^2
+	struct lensy_element_struct e;	// the element, in the frame
+};
+
+struct lensy_frames_struct {
+	int32_t n;			// number of elements
+	int32_t n_frames;		// number of frames
+	struct lensy_frame_struct f[LENSY_NMAX_ELEMENTS];
+	struct lensy_local_struct l[LENSY_NMAX_ELEMENTS];
+};
+
+
+//------------------------------ single precision structures
+/*
+ * An element for lensy_trace_float(), in its own frame (see lensy_float.c).
+ */
+struct lensy_float_element_struct {
+	int32_t type;			// LENSY_PARABOLOID, LENSY_SPHERE, ...
+	int32_t redirect;		// LENSY_REFLECT, LENSY_REFRACT, ...
+	double o[3];			// origin (the vertex), in world coordinates
+	double r[3][3];			// the x, y and z axes of the frame
+	float mr[3][3];			// rotation from the frame of the element before
+	float mt[3];			// shift from the frame of the element before
+	float k;			// |vr|, |f|, |va|, |a| or |n| of the surface
+	float e2;			// e^2 - 1 for a hyperboloid
+	double r2;			// (aperture / 2)^2
+	double g;			// order / ruling spacing, for a grating
+};
+
+struct lensy_float_struct {
+	int32_t n;			// number of elements
+	struct lensy_float_element_struct e[LENSY_NMAX_ELEMENTS];
+};
+
+//------------------------------ kernel tier comparison
+struct lensy_tier_report_struct {
+	int32_t tier;			// the tier compared with the reference
+	int32_t n_reference;		// rays left, with the reference tier
+	int32_t n_tier;			// rays left, with the tier
+	int32_t n_spots;		// spots in both traces
+	double centroid;		// largest distance of the spot centroids
+	double centroid_mean;		// mean distance of the spot centroids
+	double rms;			// largest difference of the RMS spot sizes
+	double rms_mean;		// mean difference of the RMS spot sizes
+};
+
+
+//------------------------------ non-sequential structures
+/*
+ * A node of the bounding volume hierarchy of lensy_trace_nonseq(). A leaf
+ * holds the surfaces index[first], ..., index[first + count - 1]; an inner
+ * node (count == 0) has two children.
+ */
+struct lensy_bvh_node_struct {
+	double lo[3], hi[3];		// the box around the surfaces below
+	int32_t first, count;		// the surfaces of a leaf
+	int32_t left, right;		// the children of an inner node
+};
+
+#define LENSY_NONSEQ_EVENTS	64	// default interactions per ray
+
+struct lensy_nonseq_struct {
+	struct lensy_system_struct sys;	// the surfaces, with their front rules
+	int32_t back[LENSY_NMAX_ELEMENTS];	// the rule on the back side
+	int32_t side[LENSY_NMAX_ELEMENTS];	// +1 or -1, the front side along the axis
+	double hole[LENSY_NMAX_ELEMENTS];	// radius of a central hole, or 0
+	bool bounded[LENSY_NMAX_ELEMENTS];	// bd[] is the bound of the surface
+	struct lensy_bound_struct bd[LENSY_NMAX_ELEMENTS];
+	double lo[LENSY_NMAX_ELEMENTS][3], hi[LENSY_NMAX_ELEMENTS][3];
+	int32_t index[LENSY_NMAX_ELEMENTS];	// the surfaces, in BVH leaf order
+	int32_t n_nodes;
+	struct lensy_bvh_node_struct node[2 * LENSY_NMAX_ELEMENTS];
+	int32_t max_events;		// interactions before a ray is given up
+
+	// the rays of the last lensy_trace_nonseq()
+	int64_t absorbed[LENSY_NMAX_ELEMENTS];	// rays that ended on each surface
+	int64_t escaped;		// rays that left the system
+	int64_t lost;			// rays given up, or not redirected
+	int64_t events;			// interactions, over all rays
+	int64_t tests;			// surface intersections calculated
+};
+
+/*
+ * The settings and results of lensy_trace_ghosts(). The fields up to
+ * 'seed' are set by the caller before lensy_ghost_init().
+ */
+struct lensy_ghost_struct {
+	struct lensy_ccd_struct *ccd;	// the detector
+	int32_t detector;		// the surface of the detector in the model
+	double min_weight;		// weight below which a branch plays roulette
+	uint64_t seed;			// of the roulette random numbers
+
+	double *direct;			// light per pixel, with no Fresnel reflection
+	double *ghost;			// light per pixel, after Fresnel reflections
+	uint64_t state;			// random number state
+
+	// the rays of the last lensy_trace_ghosts(), each with its bundle weight
+	int64_t split;			// Fresnel reflected rays made
+	int64_t killed;			// branches ended by roulette
+	double w_direct, w_ghost;	// weight on the detector
+	double w_absorbed;		// weight absorbed elsewhere
+	double w_escaped;		// weight that left the system
+	double w_lost;			// weight given up, or not redirected
+};
+
+
+//------------------------------ spot structure
+struct lensy_spot_struct {
+	uint64_t path;		// ray path identifier
+	int32_t n;		// number of rays in the spot
+	double weight;		// sum of the ray weights
+	double p[3];		// centroid position
+	double rms;		// RMS distance from the centroid
+	double rms_v[3];	// RMS distance from the centroid, for x, y, z
+};
+
+//------------------------------ through-focus structure
+/*
+ * For a plane moved the distance t along its normal vector, the squared
+ * RMS spot size for axis k is c[k][0] + 2 c[k][1] t + c[k][2] t^2.
+ */
+struct lensy_focus_struct {
+	uint64_t path;		// ray path identifier
+	int32_t n;		// number of rays in the spot
+	double weight;		// sum of the ray weights
+	double p[3];		// centroid position on the plane
+	double u[3];		// centroid displacement per unit of t
+	double c[3][3];		// coefficients of the squared RMS, for x, y, z
+	double t;		// plane position with the smallest RMS spot
+	double rms;		// RMS distance from the centroid, at t
+};
+
+
+//------------------------------ tolerance structures
+/*
+ * The standard deviations of the (normally distributed) errors of one
+ * element of a system, for lensy_tolerance(). Decenter is across the
+ * surface axis, and the vertex shift (despace) is along it. The radius
+ * and ruling errors are relative, i.e., 0.001 is 0.1%.
+ */
+struct lensy_tolerance_struct {
+	int32_t element;	// element index in the system
+	double decenter;	// decenter (meters)
+	double tilt;		// tilt about the vertex (radians)
+	double despace;		// vertex shift (meters)
+	double radius;		// relative radius, or focal length, error
+	double ruling;		// relative grating ruling spacing error
+};
+
+struct lensy_sample_struct {
+	int32_t n;		// number of rays that reached the last element
+	int32_t n_spots;	// number of spots (of more than one ray)
+	double rms;		// mean RMS spot size
+	double shift;		// mean distance of the spots from the nominal
+	double shift_v[3];	// mean displacement of the spots, for x, y, z
+};
+
+
+//------------------------------ sweep structure
+#define	LENSY_NMAX_WORKERS	64	// maximum number of sweep worker processes
+
+#define	LENSY_SWEEP_TODO	0	// status of a point of a sweep
+#define	LENSY_SWEEP_DONE	1
+#define	LENSY_SWEEP_FAILED	2
+
+struct lensy_sweep_struct {
+	int fd;			// the sweep file
+	int32_t n_points;	// number of points in the sweep
+	size_t result_size;	// size of the result record of a point
+	size_t size;		// size of the sweep file
+	void *map;		// the mapped sweep file
+	uint8_t *status;	// status of each point, LENSY_SWEEP_TODO, ...
+	char *results;		// result records
+};
+
+
+//------------------------------ trace server structures
+#define	LENSY_NMAX_SERVED	16	// maximum number of systems in a server
+#define	LENSY_NMAX_OVERRIDES	16	// maximum number of overrides in a job
+
+#define	LENSY_JOB_QUIT		-1	// job system ID to stop the server
+
+#define	LENSY_OVERRIDE_VERTEX	1	// the surface vertex position
+#define	LENSY_OVERRIDE_AXIS	2	// the surface axis vector (focus, center, normal)
+#define	LENSY_OVERRIDE_RULING	3	// the grating ruling vector
+
+struct lensy_override_struct {
+	int32_t element;	// element index in the system
+	int32_t what;		// LENSY_OVERRIDE_VERTEX, ...
+	double value[3];	// the new vector
+};
+
+struct lensy_job_struct {
+	int32_t system;		// system ID, from lensy_server_add()
+	int32_t n_rays;		// use only the first n_rays rays (0 for all)
+	int32_t n_overrides;
+	struct lensy_override_struct o[LENSY_NMAX_OVERRIDES];
+};
+
+struct lensy_result_struct {
+	int32_t rc;		// zero for OK
+	int32_t n_rays;		// number of rays that reached the last element
+	int32_t n_spots;
+	struct lensy_spot_struct *spots;	// the spot table (shared memory)
+	uint16_t *frame;	// the CCD frame (shared memory), or NULL
+	int32_t x_nmax, y_nmax;	// CCD frame dimensions
+	void *map;
+	size_t size;
+};
+
+struct lensy_served_struct {
+	struct lensy_system_struct *sys;
+	struct lensy_bundle_struct *b;
+	struct lensy_ccd_struct *ccd;
+	int32_t i0;		// the rays in 'prefix' are traced up to element i0
+	int32_t n_rays;		// ... for this ray count
+	struct lensy_bundle_struct prefix;
+};
+
+struct lensy_server_struct {
+	int fd;			// the listening socket
+	char path[108];
+	int32_t n;		// number of systems
+	struct lensy_served_struct s[LENSY_NMAX_SERVED];
+};
+
+
+//------------------------------ result cache structures
+#define	LENSY_CACHE_KEY_SIZE	33	// 32 hex digits and a 0
+
+struct lensy_hash_struct {
+	uint64_t h[2];
+	uint64_t len;
+};
+
+struct lensy_cache_struct {
+	char dir[256];		// the cache directory
+	uint64_t max_size;	// maximum size of the cache, in bytes
+};
+
+
+//------------------------------ generated code structure
+#define	LENSY_CODEGEN_VERSION	2	// changed when the generated code changes
+
+struct lensy_codegen_struct {
+	char dir[256];			// the directory of the modules
+	const char *include;		// the directory of lensy.h, for the compiler
+	char key[LENSY_CACHE_KEY_SIZE];	// hash of the system of the module
+	void *handle;			// the loaded module, or NULL
+	int32_t j0;			// the first element in the module
+	int32_t (*trace)(struct lensy_codegen_struct *cg,
+			struct lensy_system_struct *sys,
+			struct lensy_bundle_struct *b);
+
+	// library functions for the generated code
+	double (*index)(double wl, struct lensy_medium_struct *m);
+	double (*index_fast)(double wl, struct lensy_medium_struct *m);
+	int32_t (*intersect)(struct lensy_element_struct *e,
+			struct lensy_ray_struct *r, double q[3], double n[3]);
+	int32_t (*redirect)(struct lensy_element_struct *e,
+			struct lensy_ray_struct *r, double q[3], double n[3],
+			double m, int32_t order);
+	int32_t (*redirect_fast)(struct lensy_element_struct *e,
+			struct lensy_ray_struct *r, double q[3], double n[3],
+			double m, int32_t order);
+};
+
+
+//------------------------------ packed bundle structures
+#define	LENSY_PACK_CHUNK	256	// rays with the same position origin
+#define	LENSY_NMAX_WAVELENGTHS	65536	// wavelengths in a packed bundle
+
+struct lensy_packed_struct {
+	int32_t n;		// number of rays
+	int32_t nmax;		// number of rays allocated
+	double *origin[3];	// position origin of each chunk
+	float *p[3];		// position offsets from the chunk origin
+	uint32_t *d[2];		// octahedral coordinates of the directions
+	uint16_t *wl;		// index in wl_table
+	int32_t n_wl;		// number of wavelengths in wl_table
+	double *wl_table;	// the wavelengths
+	uint64_t *path;		// ray path identifier
+	float *weight;		// ray intensity weight (NULL: all 1)
+	char *red, *green, *blue;
+	bool borrowed;		// the columns are in a mapped file
+};
+
+//------------------------------ streaming structures
+#define	LENSY_STREAM_CHUNK	4096	// default rays per chunk
+
+#define	LENSY_PIPE_FREE		0	// queues of lensy_stream_pipeline()
+#define	LENSY_PIPE_TRACE	1
+#define	LENSY_PIPE_CCD		2
+#define	LENSY_PIPE_SPOTS	3
+#define	LENSY_PIPE_NQUEUES	4
+
+struct lensy_spotsum_struct {
+	int32_t n;			// number of spots
+	int32_t n_hash;			// size of the hash table
+	struct lensy_spot_struct *sum;	// running sums of each spot
+	int32_t *slot;			// hash table of spot numbers, by path
+};
+
+struct lensy_queue_stats_struct {
+	uint64_t n_put;			// chunks put in the queue
+	uint64_t n_full;		// times a thread waited to put
+	uint64_t n_empty;		// times a thread waited to get
+	uint64_t occupancy_sum;		// sum of the chunks in the queue, at put
+	int64_t max;			// most chunks in the queue
+	double occupancy;		// mean chunks in the queue, at put
+};
+
+struct lensy_stream_struct {
+	struct lensy_ccd_struct *ccd;		// CCD to add the rays to, or NULL
+	int32_t ccd_value;			// counts per ray
+	struct lensy_spotsum_struct *spots;	// spot sums, or NULL
+	uint64_t n_in;				// rays made by the source
+	uint64_t n_out;				// rays that reached the end
+	struct lensy_bundle_struct b;		// the chunk bundle
+	struct lensy_queue_stats_struct queue[LENSY_PIPE_NQUEUES];
+};
+
+//------------------------------ ray file structures
+#define	LENSY_UNITS_METERS		1	// positions and wavelengths in m
+#define	LENSY_PATH_SCHEMA_ORDER8	1	// see LENSY_PATH_ORDER()
+#define	LENSY_RAYFILE_BUNDLE		0	// the columns of a bundle
+#define	LENSY_RAYFILE_PACKED		1	// the columns of a packed bundle
+#define	LENSY_RAYFILE_NMAX_COLUMNS	15
+
+struct lensy_rayfile_struct {
+	void *map;		// the mapped file
+	size_t size;
+	uint32_t units;		// LENSY_UNITS_METERS
+	uint32_t path_schema;	// LENSY_PATH_SCHEMA_ORDER8
+	char comment[64];
+	uint32_t format;	// LENSY_RAYFILE_BUNDLE or LENSY_RAYFILE_PACKED
+	struct lensy_packed_struct pk;	// the packed rays, in the mapped file
+	struct lensy_bundle_struct b;	// the rays, in the mapped file
+	double *weight;		// the weights of a version 1 file, or NULL
+};
+
+
+/*------------------------------------------------------- lensy_index_medium
+ * Return the index of refraction of the medium 'm' for the wavelength wl
+ * in meters.
+ */
+double lensy_index_medium(double wl, struct lensy_medium_struct *m);
+
+
+/*------------------------------------------------------- lensy_system_init
+ * Initialize an empty optical system, with the chunk size
+ * LENSY_TRACE_CHUNK.
+ */
+void lensy_system_init(struct lensy_system_struct *sys);
+
+
+/*------------------------------------------------------- lensy_surface_size
+ * Return the size of the surface structure for the surface type 'type',
+ * or zero for an unknown type.
+ */
+size_t lensy_surface_size(int32_t type);
+
+
+/*------------------------------------------------------- lensy_add_reflect
+ * Append an element to the system, with a copy of the surface structure
+ * 'surface' of type 'type' (LENSY_PARABOLOID, ...).
  *
- * Input parameters:
+ * lensy_add_refract():	'm0' is the incident medium, and 'm1' the
+ *			transmission medium.
+ * lensy_add_diffract():	'a' is the ruling vector, see
+ *			lensy_redirect_diffract(), and the orders order0 to
+ *			order1 are used.
  *
- *	beam_dia	- The beam diameter in meters.
- *	beam_step	- The spacing between rays in the beam, in meters.
+ * The return value is the element index, or -1 if the system is full.
+ */
+int32_t lensy_add_reflect(struct lensy_system_struct *sys, int32_t type,
+				void *surface);
+
+int32_t lensy_add_refract(struct lensy_system_struct *sys, int32_t type,
+				void *surface, struct lensy_medium_struct *m0,
+				struct lensy_medium_struct *m1);
+
+int32_t lensy_add_diffract(struct lensy_system_struct *sys, int32_t type,
+				void *surface, double a[3],
+				int32_t order0, int32_t order1);
+
+int32_t lensy_add_impact(struct lensy_system_struct *sys, int32_t type,
+				void *surface);
+
+
+/*------------------------------------------------------- lensy_element_dispersive
+ * Return true if the path of a ray at the element 'e' depends on the
+ * wavelength.
+ */
+bool lensy_element_dispersive(struct lensy_element_struct *e);
+
+
+/*------------------------------------------------------- lensy_element_axis
+ * Return a pointer to the axis vector of the surface of element 'e' (the
+ * vector from the vertex to the focus, or center, or the normal vector of
+ * a plane), or NULL for an unknown surface type.
+ */
+double *lensy_element_axis(struct lensy_element_struct *e);
+
+
+/*------------------------------------------------------- lensy_element_bound
+ * Make the bound 'bd' of the clear aperture of element 'e' (see struct
+ * lensy_bound_struct). The bound test is lensy_kernel_bound_miss(), in
+ * lensy_kernel.h.
  *
+ * The return value is true, or false if the surface has no bound.
  */
-int32_t lensy_beam(struct list_head *pl, struct lensy_ray_struct *pr,
-				double beam_dia, double beam_step);
+bool lensy_element_bound(struct lensy_element_struct *e, struct lensy_bound_struct *bd);
 
 
-/*----------------------------------------------------- lensy_init_ccd
- * This function fills in the values for the associated plane structure,
- * and allocates space for an image buffer.
+/*------------------------------------------------------- lensy_element_intersect
+ * Calculate where the ray 'r' intersects the surface of element 'e'. The
+ * return values are those of the lensy_intersect_X() functions.
  */
-void lensy_init_ccd(struct lensy_ccd_struct *ccd);
+int32_t lensy_element_intersect(struct lensy_element_struct *e,
+				struct lensy_ray_struct *r, double q[3], double n[3]);
+
+
+/*------------------------------------------------------- lensy_element_hit_t
+ * Calculate only where along the ray 'r' the surface of element 'e' is
+ * intersected (see lensy_hit_t_X()).
+ */
+int32_t lensy_element_hit_t(struct lensy_element_struct *e,
+				struct lensy_ray_struct *r, double *t);
+
+
+/*------------------------------------------------------- lensy_element_normal
+ * Calculate the unit normal vector n[3] to the surface of element 'e' at
+ * the point q[3] (see lensy_normal_X()).
+ */
+int32_t lensy_element_normal(struct lensy_element_struct *e,
+				double q[3], double n[3]);
+
+
+/*------------------------------------------------------- lensy_element_hit_t_bundle
+ * Calculate where along each ray of the bundle 'b' the surface of element
+ * 'e' is intersected. t[i] and rc[i] are the distance and the return value
+ * of lensy_element_hit_t() for ray i. The rays are not changed. Rays that
+ * are outside the bound of the aperture (see lensy_element_bound()) are
+ * not intersected, and have rc[i] = -1 and t[i] = 0.
+ *
+ * The return value is the number of rays that hit the surface inside the
+ * aperture.
+ */
+int32_t lensy_element_hit_t_bundle(struct lensy_element_struct *e,
+				struct lensy_bundle_struct *b, double *t, int32_t *rc);
+
+
+/*------------------------------------------------------- lensy_element_redirect
+ * Redirect the ray 'r' at the intersect point 'q' (with the unit normal
+ * 'n') of element 'e'. 'm' is the index of refraction ratio for a
+ * refracting element, and 'order' the grating order for a diffracting
+ * element.
+ *
+ * A return value of zero means OK. A negative value means that the ray
+ * cannot continue.
+ */
+int32_t lensy_element_redirect(struct lensy_element_struct *e,
+				struct lensy_ray_struct *r, double q[3], double n[3],
+				double m, int32_t order);
+
+
+/*------------------------------------------------------- lensy_fused_sphere_refract
+ * Intersect a ray with a surface and redirect it in one step, for the
+ * pairs that have a fused function (see lensy_fused.c). 'm' is the index
+ * of refraction ratio, and 'a' and 'order' are those of
+ * lensy_redirect_diffract().
+ *
+ * A return value of zero means OK.
+ * A return value of -1 means that the ray is outside the aperture.
+ * A return value of -2 means that there is no intersect point.
+ * A return value of -3 means that the ray cannot be redirected.
+ * For -1 and -3, r->p is the intersect point.
+ */
+int32_t lensy_fused_sphere_refract(struct lensy_ray_struct *r,
+				struct lensy_sphere_struct *s, double m);
+int32_t lensy_fused_paraboloid_reflect(struct lensy_ray_struct *r,
+				struct lensy_paraboloid_struct *p);
+int32_t lensy_fused_hyperboloid_reflect(struct lensy_ray_struct *r,
+				struct lensy_hyperboloid_struct *h);
+int32_t lensy_fused_plane_diffract(struct lensy_ray_struct *r,
+				struct lensy_plane_struct *p, double a[3], int32_t order);
+int32_t lensy_fused_plane_refract(struct lensy_ray_struct *r,
+				struct lensy_plane_struct *p, double m);
+int32_t lensy_fused_plane_impact(struct lensy_ray_struct *r,
+				struct lensy_plane_struct *p);
+
+
+/*------------------------------------------------------- lensy_element_fused
+ * Return true if there is a fused function for element 'e' (a grating
+ * with more than one order has none).
+ */
+bool lensy_element_fused(struct lensy_element_struct *e);
+
+
+/*------------------------------------------------------- lensy_element_trace
+ * Take the ray 'r' through element 'e' with its fused function. 'm' is the
+ * index of refraction ratio for a refracting element. The return values
+ * are those of the lensy_fused_X_Y() functions.
+ */
+int32_t lensy_element_trace(struct lensy_element_struct *e,
+				struct lensy_ray_struct *r, double m);
+
+
+/*------------------------------------------------------- lensy_fused_bundle
+ * Take the rays of bundle 'b' through element 'j' of the system, which
+ * must have a fused function. Lost rays are removed from the bundle.
+ *
+ * The return value is the number of rays left.
+ */
+int32_t lensy_fused_bundle(struct lensy_system_struct *sys, int32_t j,
+				struct lensy_bundle_struct *b);
+
+
+/*------------------------------------------------------- lensy_trace
+ * Take the rays of bundle 'b' through all of the elements of the system.
+ * Rays that miss a surface, or cannot be redirected, are removed from the
+ * bundle.
+ *
+ * Up to the first dispersive element, rays that share a start position
+ * and direction (for example, one cone of rays at several wavelengths)
+ * are traced only once (not if the rays are weighted, or the rejected
+ * rays counted).
+ *
+ * The return value is the number of rays left, or -1 if malloc failed.
+ */
+int32_t lensy_trace(struct lensy_system_struct *sys,
+				struct lensy_bundle_struct *b);
+
+
+/*------------------------------------------------------- lensy_trace_elements
+ * Take the rays of bundle 'b' through the elements i0, ..., i1 - 1 of the
+ * system, without sharing.
+ *
+ * The return value is the number of rays left, or -1 if malloc failed.
+ */
+int32_t lensy_trace_elements(struct lensy_system_struct *sys,
+				int32_t i0, int32_t i1,
+				struct lensy_bundle_struct *b);
+
+
+/*------------------------------------------------------- lensy_frames_prepare
+ * Make the surface-local frames of the elements of the system 'sys' in
+ * 'fr' (see lensy_frames.c). Consecutive surfaces on one axis share a
+ * frame. This must be done again when a surface is changed.
+ *
+ * The return value is the number of frames, or -1 if the system is
+ * weighted (lensy_system_weighted(); trace it with lensy_trace()).
+ */
+int32_t lensy_frames_prepare(struct lensy_system_struct *sys,
+				struct lensy_frames_struct *fr);
+
+
+/*------------------------------------------------------- lensy_trace_frames
+ * Take the rays of bundle 'b' through all of the elements of the system,
+ * like lensy_trace(), in the frames 'fr'.
+ *
+ * The return value is the number of rays left, or -1 on error.
+ */
+int32_t lensy_trace_frames(struct lensy_system_struct *sys,
+				struct lensy_frames_struct *fr,
+				struct lensy_bundle_struct *b);
+
+
+/*------------------------------------------------------- lensy_float_prepare
+ * Make the single precision elements of the system 'sys' in 'fl' (see
+ * lensy_float.c). This must be done again when a surface is changed.
+ *
+ * The return value is 0, or -1 if a grating is not a plane.
+ */
+int32_t lensy_float_prepare(struct lensy_system_struct *sys,
+				struct lensy_float_struct *fl);
+
+
+/*------------------------------------------------------- lensy_trace_float
+ * Take the rays of bundle 'b' through all of the elements of the system,
+ * like lensy_trace(), in single precision (to about a micron).
+ *
+ * The return value is the number of rays left, or -1 on error.
+ */
+int32_t lensy_trace_float(struct lensy_system_struct *sys,
+				struct lensy_float_struct *fl,
+				struct lensy_bundle_struct *b);
+
+
+/*------------------------------------------------------- lensy_tier_name
+ * Return the name of the kernel tier 'tier' ("reference", "fast" or
+ * "fastest").
+ */
+const char *lensy_tier_name(int32_t tier);
+
+
+/*------------------------------------------------------- lensy_element_redirect_fast
+ * lensy_element_redirect() for the fast kernel tier.
+ */
+int32_t lensy_element_redirect_fast(struct lensy_element_struct *e,
+				struct lensy_ray_struct *r, double q[3], double n[3],
+				double m, int32_t order);
+
+
+/*------------------------------------------------------- lensy_element_trace_fast
+ * lensy_element_trace() for the fast kernel tier.
+ */
+int32_t lensy_element_trace_fast(struct lensy_element_struct *e,
+				struct lensy_ray_struct *r, double m);
+
+
+/*------------------------------------------------------- lensy_index_medium_fast
+ * lensy_index_medium() for the fast kernel tiers (the dispersion formula
+ * of lensy_index_of_refraction() in Horner form, without pow()).
+ */
+double lensy_index_medium_fast(double wl, struct lensy_medium_struct *m);
+
+
+/*------------------------------------------------------- lensy_trace_fastest
+ * Take the rays of bundle 'b' through the system in single precision, for
+ * lensy_trace() with the tier LENSY_TIER_FASTEST. A system that cannot be
+ * traced in single precision is traced with LENSY_TIER_FAST.
+ *
+ * The return value is the number of rays left, or -1 on error.
+ */
+int32_t lensy_trace_fastest(struct lensy_system_struct *sys,
+				struct lensy_bundle_struct *b);
+
+
+/*------------------------------------------------------- lensy_tier_report
+ * Trace the rays of bundle 'b' (which is not changed) through the system
+ * with the reference tier and with the tier 'tier', and compare the spot
+ * centroids and RMS sizes of the spots found in both, in 'rep'.
+ *
+ * The return value is 0, or -1 on error.
+ */
+int32_t lensy_tier_report(struct lensy_system_struct *sys, int32_t tier,
+				struct lensy_bundle_struct *b,
+				struct lensy_tier_report_struct *rep);
+
+
+/*------------------------------------------------------- lensy_tier_select
+ * Return the fastest kernel tier with which the spots of bundle 'b' in
+ * the system keep all of their rays, and are within 'tolerance' (meters)
+ * of the reference in centroid and in RMS size. The tier found can be set
+ * in sys->tier.
+ *
+ * The return value is the tier, or -1 on error.
+ */
+int32_t lensy_tier_select(struct lensy_system_struct *sys,
+				struct lensy_bundle_struct *b, double tolerance);
+
+
+/*------------------------------------------------------- lensy_nonseq_prepare
+ * Make the non-sequential model 'ns' of the surfaces of the system 'sys'
+ * (see lensy_nonseq.c). The front side of each surface is the side the
+ * ray 'probe' comes from when it is traced through the system in order;
+ * there the element's redirect is the rule. On the back side, a mirror
+ * absorbs, and the other surfaces have the same rule as on the front.
+ *
+ * The return value is 0, or -1 on error.
+ */
+int32_t lensy_nonseq_prepare(struct lensy_nonseq_struct *ns,
+				struct lensy_system_struct *sys,
+				struct lensy_ray_struct *probe);
+
+
+/*------------------------------------------------------- lensy_nonseq_add
+ * Add the surface of element 'e' (e.g., a baffle, with LENSY_IMPACT) to
+ * the model, with the front side 'side' (+1 if along the surface axis),
+ * the back rule 'back', and a central hole of radius 'hole'.
+ *
+ * The return value is the index of the surface, or -1 on error.
+ */
+int32_t lensy_nonseq_add(struct lensy_nonseq_struct *ns,
+				struct lensy_element_struct *e, int32_t side,
+				int32_t back, double hole);
+
+
+/*------------------------------------------------------- lensy_nonseq_build
+ * Build the bounding volume hierarchy of the surfaces of the model. This
+ * must be done again when a surface is added or changed.
+ */
+void lensy_nonseq_build(struct lensy_nonseq_struct *ns);
+
+
+/*------------------------------------------------------- lensy_nonseq_nearest
+ * Find the surface that the ray 'r' reaches first, other than the surface
+ * 'skip' (or -1). *t is the distance along the ray (see lensy_hit_t_X()).
+ *
+ * The return value is the index of the surface, or -1 if there is none.
+ */
+int32_t lensy_nonseq_nearest(struct lensy_nonseq_struct *ns,
+				struct lensy_ray_struct *r, int32_t skip, double *t);
+
+
+/*------------------------------------------------------- lensy_trace_nonseq
+ * Take each ray of bundle 'b' to the nearest surface, over and over, with
+ * the rule of the side it reaches, until it is absorbed (LENSY_IMPACT),
+ * leaves the system, or has had ns->max_events interactions. The rays that
+ * are absorbed are left in the bundle, in order, at the point they were
+ * absorbed; if 'stop' is not NULL, stop[i] is the surface of ray i.
+ * The counts are kept in 'ns'.
+ *
+ * The return value is the number of rays left, or -1 on error.
+ */
+int32_t lensy_trace_nonseq(struct lensy_nonseq_struct *ns,
+				struct lensy_bundle_struct *b, int32_t *stop);
+
+
+/*------------------------------------------------------- lensy_ghost_init
+ * Allocate the image layers of 'gh' (for gh->ccd), and clear them.
+ *
+ * The return value is 0, or -1 if malloc failed.
+ */
+int32_t lensy_ghost_init(struct lensy_ghost_struct *gh);
+
+
+/*------------------------------------------------------- lensy_ghost_free
+ * Free the image layers of 'gh'.
+ */
+void lensy_ghost_free(struct lensy_ghost_struct *gh);
+
+
+/*------------------------------------------------------- lensy_trace_ghosts
+ * Trace the rays of bundle 'b' (which is not changed) non-sequentially, as
+ * lensy_trace_nonseq(), with each ray starting with its weight in the
+ * bundle. At a refracting surface the ray is split: the refracted ray
+ * keeps 1 - R of the weight, and a reflected ray gets R, the Fresnel
+ * reflectance. A
+ * branch with weight below gh->min_weight ends by Russian roulette, or
+ * goes on with the weight gh->min_weight. The light that reaches the
+ * detector is added to the layer gh->direct, or, after a Fresnel
+ * reflection, to gh->ghost.
+ *
+ * The return value is 0, or -1 on error.
+ */
+int32_t lensy_trace_ghosts(struct lensy_nonseq_struct *ns,
+				struct lensy_bundle_struct *b,
+				struct lensy_ghost_struct *gh);
+
+
+/*------------------------------------------------------- lensy_curve_init
+ * Make 'c' the curve of the 'n' points (wl[i], v[i]), the wavelengths in
+ * meters and increasing (see lensy_throughput.c). The arrays are not
+ * copied. lensy_curve_value() returns the value of the curve at the
+ * wavelength 'wl'.
+ *
+ * A return value of zero means OK, and -1 that the points are not valid.
+ */
+int32_t lensy_curve_init(struct lensy_curve_struct *c, int32_t n,
+				double *wl, double *v);
+double lensy_curve_value(struct lensy_curve_struct *c, double wl);
+
+
+/*------------------------------------------------------- lensy_element_medium
+ * Return the medium that the rays cross to reach element 'j' of the
+ * system: the incident medium of a refracting element, else the
+ * transmission medium of the last refracting element before it, or NULL.
+ */
+struct lensy_medium_struct *lensy_element_medium(struct lensy_system_struct *sys,
+				int32_t j);
+
+
+/*------------------------------------------------------- lensy_throughput_init
+ * Set up 't' for the throughput of element 'j' of the system, for
+ * lensy_kernel_throughput() (see lensy_kernel.h).
+ */
+void lensy_throughput_init(struct lensy_throughput_struct *t,
+				struct lensy_system_struct *sys, int32_t j);
+
+
+/*------------------------------------------------------- lensy_system_weighted
+ * Return true if the system has an efficiency or absorption curve, or a
+ * throughput budget (sys->budget).
+ */
+bool lensy_system_weighted(struct lensy_system_struct *sys);
+
+/*------------------------------------------------------- lensy_trace_configs
+ * Trace the rays of bundle 'b' through 'k' configurations sys[0], ...,
+ * sys[k - 1] of an optical system (with the same number of elements),
+ * for example the steps of a focus sweep. The leading elements that are
+ * identical in all configurations are traced once, and the rays are then
+ * traced separately for each configuration into the (initialized) output
+ * bundles out[0], ..., out[k - 1]. The bundle 'b' is not changed.
+ *
+ * The return value is the number of shared elements, or -1 on error.
+ */
+int32_t lensy_trace_configs(struct lensy_system_struct sys[], int32_t k,
+				struct lensy_bundle_struct *b,
+				struct lensy_bundle_struct out[]);
+
+
+/*------------------------------------------------------- lensy_spots
+ * Calculate the spot centroid and RMS sizes for the rays of bundle 'b',
+ * weighted by the ray weights. Rays with the same path identifier belong
+ * to the same spot.
+ *
+ * An array of spots is allocated and returned in '*ps', and must be freed
+ * by the caller. The return value is the number of spots, or -1 if malloc
+ * failed.
+ */
+int32_t lensy_spots(struct lensy_bundle_struct *b, struct lensy_spot_struct **ps);
+
+
+/*------------------------------------------------------- lensy_focus
+ * Through-focus analysis of the rays of bundle 'b', which have impacted
+ * a plane with the normal vector 'n'. For each spot (rays with the same
+ * path identifier), the squared RMS spot size (weighted by the ray
+ * weights) is a quadratic in the distance t that the plane is moved
+ * along 'n', and the best focus t is found from it.
+ *
+ * An array of focus structures is allocated and returned in '*pf', and
+ * must be freed by the caller. The return value is the number of spots,
+ * or -1 on error.
+ */
+int32_t lensy_focus(struct lensy_bundle_struct *b, double n[3],
+				struct lensy_focus_struct **pf);
+
+
+/*------------------------------------------------------- lensy_focus_rms
+ * Return the RMS spot size of 'f' for the plane moved the distance 't'.
+ * The RMS sizes for x, y, z are returned in rms_v[], if it is not NULL.
+ */
+double lensy_focus_rms(struct lensy_focus_struct *f, double t, double rms_v[3]);
+
+
+/*------------------------------------------------------- lensy_focus_best
+ * Return the plane position t with the smallest mean square spot size of
+ * the 'n' spots in f[] (spots of one ray are not counted). The RMS spot
+ * size there is returned in '*rms', if it is not NULL.
+ */
+double lensy_focus_best(struct lensy_focus_struct f[], int32_t n, double *rms);
+
+
+/*------------------------------------------------------- lensy_tolerance_perturb
+ * Apply random errors, as given by the 'n_tol' tolerance structures in
+ * tol[], to the elements of the system 'sys'. The errors are those of
+ * sample number 'k' of lensy_tolerance() with the same seed.
+ */
+void lensy_tolerance_perturb(struct lensy_system_struct *sys,
+				struct lensy_tolerance_struct tol[], int32_t n_tol,
+				uint64_t seed, int32_t k);
+
+
+/*------------------------------------------------------- lensy_tolerance
+ * Monte Carlo tolerance analysis. The rays of bundle 'b' are traced
+ * through 'n_samples' randomly perturbed copies of the system 'sys', on
+ * 'n_threads' threads (one for each processor if n_threads <= 0). The
+ * spot size and the image shift of each sample are put in samples[].
+ * The results only depend on 'seed', not on the number of threads.
+ *
+ * A return value of zero means OK, and -1 means an error.
+ */
+int32_t lensy_tolerance(struct lensy_system_struct *sys,
+				struct lensy_tolerance_struct tol[], int32_t n_tol,
+				struct lensy_bundle_struct *b, int32_t n_samples,
+				uint64_t seed, int32_t n_threads,
+				struct lensy_sample_struct samples[]);
+
+
+/*------------------------------------------------------- lensy_sample_quantiles
+ * Find the quantiles q[0], ..., q[n_q - 1] (0.0 to 1.0) of the RMS spot
+ * size and of the image shift of the 'n' samples s[], in rms[] and
+ * shift[].
+ *
+ * A return value of zero means OK, and -1 means an error.
+ */
+int32_t lensy_sample_quantiles(struct lensy_sample_struct s[], int32_t n,
+				double q[], int32_t n_q, double rms[], double shift[]);
+
+
+/*------------------------------------------------------- lensy_sweep_open
+ * Open (or create) the sweep file 'path' for 'n_points' points, with
+ * result records of 'result_size' bytes. The points already done in an
+ * existing file are kept, so a sweep can be continued.
+ *
+ * A return value of zero means OK.
+ * A return value of -1 means that the file could not be opened or mapped.
+ * A return value of -2 means that the file is for a different sweep.
+ */
+int32_t lensy_sweep_open(struct lensy_sweep_struct *s, const char *path,
+				int32_t n_points, size_t result_size);
+
+
+/*------------------------------------------------------- lensy_sweep_close
+ * Unmap and close the sweep file.
+ */
+void lensy_sweep_close(struct lensy_sweep_struct *s);
+
+
+/*------------------------------------------------------- lensy_sweep_result
+ * Return a pointer to the result record of point 'k', or NULL if the
+ * point is not done.
+ */
+void *lensy_sweep_result(struct lensy_sweep_struct *s, int32_t k);
+
+
+/*------------------------------------------------------- lensy_sweep_run
+ * Run the points of the sweep that are not done yet in 'n_workers' worker
+ * processes (one for each processor if n_workers <= 0). For each point,
+ * point(k, arg, result) is called in a worker process, and it fills in
+ * the result record and returns zero, or returns non-zero if the point
+ * failed. A worker that crashes is replaced, and its point is marked as
+ * failed. Only the worker processes are waited for, not other children
+ * of the program.
+ *
+ * The return value is the number of points done, or -1 on error.
+ */
+int32_t lensy_sweep_run(struct lensy_sweep_struct *s, int32_t n_workers,
+				int32_t (*point)(int32_t k, void *arg, void *result),
+				void *arg);
+
+
+/*------------------------------------------------------- lensy_server_init
+ * Create a trace server socket at 'path'.
+ *
+ * A return value of zero means OK, and -1 means an error.
+ */
+int32_t lensy_server_init(struct lensy_server_struct *srv, const char *path);
+
+
+/*------------------------------------------------------- lensy_server_add
+ * Add the system 'sys', with the rays of bundle 'b' (and the CCD 'ccd',
+ * or NULL), to the server. The structures must be kept by the caller.
+ *
+ * The return value is the system ID, or -1 if the server is full.
+ */
+int32_t lensy_server_add(struct lensy_server_struct *srv,
+				struct lensy_system_struct *sys,
+				struct lensy_bundle_struct *b, struct lensy_ccd_struct *ccd);
+
+
+/*------------------------------------------------------- lensy_server_run
+ * Trace the jobs sent by clients, until a LENSY_JOB_QUIT job.
+ *
+ * A return value of zero means OK, and -1 means that the socket failed.
+ */
+int32_t lensy_server_run(struct lensy_server_struct *srv);
+
+
+/*------------------------------------------------------- lensy_server_close
+ * Close the server socket.
+ */
+void lensy_server_close(struct lensy_server_struct *srv);
+
+
+/*------------------------------------------------------- lensy_client_open
+ * Connect to the trace server at 'path'. The return value is the
+ * connection file descriptor, or -1 on error.
+ */
+int lensy_client_open(const char *path);
+
+
+/*------------------------------------------------------- lensy_client_trace
+ * Send a job to the trace server on connection 'fd', and wait for the
+ * result 'r', which must be released with lensy_result_free().
+ *
+ * A return value of zero means OK.
+ * A return value of -1 means that the connection failed.
+ * A return value of -2 means that the server could not trace the job.
+ */
+int32_t lensy_client_trace(int fd, struct lensy_job_struct *job,
+				struct lensy_result_struct *r);
+
+
+/*------------------------------------------------------- lensy_result_free
+ * Release the shared memory of a trace server result.
+ */
+void lensy_result_free(struct lensy_result_struct *r);
+
+
+/*------------------------------------------------------- lensy_hash_init
+ * Functions for the 128 bit hash that is used for the cache keys. Start
+ * a hash with lensy_hash_init(), add bytes, systems and bundles to it,
+ * and get the key (32 hex digits) with lensy_hash_hex().
+ */
+void lensy_hash_init(struct lensy_hash_struct *h);
+void lensy_hash_add(struct lensy_hash_struct *h, const void *p, size_t len);
+void lensy_hash_system(struct lensy_hash_struct *h, struct lensy_system_struct *sys);
+void lensy_hash_bundle(struct lensy_hash_struct *h, struct lensy_bundle_struct *b);
+void lensy_hash_hex(struct lensy_hash_struct *h, char key[LENSY_CACHE_KEY_SIZE]);
+
+
+/*------------------------------------------------------- lensy_cache_init
+ * Use the directory 'dir' (created if needed) as a result cache of at
+ * most 'max_size' bytes. The least recently used entries are removed
+ * when it is full.
+ *
+ * A return value of zero means OK, and -1 means an error.
+ */
+int32_t lensy_cache_init(struct lensy_cache_struct *c, const char *dir,
+				uint64_t max_size);
+
+
+/*------------------------------------------------------- lensy_cache_get
+ * Look up the cache entry 'key'. On a hit, the contents are returned in a
+ * malloc'ed buffer '*data' of '*size' bytes.
+ *
+ * A return value of zero means a hit, and -1 a miss.
+ */
+int32_t lensy_cache_get(struct lensy_cache_struct *c, const char *key,
+				void **data, size_t *size);
+
+
+/*------------------------------------------------------- lensy_cache_put
+ * Store 'size' bytes at 'data' as the cache entry 'key'.
+ *
+ * A return value of zero means OK, and -1 means an error.
+ */
+int32_t lensy_cache_put(struct lensy_cache_struct *c, const char *key,
+				const void *data, size_t size);
+
+
+/*------------------------------------------------------- lensy_cache_trace
+ * Trace the rays of bundle 'b' through the system 'sys', like
+ * lensy_trace(), or take the traced rays from the cache if the same
+ * system, rays and options 'opt' (of 'opt_size' bytes, may be NULL) were
+ * traced before. '*hit' (if 'hit' is not NULL) tells which. A system
+ * with a throughput budget or reject counts is always traced.
+ *
+ * The return value is the number of rays left, or -1 on error.
+ */
+int32_t lensy_cache_trace(struct lensy_cache_struct *c,
+				struct lensy_system_struct *sys,
+				struct lensy_bundle_struct *b,
+				const void *opt, size_t opt_size, bool *hit);
+
+
+/*------------------------------------------------------- lensy_codegen_init
+ * Use the directory 'dir' (created if needed) for the generated trace
+ * functions (see lensy_codegen.c). The modules are compiled with the
+ * headers of the build tree of the library; set cg->include to use
+ * others (e.g., the installed ones).
+ * lensy_codegen_close() unloads the module.
+ *
+ * lensy_codegen_init() returns zero if OK, or -1 if the directory could
+ * not be made.
+ */
+int32_t lensy_codegen_init(struct lensy_codegen_struct *cg, const char *dir);
+void lensy_codegen_close(struct lensy_codegen_struct *cg);
+
+
+/*------------------------------------------------------- lensy_codegen_source
+ * Write the C source of the trace function for the elements j0, ...,
+ * sys->n - 1 of the system to 'fp'.
+ *
+ * A return value of zero means OK, and -1 that there is a grating with
+ * several orders among the elements.
+ */
+int32_t lensy_codegen_source(struct lensy_system_struct *sys, int32_t j0, FILE *fp);
+
+
+/*------------------------------------------------------- lensy_codegen_load
+ * Load the generated trace function for the system 'sys', and generate
+ * and compile it first if needed. The modules are kept by system hash.
+ *
+ * A return value of zero means OK, and -1 that the module could not be
+ * made or loaded, or that the system is weighted (lensy_system_weighted();
+ * trace it with lensy_trace()).
+ */
+int32_t lensy_codegen_load(struct lensy_codegen_struct *cg, struct lensy_system_struct *sys);
+
+
+/*------------------------------------------------------- lensy_codegen_trace
+ * Take the rays of bundle 'b' through the system 'sys' with the loaded
+ * trace function, like lensy_trace().
+ *
+ * The return value is the number of rays left, or -1 on error.
+ */
+int32_t lensy_codegen_trace(struct lensy_codegen_struct *cg,
+				struct lensy_system_struct *sys,
+				struct lensy_bundle_struct *b);
+
+
+/*------------------------------------------------------- lensy_packed_init
+ * Initialize an empty packed bundle, or free its columns. A packed bundle
+ * is a quantized copy of a bundle, with errors of a few nanometers and
+ * nanoradians (see lensy_packed.c).
+ */
+void lensy_packed_init(struct lensy_packed_struct *pk);
+void lensy_packed_free(struct lensy_packed_struct *pk);
+
+
+/*------------------------------------------------------- lensy_pack
+ * Pack the rays of bundle 'b' into 'pk', or unpack them again. The rays
+ * that were in the destination are replaced.
+ *
+ * A return value of zero means OK, -1 means that realloc failed, and -2
+ * (lensy_pack) that there are more than LENSY_NMAX_WAVELENGTHS wavelengths.
+ */
+int32_t lensy_pack(struct lensy_packed_struct *pk, struct lensy_bundle_struct *b);
+int32_t lensy_unpack(struct lensy_bundle_struct *b, struct lensy_packed_struct *pk);
+
+
+/*------------------------------------------------------- lensy_pack_error
+ * Return the largest position error (meters) in err[0] and the largest
+ * direction error (radians) in err[1] of the packed bundle 'pk', compared
+ * to the bundle 'b' it was packed from.
+ */
+void lensy_pack_error(struct lensy_packed_struct *pk, struct lensy_bundle_struct *b,
+				double err[2]);
+
+/*------------------------------------------------------- lensy_spotsum_init
+ * Spot statistics that are accumulated a bundle at a time: initialize
+ * them, add the rays of a bundle, get the spots (an array that must be
+ * freed by the caller, as for lensy_spots()), and free them.
+ *
+ * lensy_spotsum_add() and lensy_spotsum_spots() return -1 if malloc
+ * failed. lensy_spotsum_spots() otherwise returns the number of spots.
+ */
+void lensy_spotsum_init(struct lensy_spotsum_struct *s);
+int32_t lensy_spotsum_add(struct lensy_spotsum_struct *s, struct lensy_bundle_struct *b);
+int32_t lensy_spotsum_spots(struct lensy_spotsum_struct *s, struct lensy_spot_struct **ps);
+void lensy_spotsum_free(struct lensy_spotsum_struct *s);
+
+
+/*------------------------------------------------------- lensy_stream
+ * Trace the rays from source(arg, b, nmax) through the system 'sys',
+ * 'chunk' rays at a time (LENSY_STREAM_CHUNK if chunk <= 0), and add the
+ * traced rays to st->ccd and st->spots. The memory used does not grow
+ * with the number of rays. The source adds at most nmax rays to the empty
+ * bundle b, and returns the number added, zero at the end, or -1.
+ *
+ * A return value of zero means OK, and -1 means an error.
+ */
+int32_t lensy_stream(struct lensy_system_struct *sys,
+				int32_t (*source)(void *arg, struct lensy_bundle_struct *b,
+						int32_t nmax),
+				void *arg, int32_t chunk, struct lensy_stream_struct *st);
+
+
+/*------------------------------------------------------- lensy_stream_pipeline
+ * Do the same as lensy_stream(), with the source, the tracing (in
+ * 'n_tracers' threads, one for each processor if n_tracers <= 0), the CCD
+ * and the spot sums in threads of their own, connected by lock-free
+ * queues. The results are the same as those of lensy_stream(). The
+ * statistics of the queues are returned in st->queue[].
+ *
+ * A return value of zero means OK, and -1 means an error.
+ */
+int32_t lensy_stream_pipeline(struct lensy_system_struct *sys,
+				int32_t (*source)(void *arg, struct lensy_bundle_struct *b,
+						int32_t nmax),
+				void *arg, int32_t chunk, int32_t n_tracers,
+				struct lensy_stream_struct *st);
+
+
+/*------------------------------------------------------- lensy_rayfile_write
+ * Write the rays of bundle 'b' to the binary ray file 'path', with the
+ * text 'comment' (may be NULL) in the header. The format is described in
+ * lensy_rayfile.c.
+ *
+ * A return value of zero means OK, and -1 means an error.
+ */
+int32_t lensy_rayfile_write(const char *path, struct lensy_bundle_struct *b,
+				const char *comment);
+
+
+/*------------------------------------------------------- lensy_rayfile_write_packed
+ * Write the rays of the packed bundle 'pk' to the ray file 'path', like
+ * lensy_rayfile_write(). The file is less than half the size.
+ */
+int32_t lensy_rayfile_write_packed(const char *path, struct lensy_packed_struct *pk,
+				const char *comment);
+
+
+/*------------------------------------------------------- lensy_rayfile_map
+ * Map the ray file 'path' into memory, without copying it. The rays are
+ * in the borrowed bundle rf->b, which can be traced in place; it is
+ * copied out of the file if it has to grow (through a grating with more
+ * than one order). The rays of a packed ray file are unpacked into rf->b.
+ * The rays of a version 1 file (without weights) get a weight of 1.
+ *
+ * A return value of zero means OK, -1 means that the file could not be
+ * mapped, and -2 means that it is not a ray file of this machine.
+ */
+int32_t lensy_rayfile_map(const char *path, struct lensy_rayfile_struct *rf);
+
+
+/*------------------------------------------------------- lensy_rayfile_unmap
+ * Unmap a ray file that was mapped with lensy_rayfile_map(), and free
+ * rf->b if it was copied out of the file.
+ */
+void lensy_rayfile_unmap(struct lensy_rayfile_struct *rf);
+
+
+
+/*----------------------------------------------------- lensy_cone
+ * Create a cone of rays in a list 'pl', centered around the ray 'pr'.
+ *
+ * Input parameters:
+ *
+ *	cone_dia	- The diameter of a cone of rays, in degrees.
+ *	cone_step	- The angular spacing of rays in the cone, in degrees.
+ *
+ *
+ */
+int32_t lensy_cone(struct list_head *pl, struct lensy_ray_struct *pr,
+				double cone_dia, double cone_step);
+
+
+/*----------------------------------------------------- lensy_cone_count
+ * Return the number of rays that lensy_cone() will create for the
+ * parameters 'cone_dia' and 'cone_step' (in degrees), including the
+ * center ray.
+ */
+int32_t lensy_cone_count(double cone_dia, double cone_step);
+
+
+/*----------------------------------------------------- lensy_cone_bundle
+ * Create a cone of rays centered around the ray 'pr', and append them to
+ * the bundle 'b'. All of the rays are given the path identifier 'path'.
+ *
+ * Input parameters:
+ *
+ *	cone_dia	- The diameter of a cone of rays, in degrees.
+ *	cone_step	- The angular spacing of rays in the cone, in degrees.
+ *
+ * The return value is the number of rays added.
+ */
+int32_t lensy_cone_bundle(struct lensy_bundle_struct *b,
+				struct lensy_ray_struct *pr,
+				double cone_dia, double cone_step, uint64_t path);
+
+
+/*----------------------------------------------------- lensy_beam
+ * Create a circular beam of parallel rays in a list 'pl', centered around
+ * the ray 'pr'.
+ *
+ * Input parameters:
+ *
+ *	beam_dia	- The beam diameter in meters.
+ *	beam_step	- The spacing between rays in the beam, in meters.
+ *
+ */
+int32_t lensy_beam(struct list_head *pl, struct lensy_ray_struct *pr,
+				double beam_dia, double beam_step);
+
+
+/*----------------------------------------------------- lensy_beam_bundle
+ * Create a circular beam of parallel rays centered around the ray 'pr',
+ * and append them to the bundle 'b'. All of the rays are given the path
+ * identifier 'path'.
+ *
+ * Input parameters:
+ *
+ *	beam_dia	- The beam diameter in meters.
+ *	beam_step	- The spacing between rays in the beam, in meters.
+ *
+ * The return value is the number of rays added.
+ */
+int32_t lensy_beam_bundle(struct lensy_bundle_struct *b,
+				struct lensy_ray_struct *pr,
+				double beam_dia, double beam_step, uint64_t path);
+
+
+/*----------------------------------------------------- lensy_pattern_cone
+ * Return the (cached) sampling pattern for a cone of rays around the
+ * direction 'd', or NULL on error. The pattern stays valid until the
+ * caller gives it back with lensy_pattern_release(), even if the cache
+ * drops it meanwhile; it must not be changed or freed. The cache is
+ * locked, so several threads can use it at once.
+ */
+struct lensy_pattern_struct *lensy_pattern_cone(double d[3],
+				double cone_dia, double cone_step);
+
+
+/*----------------------------------------------------- lensy_pattern_beam
+ * Return the (cached) sampling pattern for a beam of parallel rays with
+ * the direction 'd', or NULL on error. As for lensy_pattern_cone(), it
+ * must be given back with lensy_pattern_release().
+ */
+struct lensy_pattern_struct *lensy_pattern_beam(double d[3],
+				double beam_dia, double beam_step);
+
+
+/*----------------------------------------------------- lensy_pattern_release
+ * Give back a pattern from lensy_pattern_cone() or lensy_pattern_beam()
+ * ('pp' may be NULL). The pattern must not be used after this.
+ */
+void lensy_pattern_release(struct lensy_pattern_struct *pp);
+
+
+/*----------------------------------------------------- lensy_pattern_bundle
+ * Append the rays of the sampling pattern 'pp' to the bundle 'b', taking
+ * the start position (cone) or direction (beam), the wavelength and the
+ * colors from the ray 'pr'. All of the rays are given the path identifier
+ * 'path'.
+ *
+ * The return value is the number of rays added.
+ */
+int32_t lensy_pattern_bundle(struct lensy_bundle_struct *b,
+				struct lensy_pattern_struct *pp,
+				struct lensy_ray_struct *pr, uint64_t path);
+
+
+/*----------------------------------------------------- lensy_pattern_flush
+ * Free all of the cached sampling patterns (those still held by a caller
+ * when they are released).
+ */
+void lensy_pattern_flush(void);
+
+
+/*----------------------------------------------------- lensy_bundle_init
+ * Allocate the columns of a ray bundle for 'nmax' rays. The bundle is
+ * initially empty.
+ *
+ * A return value of zero means OK.
+ * A return value of -1 means that malloc failed.
+ */
+int32_t lensy_bundle_init(struct lensy_bundle_struct *b, int32_t nmax);
+
+
+/*----------------------------------------------------- lensy_bundle_reserve
+ * Make sure that the bundle has room for at least 'nmax' rays.
+ *
+ * A return value of zero means OK.
+ * A return value of -1 means that realloc failed.
+ */
+int32_t lensy_bundle_reserve(struct lensy_bundle_struct *b, int32_t nmax);
+
+
+/*----------------------------------------------------- lensy_bundle_free
+ * Free the columns of a ray bundle.
+ */
+void lensy_bundle_free(struct lensy_bundle_struct *b);
+
+
+/*----------------------------------------------------- lensy_bundle_add
+ * Append a copy of the ray 'r' to the bundle, with the path identifier
+ * 'path' and a weight of 1.
+ *
+ * A return value of zero means OK.
+ * A return value of -1 means that realloc failed.
+ */
+int32_t lensy_bundle_add(struct lensy_bundle_struct *b,
+				struct lensy_ray_struct *r, uint64_t path);
+
+
+/*----------------------------------------------------- lensy_bundle_get
+ * Copy ray 'i' of the bundle into the ray structure 'r'.
+ */
+void lensy_bundle_get(struct lensy_bundle_struct *b, int32_t i,
+				struct lensy_ray_struct *r);
+
+
+/*----------------------------------------------------- lensy_bundle_set
+ * Copy the ray structure 'r' into slot 'i' of the bundle. The path and
+ * the weight of the slot are not changed.
+ */
+void lensy_bundle_set(struct lensy_bundle_struct *b, int32_t i,
+				struct lensy_ray_struct *r);
+
+
+/*----------------------------------------------------- lensy_bundle_copy
+ * Copy ray 'i0' of bundle 'b0' (including the path and the weight) into
+ * slot 'i' of bundle 'b'.
+ */
+void lensy_bundle_copy(struct lensy_bundle_struct *b, int32_t i,
+				struct lensy_bundle_struct *b0, int32_t i0);
+
+
+/*----------------------------------------------------- lensy_bundle_clone
+ * Make the (initialized) bundle 'b' a copy of bundle 'b0'.
+ *
+ * A return value of zero means OK.
+ * A return value of -1 means that realloc failed.
+ */
+int32_t lensy_bundle_clone(struct lensy_bundle_struct *b,
+				struct lensy_bundle_struct *b0);
+
+
+/*----------------------------------------------------- lensy_init_ccd
+ * This function fills in the values for the associated plane structure,
+ * and allocates space for an image buffer.
+ */
+void lensy_init_ccd(struct lensy_ccd_struct *ccd);
+
+
+/*----------------------------------------------------- lensy_ccd_pixel
+ * Find the pixel (*i, *j) of the CCD where the point 'p' (on the CCD
+ * plane) lands. The return value is true if it is on the detector.
+ */
+bool lensy_ccd_pixel(struct lensy_ccd_struct *ccd, double p[3],
+				int32_t *i, int32_t *j);
+
+
+/*----------------------------------------------------- lensy_ccd_add
+ * Add the impact positions of the rays of bundle 'b' to the CCD image
+ * buffer, 'value' counts per ray times the ray weight, rounded (up to
+ * 65000 per pixel).
+ *
+ * The return value is the number of rays that landed on the detector.
+ */
+int32_t lensy_ccd_add(struct lensy_ccd_struct *ccd, struct lensy_bundle_struct *b,
+				int32_t value);
 
 #endif
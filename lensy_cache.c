@@ -0,0 +1,482 @@
+/*
+ * lensy_cache.c - v1.4 (codename FlamingMarshmallow)
+ *
+ * Library functions for an on-disk cache of trace results, keyed by a
+ * hash of the optical system and the rays.
+ *
+ *-----------------------------------------------------------------------
+ * Copyright (C) 2013 - 2015 FSF
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *-----------------------------------------------------------------------
+ *
+ * The key of a cache entry is a 128 bit hash of everything that the
+ * result depends on: the elements of the system (surface parameters,
+ * media, grating parameters and throughput curves, not the addresses of
+ * the structures),
+ * all of the columns of the ray bundle, and any options of the caller.
+ * Each entry is a file in the cache directory, named by the key in hex.
+ *
+ * The cache directory is kept below a maximum size by removing the least
+ * recently used entries (the file modification time is updated on each
+ * hit). Entries are written to a temporary file and renamed, so several
+ * programs can share a cache directory.
+ *
+ * Send questions or contributions to me at <michael.h.williamson@gmail.com>.
+ *
+ * History:
+ *
+ *  2026-10-16  Only systems with a budget or reject counts are traced
+ *              without the cache, not all weighted systems.
+ *  2026-10-16  Weighted systems, and systems with reject counts, are
+ *              traced without the cache.
+ *  2026-10-16  The tier of the system is hashed.
+ *  2026-10-16  The throughput curves are hashed, and the weights of the
+ *              rays are kept.
+ *  2026-10-16  This file is created.
+ */
+
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <lensy.h>
+#include <lensy_hash.h>
+
+
+#define	LENSY_CACHE_VERSION	3	// change when the entry format changes
+#define	LENSY_CACHE_MAGIC	"lensyrb1"
+
+
+/*------------------------------------------------------- lensy_hash_init
+ * Start a new hash.
+ */
+void lensy_hash_init(struct lensy_hash_struct *h)
+{
+	h->h[0] = 0x6a09e667f3bcc908ULL;
+	h->h[1] = 0xbb67ae8584caa73bULL;
+	h->len = 0;
+}
+
+
+/*------------------------------------------------------- lensy_hash_add
+ * Add 'len' bytes at 'p' to the hash.
+ */
+void lensy_hash_add(struct lensy_hash_struct *h, const void *p, size_t len)
+{
+	const unsigned char *c = p;
+	uint64_t w;
+	size_t i, k;
+
+	for (i = 0; i < len; i += 8) {
+		k = (len - i < 8) ? len - i : 8;
+		w = 0;
+		memcpy(&w, c + i, k);
+		h->h[0] = lensy_mix64(h->h[0] ^ w);
+		h->h[1] = lensy_mix64(h->h[1] + ((w << 32) | (w >> 32)) + 0x9e3779b97f4a7c15ULL);
+	}
+	h->len += len;
+}
+
+
+/*------------------------------------------------------- lensy_hash_hex
+ * Finish the hash, and write it as 32 hex digits (and a 0) to 'key'.
+ */
+void lensy_hash_hex(struct lensy_hash_struct *h, char key[LENSY_CACHE_KEY_SIZE])
+{
+	uint64_t h0, h1;
+
+	h0 = lensy_mix64(h->h[0] ^ h->len);
+	h1 = lensy_mix64(h->h[1] ^ h0);
+	snprintf(key, LENSY_CACHE_KEY_SIZE, "%016llx%016llx",
+		 (unsigned long long) h0, (unsigned long long) h1);
+}
+
+
+/*------------------------------------------------------- lensy_hash_curve
+ * Add a curve to the hash, by its points.
+ */
+static void lensy_hash_curve(struct lensy_hash_struct *h,
+				struct lensy_curve_struct *c)
+{
+	int32_t n;
+
+	n = (c == NULL) ? 0 : c->n;
+	lensy_hash_add(h, &n, sizeof(n));
+	if (n == 0) return;
+
+	lensy_hash_add(h, c->wl, n * sizeof(double));
+	lensy_hash_add(h, c->v, n * sizeof(double));
+}
+
+
+/*------------------------------------------------------- lensy_hash_medium
+ * Add a medium to the hash, by its values.
+ */
+static void lensy_hash_medium(struct lensy_hash_struct *h,
+				struct lensy_medium_struct *m)
+{
+	int32_t k;
+
+	k = (m == NULL) ? 0 : 1 + ((m->a != NULL) ? 2 : 0) + ((m->s != NULL) ? 4 : 0);
+	lensy_hash_add(h, &k, sizeof(k));
+	if (m == NULL) return;
+
+	lensy_hash_add(h, &m->n, sizeof(m->n));
+	if (m->a != NULL) lensy_hash_add(h, m->a, 6 * sizeof(double));
+	if (m->s != NULL) lensy_hash_add(h, m->s, sizeof(*m->s));
+	lensy_hash_curve(h, m->absorption);
+}
+
+
+/*------------------------------------------------------- lensy_hash_system
+ * Add the elements of a system to the hash, and its tier (the faster
+ * tiers give slightly different rays).
+ */
+void lensy_hash_system(struct lensy_hash_struct *h, struct lensy_system_struct *sys)
+{
+	struct lensy_element_struct *e;
+	int32_t i;
+
+	lensy_hash_add(h, &sys->tier, sizeof(sys->tier));
+	lensy_hash_add(h, &sys->n, sizeof(sys->n));
+	for (i = 0; i < sys->n; i++) {
+		e = &sys->e[i];
+		lensy_hash_add(h, &e->type, sizeof(e->type));
+		lensy_hash_add(h, &e->s, lensy_surface_size(e->type));
+		lensy_hash_add(h, &e->redirect, sizeof(e->redirect));
+		lensy_hash_curve(h, e->efficiency);
+
+		switch (e->redirect) {
+		case LENSY_REFRACT:
+			lensy_hash_medium(h, e->m0);
+			lensy_hash_medium(h, e->m1);
+			break;
+		case LENSY_DIFFRACT:
+			lensy_hash_add(h, e->a, sizeof(e->a));
+			lensy_hash_add(h, &e->order0, sizeof(e->order0));
+			lensy_hash_add(h, &e->order1, sizeof(e->order1));
+			break;
+		}
+	}
+}
+
+
+/*------------------------------------------------------- lensy_hash_bundle
+ * Add all of the rays of a bundle to the hash.
+ */
+void lensy_hash_bundle(struct lensy_hash_struct *h, struct lensy_bundle_struct *b)
+{
+	int32_t k;
+
+	lensy_hash_add(h, &b->n, sizeof(b->n));
+	for (k = 0; k < 3; k++) {
+		lensy_hash_add(h, b->p[k], b->n * sizeof(double));
+		lensy_hash_add(h, b->d[k], b->n * sizeof(double));
+	}
+	lensy_hash_add(h, b->wavelength, b->n * sizeof(double));
+	lensy_hash_add(h, b->path, b->n * sizeof(uint64_t));
+	lensy_hash_add(h, b->weight, b->n * sizeof(double));
+	lensy_hash_add(h, b->red, b->n);
+	lensy_hash_add(h, b->green, b->n);
+	lensy_hash_add(h, b->blue, b->n);
+}
+
+
+/*------------------------------------------------------- lensy_cache_init
+ * Use the directory 'dir' (created if needed) as a cache of at most
+ * 'max_size' bytes.
+ *
+ * A return value of zero means OK, and -1 means that the directory could
+ * not be made.
+ */
+int32_t lensy_cache_init(struct lensy_cache_struct *c, const char *dir,
+				uint64_t max_size)
+{
+	struct stat st;
+
+	memset(c, 0, sizeof(*c));
+	if (strlen(dir) >= sizeof(c->dir) - LENSY_CACHE_KEY_SIZE - 32) {
+		fprintf(stderr, "%s: directory name too long\n", __func__);
+		return -1;
+	}
+	strcpy(c->dir, dir);
+	c->max_size = max_size;
+
+	if ((mkdir(dir, 0755) < 0) && (errno != EEXIST)) {
+		fprintf(stderr, "%s: mkdir %s failed\n", __func__, dir);
+		return -1;
+	}
+	if ((stat(dir, &st) < 0) || !S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "%s: %s is not a directory\n", __func__, dir);
+		return -1;
+	}
+	return 0;
+}
+
+
+/*------------------------------------------------------- lensy_cache_get
+ * Look up the entry 'key'. On a hit, its contents are returned in a
+ * malloc'ed buffer '*data' of '*size' bytes, which must be freed by the
+ * caller.
+ *
+ * A return value of zero means a hit, and -1 a miss.
+ */
+int32_t lensy_cache_get(struct lensy_cache_struct *c, const char *key,
+				void **data, size_t *size)
+{
+	char path[sizeof(c->dir) + LENSY_CACHE_KEY_SIZE];
+	struct stat st;
+	void *p;
+	int fd;
+
+	*data = NULL;
+	*size = 0;
+	snprintf(path, sizeof(path), "%s/%s", c->dir, key);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) return -1;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	p = malloc(st.st_size > 0 ? st.st_size : 1);
+	if ((p == NULL) || (read(fd, p, st.st_size) != st.st_size)) {
+		free(p);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	utimes(path, NULL);			// most recently used
+	*data = p;
+	*size = st.st_size;
+	return 0;
+}
+
+
+/*------------------------------------------------------- cache entry
+ * A file in the cache directory, for the LRU eviction.
+ */
+struct lensy_cache_entry_struct {
+	char name[LENSY_CACHE_KEY_SIZE];
+	time_t mtime;
+	off_t size;
+};
+
+
+/*------------------------------------------------------- lensy_cache_entry_compare
+ * Compare two cache entries by modification time, for qsort().
+ */
+static int lensy_cache_entry_compare(const void *p0, const void *p1)
+{
+	const struct lensy_cache_entry_struct *e0 = p0, *e1 = p1;
+
+	return (e0->mtime > e1->mtime) - (e0->mtime < e1->mtime);
+}
+
+
+/*------------------------------------------------------- lensy_cache_evict
+ * Remove the least recently used entries, until the cache is no larger
+ * than its maximum size.
+ */
+static void lensy_cache_evict(struct lensy_cache_struct *c)
+{
+	char path[sizeof(c->dir) + LENSY_CACHE_KEY_SIZE];
+	struct lensy_cache_entry_struct *entries, *pe;
+	struct dirent *de;
+	struct stat st;
+	uint64_t total;
+	int32_t i, n, nmax;
+	DIR *dir;
+
+	dir = opendir(c->dir);
+	if (dir == NULL) return;
+
+	entries = NULL;
+	n = nmax = 0;
+	total = 0;
+	while ((de = readdir(dir)) != NULL) {
+		if (strlen(de->d_name) != LENSY_CACHE_KEY_SIZE - 1) continue;
+		if (strspn(de->d_name, "0123456789abcdef") != LENSY_CACHE_KEY_SIZE - 1)
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%.32s", c->dir, de->d_name);
+		if (stat(path, &st) < 0) continue;
+
+		if (n >= nmax) {
+			nmax = (nmax > 0) ? 2 * nmax : 64;
+			pe = realloc(entries, nmax * sizeof(*entries));
+			if (pe == NULL) break;
+			entries = pe;
+		}
+		strcpy(entries[n].name, de->d_name);
+		entries[n].mtime = st.st_mtime;
+		entries[n].size = st.st_size;
+		total += st.st_size;
+		n++;
+	}
+	closedir(dir);
+
+	qsort(entries, n, sizeof(*entries), lensy_cache_entry_compare);
+	for (i = 0; (i < n) && (total > c->max_size); i++) {
+		snprintf(path, sizeof(path), "%s/%s", c->dir, entries[i].name);
+		if (unlink(path) == 0) total -= entries[i].size;
+	}
+	free(entries);
+}
+
+
+/*------------------------------------------------------- lensy_cache_put
+ * Store 'size' bytes at 'data' as the entry 'key', then remove old
+ * entries if the cache is too large.
+ *
+ * A return value of zero means OK, and -1 means that the entry could not
+ * be written.
+ */
+int32_t lensy_cache_put(struct lensy_cache_struct *c, const char *key,
+				const void *data, size_t size)
+{
+	char path[sizeof(c->dir) + LENSY_CACHE_KEY_SIZE];
+	char tmp[sizeof(c->dir) + LENSY_CACHE_KEY_SIZE + 32];
+	FILE *fp;
+	int32_t rc;
+
+	snprintf(path, sizeof(path), "%s/%s", c->dir, key);
+	snprintf(tmp, sizeof(tmp), "%s/%s.tmp.%d", c->dir, key, (int) getpid());
+
+	fp = fopen(tmp, "w");
+	if (fp == NULL) return -1;
+	rc = (fwrite(data, 1, size, fp) == size) ? 0 : -1;
+	if (fclose(fp) != 0) rc = -1;
+	if ((rc == 0) && (rename(tmp, path) < 0)) rc = -1;
+	if (rc < 0) {
+		unlink(tmp);
+		return -1;
+	}
+
+	lensy_cache_evict(c);
+	return 0;
+}
+
+
+/*------------------------------------------------------- lensy_cache_trace
+ * Trace the rays of bundle 'b' through the system 'sys' (as lensy_trace()
+ * does), unless the same system and rays, with the same options 'opt' of
+ * 'opt_size' bytes (may be NULL), were traced before. Then the traced
+ * rays are taken from the cache instead. In both cases 'b' holds the
+ * traced rays after the call, and spot tables and CCD frames can be made
+ * from it.
+ *
+ * If 'hit' is not NULL, it is set to true when the rays came from the
+ * cache. The system is not drawn (sys->line) on a hit.
+ *
+ * A system with a throughput budget (sys->budget) or reject counts
+ * (sys->reject) is always traced, since a hit would not add to them. The
+ * throughput curves are part of the key, and the weights of the rays are
+ * kept, so a system with curves is cached.
+ *
+ * The return value is the number of rays left, or -1 on error.
+ */
+int32_t lensy_cache_trace(struct lensy_cache_struct *c,
+				struct lensy_system_struct *sys,
+				struct lensy_bundle_struct *b,
+				const void *opt, size_t opt_size, bool *hit)
+{
+	struct lensy_hash_struct h;
+	char key[LENSY_CACHE_KEY_SIZE];
+	char *data, *q;
+	size_t size;
+	int32_t k, n, rc;
+
+	if (hit != NULL) *hit = false;
+	if ((sys->budget != NULL) || (sys->reject != NULL))
+		return lensy_trace(sys, b);
+
+	lensy_hash_init(&h);
+	k = LENSY_CACHE_VERSION;
+	lensy_hash_add(&h, &k, sizeof(k));
+	lensy_hash_system(&h, sys);
+	lensy_hash_bundle(&h, b);
+	if (opt != NULL) lensy_hash_add(&h, opt, opt_size);
+	lensy_hash_hex(&h, key);
+
+	//------ a hit: the entry is the magic, the ray count, and the columns
+	if (lensy_cache_get(c, key, (void **) &data, &size) == 0) {
+		n = -1;
+		if ((size >= 16) && (memcmp(data, LENSY_CACHE_MAGIC, 8) == 0))
+			memcpy(&n, data + 8, sizeof(n));
+		if ((n >= 0) && (size == 16 + (size_t) n * (8 * sizeof(double) + sizeof(uint64_t) + 3)) &&
+		    (lensy_bundle_reserve(b, n) == 0)) {
+			q = data + 16;
+			for (k = 0; k < 3; k++) {
+				memcpy(b->p[k], q, n * sizeof(double));	q += n * sizeof(double);
+				memcpy(b->d[k], q, n * sizeof(double));	q += n * sizeof(double);
+			}
+			memcpy(b->wavelength, q, n * sizeof(double));	q += n * sizeof(double);
+			memcpy(b->path, q, n * sizeof(uint64_t));	q += n * sizeof(uint64_t);
+			memcpy(b->weight, q, n * sizeof(double));	q += n * sizeof(double);
+			memcpy(b->red, q, n);				q += n;
+			memcpy(b->green, q, n);				q += n;
+			memcpy(b->blue, q, n);
+			b->n = n;
+			free(data);
+			if (hit != NULL) *hit = true;
+			return n;
+		}
+		free(data);
+	}
+
+	//------ a miss: trace, and store the traced rays
+	rc = lensy_trace(sys, b);
+	if (rc < 0) return rc;
+
+	n = b->n;
+	size = 16 + (size_t) n * (8 * sizeof(double) + sizeof(uint64_t) + 3);
+	data = (char *) malloc(size);
+	if (data == NULL) return rc;
+
+	memset(data, 0, 16);
+	memcpy(data, LENSY_CACHE_MAGIC, 8);
+	memcpy(data + 8, &n, sizeof(n));
+	q = data + 16;
+	for (k = 0; k < 3; k++) {
+		memcpy(q, b->p[k], n * sizeof(double));	q += n * sizeof(double);
+		memcpy(q, b->d[k], n * sizeof(double));	q += n * sizeof(double);
+	}
+	memcpy(q, b->wavelength, n * sizeof(double));	q += n * sizeof(double);
+	memcpy(q, b->path, n * sizeof(uint64_t));	q += n * sizeof(uint64_t);
+	memcpy(q, b->weight, n * sizeof(double));	q += n * sizeof(double);
+	memcpy(q, b->red, n);				q += n;
+	memcpy(q, b->green, n);				q += n;
+	memcpy(q, b->blue, n);
+
+	lensy_cache_put(c, key, data, size);
+	free(data);
+	return rc;
+}
@@ -0,0 +1,576 @@
+/*
+ * lensy_codegen.c - v1.4 (codename FlamingMarshmallow)
+ *
+ * Library functions that generate, compile and load a trace function for
+ * one particular optical system.
+ *
+ *-----------------------------------------------------------------------
+ * Copyright (C) 2013 - 2015 FSF
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *-----------------------------------------------------------------------
+ *
+ * lensy_trace() looks at the type of each element for each ray. When a
+ * system is fixed (for a sweep, or for a long simulation), that is pure
+ * overhead. lensy_codegen_load() writes C source for the elements of the
+ * system, one after the other: the surface values are constants, the
+ * index of refraction ratios of non-dispersive elements are calculated in
+ * advance, and the fused functions of lensy_kernel.h are inlined. The
+ * source is compiled with gcc into a shared object, which is loaded with
+ * dlopen().
+ *
+ * The modules are kept in a directory, named by the hash of the system,
+ * so a system is only compiled once, also by later runs of a program.
+ * They are compiled with the lensy.h and lensy_kernel.h of the build tree
+ * of the library (LENSY_INCLUDE_DIR, set by the Makefile), unless
+ * cg->include is changed. The hash also covers the contents of those
+ * headers and the layout of the structures that the generated code uses,
+ * as the library was compiled, so a module is never loaded by a library
+ * with other structures than it was compiled for.
+ *
+ * The generated code uses the kernels of the tier of the system (see
+ * lensy_tier.c); the fastest tier is traced with the fast kernels, in
+ * double precision. As lensy_trace() does, it drops the rays outside the
+ * bound of an element before they are intersected.
+ *
+ * A grating that fans out into several orders is not generated: the
+ * elements up to the last such grating are traced by lensy_trace(), and
+ * the generated function takes the rays from there. Elements without a
+ * fused function (e.g., a cylinder) call lensy_element_intersect() and
+ * lensy_element_redirect() through function pointers in the codegen
+ * structure, as do dispersive media for lensy_index_medium(). The
+ * generated code is not linked with liblensy.a.
+ *
+ * The generated code does not weight the rays, or sum a throughput
+ * budget, so lensy_codegen_load() refuses a weighted system (see
+ * lensy_system_weighted()), which must be traced by lensy_trace().
+ *
+ * The lensy_intersect_X() and lensy_redirect_Y() functions remain the
+ * reference: the generated function gives the same rays as lensy_trace(),
+ * up to the differences of the fused functions (see lensy_fused.c).
+ *
+ * Send questions or contributions to me at <michael.h.williamson@gmail.com>.
+ *
+ * History:
+ *
+ *  2026-10-16  The modules are compiled with the headers of the build
+ *              tree, and keyed by the headers and the structure layout.
+ *  2026-10-16  A weighted system is refused.
+ *  2026-10-16  The tier of the system is used, and the rays outside the
+ *              bound of an element are dropped early. The compiler gets the
+ *              file names as arguments, and the installed headers.
+ *  2026-10-16  This file is created.
+ */
+
+
+#include <ctype.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <lensy.h>
+
+
+#ifndef LENSY_CODEGEN_CC
+#define	LENSY_CODEGEN_CC	"gcc -O2 -fPIC -shared"
+#endif
+
+#ifndef LENSY_INCLUDE_DIR
+#error "LENSY_INCLUDE_DIR must name the directory of lensy.h (see the Makefile)"
+#endif
+
+
+/*------------------------------------------------------- lensy_codegen_init
+ * Use the directory 'dir' (created if needed) for the generated sources
+ * and modules.
+ *
+ * A return value of zero means OK, and -1 means that the directory could
+ * not be made.
+ */
+int32_t lensy_codegen_init(struct lensy_codegen_struct *cg, const char *dir)
+{
+	struct stat st;
+
+	memset(cg, 0, sizeof(*cg));
+	if (strlen(dir) >= sizeof(cg->dir) - LENSY_CACHE_KEY_SIZE - 32) {
+		fprintf(stderr, "%s: directory name too long\n", __func__);
+		return -1;
+	}
+	strcpy(cg->dir, dir);
+
+	cg->include = LENSY_INCLUDE_DIR;
+	cg->index = lensy_index_medium;
+	cg->index_fast = lensy_index_medium_fast;
+	cg->intersect = lensy_element_intersect;
+	cg->redirect = lensy_element_redirect;
+	cg->redirect_fast = lensy_element_redirect_fast;
+
+	if ((mkdir(dir, 0755) < 0) && (errno != EEXIST)) {
+		fprintf(stderr, "%s: mkdir %s failed\n", __func__, dir);
+		return -1;
+	}
+	if ((stat(dir, &st) < 0) || !S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "%s: %s is not a directory\n", __func__, dir);
+		return -1;
+	}
+	return 0;
+}
+
+
+/*------------------------------------------------------- lensy_codegen_close
+ * Unload the module.
+ */
+void lensy_codegen_close(struct lensy_codegen_struct *cg)
+{
+	if (cg->handle != NULL) dlclose(cg->handle);
+	cg->handle = NULL;
+	cg->trace = NULL;
+	cg->key[0] = 0;
+}
+
+
+/*------------------------------------------------------- lensy_codegen_first
+ * Return the first element of the system that is generated: the element
+ * after the last grating that fans out into several orders.
+ */
+static int32_t lensy_codegen_first(struct lensy_system_struct *sys)
+{
+	int32_t j, j0;
+
+	for (j0 = j = 0; j < sys->n; j++)
+		if ((sys->e[j].redirect == LENSY_DIFFRACT) &&
+		    (sys->e[j].order0 < sys->e[j].order1)) j0 = j + 1;
+	return j0;
+}
+
+
+/*------------------------------------------------------- lensy_codegen_vector
+ * Write a 3-D vector as a C initializer, with exact (hex) values.
+ */
+static void lensy_codegen_vector(FILE *fp, const double v[3])
+{
+	fprintf(fp, "{ %a, %a, %a }", v[0], v[1], v[2]);
+}
+
+
+/*------------------------------------------------------- lensy_codegen_surface
+ * Write the surface of element 'e' as the constant s<j>, and its bound
+ * (see lensy_element_bound()) as bd<j>.
+ */
+static void lensy_codegen_surface(FILE *fp, struct lensy_element_struct *e, int32_t j)
+{
+	struct lensy_bound_struct bd;
+
+	if (lensy_element_bound(e, &bd)) {
+		fprintf(fp, "static const struct lensy_bound_struct bd%d = {\n\t", j);
+		lensy_codegen_vector(fp, bd.v);
+		fprintf(fp, ", ");
+		lensy_codegen_vector(fp, bd.a);
+		fprintf(fp, ", %a, %a };\n", bd.r, bd.sag);
+	}
+
+	switch (e->type) {
+	case LENSY_PARABOLOID:
+		fprintf(fp, "static const struct lensy_paraboloid_struct s%d = {\n\t", j);
+		lensy_codegen_vector(fp, e->s.paraboloid.v);
+		fprintf(fp, ", ");
+		lensy_codegen_vector(fp, e->s.paraboloid.f);
+		fprintf(fp, ", %a };\n", e->s.paraboloid.aperture);
+		break;
+	case LENSY_SPHERE:
+		fprintf(fp, "static const struct lensy_sphere_struct s%d = {\n\t", j);
+		lensy_codegen_vector(fp, e->s.sphere.v);
+		fprintf(fp, ", ");
+		lensy_codegen_vector(fp, e->s.sphere.vr);
+		fprintf(fp, ", %a };\n", e->s.sphere.aperture);
+		break;
+	case LENSY_PLANE:
+		fprintf(fp, "static const struct lensy_plane_struct s%d = {\n\t", j);
+		lensy_codegen_vector(fp, e->s.plane.v);
+		fprintf(fp, ", ");
+		lensy_codegen_vector(fp, e->s.plane.n);
+		fprintf(fp, ", %a };\n", e->s.plane.aperture);
+		break;
+	case LENSY_HYPERBOLOID:
+		fprintf(fp, "static const struct lensy_hyperboloid_struct s%d = {\n\t", j);
+		lensy_codegen_vector(fp, e->s.hyperboloid.v);
+		fprintf(fp, ", ");
+		lensy_codegen_vector(fp, e->s.hyperboloid.a);
+		fprintf(fp, ", %a, %a };\n", e->s.hyperboloid.e, e->s.hyperboloid.aperture);
+		break;
+	}
+	if (e->redirect == LENSY_DIFFRACT) {
+		fprintf(fp, "static const double a%d[3] = ", j);
+		lensy_codegen_vector(fp, e->a);
+		fprintf(fp, ";\n");
+	}
+}
+
+
+/*------------------------------------------------------- lensy_codegen_element
+ * Write the code that takes the ray 'r' through element 'e' (element j of
+ * the system), with the fast kernels if 'fast'. Without a line function,
+ * rays outside the bound of the element are dropped first, as by
+ * lensy_trace().
+ */
+static void lensy_codegen_element(FILE *fp, struct lensy_element_struct *e, int32_t j,
+				bool fast)
+{
+	struct lensy_bound_struct bd;
+
+	fprintf(fp, "\n\t\t//------ element %d\n", j);
+	if (lensy_element_bound(e, &bd))
+		fprintf(fp, "\t\tif ((line == NULL) && lensy_kernel_bound_miss(&bd%d, &r)) "
+				"continue;\n", j);
+
+	if (!lensy_element_fused(e)) {
+		fprintf(fp, "\t\trc = cg->intersect(&sys->e[%d], &r, q, n);\n", j);
+		fprintf(fp, "\t\tif ((line != NULL) && (rc >= -1)) "
+				"line(r.p, q, r.red, r.green, r.blue);\n");
+		fprintf(fp, "\t\tif (rc < 0) continue;\n");
+		fprintf(fp, "\t\tif (cg->redirect%s(&sys->e[%d], &r, q, n, m%d, %d) < 0) continue;\n",
+			fast ? "_fast" : "", j, j, e->order0);
+		return;
+	}
+
+	fprintf(fp, "\t\tp0[0] = r.p[0]; p0[1] = r.p[1]; p0[2] = r.p[2];\n");
+	switch (e->type) {
+	case LENSY_SPHERE:
+		fprintf(fp, "\t\trc = lensy_kernel_sphere_refract_tier(&r, &s%d, m%d, %d);\n",
+			j, j, fast);
+		break;
+	case LENSY_PARABOLOID:
+		fprintf(fp, "\t\trc = lensy_kernel_paraboloid_reflect(&r, &s%d);\n", j);
+		break;
+	case LENSY_HYPERBOLOID:
+		fprintf(fp, "\t\trc = lensy_kernel_hyperboloid_reflect(&r, &s%d);\n", j);
+		break;
+	case LENSY_PLANE:
+		switch (e->redirect) {
+		case LENSY_REFRACT:
+			fprintf(fp, "\t\trc = lensy_kernel_plane_refract_tier(&r, &s%d, m%d, %d);\n",
+				j, j, fast);
+			break;
+		case LENSY_DIFFRACT:
+			fprintf(fp, "\t\trc = lensy_kernel_plane_diffract_tier(&r, &s%d, a%d, %d, %d);\n",
+				j, j, e->order0, fast);
+			break;
+		case LENSY_IMPACT:
+			fprintf(fp, "\t\trc = lensy_kernel_plane_impact(&r, &s%d);\n", j);
+			break;
+		}
+		break;
+	}
+	fprintf(fp, "\t\tif ((line != NULL) && (rc != -2)) "
+			"line(p0, r.p, r.red, r.green, r.blue);\n");
+	fprintf(fp, "\t\tif (rc < 0) continue;\n");
+}
+
+
+/*------------------------------------------------------- lensy_codegen_source
+ * Write the C source of the trace function for the elements j0, ...,
+ * sys->n - 1 of the system to 'fp'. The function is
+ *
+ *	int32_t lensy_generated_trace(struct lensy_codegen_struct *cg,
+ *			struct lensy_system_struct *sys,
+ *			struct lensy_bundle_struct *b);
+ *
+ * and it returns the number of rays left in the bundle.
+ *
+ * A return value of zero means OK, and -1 that there is a grating with
+ * several orders among the elements.
+ */
+int32_t lensy_codegen_source(struct lensy_system_struct *sys, int32_t j0, FILE *fp)
+{
+	struct lensy_element_struct *e;
+	int32_t j;
+	bool dispersive, fast;
+
+	fast = (sys->tier != LENSY_TIER_REFERENCE);
+	for (j = j0; j < sys->n; j++) {
+		e = &sys->e[j];
+		if ((e->redirect == LENSY_DIFFRACT) && (e->order0 < e->order1)) {
+			fprintf(stderr, "%s: element %d has several orders\n", __func__, j);
+			return -1;
+		}
+	}
+
+	fprintf(fp, "/*\n * Generated by lensy_codegen_source(), for elements %d to %d.\n */\n\n",
+		j0, sys->n - 1);
+	fprintf(fp, "#include <lensy.h>\n#include <lensy_kernel.h>\n\n");
+
+	for (j = j0; j < sys->n; j++) lensy_codegen_surface(fp, &sys->e[j], j);
+
+	fprintf(fp, "\n\nint32_t lensy_generated_trace(struct lensy_codegen_struct *cg,\n"
+		"\t\t\tstruct lensy_system_struct *sys, struct lensy_bundle_struct *b)\n{\n");
+	fprintf(fp, "\tvoid (*line)(double p0[3], double p1[3], char red, char green, char blue);\n");
+	fprintf(fp, "\tstruct lensy_ray_struct r;\n");
+	fprintf(fp, "\tdouble p0[3], q[3], n[3], wl;\n");
+	fprintf(fp, "\tint32_t i, w, rc;\n");
+
+	//------ the index of refraction ratios
+	dispersive = false;
+	for (j = j0; j < sys->n; j++) {
+		e = &sys->e[j];
+		if (e->redirect != LENSY_REFRACT) {
+			fprintf(fp, "\tconst double m%d = 1.0;\n", j);
+		} else if (lensy_element_dispersive(e)) {
+			fprintf(fp, "\tdouble m%d = 1.0;\n", j);
+			dispersive = true;
+		} else {
+			fprintf(fp, "\tconst double m%d = %a;\n", j,
+				lensy_index_medium(0.0, e->m0) / lensy_index_medium(0.0, e->m1));
+		}
+	}
+
+	fprintf(fp, "\n\t(void) q;\n\t(void) n;\n");
+	fprintf(fp, "\tline = sys->line;\n\twl = -1.0;\n\n");
+	fprintf(fp, "\tfor (i = w = 0; i < b->n; i++) {\n");
+	fprintf(fp, "\t\tr.p[0] = b->p[0][i]; r.p[1] = b->p[1][i]; r.p[2] = b->p[2][i];\n");
+	fprintf(fp, "\t\tr.d[0] = b->d[0][i]; r.d[1] = b->d[1][i]; r.d[2] = b->d[2][i];\n");
+	fprintf(fp, "\t\tr.wavelength = b->wavelength[i];\n");
+	fprintf(fp, "\t\tr.red = b->red[i]; r.green = b->green[i]; r.blue = b->blue[i];\n");
+
+	if (dispersive) {
+		fprintf(fp, "\n\t\tif (r.wavelength != wl) {\n\t\t\twl = r.wavelength;\n");
+		for (j = j0; j < sys->n; j++) {
+			e = &sys->e[j];
+			if ((e->redirect == LENSY_REFRACT) && lensy_element_dispersive(e))
+				fprintf(fp, "\t\t\tm%d = cg->index%s(wl, sys->e[%d].m0) / "
+					"cg->index%s(wl, sys->e[%d].m1);\n",
+					j, fast ? "_fast" : "", j, fast ? "_fast" : "", j);
+		}
+		fprintf(fp, "\t\t}\n");
+	}
+
+	for (j = j0; j < sys->n; j++) lensy_codegen_element(fp, &sys->e[j], j, fast);
+
+	fprintf(fp, "\n\t\tb->p[0][w] = r.p[0]; b->p[1][w] = r.p[1]; b->p[2][w] = r.p[2];\n");
+	fprintf(fp, "\t\tb->d[0][w] = r.d[0]; b->d[1][w] = r.d[1]; b->d[2][w] = r.d[2];\n");
+	fprintf(fp, "\t\tb->wavelength[w] = r.wavelength;\n");
+	fprintf(fp, "\t\tb->red[w] = r.red; b->green[w] = r.green; b->blue[w] = r.blue;\n");
+	fprintf(fp, "\t\tb->path[w] = b->path[i];\n");
+	fprintf(fp, "\t\tb->weight[w] = b->weight[i];\n");
+	fprintf(fp, "\t\tw++;\n\t}\n\t(void) wl;\n\tb->n = w;\n\treturn w;\n}\n");
+	return 0;
+}
+
+
+/*------------------------------------------------------- lensy_codegen_compile
+ * Compile the source 'src' into the shared object 'out', with lensy.h
+ * and lensy_kernel.h from the directory 'include'. The file names are
+ * given to the shell as arguments, so they are never parsed as commands.
+ *
+ * A return value of zero means OK, and -1 that the compiler failed.
+ */
+static int32_t lensy_codegen_compile(const char *include, const char *out,
+				const char *src)
+{
+	pid_t pid;
+	int status;
+
+	pid = fork();
+	if (pid < 0) return -1;
+	if (pid == 0) {
+		execl("/bin/sh", "sh", "-c",
+			LENSY_CODEGEN_CC " -I\"$1\" -o \"$2\" \"$3\" -lm",
+			"sh", include, out, src, (char *) NULL);
+		_exit(127);
+	}
+	while (waitpid(pid, &status, 0) < 0)
+		if (errno != EINTR) return -1;
+	return (WIFEXITED(status) && (WEXITSTATUS(status) == 0)) ? 0 : -1;
+}
+
+
+/*------------------------------------------------------- lensy_codegen_layout
+ * Add to the hash 'h' the layout of the structures that the generated
+ * code uses, as this library was compiled, and the contents of the
+ * headers in the directory 'include' that the module is compiled with.
+ *
+ * A return value of zero means OK, and -1 that a header could not be
+ * read.
+ */
+static int32_t lensy_codegen_layout(struct lensy_hash_struct *h, const char *include)
+{
+	static const char *headers[] = { "lensy.h", "lensy_kernel.h", "lensy_vec3.h", "list.h" };
+	const size_t layout[] = {
+		sizeof(struct lensy_ray_struct),
+		offsetof(struct lensy_ray_struct, d),
+		offsetof(struct lensy_ray_struct, wavelength),
+		offsetof(struct lensy_ray_struct, red),
+		sizeof(struct lensy_bundle_struct),
+		offsetof(struct lensy_bundle_struct, p),
+		offsetof(struct lensy_bundle_struct, d),
+		offsetof(struct lensy_bundle_struct, wavelength),
+		offsetof(struct lensy_bundle_struct, path),
+		offsetof(struct lensy_bundle_struct, weight),
+		offsetof(struct lensy_bundle_struct, red),
+		offsetof(struct lensy_bundle_struct, borrowed),
+		sizeof(struct lensy_element_struct),
+		offsetof(struct lensy_element_struct, s),
+		offsetof(struct lensy_element_struct, m0),
+		offsetof(struct lensy_element_struct, order0),
+		sizeof(struct lensy_system_struct),
+		offsetof(struct lensy_system_struct, e),
+		offsetof(struct lensy_system_struct, line),
+		sizeof(struct lensy_codegen_struct),
+		offsetof(struct lensy_codegen_struct, index),
+		offsetof(struct lensy_codegen_struct, redirect_fast),
+		sizeof(struct lensy_bound_struct),
+		sizeof(struct lensy_sphere_struct),
+		sizeof(struct lensy_paraboloid_struct),
+		sizeof(struct lensy_hyperboloid_struct),
+		sizeof(struct lensy_plane_struct),
+		sizeof(struct lensy_cylinder_struct),
+		sizeof(struct lensy_medium_struct),
+	};
+	char path[PATH_MAX], buf[4096];
+	size_t i, n;
+	FILE *fp;
+
+	lensy_hash_add(h, layout, sizeof(layout));
+
+	for (i = 0; i < sizeof(headers) / sizeof(headers[0]); i++) {
+		snprintf(path, sizeof(path), "%s/%s", include, headers[i]);
+		fp = fopen(path, "r");
+		if (fp == NULL) {
+			fprintf(stderr, "%s: cannot read %s\n", __func__, path);
+			return -1;
+		}
+		while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+			lensy_hash_add(h, buf, n);
+		fclose(fp);
+	}
+	return 0;
+}
+
+
+/*------------------------------------------------------- lensy_codegen_load
+ * Load the module for the system 'sys', and generate and compile it first
+ * if it is not in the directory yet. Nothing is done if the module is
+ * already loaded.
+ *
+ * A return value of zero means OK.
+ * A return value of -1 means that the module could not be made or loaded,
+ * or that the system is weighted (the generated code has no throughput).
+ */
+int32_t lensy_codegen_load(struct lensy_codegen_struct *cg, struct lensy_system_struct *sys)
+{
+	char key[LENSY_CACHE_KEY_SIZE];
+	char src[sizeof(cg->dir) + LENSY_CACHE_KEY_SIZE + 32];
+	char so[sizeof(src)], tmp[sizeof(src)];
+	struct lensy_hash_struct h;
+	int32_t j0, version, rc;
+	FILE *fp;
+
+	if (lensy_system_weighted(sys)) return -1;
+
+	j0 = lensy_codegen_first(sys);
+	version = LENSY_CODEGEN_VERSION;
+
+	lensy_hash_init(&h);
+	lensy_hash_add(&h, &version, sizeof(version));
+	lensy_hash_add(&h, &j0, sizeof(j0));
+	lensy_hash_system(&h, sys);
+	if (lensy_codegen_layout(&h, cg->include) < 0) return -1;
+	lensy_hash_hex(&h, key);
+
+	if ((cg->handle != NULL) && (strcmp(key, cg->key) == 0)) return 0;
+	lensy_codegen_close(cg);
+
+	snprintf(src, sizeof(src), "%s/%s.c", cg->dir, key);
+	snprintf(so, sizeof(so), "%s/%s.so", cg->dir, key);
+
+	if (access(so, R_OK) < 0) {
+		fp = fopen(src, "w");
+		if (fp == NULL) {
+			fprintf(stderr, "%s: cannot write %s\n", __func__, src);
+			return -1;
+		}
+		rc = lensy_codegen_source(sys, j0, fp);
+		if (fclose(fp) != 0) rc = -1;
+		if (rc < 0) return -1;
+
+		//------ compiled to a temporary name, so that no one loads half a module
+		snprintf(tmp, sizeof(tmp), "%s/%s.%d", cg->dir, key, (int) getpid());
+		rc = lensy_codegen_compile(cg->include, tmp, src);
+		if ((rc != 0) || (rename(tmp, so) < 0)) {
+			fprintf(stderr, "%s: cannot compile %s\n", __func__, src);
+			unlink(tmp);
+			return -1;
+		}
+	}
+
+	cg->handle = dlopen(so, RTLD_NOW | RTLD_LOCAL);
+	if (cg->handle == NULL) {
+		fprintf(stderr, "%s: %s\n", __func__, dlerror());
+		return -1;
+	}
+	*(void **) &cg->trace = dlsym(cg->handle, "lensy_generated_trace");
+	if (cg->trace == NULL) {
+		fprintf(stderr, "%s: %s\n", __func__, dlerror());
+		lensy_codegen_close(cg);
+		return -1;
+	}
+
+	strcpy(cg->key, key);
+	cg->j0 = j0;
+	return 0;
+}
+
+
+/*------------------------------------------------------- lensy_codegen_trace
+ * Take the rays of bundle 'b' through the system 'sys' with the loaded
+ * module (see lensy_codegen_load()), like lensy_trace().
+ *
+ * The return value is the number of rays left, or -1 if no module is
+ * loaded or malloc failed.
+ */
+int32_t lensy_codegen_trace(struct lensy_codegen_struct *cg,
+				struct lensy_system_struct *sys,
+				struct lensy_bundle_struct *b)
+{
+	struct lensy_system_struct *head;
+	int32_t rc;
+
+	if (cg->trace == NULL) {
+		fprintf(stderr, "%s: no module loaded\n", __func__);
+		return -1;
+	}
+
+	//------ the elements up to the last grating with several orders
+	if (cg->j0 > 0) {
+		head = (struct lensy_system_struct *) malloc(sizeof(*head));
+		if (head == NULL) return -1;
+		memcpy(head, sys, sizeof(*head));
+		head->n = cg->j0;
+		rc = lensy_trace(head, b);
+		free(head);
+		if (rc < 0) return -1;
+	}
+
+	return cg->trace(cg, sys, b);
+}
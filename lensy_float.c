@@ -0,0 +1,563 @@
+/*
+ * lensy_float.c - v1.4 (codename FlamingMarshmallow)
+ *
+ * Library functions for tracing rays in single precision, for exploratory
+ * sweeps where a micron of error is acceptable.
+ *
+ *-----------------------------------------------------------------------
+ * Copyright (C) 2013 - 2015 FSF
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *-----------------------------------------------------------------------
+ *
+ * A float has 24 bits of mantissa, about 60 nm at one meter. To keep the
+ * error near that, and not far above it, the trace is arranged so that
+ * nothing large is subtracted from anything large:
+ *
+ *	- Each element has its own frame, with the vertex at the origin and
+ *	  the surface axis along +z (lensy_float_prepare() works out the
+ *	  frames in double). A ray is moved from the frame of one element to
+ *	  the next with a rotation and a shift that are rounded once.
+ *
+ *	- With the vertex at the origin, the constant term of the quadratic
+ *	  has no k^2 to cancel, e.g. x^2 + y^2 + z (z - 2k) for a sphere of
+ *	  radius k, in place of |p - c|^2 - k^2.
+ *
+ *	- The roots are found with the stable pair q = -(b + sign(b) sqrt(D)),
+ *	  t = q / a and t = c / q (b is half the linear coefficient), which
+ *	  does not cancel when b^2 >> ac, and also works for a = 0.
+ *
+ *	- The aperture tests compare x^2 + y^2 with (aperture / 2)^2 in
+ *	  double: the squares of floats are exact there, so a ray on the rim
+ *	  is kept or dropped as the double trace would.
+ *
+ *	- The refraction and the (single order) diffraction use the vector
+ *	  form of the laws, without asin(), sin() and cos().
+ *
+ * The surfaces are, with k = |vr|, |f|, |va| or |a| of the surface:
+ *
+ *	sphere		x^2 + y^2 + z^2 - 2kz = 0
+ *	paraboloid	x^2 + y^2 - 4kz = 0
+ *	cylinder	y^2 + z^2 - 2kz = 0 (the cylinder axis is x)
+ *	hyperboloid	x^2 + y^2 - (e^2 - 1)(z^2 - 2kz) = 0
+ *	plane		z = 0 (for a grating, the ruling vector is along x)
+ *
+ * The rays are kept as arrays of floats (half the size of the doubles, so
+ * twice as many in a vector register or a cache line), and are taken
+ * through one element at a time. Gratings with several orders are traced
+ * in double, by lensy_trace_elements().
+ *
+ * This is the LENSY_TIER_FASTEST kernel tier of lensy_trace() (see
+ * lensy_tier.c), where lensy_tier_report() compares its spots with those
+ * of the reference.
+ *
+ * Send questions or contributions to me at <michael.h.williamson@gmail.com>.
+ *
+ * History:
+ *
+ *  2026-10-16  This file is created.
+ */
+
+
+#include <ctype.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <lensy.h>
+#include <lensy_kernel.h>
+
+
+//------------------------------ the rays of lensy_float_range()
+struct lensy_float_rays_struct {
+	int32_t n;			// number of rays
+	int32_t *i;			// index of each ray in the bundle
+	float *p[3];			// positions, in the frame of the element
+	float *d[3];			// directions, in the frame of the element
+	float *m;			// index of refraction ratio
+};
+
+
+/*------------------------------------------------------- lensy_float_fan
+ * Return true if element 'e' is a grating with several orders.
+ */
+static inline bool lensy_float_fan(struct lensy_element_struct *e)
+{
+	return (e->redirect == LENSY_DIFFRACT) && (e->order0 != e->order1);
+}
+
+
+/*------------------------------------------------------- lensy_float_axes
+ * Make the rotation 'r' (rows are the x, y and z axes) with the z axis
+ * along 'z', and the x axis along the part of 'x' across z (or any axis
+ * across z, if 'x' is NULL or parallel to z).
+ *
+ * The return value is 0, or -1 if 'z' is zero.
+ */
+static int32_t lensy_float_axes(double r[3][3], double z[3], double *x)
+{
+	double d0, a[3];
+	int32_t k;
+
+	d0 = lensy_norm3(z);
+	if (d0 == 0.0) return -1;
+	for (k = 0; k < 3; k++) r[2][k] = z[k] / d0;
+
+	a[0] = a[1] = a[2] = 0.0;
+	if (x != NULL) {
+		d0 = lensy_dot3(x, r[2]);
+		for (k = 0; k < 3; k++) a[k] = x[k] - d0 * r[2][k];
+	}
+	if (lensy_norm3(a) == 0.0) {
+		a[(fabs(r[2][0]) < 0.9) ? 0 : 1] = 1.0;
+		d0 = lensy_dot3(a, r[2]);
+		for (k = 0; k < 3; k++) a[k] -= d0 * r[2][k];
+	}
+	d0 = lensy_norm3(a);
+	for (k = 0; k < 3; k++) r[0][k] = a[k] / d0;
+
+	lensy_vcross3(r[2], r[0], r[1]);
+	return 0;
+}
+
+
+/*------------------------------------------------------- lensy_float_prepare
+ * Make the single precision elements of the system 'sys' in 'fl'.
+ *
+ * The return value is 0, or -1 if an element cannot be traced in single
+ * precision (a grating that is not a plane).
+ */
+int32_t lensy_float_prepare(struct lensy_system_struct *sys, struct lensy_float_struct *fl)
+{
+	struct lensy_element_struct *e;
+	struct lensy_float_element_struct *f, *g;
+	double r[3][3], w[3], *x, ap;
+	int32_t j, k, l;
+
+	memset(fl, 0, sizeof(*fl));
+	fl->n = sys->n;
+
+	for (j = 0; j < sys->n; j++) {
+		e = &sys->e[j];
+		f = &fl->e[j];
+		f->type = e->type;
+		f->redirect = e->redirect;
+		if (lensy_float_fan(e)) continue;
+
+		if ((e->redirect == LENSY_DIFFRACT) && (e->type != LENSY_PLANE)) {
+			fprintf(stderr, "%s: element %d is a grating that is not a plane\n",
+				__func__, j);
+			return -1;
+		}
+
+		x = NULL;
+		if (e->type == LENSY_CYLINDER) x = e->s.cylinder.a;
+		if (e->redirect == LENSY_DIFFRACT) x = e->a;
+		if (lensy_float_axes(f->r, lensy_element_axis(e), x) < 0) {
+			fprintf(stderr, "%s: element %d has no axis\n", __func__, j);
+			return -1;
+		}
+		memcpy(f->o, e->s.sphere.v, sizeof(f->o));	// the vertex is first
+
+		f->k = lensy_norm3(lensy_element_axis(e));
+		switch (e->type) {
+		case LENSY_CYLINDER:	ap = e->s.cylinder.aperture; break;
+		case LENSY_HYPERBOLOID:	ap = e->s.hyperboloid.aperture; break;
+		default:		ap = e->s.sphere.aperture; break;
+		}
+		f->r2 = (ap / 2.0) * (ap / 2.0);
+		if (e->type == LENSY_HYPERBOLOID)
+			f->e2 = e->s.hyperboloid.e * e->s.hyperboloid.e - 1.0;
+		if (e->redirect == LENSY_DIFFRACT)
+			f->g = e->order0 / lensy_norm3(e->a);
+	}
+
+	//------ the move from the frame of the element before
+	for (j = 1; j < sys->n; j++) {
+		f = &fl->e[j];
+		g = &fl->e[j - 1];
+		if (lensy_float_fan(&sys->e[j]) || lensy_float_fan(&sys->e[j - 1])) continue;
+
+		// r = f->r g->r^T, t = f->r (g->o - f->o)
+		for (k = 0; k < 3; k++) {
+			for (l = 0; l < 3; l++)
+				r[k][l] = f->r[k][0] * g->r[l][0] + f->r[k][1] * g->r[l][1] +
+					  f->r[k][2] * g->r[l][2];
+			w[k] = g->o[k] - f->o[k];
+		}
+		for (k = 0; k < 3; k++) {
+			for (l = 0; l < 3; l++) f->mr[k][l] = r[k][l];
+			f->mt[k] = lensy_dot3(f->r[k], w);
+		}
+	}
+	return 0;
+}
+
+
+/*------------------------------------------------------- lensy_float_root
+ * Return the roots of a t^2 + 2 b t + c = 0 in '*tp' (the root with +sqrt
+ * of the usual formula) and '*tm' (with -sqrt).
+ *
+ * The return value is 0, or -2 if there is no root.
+ */
+static inline int32_t lensy_float_root(float a, float b, float c, float *tp, float *tm)
+{
+	float d0, q;
+
+	d0 = b * b - a * c;
+	if (d0 < 0.0f) return -2;
+
+	q = (b >= 0.0f) ? -(b + sqrtf(d0)) : -(b - sqrtf(d0));
+	if (q == 0.0f) return -2;
+	if (b >= 0.0f) {
+		*tp = c / q;
+		*tm = (a != 0.0f) ? q / a : -INFINITY;
+	} else {
+		*tp = (a != 0.0f) ? q / a : INFINITY;
+		*tm = c / q;
+	}
+	return 0;
+}
+
+
+/*------------------------------------------------------- lensy_float_inside
+ * Return true if the point (x, y) is inside the aperture r2 = (aperture/2)^2.
+ */
+static inline bool lensy_float_inside(float x, float y, double r2)
+{
+	return ((double) x * x + (double) y * y) <= r2;
+}
+
+
+/*------------------------------------------------------- lensy_float_ray
+ * Take one ray, at p[] with the direction d[] in the frame of the element
+ * 'f', to the surface and redirect it ('m' is the index of refraction
+ * ratio, and 'wl' the wavelength).
+ *
+ * The return values are those of the lensy_fused_X_Y() functions.
+ */
+static inline int32_t lensy_float_ray(const struct lensy_float_element_struct *f,
+				float p[3], float d[3], float m, double wl)
+{
+	float a, b, c, t, tp, tm, k, z, d0, d1, d2, n[3];
+	int32_t rc;
+
+	k = f->k;
+
+	//------ the intersect point
+	switch (f->type) {
+	case LENSY_SPHERE:
+	case LENSY_HYPERBOLOID:
+	case LENSY_CYLINDER:
+		if (f->type == LENSY_SPHERE) {
+			a = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+			b = p[0] * d[0] + p[1] * d[1] + (p[2] - k) * d[2];
+			c = p[0] * p[0] + p[1] * p[1] + p[2] * (p[2] - 2 * k);
+		} else if (f->type == LENSY_CYLINDER) {
+			a = d[1] * d[1] + d[2] * d[2];
+			b = p[1] * d[1] + (p[2] - k) * d[2];
+			c = p[1] * p[1] + p[2] * (p[2] - 2 * k);
+		} else {
+			a = d[0] * d[0] + d[1] * d[1] - f->e2 * d[2] * d[2];
+			b = p[0] * d[0] + p[1] * d[1] - f->e2 * (p[2] - k) * d[2];
+			c = p[0] * p[0] + p[1] * p[1] - f->e2 * p[2] * (p[2] - 2 * k);
+		}
+		if (lensy_float_root(a, b, c, &tp, &tm) < 0) return -2;
+
+		// the intersect point on the vertex side of the center
+		t = (p[2] + tp * d[2] < k) ? tp : tm;
+		break;
+	case LENSY_PARABOLOID:
+		a = d[0] * d[0] + d[1] * d[1];
+		b = p[0] * d[0] + p[1] * d[1] - 2 * k * d[2];
+		c = p[0] * p[0] + p[1] * p[1] - 4 * k * p[2];
+		if (lensy_float_root(a, b, c, &tp, &tm) < 0) return -2;
+
+		// the nearest intersect point ahead of the ray
+		t = tp;
+		if ((t < 0.0f) || ((tm > 0.0f) && (tm < t))) t = tm;
+		if (t < 0.0f) return -2;
+		break;
+	case LENSY_PLANE:
+		if (d[2] == 0.0f) return -2;
+		t = -p[2] / d[2];
+		if (t < 0.0f) return -2;
+		break;
+	default:
+		return -2;
+	}
+	if (!isfinite(t)) return -2;
+
+	z = p[2] + t * d[2];
+	if ((f->type != LENSY_PARABOLOID) && (f->type != LENSY_PLANE) && (z >= k)) return -2;
+	p[0] += t * d[0];
+	p[1] += t * d[1];
+	p[2] = z;
+
+	//------ the unit normal
+	switch (f->type) {
+	case LENSY_SPHERE:
+		n[0] = p[0];
+		n[1] = p[1];
+		n[2] = p[2] - k;
+		break;
+	case LENSY_PARABOLOID:
+		n[0] = -p[0];
+		n[1] = -p[1];
+		n[2] = 2 * k;
+		break;
+	case LENSY_CYLINDER:
+		n[0] = 0.0f;
+		n[1] = p[1];
+		n[2] = p[2] - k;
+		break;
+	case LENSY_HYPERBOLOID:
+		n[0] = p[0];
+		n[1] = p[1];
+		n[2] = f->e2 * (k - p[2]);
+		break;
+	default:
+		n[0] = 0.0f;
+		n[1] = 0.0f;
+		n[2] = 1.0f;
+		break;
+	}
+	d0 = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+	if (d0 == 0.0f) return -2;
+	n[0] /= d0;
+	n[1] /= d0;
+	n[2] /= d0;
+
+	if (!lensy_float_inside(p[0], p[1], f->r2)) return -1;
+
+	//------ the new direction
+	rc = 0;
+	switch (f->redirect) {
+	case LENSY_REFLECT:
+		d0 = 2 * (d[0] * n[0] + d[1] * n[1] + d[2] * n[2]);
+		d[0] -= d0 * n[0];
+		d[1] -= d0 * n[1];
+		d[2] -= d0 * n[2];
+		break;
+	case LENSY_REFRACT:
+		// with the normal toward the incident side, cos(i) = -u.n
+		d0 = sqrtf(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+		if (d0 == 0.0f) return -3;
+		d1 = -(d[0] * n[0] + d[1] * n[1] + d[2] * n[2]) / d0;
+		if (d1 < 0.0f) {
+			n[0] = -n[0];
+			n[1] = -n[1];
+			n[2] = -n[2];
+			d1 = -d1;
+		}
+		d2 = 1.0f - m * m * (1.0f - d1 * d1);
+		if (d2 <= 0.0f) return -3;
+		d2 = (m * d1 - sqrtf(d2)) * d0;
+		d[0] = m * d[0] + d2 * n[0];
+		d[1] = m * d[1] + d2 * n[1];
+		d[2] = m * d[2] + d2 * n[2];
+		break;
+	case LENSY_DIFFRACT:
+		// the ruling vector is x, and the plane normal z
+		d0 = sqrtf(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+		if ((d0 == 0.0f) || (d[2] == 0.0f)) return -3;
+		d1 = d[0] / d0 + (float) (wl * f->g);
+		d2 = d[1] / d0;
+		d2 = 1.0f - d2 * d2 - d1 * d1;
+		if (d2 <= 0.0f) return -3;
+		d[0] = d0 * d1;
+		d[2] = d0 * sqrtf(d2);
+		break;
+	}
+	return rc;
+}
+
+
+/*------------------------------------------------------- lensy_float_world
+ * Move the point (or, if 'vector', the direction) 'v' in the frame of the
+ * element 'f' back to world coordinates, in 'w'.
+ */
+static void lensy_float_world(const struct lensy_float_element_struct *f,
+				float v[3], double w[3], bool vector)
+{
+	int32_t k;
+
+	for (k = 0; k < 3; k++)
+		w[k] = f->r[0][k] * v[0] + f->r[1][k] * v[1] + f->r[2][k] * v[2] +
+		       (vector ? 0.0 : f->o[k]);
+}
+
+
+/*------------------------------------------------------- lensy_float_range
+ * Take the rays of bundle 'b' through the elements j0, ..., j1 - 1 (none
+ * of them a grating with several orders), in single precision.
+ *
+ * The return value is the number of rays left, or -1 if malloc failed.
+ */
+static int32_t lensy_float_range(struct lensy_system_struct *sys,
+				struct lensy_float_struct *fl, int32_t j0, int32_t j1,
+				struct lensy_bundle_struct *b)
+{
+	struct lensy_float_element_struct *f;
+	struct lensy_float_rays_struct r;
+	struct lensy_element_struct *e;
+	struct lensy_ray_struct ray;
+	double wl, m, w[3], w1[3];
+	float p[3], d[3];
+	int32_t i, j, k, l, rc;
+
+	if (b->n == 0) return 0;
+	r.i = malloc(b->n * (sizeof(int32_t) + 7 * sizeof(float)));
+	if (r.i == NULL) {
+		fprintf(stderr, "%s: malloc failed\n", __func__);
+		return -1;
+	}
+	for (k = 0; k < 3; k++) {
+		r.p[k] = (float *) (r.i + b->n) + k * b->n;
+		r.d[k] = (float *) (r.i + b->n) + (k + 3) * b->n;
+	}
+	r.m = (float *) (r.i + b->n) + 6 * b->n;
+
+	//------ into the frame of the first element, in double
+	f = &fl->e[j0];
+	for (i = 0; i < b->n; i++) {
+		r.i[i] = i;
+		for (k = 0; k < 3; k++)
+			w[k] = b->p[k][i] - f->o[k];
+		for (k = 0; k < 3; k++) {
+			r.p[k][i] = lensy_dot3(f->r[k], w);
+			w1[k] = b->d[k][i];
+		}
+		for (k = 0; k < 3; k++)
+			r.d[k][i] = lensy_dot3(f->r[k], w1);
+	}
+	r.n = b->n;
+
+	for (j = j0; j < j1; j++) {
+		f = &fl->e[j];
+		e = &sys->e[j];
+
+		//------ the index of refraction ratios, for each wavelength
+		wl = -1.0;
+		m = 1.0;
+		if (e->redirect == LENSY_REFRACT) {
+			for (l = 0; l < r.n; l++) {
+				i = r.i[l];
+				r.m[l] = lensy_kernel_ratio(e, LENSY_TIER_FAST,
+							b->wavelength[i], &wl, &m);
+			}
+		}
+
+		for (l = k = 0; l < r.n; l++) {
+			p[0] = r.p[0][l];
+			p[1] = r.p[1][l];
+			p[2] = r.p[2][l];
+			d[0] = r.d[0][l];
+			d[1] = r.d[1][l];
+			d[2] = r.d[2][l];
+
+			//------ from the frame of the element before
+			if (j > j0) {
+				float q[3], v[3];
+
+				for (i = 0; i < 3; i++) {
+					q[i] = f->mr[i][0] * p[0] + f->mr[i][1] * p[1] +
+					       f->mr[i][2] * p[2] + f->mt[i];
+					v[i] = f->mr[i][0] * d[0] + f->mr[i][1] * d[1] +
+					       f->mr[i][2] * d[2];
+				}
+				memcpy(p, q, sizeof(p));
+				memcpy(d, v, sizeof(d));
+			}
+			if (sys->line != NULL) lensy_float_world(f, p, w, false);
+
+			rc = lensy_float_ray(f, p, d, (e->redirect == LENSY_REFRACT) ? r.m[l] : 1.0f,
+					     b->wavelength[r.i[l]]);
+
+			if ((sys->line != NULL) && (rc >= -1)) {
+				i = r.i[l];
+				lensy_float_world(f, p, w1, false);
+				sys->line(w, w1, b->red[i], b->green[i], b->blue[i]);
+			}
+			if (rc < 0) continue;
+
+			r.i[k] = r.i[l];
+			r.p[0][k] = p[0];
+			r.p[1][k] = p[1];
+			r.p[2][k] = p[2];
+			r.d[0][k] = d[0];
+			r.d[1][k] = d[1];
+			r.d[2][k] = d[2];
+			k++;
+		}
+		r.n = k;
+	}
+
+	//------ back to world coordinates, in double
+	f = &fl->e[j1 - 1];
+	for (l = 0; l < r.n; l++) {
+		lensy_bundle_get(b, r.i[l], &ray);
+		p[0] = r.p[0][l];
+		p[1] = r.p[1][l];
+		p[2] = r.p[2][l];
+		d[0] = r.d[0][l];
+		d[1] = r.d[1][l];
+		d[2] = r.d[2][l];
+		lensy_float_world(f, p, ray.p, false);
+		lensy_float_world(f, d, ray.d, true);
+		lensy_bundle_set(b, l, &ray);
+		b->path[l] = b->path[r.i[l]];
+		b->weight[l] = b->weight[r.i[l]];
+	}
+	b->n = r.n;
+	free(r.i);
+	return r.n;
+}
+
+
+/*------------------------------------------------------- lensy_trace_float
+ * Take the rays of bundle 'b' through all of the elements of the system,
+ * like lensy_trace(), in single precision.
+ *
+ * The return value is the number of rays left, or -1 on error.
+ */
+int32_t lensy_trace_float(struct lensy_system_struct *sys, struct lensy_float_struct *fl,
+				struct lensy_bundle_struct *b)
+{
+	int32_t j0, j1, rc;
+
+	if (fl->n != sys->n) {
+		fprintf(stderr, "%s: the elements are not for this system\n", __func__);
+		return -1;
+	}
+
+	rc = b->n;
+	for (j0 = 0; (j0 < sys->n) && (rc > 0); j0 = j1) {
+		if (lensy_float_fan(&sys->e[j0])) {
+			j1 = j0 + 1;
+			rc = lensy_trace_elements(sys, j0, j1, b);
+			continue;
+		}
+		for (j1 = j0; (j1 < sys->n) && !lensy_float_fan(&sys->e[j1]); j1++);
+		rc = lensy_float_range(sys, fl, j0, j1, b);
+	}
+	return rc;
+}
+
@@ -0,0 +1,527 @@
+/*
+ * lensy_frames.c - v1.4 (codename FlamingMarshmallow)
+ *
+ * Library functions for tracing rays in surface-local coordinate frames,
+ * in which the axis of each surface is the z axis.
+ *
+ *-----------------------------------------------------------------------
+ * Copyright (C) 2013 - 2015 FSF
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *-----------------------------------------------------------------------
+ *
+ * The lensy_intersect_X() functions take the surface axis (p->f, s->vr,
+ * h->a) as an arbitrary vector, and spend several inner products per ray
+ * on projecting onto it. lensy_frames_prepare() instead gives each
+ * element a rigid transform (a rotation and a shift) into a frame where
+ * the axis of the surface is the z axis, and the vertex is on it. There,
+ * the surfaces are simple:
+ *
+ *	sphere		x^2 + y^2 + (z - zc)^2 = R^2
+ *	paraboloid	x^2 + y^2 = 4 F s (z - z0)
+ *	hyperboloid	x^2 + y^2 = (e^2 - 1) (h^2 - A^2), with h the distance
+ *			from the center along the axis
+ *	plane		z = z0
+ *
+ * where s = +1 or -1 is the direction of the surface axis along z.
+ *
+ * Consecutive surfaces on the same axis (e.g., the lenses of a camera)
+ * share one frame: a ray is moved into the frame when it reaches the
+ * first of them, and back to world coordinates after the last. Other
+ * surfaces in the run (the cylinder) are moved into the frame too, and
+ * use the lensy_intersect_X() functions there. A surface that is not on
+ * the axis of its neighbours stays in world coordinates, and uses its
+ * fused function (see lensy_fused.c). Gratings with several orders are
+ * traced by lensy_trace_elements().
+ *
+ * The framed trace does not weight the rays, or sum a throughput budget,
+ * so lensy_frames_prepare() refuses a weighted system (see
+ * lensy_system_weighted()), which must be traced by lensy_trace().
+ *
+ * The framed trace is not used by lensy_trace() or lensy_trace_fastest(),
+ * only when it is called: it saves the projections, but moving the rays
+ * in and out of the frames costs more than that for the short runs of
+ * surfaces here, and it is about 10% slower than the chunked fused trace
+ * (the benchmark of the spectrograph program prints both).
+ *
+ * The results agree with lensy_trace() to rounding (less than a
+ * picometer for the programs here). The frames are a copy of the system:
+ * after a surface is changed, lensy_frames_prepare() must be called again.
+ *
+ * Send questions or contributions to me at <michael.h.williamson@gmail.com>.
+ *
+ * History:
+ *
+ *  2026-10-16  Several orders are order0 < order1, as elsewhere.
+ *  2026-10-16  A weighted system is refused.
+ *  2026-10-16  This file is created.
+ */
+
+
+#include <ctype.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <lensy.h>
+#include <lensy_kernel.h>
+
+
+#define	LENSY_FRAME_EPS		1e-12	// relative tolerance for a common axis
+
+
+/*------------------------------------------------------- lensy_frame_point
+ * Move the point 'p' into the frame 'f' (or, if 'out', back out of it).
+ */
+static inline void lensy_frame_point(struct lensy_frame_struct *f, double p[3], bool out)
+{
+	double w[3];
+	int32_t k;
+
+	if (out) {
+		for (k = 0; k < 3; k++)
+			w[k] = f->r[0][k] * p[0] + f->r[1][k] * p[1] + f->r[2][k] * p[2] + f->o[k];
+	} else {
+		for (k = 0; k < 3; k++)
+			w[k] = f->r[k][0] * (p[0] - f->o[0]) + f->r[k][1] * (p[1] - f->o[1]) +
+			       f->r[k][2] * (p[2] - f->o[2]);
+	}
+	p[0] = w[0];
+	p[1] = w[1];
+	p[2] = w[2];
+}
+
+
+/*------------------------------------------------------- lensy_frame_vector
+ * Rotate the vector 'v' into the frame 'f' (or, if 'out', back out of it).
+ */
+static inline void lensy_frame_vector(struct lensy_frame_struct *f, double v[3], bool out)
+{
+	double w[3];
+	int32_t k;
+
+	for (k = 0; k < 3; k++)
+		w[k] = out ? f->r[0][k] * v[0] + f->r[1][k] * v[1] + f->r[2][k] * v[2] :
+			     lensy_dot3(f->r[k], v);
+	v[0] = w[0];
+	v[1] = w[1];
+	v[2] = w[2];
+}
+
+
+/*------------------------------------------------------- lensy_frame_make
+ * Make the frame 'f' with the origin 'o' and the z axis along 'axis'.
+ */
+static void lensy_frame_make(struct lensy_frame_struct *f, double o[3], double axis[3])
+{
+	double d0, a[3];
+	int32_t k;
+
+	d0 = lensy_norm3(axis);
+	for (k = 0; k < 3; k++) {
+		f->o[k] = o[k];
+		f->r[2][k] = axis[k] / d0;
+	}
+
+	//------ the x axis from the world axis least parallel to z
+	a[0] = a[1] = a[2] = 0.0;
+	a[(fabs(f->r[2][0]) < 0.9) ? 0 : 1] = 1.0;
+	d0 = lensy_dot3(a, f->r[2]);
+	for (k = 0; k < 3; k++) f->r[0][k] = a[k] - d0 * f->r[2][k];
+	d0 = lensy_norm3(f->r[0]);
+	for (k = 0; k < 3; k++) f->r[0][k] /= d0;
+
+	lensy_vcross3(f->r[2], f->r[0], f->r[1]);
+}
+
+
+/*------------------------------------------------------- lensy_frame_coaxial
+ * Return true if a surface with the vertex 'v' and the axis 'axis' has the
+ * z axis of frame 'f' as its axis.
+ */
+static bool lensy_frame_coaxial(struct lensy_frame_struct *f, double v[3], double axis[3])
+{
+	double d0, d1, w[3];
+	int32_t k;
+
+	d0 = lensy_norm3(axis);
+	if (d0 == 0.0) return false;
+	if (fabs(lensy_dot3(axis, f->r[2])) < (1.0 - LENSY_FRAME_EPS) * d0) return false;
+
+	for (k = 0; k < 3; k++) w[k] = v[k] - f->o[k];
+	d1 = lensy_dot3(w, f->r[2]);
+	for (k = 0; k < 3; k++) w[k] -= d1 * f->r[2][k];
+	return (lensy_norm3(w) <= LENSY_FRAME_EPS * fmax(1.0, fabs(d1)));
+}
+
+
+/*------------------------------------------------------- lensy_frames_fan
+ * Return true if element 'e' is a grating with several orders.
+ */
+static inline bool lensy_frames_fan(struct lensy_element_struct *e)
+{
+	return (e->redirect == LENSY_DIFFRACT) && (e->order0 < e->order1);
+}
+
+
+/*------------------------------------------------------- lensy_frames_move
+ * Move element 'j' of the system into the frame 'f'.
+ */
+static void lensy_frames_move(struct lensy_system_struct *sys, struct lensy_frames_struct *fr,
+				int32_t j, int32_t frame, struct lensy_frame_struct *f)
+{
+	struct lensy_element_struct *e;
+	struct lensy_local_struct *l;
+	double *axis;
+
+	e = &sys->e[j];
+	l = &fr->l[j];
+	l->frame = frame;
+	lensy_frame_point(f, l->e.s.sphere.v, false);
+	switch (e->type) {
+	case LENSY_PARABOLOID:
+		lensy_frame_vector(f, l->e.s.paraboloid.f, false);
+		break;
+	case LENSY_SPHERE:
+		lensy_frame_vector(f, l->e.s.sphere.vr, false);
+		break;
+	case LENSY_CYLINDER:
+		lensy_frame_vector(f, l->e.s.cylinder.va, false);
+		lensy_frame_vector(f, l->e.s.cylinder.a, false);
+		break;
+	case LENSY_PLANE:
+		lensy_frame_vector(f, l->e.s.plane.n, false);
+		break;
+	case LENSY_HYPERBOLOID:
+		lensy_frame_vector(f, l->e.s.hyperboloid.a, false);
+		break;
+	}
+	lensy_frame_vector(f, l->e.a, false);
+
+	if (!l->canonical) return;
+
+	//------ the values of the canonical surface (the plane and sphere
+	// have the aperture in the same place as the paraboloid)
+	axis = lensy_element_axis(e);
+	l->z0 = l->e.s.sphere.v[2];
+	l->s = (lensy_dot3(axis, f->r[2]) < 0.0) ? -1.0 : 1.0;
+	l->k = lensy_norm3(axis);
+	if (e->type == LENSY_HYPERBOLOID) {
+		l->e2 = e->s.hyperboloid.e * e->s.hyperboloid.e - 1.0;
+		l->r2 = pow(e->s.hyperboloid.aperture / 2.0, 2.0);
+	} else {
+		l->r2 = pow(e->s.sphere.aperture / 2.0, 2.0);
+	}
+}
+
+
+/*------------------------------------------------------- lensy_frames_prepare
+ * Make the surface-local frames of the elements of the system 'sys' in
+ * 'fr'. A run of consecutive elements on one axis gets a frame, and other
+ * elements stay in world coordinates (moving a ray in and out of a frame
+ * for a single surface costs more than it saves).
+ *
+ * The return value is the number of frames, or -1 if the system is
+ * weighted (lensy_system_weighted()); 'fr' then has no elements.
+ */
+int32_t lensy_frames_prepare(struct lensy_system_struct *sys, struct lensy_frames_struct *fr)
+{
+	struct lensy_element_struct *e;
+	struct lensy_frame_struct f;
+	double *v;
+	int32_t j, j0, k;
+	bool canonical;
+
+	memset(fr, 0, sizeof(*fr));
+	if (lensy_system_weighted(sys)) return -1;
+	fr->n = sys->n;
+
+	for (j = 0; j < sys->n; j++) {
+		memcpy(&fr->l[j].e, &sys->e[j], sizeof(sys->e[j]));
+		fr->l[j].frame = -1;
+	}
+
+	for (j0 = 0; j0 < sys->n; j0 = j) {
+		//------ the run of elements on the axis of element j0
+		e = &sys->e[j0];
+		j = j0 + 1;
+		if (lensy_frames_fan(e)) continue;
+
+		lensy_frame_make(&f, e->s.sphere.v, lensy_element_axis(e));
+		for (; j < sys->n; j++) {
+			e = &sys->e[j];
+			v = e->s.sphere.v;	// the vertex is first in all surface structures
+			canonical = (e->type == LENSY_SPHERE) || (e->type == LENSY_PARABOLOID) ||
+				    (e->type == LENSY_HYPERBOLOID) || (e->type == LENSY_PLANE);
+			if (lensy_frames_fan(e) ||
+			    (canonical && !lensy_frame_coaxial(&f, v, lensy_element_axis(e))))
+				break;
+		}
+		if (j - j0 < 2) continue;
+
+		memcpy(&fr->f[fr->n_frames], &f, sizeof(f));
+		for (k = j0; k < j; k++) {
+			e = &sys->e[k];
+			fr->l[k].canonical = (e->type == LENSY_SPHERE) ||
+				(e->type == LENSY_PARABOLOID) || (e->type == LENSY_HYPERBOLOID) ||
+				(e->type == LENSY_PLANE);
+			lensy_frames_move(sys, fr, k, fr->n_frames, &f);
+		}
+		fr->n_frames++;
+	}
+	return fr->n_frames;
+}
+
+
+/*------------------------------------------------------- lensy_local_root
+ * Return the roots t0 >= t1 (for a > 0) of a t^2 + b t + c = 0, or -1 if
+ * there are none.
+ */
+static inline int32_t lensy_local_root(double a, double b, double c, double *t0, double *t1)
+{
+	double d0;
+
+	if (a == 0.0) {
+		*t0 = *t1 = -c / b;
+		return 0;
+	}
+	d0 = b * b - 4 * a * c;
+	if (d0 < 0.0) return -1;
+	d0 = sqrt(d0);
+	*t0 = (-b + d0) / (2 * a);
+	*t1 = (-b - d0) / (2 * a);
+	return 0;
+}
+
+
+/*------------------------------------------------------- lensy_local_intersect
+ * Intersect the ray 'r' (in the frame) with the canonical surface of 'l'.
+ * The return values are those of lensy_intersect_X(), with the intersect
+ * point in q[] and the unit normal in n[].
+ */
+static int32_t lensy_local_intersect(struct lensy_local_struct *l,
+				struct lensy_ray_struct *r, double q[3], double n[3])
+{
+	double a, b, c, t, t1, zc, h0, hd, d0;
+	double *p = r->p, *d = r->d;
+
+	switch (l->e.type) {
+	case LENSY_SPHERE:
+		//------ the center is at z = zc, the vertex on the -s side
+		zc = l->z0 + l->s * l->k;
+		h0 = p[2] - zc;
+		a = lensy_dot3(d, d);
+		b = 2 * (p[0] * d[0] + p[1] * d[1] + h0 * d[2]);
+		c = p[0] * p[0] + p[1] * p[1] + h0 * h0 - l->k * l->k;
+		if (lensy_local_root(a, b, c, &t, &t1) < 0) return -2;
+		if (l->s * (h0 + t * d[2]) >= 0.0) t = t1;
+		if (l->s * (h0 + t * d[2]) >= 0.0) return -2;
+
+		q[0] = p[0] + t * d[0];
+		q[1] = p[1] + t * d[1];
+		q[2] = p[2] + t * d[2];
+		n[0] = q[0] / l->k;
+		n[1] = q[1] / l->k;
+		n[2] = (q[2] - zc) / l->k;
+		break;
+
+	case LENSY_PARABOLOID:
+		//------ the height above the vertex, along the axis
+		h0 = l->s * (p[2] - l->z0);
+		hd = l->s * d[2];
+		a = d[0] * d[0] + d[1] * d[1];
+		b = 2 * (p[0] * d[0] + p[1] * d[1]) - 4 * l->k * hd;
+		c = p[0] * p[0] + p[1] * p[1] - 4 * l->k * h0;
+		if (lensy_local_root(a, b, c, &t, &t1) < 0) return -2;
+		if ((t < 0.0) || ((t1 > 0.0) && (t1 < t))) t = t1;
+		if (t < 0.0) return -2;
+
+		q[0] = p[0] + t * d[0];
+		q[1] = p[1] + t * d[1];
+		q[2] = p[2] + t * d[2];
+		n[0] = -q[0];
+		n[1] = -q[1];
+		n[2] = 2 * l->k * l->s;
+		break;
+
+	case LENSY_HYPERBOLOID:
+		//------ h is the distance from the center, towards the vertex
+		zc = l->z0 + l->s * l->k;
+		h0 = -l->s * (p[2] - zc);
+		hd = -l->s * d[2];
+		a = d[0] * d[0] + d[1] * d[1] - l->e2 * hd * hd;
+		b = 2 * (p[0] * d[0] + p[1] * d[1] - l->e2 * h0 * hd);
+		c = p[0] * p[0] + p[1] * p[1] - l->e2 * (h0 * h0 - l->k * l->k);
+		if (lensy_local_root(a, b, c, &t, &t1) < 0) return -2;
+		if (h0 + t * hd <= 0.0) t = t1;
+		if (h0 + t * hd <= 0.0) return -2;
+
+		q[0] = p[0] + t * d[0];
+		q[1] = p[1] + t * d[1];
+		q[2] = p[2] + t * d[2];
+		n[0] = -q[0];
+		n[1] = -q[1];
+		n[2] = -l->s * l->e2 * (h0 + t * hd);
+		break;
+
+	case LENSY_PLANE:
+		if (d[2] == 0.0) return -2;
+		t = (l->z0 - p[2]) / d[2];
+		if (t < 0.0) return -2;
+
+		q[0] = p[0] + t * d[0];
+		q[1] = p[1] + t * d[1];
+		q[2] = p[2] + t * d[2];
+		n[0] = 0.0;
+		n[1] = 0.0;
+		n[2] = l->s;
+		break;
+
+	default:
+		return -2;
+	}
+
+	if ((l->e.type == LENSY_PARABOLOID) || (l->e.type == LENSY_HYPERBOLOID)) {
+		d0 = lensy_norm3(n);
+		if (d0 == 0.0) return -2;
+		n[0] /= d0;
+		n[1] /= d0;
+		n[2] /= d0;
+	}
+	if (q[0] * q[0] + q[1] * q[1] > l->r2) return -1;
+	return 0;
+}
+
+
+/*------------------------------------------------------- lensy_frames_range
+ * Take the rays of bundle 'b' through the elements j0, ..., j1 - 1 (none
+ * of them a grating with several orders), one ray at a time.
+ *
+ * The return value is the number of rays left.
+ */
+static int32_t lensy_frames_range(struct lensy_system_struct *sys,
+				struct lensy_frames_struct *fr, int32_t j0, int32_t j1,
+				struct lensy_bundle_struct *b)
+{
+	struct lensy_local_struct *l;
+	struct lensy_frame_struct *f, *g;
+	struct lensy_ray_struct ray;
+	double wl[LENSY_NMAX_ELEMENTS], m[LENSY_NMAX_ELEMENTS];
+	double q[3], n[3], p0[3], p1[3];
+	int32_t i, j, w, rc;
+
+	for (j = j0; j < j1; j++) {
+		wl[j] = -1.0;
+		m[j] = 1.0;
+	}
+
+	for (i = w = 0; i < b->n; i++) {
+		lensy_bundle_get(b, i, &ray);
+		f = NULL;
+		rc = 0;
+
+		for (j = j0; (j < j1) && (rc == 0); j++) {
+			l = &fr->l[j];
+			if (l->e.redirect == LENSY_REFRACT)
+				lensy_kernel_ratio(&l->e, LENSY_TIER_REFERENCE, ray.wavelength,
+							&wl[j], &m[j]);
+
+			//------ into (or out of) the frame of the element
+			g = (l->frame < 0) ? NULL : &fr->f[l->frame];
+			if (g != f) {
+				if (f != NULL) {
+					lensy_frame_point(f, ray.p, true);
+					lensy_frame_vector(f, ray.d, true);
+				}
+				if (g != NULL) {
+					lensy_frame_point(g, ray.p, false);
+					lensy_frame_vector(g, ray.d, false);
+				}
+				f = g;
+			}
+
+			if ((f == NULL) && lensy_element_fused(&l->e)) {
+				memcpy(p0, ray.p, sizeof(p0));
+				rc = lensy_element_trace(&l->e, &ray, m[j]);
+				if ((sys->line != NULL) && (rc != -2))
+					sys->line(p0, ray.p, ray.red, ray.green, ray.blue);
+				continue;
+			}
+
+			if (l->canonical) rc = lensy_local_intersect(l, &ray, q, n);
+			else rc = lensy_element_intersect(&l->e, &ray, q, n);
+
+			if ((sys->line != NULL) && (rc >= -1)) {
+				memcpy(p0, ray.p, sizeof(p0));
+				memcpy(p1, q, sizeof(p1));
+				if (f != NULL) {
+					lensy_frame_point(f, p0, true);
+					lensy_frame_point(f, p1, true);
+				}
+				sys->line(p0, p1, ray.red, ray.green, ray.blue);
+			}
+			if (rc < 0) break;
+
+			rc = lensy_element_redirect(&l->e, &ray, q, n, m[j], l->e.order0);
+		}
+		if (rc < 0) continue;
+
+		if (f != NULL) {
+			lensy_frame_point(f, ray.p, true);
+			lensy_frame_vector(f, ray.d, true);
+		}
+		lensy_bundle_set(b, w, &ray);
+		b->path[w] = b->path[i];
+		b->weight[w] = b->weight[i];
+		w++;
+	}
+	b->n = w;
+	return w;
+}
+
+
+/*------------------------------------------------------- lensy_trace_frames
+ * Take the rays of bundle 'b' through all of the elements of the system,
+ * like lensy_trace(), in the frames 'fr' made by lensy_frames_prepare().
+ *
+ * The return value is the number of rays left, or -1 on error.
+ */
+int32_t lensy_trace_frames(struct lensy_system_struct *sys, struct lensy_frames_struct *fr,
+				struct lensy_bundle_struct *b)
+{
+	int32_t j0, j1, rc;
+
+	if (fr->n != sys->n) {
+		fprintf(stderr, "%s: the frames are not for this system\n", __func__);
+		return -1;
+	}
+
+	rc = b->n;
+	for (j0 = 0; (j0 < sys->n) && (rc > 0); j0 = j1) {
+		if (lensy_frames_fan(&sys->e[j0])) {
+			j1 = j0 + 1;
+			rc = lensy_trace_elements(sys, j0, j1, b);
+			continue;
+		}
+		for (j1 = j0; (j1 < sys->n) && !lensy_frames_fan(&sys->e[j1]); j1++);
+		rc = lensy_frames_range(sys, fr, j0, j1, b);
+	}
+	return rc;
+}
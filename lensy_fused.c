@@ -0,0 +1,262 @@
+/*
+ * lensy_fused.c - v1.4 (codename FlamingMarshmallow)
+ *
+ * Library functions that intersect a ray with a surface and redirect it in
+ * one step, for the surface and redirect combinations that the programs
+ * use.
+ *
+ *-----------------------------------------------------------------------
+ * Copyright (C) 2013 - 2015 FSF
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *-----------------------------------------------------------------------
+ *
+ * A lensy_intersect_X() function returns the intersect point and the unit
+ * normal in arrays, and the lensy_redirect_Y() function then reads them
+ * back. The fused functions here keep them in local variables, and leave
+ * out what the pair does twice or does not need:
+ *
+ *	sphere + refract	the center and the unit axis of the sphere are
+ *				found once
+ *	paraboloid + reflect	|f| is found once
+ *	hyperboloid + reflect	the center and the unit axis are found once
+ *	plane + diffract	the normal of the plane is not made a unit
+ *				vector again by the grating
+ *	plane + refract		as plane + diffract
+ *	plane + impact		no normal at all
+ *
+ * The arithmetic is otherwise that of lensy.c, so the traced rays agree
+ * with the lensy_intersect_X() and lensy_redirect_Y() functions to a few
+ * units in the last place. The functions themselves are inline, in
+ * lensy_kernel.h.
+ *
+ * The fused functions return:
+ *
+ *	 0	OK, the ray is redirected.
+ *	-1	The ray is outside the aperture. r->p is the intersect point.
+ *	-2	There is no intersect point. The ray is not changed.
+ *	-3	The ray cannot be redirected (e.g., total internal reflection).
+ *		r->p is the intersect point.
+ *
+ * Send questions or contributions to me at <michael.h.williamson@gmail.com>.
+ *
+ * History:
+ *
+ *  2026-10-16  This file is created.
+ */
+
+
+#include <ctype.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <lensy.h>
+#include <lensy_kernel.h>
+
+
+
+/*------------------------------------------------------- lensy_fused_sphere_refract
+ * Intersect the ray 'r' with the sphere 's', and refract it with the index
+ * of refraction ratio 'm'.
+ */
+int32_t lensy_fused_sphere_refract(struct lensy_ray_struct *r,
+				struct lensy_sphere_struct *s, double m)
+{
+	return lensy_kernel_sphere_refract(r, s, m);
+}
+
+
+/*------------------------------------------------------- lensy_fused_paraboloid_reflect
+ * Intersect the ray 'r' with the paraboloid 'p', and reflect it.
+ */
+int32_t lensy_fused_paraboloid_reflect(struct lensy_ray_struct *r,
+				struct lensy_paraboloid_struct *p)
+{
+	return lensy_kernel_paraboloid_reflect(r, p);
+}
+
+
+/*------------------------------------------------------- lensy_fused_hyperboloid_reflect
+ * Intersect the ray 'r' with the hyperboloid 'h', and reflect it.
+ */
+int32_t lensy_fused_hyperboloid_reflect(struct lensy_ray_struct *r,
+				struct lensy_hyperboloid_struct *h)
+{
+	return lensy_kernel_hyperboloid_reflect(r, h);
+}
+
+
+/*------------------------------------------------------- lensy_fused_plane_diffract
+ * Intersect the ray 'r' with the plane 'p', and diffract it from a grating
+ * with the ruling vector 'a', in the order 'order'.
+ */
+int32_t lensy_fused_plane_diffract(struct lensy_ray_struct *r,
+				struct lensy_plane_struct *p, double a[3], int32_t order)
+{
+	return lensy_kernel_plane_diffract(r, p, a, order);
+}
+
+
+/*------------------------------------------------------- lensy_fused_plane_refract
+ * Intersect the ray 'r' with the plane 'p', and refract it with the index
+ * of refraction ratio 'm'.
+ */
+int32_t lensy_fused_plane_refract(struct lensy_ray_struct *r,
+				struct lensy_plane_struct *p, double m)
+{
+	return lensy_kernel_plane_refract(r, p, m);
+}
+
+
+/*------------------------------------------------------- lensy_fused_plane_impact
+ * Intersect the ray 'r' with the plane 'p' (a detector).
+ */
+int32_t lensy_fused_plane_impact(struct lensy_ray_struct *r,
+				struct lensy_plane_struct *p)
+{
+	return lensy_kernel_plane_impact(r, p);
+}
+
+/*------------------------------------------------------- lensy_element_fused
+ * Return true if there is a fused function for element 'e'. A grating
+ * with more than one order is not fused, since the intersection is shared
+ * by the orders.
+ */
+bool lensy_element_fused(struct lensy_element_struct *e)
+{
+	switch (e->type) {
+	case LENSY_SPHERE:
+		return (e->redirect == LENSY_REFRACT);
+	case LENSY_PARABOLOID:
+	case LENSY_HYPERBOLOID:
+		return (e->redirect == LENSY_REFLECT);
+	case LENSY_PLANE:
+		return (e->redirect == LENSY_REFRACT) || (e->redirect == LENSY_IMPACT) ||
+		       ((e->redirect == LENSY_DIFFRACT) && (e->order0 == e->order1));
+	}
+	return false;
+}
+
+
+/*------------------------------------------------------- lensy_element_trace
+ * Take the ray 'r' through element 'e', which must have a fused function
+ * (see lensy_element_fused()). 'm' is the index of refraction ratio for a
+ * refracting element. The return values are those of the fused functions.
+ */
+int32_t lensy_element_trace(struct lensy_element_struct *e,
+				struct lensy_ray_struct *r, double m)
+{
+	switch (e->type) {
+	case LENSY_SPHERE:
+		return lensy_fused_sphere_refract(r, &e->s.sphere, m);
+	case LENSY_PARABOLOID:
+		return lensy_fused_paraboloid_reflect(r, &e->s.paraboloid);
+	case LENSY_HYPERBOLOID:
+		return lensy_fused_hyperboloid_reflect(r, &e->s.hyperboloid);
+	case LENSY_PLANE:
+		switch (e->redirect) {
+		case LENSY_REFRACT:
+			return lensy_fused_plane_refract(r, &e->s.plane, m);
+		case LENSY_DIFFRACT:
+			return lensy_fused_plane_diffract(r, &e->s.plane, e->a, e->order0);
+		case LENSY_IMPACT:
+			return lensy_fused_plane_impact(r, &e->s.plane);
+		}
+	}
+	return -2;
+}
+
+
+/*------------------------------------------------------- lensy_fused_bundle
+ * Take the rays of bundle 'b' through element 'j' of the system with the
+ * fused function of the element (see lensy_element_fused()). The rays that
+ * are lost are removed from the bundle, and sys->line (if not NULL) is
+ * called for each ray that reaches the surface. Without sys->line, the
+ * rays that miss the bound of the aperture (see lensy_element_bound())
+ * are removed without being intersected. The weights of the rays are
+ * multiplied by the throughput of the element, and summed in sys->budget,
+ * as in lensy_trace().
+ *
+ * The return value is the number of rays left.
+ */
+int32_t lensy_fused_bundle(struct lensy_system_struct *sys, int32_t j,
+				struct lensy_bundle_struct *b)
+{
+	struct lensy_element_struct *e;
+	struct lensy_ray_struct ray;
+	struct lensy_bound_struct bd;
+	struct lensy_throughput_struct tp;
+	double p0[3], wl, m, in, lost, out;
+	int32_t i, w, rc, n_rejected;
+	bool bound;
+
+	e = &sys->e[j];
+	wl = -1.0;
+	m = 1.0;
+	lensy_throughput_init(&tp, sys, j);
+	in = lost = out = 0.0;
+
+	// the rays are drawn to the intersect point, so none are rejected early
+	bound = (sys->line == NULL) && lensy_element_bound(e, &bd);
+	n_rejected = 0;
+
+	for (i = w = 0; i < b->n; i++) {
+		lensy_bundle_get(b, i, &ray);
+		in += b->weight[i];
+		if (bound && lensy_kernel_bound_miss(&bd, &ray)) {
+			n_rejected++;
+			lost += b->weight[i];
+			continue;
+		}
+		p0[0] = ray.p[0];
+		p0[1] = ray.p[1];
+		p0[2] = ray.p[2];
+
+		if (e->redirect == LENSY_REFRACT)
+			lensy_kernel_ratio(e, sys->tier, ray.wavelength, &wl, &m);
+
+		if (sys->tier == LENSY_TIER_REFERENCE) rc = lensy_element_trace(e, &ray, m);
+		else rc = lensy_element_trace_fast(e, &ray, m);
+		if ((sys->line != NULL) && (rc != -2))
+			sys->line(p0, ray.p, ray.red, ray.green, ray.blue);
+		if (rc < 0) {
+			lost += b->weight[i];
+			continue;
+		}
+
+		lensy_bundle_set(b, w, &ray);
+		b->path[w] = b->path[i];
+		b->weight[w] = b->weight[i] * lensy_kernel_throughput(&tp, ray.wavelength, p0, ray.p);
+		out += b->weight[w];
+		w++;
+	}
+	if (sys->reject != NULL) {
+		sys->reject->n[j] += b->n;
+		sys->reject->rejected[j] += n_rejected;
+	}
+	if (sys->budget != NULL) {
+		sys->budget->in[j] += in;
+		sys->budget->lost[j] += lost;
+		sys->budget->out[j] += out;
+	}
+	b->n = w;
+	return w;
+}
@@ -0,0 +1,64 @@
+/*
+ * lensy_hash.h - v1.4 (codename FlamingMarshmallow)
+ *
+ * Inline functions that mix the bits of 64 bit words, for the hash tables,
+ * the cache keys and the random number streams of the library.
+ *
+ *-----------------------------------------------------------------------
+ * Copyright (C) 2013 - 2015 FSF
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *-----------------------------------------------------------------------
+ *
+ * Both functions are from splitmix64 (Steele, Lea and Flood). The cache
+ * keys of lensy_cache.c depend on lensy_mix64(), so a change to it must
+ * come with a new LENSY_CACHE_VERSION.
+ *
+ * Send questions or contributions to me at <michael.h.williamson@gmail.com>.
+ *
+ * History:
+ *
+ *  2026-10-16  This file is created.
+ */
+
+#ifndef LENSY_HASH_H
+#define LENSY_HASH_H	1
+
+#include <stdint.h>
+
+
+/*------------------------------------------------------- lensy_mix64
+ * Mix the bits of a 64 bit value (the splitmix64 finalizer).
+ */
+static inline uint64_t lensy_mix64(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+
+/*------------------------------------------------------- lensy_random64
+ * Return the next 64 bit random number of the stream '*state' (the
+ * splitmix64 generator).
+ */
+static inline uint64_t lensy_random64(uint64_t *state)
+{
+	return lensy_mix64(*state += 0x9e3779b97f4a7c15ULL);
+}
+
+#endif
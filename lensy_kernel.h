@@ -0,0 +1,623 @@
+/*
+ * lensy_kernel.h - v1.4 (codename FlamingMarshmallow)
+ *
+ * Inline functions that intersect a ray with a surface and redirect it in
+ * one step. They are used by lensy_fused.c, and by the code that
+ * lensy_codegen.c generates, so that the compiler can fold the surface
+ * values into them.
+ *
+ *-----------------------------------------------------------------------
+ * Copyright (C) 2013 - 2015 FSF
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *-----------------------------------------------------------------------
+ *
+ * The return values are those of the lensy_fused_X_Y() functions (see
+ * lensy_fused.c). The X_Y_tier() forms take a flag 'fast' for the fast
+ * kernel tier (see lensy_tier.c); the compiler drops the other branch
+ * when the flag is a constant.
+ *
+ * Send questions or contributions to me at <michael.h.williamson@gmail.com>.
+ *
+ * History:
+ *
+ *  2026-10-16  Added lensy_kernel_ratio(), for the index of refraction
+ *              ratios of all of the tracers.
+ *  2026-10-16  Added lensy_kernel_throughput(), for the ray weights.
+ *  2026-10-16  This file is created.
+ */
+
+#ifndef LENSY_KERNEL_H
+#define LENSY_KERNEL_H	1
+
+#include <math.h>
+#include <lensy.h>
+
+
+#define	LENSY_BOUND_EPS		1e-9	// relative slack of the bound test
+
+
+/*------------------------------------------------------- lensy_kernel_bound_miss
+ * Return true if the ray 'r' cannot reach the clear aperture in the bound
+ * 'bd' (see lensy_element_bound()). Where the ray crosses the plane of the
+ * vertex, it must be within r of the axis, plus what it moves across the
+ * axis over the sag. A ray parallel to the plane is never rejected.
+ */
+static inline bool lensy_kernel_bound_miss(const struct lensy_bound_struct *bd,
+				const struct lensy_ray_struct *r)
+{
+	double d0, d1, d2, t, w[3];
+
+	d1 = lensy_dot3(r->d, bd->a);
+	if (d1 == 0.0) return false;
+
+	w[0] = r->p[0] - bd->v[0];
+	w[1] = r->p[1] - bd->v[1];
+	w[2] = r->p[2] - bd->v[2];
+	t = -lensy_dot3(w, bd->a) / d1;
+	w[0] += t * r->d[0];
+	w[1] += t * r->d[1];
+	w[2] += t * r->d[2];
+
+	d2 = lensy_dot3(r->d, r->d) - d1 * d1;
+	d0 = bd->r + bd->sag * sqrt(fmax(d2, 0.0)) / fabs(d1);
+	return lensy_dot3(w, w) > d0 * d0 * (1.0 + LENSY_BOUND_EPS);
+}
+
+
+/*------------------------------------------------------- lensy_kernel_throughput
+ * Return the factor of the weight of a ray with the wavelength
+ * 'wavelength', that goes from 'p' to the element of 't' at 'q': the
+ * efficiency of the element, times the internal transmittance of the
+ * medium in between (see lensy_throughput.c). The curves are only looked
+ * up when the wavelength is not the last one.
+ */
+static inline double lensy_kernel_throughput(struct lensy_throughput_struct *t,
+				double wavelength, const double p[3], const double q[3])
+{
+	double w[3];
+
+	if (!t->on) return 1.0;
+	if (wavelength != t->wl) {
+		t->wl = wavelength;
+		t->f = (t->efficiency != NULL) ? lensy_curve_value(t->efficiency, wavelength) : 1.0;
+		t->alpha = (t->absorption != NULL) ? lensy_curve_value(t->absorption, wavelength) : 0.0;
+	}
+	if (t->alpha == 0.0) return t->f;
+
+	w[0] = q[0] - p[0];
+	w[1] = q[1] - p[1];
+	w[2] = q[2] - p[2];
+	return t->f * exp(-t->alpha * sqrt(lensy_dot3(w, w)));
+}
+
+
+/*------------------------------------------------------- lensy_kernel_ratio
+ * Return the index of refraction ratio (incident / transmission) of the
+ * refracting element 'e', with the index functions of the kernel tier
+ * 'tier'. The last value is kept in '*wl' and '*m', since consecutive
+ * rays usually have the same wavelength.
+ */
+static inline double lensy_kernel_ratio(struct lensy_element_struct *e, int32_t tier,
+				double wavelength, double *wl, double *m)
+{
+	if (wavelength != *wl) {
+		*wl = wavelength;
+		if (tier == LENSY_TIER_REFERENCE)
+			*m = lensy_index_medium(wavelength, e->m0) /
+				lensy_index_medium(wavelength, e->m1);
+		else
+			*m = lensy_index_medium_fast(wavelength, e->m0) /
+				lensy_index_medium_fast(wavelength, e->m1);
+	}
+	return *m;
+}
+
+
+/*------------------------------------------------------- lensy_kernel_refract
+ * Refract the direction 'd' at a surface with the unit normal 'n', with
+ * the index of refraction ratio 'm' (as lensy_redirect_refract).
+ */
+static inline int32_t lensy_kernel_refract(double d[3], const double n[3], double m)
+{
+	double d0, d1, d2, d3;
+	lensy_vec3 n1, u, w, v;
+
+	d0 = lensy_norm3(d);
+	if (d0 == 0.0) return -3;
+
+	u = lensy_v3_div(lensy_v3_neg(lensy_v3_load(d)), d0);
+	n1 = lensy_v3_load(n);
+	if (lensy_v3_dot(u, n1) < 0.0) n1 = lensy_v3_neg(n1);
+
+	w = lensy_v3_cross(u, n1);
+	d1 = lensy_v3_mag(w);
+	d2 = m * d1;
+	if (fabs(d2) >= 1.0) return -3;
+
+	if (d1 > 0.0) {
+		d3 = asin(d2);
+		v = lensy_v3_cross(lensy_v3_div(w, d1), n1);
+		v = lensy_v3_add(lensy_v3_scale(cos(d3), lensy_v3_neg(n1)),
+				 lensy_v3_scale(sin(d3), v));
+	} else {
+		v = lensy_v3_neg(n1);
+	}
+	lensy_v3_store(d, lensy_v3_scale(d0, v));
+	return 0;
+}
+
+
+/*------------------------------------------------------- lensy_kernel_refract_fast
+ * Refract the direction 'd' as lensy_kernel_refract(), with the vector
+ * form of Snell's law, t = m u + (m cos(i) - cos(t)) n, in place of
+ * asin(), cos() and sin() (the fast tier).
+ */
+static inline int32_t lensy_kernel_refract_fast(double d[3], const double n[3], double m)
+{
+	double d0, d1, d2;
+	lensy_vec3 n1, u;
+
+	d0 = lensy_norm3(d);
+	if (d0 == 0.0) return -3;
+
+	// with the normal toward the incident side, cos(i) = -u.n
+	u = lensy_v3_scale(1.0 / d0, lensy_v3_load(d));
+	n1 = lensy_v3_load(n);
+	d1 = -lensy_v3_dot(u, n1);
+	if (d1 < 0.0) {
+		n1 = lensy_v3_neg(n1);
+		d1 = -d1;
+	}
+	d2 = 1.0 - m * m * (1.0 - d1 * d1);
+	if (d2 <= 0.0) return -3;
+
+	lensy_v3_store(d, lensy_v3_scale(d0, lensy_v3_madd(lensy_v3_scale(m, u),
+					m * d1 - sqrt(d2), n1)));
+	return 0;
+}
+
+
+/*------------------------------------------------------- lensy_kernel_plane_hit
+ * Intersect the ray 'r' with the plane 'p'. The intersect point is
+ * returned in q[], and |p->n| in '*mag'.
+ */
+static inline int32_t lensy_kernel_plane_hit(struct lensy_ray_struct *r,
+				const struct lensy_plane_struct *p, double q[3], double *mag)
+{
+	double d0, d1, w[3];
+
+	d0 = lensy_dot3(r->d, p->n);
+	if (d0 == 0.0) return -2;
+
+	d1 = (lensy_dot3(p->v, p->n) - lensy_dot3(r->p, p->n)) / d0;
+	if (d1 < 0.0) return -2;
+
+	*mag = lensy_norm3(p->n);
+	if (*mag == 0.0) return -2;
+
+	q[0] = r->p[0] + d1 * r->d[0];
+	q[1] = r->p[1] + d1 * r->d[1];
+	q[2] = r->p[2] + d1 * r->d[2];
+	r->p[0] = q[0];
+	r->p[1] = q[1];
+	r->p[2] = q[2];
+
+	w[0] = q[0] - p->v[0];
+	w[1] = q[1] - p->v[1];
+	w[2] = q[2] - p->v[2];
+	if (lensy_norm3(w) > p->aperture / 2.0) return -1;
+	return 0;
+}
+
+
+/*------------------------------------------------------- lensy_kernel_sphere_refract_tier
+ * Intersect the ray 'r' with the sphere 's', and refract it with the index
+ * of refraction ratio 'm' (with lensy_kernel_refract_fast() if 'fast').
+ */
+static inline int32_t lensy_kernel_sphere_refract_tier(struct lensy_ray_struct *r,
+				const struct lensy_sphere_struct *s, double m, bool fast)
+{
+	double d0, d1, d2, d3, d4, d5, d7, d8;
+	double c[3], w0[3], w2[3], w3[3], q[3], n[3];
+
+	c[0] = s->v[0] + s->vr[0];
+	c[1] = s->v[1] + s->vr[1];
+	c[2] = s->v[2] + s->vr[2];
+
+	w0[0] = r->p[0] - c[0];
+	w0[1] = r->p[1] - c[1];
+	w0[2] = r->p[2] - c[2];
+
+	d1 = lensy_dot3(r->d, r->d);
+	d2 = 2 * lensy_dot3(r->d, w0);
+	d3 = lensy_dot3(w0, w0) - lensy_dot3(s->vr, s->vr);
+	if (d1 == 0.0) {
+		d4 = -d3 / d2;
+	} else {
+		d5 = (d2 * d2) - (4 * d1 * d3);
+		if (d5 < 0.0) return -2;
+
+		// the intersect point on the vertex side of the center
+		d5 = sqrt(d5);
+		d4 = (-d2 + d5) / (2 * d1);
+		n[0] = r->p[0] + d4 * r->d[0] - c[0];
+		n[1] = r->p[1] + d4 * r->d[1] - c[1];
+		n[2] = r->p[2] + d4 * r->d[2] - c[2];
+		if (lensy_dot3(n, s->vr) >= 0.0) d4 = (-d2 - d5) / (2 * d1);
+	}
+	q[0] = r->p[0] + d4 * r->d[0];
+	q[1] = r->p[1] + d4 * r->d[1];
+	q[2] = r->p[2] + d4 * r->d[2];
+
+	n[0] = q[0] - c[0];
+	n[1] = q[1] - c[1];
+	n[2] = q[2] - c[2];
+	if (lensy_dot3(n, s->vr) >= 0.0) return -2;
+
+	d0 = lensy_norm3(n);
+	if (d0 > 0.0) {
+		n[0] /= d0;
+		n[1] /= d0;
+		n[2] /= d0;
+	}
+
+	r->p[0] = q[0];
+	r->p[1] = q[1];
+	r->p[2] = q[2];
+
+	//------ the distance from the axis, for the aperture
+	w2[0] = q[0] - s->v[0];
+	w2[1] = q[1] - s->v[1];
+	w2[2] = q[2] - s->v[2];
+
+	d7 = lensy_norm3(s->vr);
+	w3[0] = s->vr[0] / d7;
+	w3[1] = s->vr[1] / d7;
+	w3[2] = s->vr[2] / d7;
+
+	d8 = lensy_dot3(w2, w3);
+	w2[0] -= d8 * w3[0];
+	w2[1] -= d8 * w3[1];
+	w2[2] -= d8 * w3[2];
+	if (lensy_norm3(w2) > s->aperture / 2.0) return -1;
+
+	if (fast) return lensy_kernel_refract_fast(r->d, n, m);
+	return lensy_kernel_refract(r->d, n, m);
+}
+
+
+/*------------------------------------------------------- lensy_kernel_sphere_refract
+ * Intersect the ray 'r' with the sphere 's', and refract it with the index
+ * of refraction ratio 'm'.
+ */
+static inline int32_t lensy_kernel_sphere_refract(struct lensy_ray_struct *r,
+				const struct lensy_sphere_struct *s, double m)
+{
+	return lensy_kernel_sphere_refract_tier(r, s, m, false);
+}
+
+
+/*------------------------------------------------------- lensy_kernel_paraboloid_reflect
+ * Intersect the ray 'r' with the paraboloid 'p', and reflect it.
+ */
+static inline int32_t lensy_kernel_paraboloid_reflect(struct lensy_ray_struct *r,
+				const struct lensy_paraboloid_struct *p)
+{
+	double d0, d1, d2, d3, d4, d5, d6, d7, d8, d9, d10;
+	double w0[3], w1[3], w2[3], q[3], n[3];
+
+	d0 = lensy_norm3(p->f);
+	w0[0] = p->f[0] / d0;
+	w0[1] = p->f[1] / d0;
+	w0[2] = p->f[2] / d0;
+
+	w1[0] = r->p[0] - p->v[0] - p->f[0];
+	w1[1] = r->p[1] - p->v[1] - p->f[1];
+	w1[2] = r->p[2] - p->v[2] - p->f[2];
+
+	d6 = lensy_dot3(r->d, w0);
+	d1 = lensy_dot3(r->d, r->d) - d6 * d6;
+	d4 = 2 * d0 + lensy_dot3(w1, w0);
+	d2 = 2 * lensy_dot3(r->d, w1) - 2 * d6 * d4;
+	d3 = lensy_dot3(w1, w1) - d4 * d4;
+	if (d1 == 0.0) {
+		d5 = -d3 / d2;
+	} else {
+		d10 = (d2 * d2) - (4 * d1 * d3);
+		if (d10 < 0.0) return -2;
+		d10 = sqrt(d10);
+		d5 = (-d2 + d10) / (2 * d1);
+		d9 = (-d2 - d10) / (2 * d1);
+		if ((d5 < 0.0) || ((d9 > 0.0) && (d9 < d5))) d5 = d9;
+		if (d5 < 0.0) return -2;
+	}
+	q[0] = r->p[0] + d5 * r->d[0];
+	q[1] = r->p[1] + d5 * r->d[1];
+	q[2] = r->p[2] + d5 * r->d[2];
+
+	w2[0] = q[0] - p->v[0];
+	w2[1] = q[1] - p->v[1];
+	w2[2] = q[2] - p->v[2];
+
+	d6 = lensy_dot3(w2, w0);
+	w2[0] -= d6 * w0[0];
+	w2[1] -= d6 * w0[1];
+	w2[2] -= d6 * w0[2];
+
+	d7 = lensy_norm3(w2);
+	if (d7 == 0.0) {
+		n[0] = w0[0];
+		n[1] = w0[1];
+		n[2] = w0[2];
+	} else {
+		w2[0] /= d7;
+		w2[1] /= d7;
+		w2[2] /= d7;
+
+		d8 = -d7 / (2 * d0);
+		n[0] = d8 * w2[0] + w0[0];
+		n[1] = d8 * w2[1] + w0[1];
+		n[2] = d8 * w2[2] + w0[2];
+
+		d8 = lensy_norm3(n);
+		n[0] /= d8;
+		n[1] /= d8;
+		n[2] /= d8;
+	}
+
+	r->p[0] = q[0];
+	r->p[1] = q[1];
+	r->p[2] = q[2];
+	if (d7 > p->aperture / 2.0) return -1;
+
+	d8 = 2 * lensy_dot3(r->d, n);
+	r->d[0] -= d8 * n[0];
+	r->d[1] -= d8 * n[1];
+	r->d[2] -= d8 * n[2];
+	return 0;
+}
+
+
+/*------------------------------------------------------- lensy_kernel_hyperboloid_reflect
+ * Intersect the ray 'r' with the hyperboloid 'h', and reflect it.
+ */
+static inline int32_t lensy_kernel_hyperboloid_reflect(struct lensy_ray_struct *r,
+				const struct lensy_hyperboloid_struct *h)
+{
+	double d0, d1, d2, d3, d4, d5, d8, d9, e2;
+	double c[3], w0[3], w2[3], w3[3], w4[3], q[3], n[3];
+
+	c[0] = h->v[0] + h->a[0];
+	c[1] = h->v[1] + h->a[1];
+	c[2] = h->v[2] + h->a[2];
+
+	d8 = lensy_norm3(h->a);
+	w2[0] = -h->a[0] / d8;
+	w2[1] = -h->a[1] / d8;
+	w2[2] = -h->a[2] / d8;
+
+	w3[0] = r->p[0] - c[0] + h->a[0] / h->e;
+	w3[1] = r->p[1] - c[1] + h->a[1] / h->e;
+	w3[2] = r->p[2] - c[2] + h->a[2] / h->e;
+
+	// from the focus
+	w4[0] = r->p[0] - (c[0] + (h->e * -h->a[0]));
+	w4[1] = r->p[1] - (c[1] + (h->e * -h->a[1]));
+	w4[2] = r->p[2] - (c[2] + (h->e * -h->a[2]));
+
+	e2 = h->e * h->e;
+	d4 = lensy_dot3(w2, r->d);
+	d5 = lensy_dot3(w2, w3);
+
+	d1 = lensy_dot3(r->d, r->d) - (e2 * d4 * d4);
+	d2 = 2 * (lensy_dot3(r->d, w4) - (e2 * d4 * d5));
+	d3 = lensy_dot3(w4, w4) - (e2 * d5 * d5);
+
+	if (d1 == 0.0) {
+		d4 = -d3 / d2;
+	} else {
+		d5 = (d2 * d2) - (4 * d1 * d3);
+		if (d5 < 0.0) return -2;
+		d5 = sqrt(d5);
+		d4 = (-d2 + d5) / (2 * d1);
+		w4[0] = r->p[0] + d4 * r->d[0] - c[0];
+		w4[1] = r->p[1] + d4 * r->d[1] - c[1];
+		w4[2] = r->p[2] + d4 * r->d[2] - c[2];
+		if (lensy_dot3(w4, h->a) >= 0.0) d4 = (-d2 - d5) / (2 * d1);
+	}
+	q[0] = r->p[0] + d4 * r->d[0];
+	q[1] = r->p[1] + d4 * r->d[1];
+	q[2] = r->p[2] + d4 * r->d[2];
+
+	w4[0] = q[0] - c[0];
+	w4[1] = q[1] - c[1];
+	w4[2] = q[2] - c[2];
+	if (lensy_dot3(w4, h->a) >= 0.0) return -2;
+
+	//------ the normal, from the distance to the axis
+	w0[0] = q[0] - h->v[0];
+	w0[1] = q[1] - h->v[1];
+	w0[2] = q[2] - h->v[2];
+
+	d0 = lensy_dot3(w0, w2);
+	w0[0] -= d0 * w2[0];
+	w0[1] -= d0 * w2[1];
+	w0[2] -= d0 * w2[2];
+
+	d9 = lensy_norm3(w0);
+	if (d0 == 0.0) {
+		n[0] = w2[0];
+		n[1] = w2[1];
+		n[2] = w2[2];
+	} else {
+		w0[0] /= d9;
+		w0[1] /= d9;
+		w0[2] /= d9;
+
+		d0 = sqrt((d8 * d8) * (e2 - 1));
+		d1 = (d8 / d0) * (d9 / sqrt(d0 * d0 + d9 * d9));
+		n[0] = w2[0] - d1 * w0[0];
+		n[1] = w2[1] - d1 * w0[1];
+		n[2] = w2[2] - d1 * w0[2];
+	}
+
+	d0 = lensy_norm3(n);
+	if (d0 <= 0.0) return -2;
+	n[0] /= d0;
+	n[1] /= d0;
+	n[2] /= d0;
+
+	r->p[0] = q[0];
+	r->p[1] = q[1];
+	r->p[2] = q[2];
+	if (d9 > h->aperture / 2.0) return -1;
+
+	d1 = 2 * lensy_dot3(r->d, n);
+	r->d[0] -= d1 * n[0];
+	r->d[1] -= d1 * n[1];
+	r->d[2] -= d1 * n[2];
+	return 0;
+}
+
+
+/*------------------------------------------------------- lensy_kernel_plane_diffract_tier
+ * Intersect the ray 'r' with the plane 'p', and diffract it from a grating
+ * with the ruling vector 'a', in the order 'order'. If 'fast', the grating
+ * equation is solved for the sine along a1 directly, sin(o) = sin(i) +
+ * order wl / |a|, without atan2(), asin(), sin() and cos().
+ */
+static inline int32_t lensy_kernel_plane_diffract_tier(struct lensy_ray_struct *r,
+				const struct lensy_plane_struct *p, const double a[3], int32_t order,
+				bool fast)
+{
+	double d0, d1, d2, d4, d5, d6, d7, d8, d9, d10, mag, cd, sd;
+	double q[3], n1[3], a1[3], t1[3], w0[3];
+	int32_t rc;
+
+	rc = lensy_kernel_plane_hit(r, p, q, &mag);
+	if (rc < 0) return rc;
+
+	n1[0] = p->n[0] / mag;
+	n1[1] = p->n[1] / mag;
+	n1[2] = p->n[2] / mag;
+
+	d0 = lensy_norm3(r->d);
+	if (d0 == 0.0) return -3;
+	w0[0] = r->d[0] / d0;
+	w0[1] = r->d[1] / d0;
+	w0[2] = r->d[2] / d0;
+
+	d1 = lensy_norm3(a);			// the ruling spacing
+	d2 = lensy_dot3(a, n1);
+	a1[0] = a[0] - d2 * n1[0];
+	a1[1] = a[1] - d2 * n1[1];
+	a1[2] = a[2] - d2 * n1[2];
+
+	d2 = lensy_norm3(a1);
+	if (d2 == 0.0) return -3;
+	a1[0] /= d2;
+	a1[1] /= d2;
+	a1[2] /= d2;
+
+	t1[0] =   a1[1] * n1[2] - n1[1] * a1[2];
+	t1[1] = -(a1[0] * n1[2] - n1[0] * a1[2]);
+	t1[2] =   a1[0] * n1[1] - n1[0] * a1[1];
+
+	d4 = lensy_dot3(w0, n1);
+	d5 = lensy_dot3(w0, a1);
+	d6 = lensy_dot3(w0, t1);
+	if ((d4 == 0.0) || (d6 == 1.0)) return -3;
+
+	if (fast) {
+		sd = d5 + order * r->wavelength / d1;
+		cd = 1.0 - d6 * d6 - sd * sd;
+		if (cd <= 0.0) return -3;
+		cd = sqrt(cd);
+		r->d[0] = d0 * (d6 * t1[0] + cd * n1[0] + sd * a1[0]);
+		r->d[1] = d0 * (d6 * t1[1] + cd * n1[1] + sd * a1[1]);
+		r->d[2] = d0 * (d6 * t1[2] + cd * n1[2] + sd * a1[2]);
+		return 0;
+	}
+
+	d10 = 1.0 / sqrt(1.0 - d6 * d6);
+	d7 = atan2(d5, -d4);
+	d8 = (sin(d7) / (r->wavelength * d10) + order / d1) * (r->wavelength * d10);
+	if (fabs(d8) >= 1.0) return -3;
+	d9 = asin(d8);
+	cd = cos(d9) / d10;
+	sd = sin(d9) / d10;
+
+	r->d[0] = d0 * (d6 * t1[0] + cd * n1[0] + sd * a1[0]);
+	r->d[1] = d0 * (d6 * t1[1] + cd * n1[1] + sd * a1[1]);
+	r->d[2] = d0 * (d6 * t1[2] + cd * n1[2] + sd * a1[2]);
+	return 0;
+}
+
+
+/*------------------------------------------------------- lensy_kernel_plane_diffract
+ * Intersect the ray 'r' with the plane 'p', and diffract it from a grating
+ * with the ruling vector 'a', in the order 'order'.
+ */
+static inline int32_t lensy_kernel_plane_diffract(struct lensy_ray_struct *r,
+				const struct lensy_plane_struct *p, const double a[3], int32_t order)
+{
+	return lensy_kernel_plane_diffract_tier(r, p, a, order, false);
+}
+
+
+/*------------------------------------------------------- lensy_kernel_plane_refract_tier
+ * Intersect the ray 'r' with the plane 'p', and refract it with the index
+ * of refraction ratio 'm' (with lensy_kernel_refract_fast() if 'fast').
+ */
+static inline int32_t lensy_kernel_plane_refract_tier(struct lensy_ray_struct *r,
+				const struct lensy_plane_struct *p, double m, bool fast)
+{
+	double mag, q[3], n[3];
+	int32_t rc;
+
+	rc = lensy_kernel_plane_hit(r, p, q, &mag);
+	if (rc < 0) return rc;
+
+	n[0] = p->n[0] / mag;
+	n[1] = p->n[1] / mag;
+	n[2] = p->n[2] / mag;
+	if (fast) return lensy_kernel_refract_fast(r->d, n, m);
+	return lensy_kernel_refract(r->d, n, m);
+}
+
+
+/*------------------------------------------------------- lensy_kernel_plane_refract
+ * Intersect the ray 'r' with the plane 'p', and refract it with the index
+ * of refraction ratio 'm'.
+ */
+static inline int32_t lensy_kernel_plane_refract(struct lensy_ray_struct *r,
+				const struct lensy_plane_struct *p, double m)
+{
+	return lensy_kernel_plane_refract_tier(r, p, m, false);
+}
+
+
+/*------------------------------------------------------- lensy_kernel_plane_impact
+ * Intersect the ray 'r' with the plane 'p' (a detector).
+ */
+static inline int32_t lensy_kernel_plane_impact(struct lensy_ray_struct *r,
+				const struct lensy_plane_struct *p)
+{
+	double mag, q[3];
+
+	return lensy_kernel_plane_hit(r, p, q, &mag);
+}
+
+#endif
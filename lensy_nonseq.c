@@ -0,0 +1,689 @@
+/*
+ * lensy_nonseq.c - v1.4 (codename FlamingMarshmallow)
+ *
+ * Library functions for tracing rays non-sequentially, where each ray
+ * goes to whichever surface it reaches first.
+ *
+ *-----------------------------------------------------------------------
+ * Copyright (C) 2013 - 2015 FSF
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *-----------------------------------------------------------------------
+ *
+ * lensy_trace() takes the rays through the surfaces in the order they are
+ * listed, and does not check whether some other surface is in the way.
+ * For stray light and baffle work, lensy_trace_nonseq() instead finds,
+ * for each ray, the nearest surface it reaches inside the aperture, and
+ * applies the rule of that surface there:
+ *
+ *	LENSY_REFLECT	the ray is reflected
+ *	LENSY_REFRACT	the ray is refracted (or, past the critical angle,
+ *			reflected)
+ *	LENSY_DIFFRACT	the ray is diffracted, in the grating order order0
+ *	LENSY_IMPACT	the ray is absorbed, e.g. at a detector or a baffle
+ *
+ * Each surface has a rule for its front side, the element's redirect, and
+ * one for its back side. The front side of a surface from a system is the
+ * side that a probe ray traced in order comes from, and the back of a
+ * mirror absorbs. A refracting surface has the incident medium m0 on its
+ * front side.
+ *
+ * The nearest surface is found with a bounding volume hierarchy: each
+ * surface is boxed by its aperture bound (see lensy_element_bound()), and
+ * the boxes are split in halves, along the longest axis, down to leaves
+ * of at most two surfaces. A ray visits only the boxes it passes through,
+ * nearer boxes first, so the number of surfaces intersected grows with the
+ * log of the number of surfaces, not linearly. The intersections are those
+ * of lensy_hit_t_X(), with the normal only at the nearest surface.
+ *
+ * lensy_hit_t_X() finds one intersect point per surface (the one on the
+ * 'vertex' side), so a ray does not hit the surface it just left again.
+ *
+ * lensy_redirect_refract() keeps only the refracted ray. For ghost images,
+ * lensy_trace_ghosts() also follows the light that the Fresnel equations
+ * reflect at each refracting surface, as a weighted branch of the ray.
+ * Weak branches are ended by Russian roulette, which keeps the expected
+ * light of the image while bounding the number of branches.
+ *
+ * Send questions or contributions to me at <michael.h.williamson@gmail.com>.
+ *
+ * History:
+ *
+ *  2026-10-16  Added lensy_trace_ghosts(), with Fresnel reflected branches.
+ *  2026-10-16  This file is created.
+ */
+
+
+#include <ctype.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <lensy.h>
+#include <lensy_hash.h>
+
+
+#define	LENSY_BVH_LEAF		2	// surfaces in a leaf, at most
+#define	LENSY_BVH_PAD		1e-9	// relative padding of a surface box
+
+
+/*------------------------------------------------------- lensy_nonseq_box
+ * Make the box of surface j from its aperture bound: the disk of radius r
+ * perpendicular to the axis, swept from -sag to +sag along the axis. A
+ * surface without a bound gets an unlimited box.
+ */
+static void lensy_nonseq_box(struct lensy_nonseq_struct *ns, int32_t j)
+{
+	struct lensy_bound_struct *bd;
+	double d0, d1;
+	int32_t k;
+
+	ns->bounded[j] = lensy_element_bound(&ns->sys.e[j], &ns->bd[j]);
+	if (!ns->bounded[j]) {
+		for (k = 0; k < 3; k++) {
+			ns->lo[j][k] = -DBL_MAX;
+			ns->hi[j][k] = +DBL_MAX;
+		}
+		return;
+	}
+
+	bd = &ns->bd[j];
+	for (k = 0; k < 3; k++) {
+		d0 = bd->r * sqrt(fmax(1.0 - bd->a[k] * bd->a[k], 0.0)) +
+			bd->sag * fabs(bd->a[k]);
+		d1 = LENSY_BVH_PAD * (bd->r + bd->sag + fabs(bd->v[k]));
+		ns->lo[j][k] = bd->v[k] - d0 - d1;
+		ns->hi[j][k] = bd->v[k] + d0 + d1;
+	}
+}
+
+
+/*------------------------------------------------------- lensy_nonseq_split
+ * Make the node for the surfaces index[first], ..., index[first + count - 1],
+ * and the nodes below it.
+ *
+ * The return value is the index of the node.
+ */
+static int32_t lensy_nonseq_split(struct lensy_nonseq_struct *ns,
+				int32_t first, int32_t count)
+{
+	struct lensy_bvh_node_struct *nd;
+	double clo[3], chi[3], c, c1;
+	int32_t i, i1, j, k, axis, m;
+
+	m = ns->n_nodes++;
+	nd = &ns->node[m];
+	for (k = 0; k < 3; k++) {
+		nd->lo[k] = +DBL_MAX;
+		nd->hi[k] = -DBL_MAX;
+		clo[k] = +DBL_MAX;
+		chi[k] = -DBL_MAX;
+	}
+	for (i = first; i < first + count; i++) {
+		j = ns->index[i];
+		for (k = 0; k < 3; k++) {
+			nd->lo[k] = fmin(nd->lo[k], ns->lo[j][k]);
+			nd->hi[k] = fmax(nd->hi[k], ns->hi[j][k]);
+			c = ns->sys.e[j].s.sphere.v[k];	// the vertex is first in all surfaces
+			clo[k] = fmin(clo[k], c);
+			chi[k] = fmax(chi[k], c);
+		}
+	}
+	nd->first = first;
+	nd->count = count;
+	nd->left = nd->right = -1;
+	if (count <= LENSY_BVH_LEAF) return m;
+
+	//--- sort the surfaces by vertex along the longest axis, and halve
+	axis = 0;
+	for (k = 1; k < 3; k++)
+		if (chi[k] - clo[k] > chi[axis] - clo[axis]) axis = k;
+
+	for (i = first + 1; i < first + count; i++) {
+		j = ns->index[i];
+		c = ns->sys.e[j].s.sphere.v[axis];
+		for (i1 = i; i1 > first; i1--) {
+			c1 = ns->sys.e[ns->index[i1 - 1]].s.sphere.v[axis];
+			if (c1 <= c) break;
+			ns->index[i1] = ns->index[i1 - 1];
+		}
+		ns->index[i1] = j;
+	}
+
+	nd->count = 0;
+	i = lensy_nonseq_split(ns, first, count / 2);
+	ns->node[m].left = i;
+	i = lensy_nonseq_split(ns, first + count / 2, count - count / 2);
+	ns->node[m].right = i;
+	return m;
+}
+
+
+/*------------------------------------------------------- lensy_nonseq_build
+ * Build the bounding volume hierarchy of the surfaces of the model.
+ */
+void lensy_nonseq_build(struct lensy_nonseq_struct *ns)
+{
+	int32_t j;
+
+	for (j = 0; j < ns->sys.n; j++) {
+		lensy_nonseq_box(ns, j);
+		ns->index[j] = j;
+	}
+	ns->n_nodes = 0;
+	if (ns->sys.n > 0) lensy_nonseq_split(ns, 0, ns->sys.n);
+}
+
+
+/*------------------------------------------------------- lensy_nonseq_add
+ * Add the surface of element 'e' to the model, and rebuild the BVH.
+ */
+int32_t lensy_nonseq_add(struct lensy_nonseq_struct *ns,
+				struct lensy_element_struct *e, int32_t side,
+				int32_t back, double hole)
+{
+	int32_t j;
+
+	if (ns->sys.n >= LENSY_NMAX_ELEMENTS) {
+		fprintf(stderr, "%s: too many surfaces\n", __func__);
+		return -1;
+	}
+	j = ns->sys.n++;
+	memcpy(&ns->sys.e[j], e, sizeof(ns->sys.e[j]));
+	ns->side[j] = (side < 0) ? -1 : +1;
+	ns->back[j] = back;
+	ns->hole[j] = hole;
+	lensy_nonseq_build(ns);
+	return j;
+}
+
+
+/*------------------------------------------------------- lensy_nonseq_prepare
+ * Make the non-sequential model of the surfaces of the system 'sys'. The
+ * front sides are found by tracing the ray 'probe' through the system in
+ * order, with lensy_element_intersect() and lensy_element_redirect(). The
+ * surfaces after the probe ray is lost keep the side along the axis.
+ */
+int32_t lensy_nonseq_prepare(struct lensy_nonseq_struct *ns,
+				struct lensy_system_struct *sys,
+				struct lensy_ray_struct *probe)
+{
+	struct lensy_ray_struct ray;
+	struct lensy_element_struct *e;
+	double q[3], n[3], m, *axis;
+	int32_t j, rc;
+	bool lost;
+
+	memset(ns, 0, sizeof(*ns));
+	memcpy(&ns->sys, sys, sizeof(ns->sys));
+	ns->sys.reject = NULL;
+	ns->max_events = LENSY_NONSEQ_EVENTS;
+
+	memcpy(&ray, probe, sizeof(ray));
+	lost = false;
+	for (j = 0; j < ns->sys.n; j++) {
+		e = &ns->sys.e[j];
+		ns->side[j] = +1;
+		ns->back[j] = (e->redirect == LENSY_REFLECT) ? LENSY_IMPACT : e->redirect;
+		if (lost) continue;
+
+		axis = lensy_element_axis(e);
+		rc = lensy_element_intersect(e, &ray, q, n);
+		if ((axis == NULL) || (rc == -2)) {
+			lost = true;
+			continue;
+		}
+		if (lensy_dot3(ray.d, axis) < 0.0) ns->side[j] = -1;
+
+		m = 1.0;
+		if (e->redirect == LENSY_REFRACT)
+			m = lensy_index_medium(ray.wavelength, e->m0) /
+				lensy_index_medium(ray.wavelength, e->m1);
+		if (lensy_element_redirect(e, &ray, q, n, m, e->order0) < 0) lost = true;
+	}
+
+	lensy_nonseq_build(ns);
+	return 0;
+}
+
+
+/*------------------------------------------------------- lensy_nonseq_enter
+ * Return the distance along the ray (p, 1/d) at which it enters the box
+ * of node 'nd', or -1 if it misses the box, or enters it beyond 'tmax'.
+ */
+static inline double lensy_nonseq_enter(struct lensy_bvh_node_struct *nd,
+				double p[3], double d[3], double inv[3], double tmax)
+{
+	double t0, t1, ta, tb;
+	int32_t k;
+
+	t0 = 0.0;
+	t1 = tmax;
+	for (k = 0; k < 3; k++) {
+		if (d[k] == 0.0) {
+			if ((p[k] < nd->lo[k]) || (p[k] > nd->hi[k])) return -1.0;
+			continue;
+		}
+		ta = (nd->lo[k] - p[k]) * inv[k];
+		tb = (nd->hi[k] - p[k]) * inv[k];
+		if (ta > tb) {
+			t0 = fmax(t0, tb);
+			t1 = fmin(t1, ta);
+		} else {
+			t0 = fmax(t0, ta);
+			t1 = fmin(t1, tb);
+		}
+		if (t0 > t1) return -1.0;
+	}
+	return t0;
+}
+
+
+/*------------------------------------------------------- lensy_nonseq_in_hole
+ * Return true if the point q[3] of surface j is in its central hole.
+ */
+static inline bool lensy_nonseq_in_hole(struct lensy_nonseq_struct *ns,
+				int32_t j, double q[3])
+{
+	struct lensy_bound_struct *bd;
+	double d0, w[3];
+
+	if ((ns->hole[j] <= 0.0) || !ns->bounded[j]) return false;
+
+	bd = &ns->bd[j];
+	w[0] = q[0] - bd->v[0];
+	w[1] = q[1] - bd->v[1];
+	w[2] = q[2] - bd->v[2];
+	d0 = lensy_dot3(w, bd->a);
+	w[0] -= d0 * bd->a[0];
+	w[1] -= d0 * bd->a[1];
+	w[2] -= d0 * bd->a[2];
+	return lensy_dot3(w, w) < ns->hole[j] * ns->hole[j];
+}
+
+
+/*------------------------------------------------------- lensy_nonseq_nearest
+ * Find the surface that the ray 'r' reaches first, other than 'skip'.
+ */
+int32_t lensy_nonseq_nearest(struct lensy_nonseq_struct *ns,
+				struct lensy_ray_struct *r, int32_t skip, double *t)
+{
+	struct lensy_bvh_node_struct *nd;
+	int32_t stack[2 * LENSY_NMAX_ELEMENTS], n_stack;
+	int32_t i, j, best, rc;
+	double inv[3], t1, tl, tr, q[3];
+
+	*t = DBL_MAX;
+	if (ns->n_nodes == 0) return -1;
+
+	for (i = 0; i < 3; i++) inv[i] = (r->d[i] != 0.0) ? 1.0 / r->d[i] : 0.0;
+
+	best = -1;
+	n_stack = 0;
+	if (lensy_nonseq_enter(&ns->node[0], r->p, r->d, inv, *t) >= 0.0)
+		stack[n_stack++] = 0;
+
+	while (n_stack > 0) {
+		nd = &ns->node[stack[--n_stack]];
+
+		if (nd->count == 0) {
+			//--- push the farther child first, so the nearer is visited first
+			tl = lensy_nonseq_enter(&ns->node[nd->left], r->p, r->d, inv, *t);
+			tr = lensy_nonseq_enter(&ns->node[nd->right], r->p, r->d, inv, *t);
+			if (tl > tr) {
+				stack[n_stack++] = nd->left;
+				if (tr >= 0.0) stack[n_stack++] = nd->right;
+			} else {
+				if (tr >= 0.0) stack[n_stack++] = nd->right;
+				if (tl >= 0.0) stack[n_stack++] = nd->left;
+			}
+			continue;
+		}
+
+		//--- a node popped may have been passed by a nearer hit since
+		if (lensy_nonseq_enter(nd, r->p, r->d, inv, *t) < 0.0) continue;
+
+		for (i = nd->first; i < nd->first + nd->count; i++) {
+			j = ns->index[i];
+			if (j == skip) continue;
+			ns->tests++;
+			rc = lensy_element_hit_t(&ns->sys.e[j], r, &t1);
+			if ((rc != 0) || (t1 <= 0.0) || (t1 >= *t)) continue;
+			lensy_ray_at(r, t1, q);
+			if (lensy_nonseq_in_hole(ns, j, q)) continue;
+			*t = t1;
+			best = j;
+		}
+	}
+	return best;
+}
+
+
+/*------------------------------------------------------- lensy_nonseq_ratio
+ * Return the index of refraction ratio (incident / transmission) at the
+ * refracting surface 'e', for a ray that reaches its front side or not.
+ */
+static inline double lensy_nonseq_ratio(struct lensy_element_struct *e, bool front,
+				double wavelength)
+{
+	double n0, n1;
+
+	n0 = lensy_index_medium(wavelength, e->m0);
+	n1 = lensy_index_medium(wavelength, e->m1);
+	return front ? n0 / n1 : n1 / n0;
+}
+
+
+/*------------------------------------------------------- lensy_nonseq_redirect
+ * Apply the rule 'rule' of surface 'e' to the ray 'r' at the point q[3]
+ * with the normal n[3]. 'front' is true if the ray reaches the front side.
+ *
+ * The return value is 1 if the ray is absorbed, 0 if it goes on, or -1 if
+ * it cannot be redirected.
+ */
+static int32_t lensy_nonseq_redirect(struct lensy_element_struct *e, int32_t rule,
+				bool front, struct lensy_ray_struct *r,
+				double q[3], double n[3])
+{
+	double m;
+
+	switch (rule) {
+	case LENSY_REFLECT:
+		lensy_redirect_reflect(r, q, n);
+		return 0;
+	case LENSY_REFRACT:
+		m = lensy_nonseq_ratio(e, front, r->wavelength);
+		if (lensy_redirect_refract(r, q, n, m) == -1)	// total internal reflection
+			lensy_redirect_reflect(r, q, n);
+		return 0;
+	case LENSY_DIFFRACT:
+		if (lensy_redirect_diffract(r, q, n, e->a, r->wavelength,
+				r->wavelength, e->order0) < 0) return -1;
+		return 0;
+	case LENSY_IMPACT:
+		lensy_redirect_impact(r, q, n);
+		return 1;
+	}
+	return -1;
+}
+
+
+/*------------------------------------------------------- lensy_trace_nonseq
+ * Trace the rays of bundle 'b' non-sequentially through the model 'ns'.
+ */
+int32_t lensy_trace_nonseq(struct lensy_nonseq_struct *ns,
+				struct lensy_bundle_struct *b, int32_t *stop)
+{
+	struct lensy_ray_struct ray;
+	struct lensy_element_struct *e;
+	double q[3], n[3], t, *axis;
+	int32_t i, j, k, w, last, rc, rule;
+	bool front;
+
+	memset(ns->absorbed, 0, sizeof(ns->absorbed));
+	ns->escaped = ns->lost = ns->events = ns->tests = 0;
+
+	for (i = w = 0; i < b->n; i++) {
+		lensy_bundle_get(b, i, &ray);
+
+		last = -1;
+		rc = 0;
+		for (k = 0; k < ns->max_events; k++) {
+			j = lensy_nonseq_nearest(ns, &ray, last, &t);
+			if (j < 0) break;
+
+			e = &ns->sys.e[j];
+			lensy_ray_at(&ray, t, q);
+			axis = lensy_element_axis(e);
+			if ((axis == NULL) || (lensy_element_normal(e, q, n) < 0)) {
+				rc = -1;
+				break;
+			}
+			front = (lensy_dot3(ray.d, axis) * ns->side[j] >= 0.0);
+			rule = front ? e->redirect : ns->back[j];
+
+			if (ns->sys.line != NULL) ns->sys.line(ray.p, q, ray.red, ray.green, ray.blue);
+			ns->events++;
+			last = j;
+
+			rc = lensy_nonseq_redirect(e, rule, front, &ray, q, n);
+			if (rc != 0) break;
+		}
+
+		if (rc == 1) {
+			ns->absorbed[last]++;
+			lensy_bundle_set(b, w, &ray);
+			b->path[w] = b->path[i];
+			b->weight[w] = b->weight[i];
+			if (stop != NULL) stop[w] = last;
+			w++;
+		} else if ((rc == 0) && (k < ns->max_events)) {
+			ns->escaped++;
+		} else {
+			ns->lost++;
+		}
+	}
+	b->n = w;
+	return w;
+}
+
+
+/*
+ * A branch of a ray in lensy_trace_ghosts().
+ */
+struct lensy_branch_struct {
+	struct lensy_ray_struct ray;
+	double weight;			// the fraction of the light of the ray
+	int32_t last;			// the surface the branch left, or -1
+	int32_t events;			// interactions so far
+	int32_t reflections;		// Fresnel reflections so far
+};
+
+
+/*------------------------------------------------------- lensy_ghost_init
+ * Allocate the image layers of 'gh', and clear them.
+ */
+int32_t lensy_ghost_init(struct lensy_ghost_struct *gh)
+{
+	size_t n;
+
+	n = (size_t) gh->ccd->x_nmax * gh->ccd->y_nmax;
+	gh->direct = (double *) calloc(n, sizeof(double));
+	gh->ghost = (double *) calloc(n, sizeof(double));
+	if ((gh->direct == NULL) || (gh->ghost == NULL)) {
+		fprintf(stderr, "%s: malloc failed\n", __func__);
+		lensy_ghost_free(gh);
+		return -1;
+	}
+	gh->state = gh->seed;
+	return 0;
+}
+
+
+/*------------------------------------------------------- lensy_ghost_free
+ * Free the image layers of 'gh'.
+ */
+void lensy_ghost_free(struct lensy_ghost_struct *gh)
+{
+	free(gh->direct);
+	free(gh->ghost);
+	gh->direct = gh->ghost = NULL;
+}
+
+
+/*------------------------------------------------------- lensy_ghost_random
+ * Return a random number in [0, 1) (splitmix64).
+ */
+static inline double lensy_ghost_random(struct lensy_ghost_struct *gh)
+{
+	return (lensy_random64(&gh->state) >> 11) * 0x1.0p-53;
+}
+
+
+/*------------------------------------------------------- lensy_ghost_roulette
+ * Play Russian roulette for a branch with the weight *w below the least
+ * weight: it goes on with the least weight, with the probability
+ * *w / min_weight, so the expected weight is kept.
+ *
+ * The return value is true if the branch goes on.
+ */
+static inline bool lensy_ghost_roulette(struct lensy_ghost_struct *gh, double *w)
+{
+	if (*w >= gh->min_weight) return true;
+	if (lensy_ghost_random(gh) * gh->min_weight < *w) {
+		*w = gh->min_weight;
+		return true;
+	}
+	gh->killed++;
+	return false;
+}
+
+
+/*------------------------------------------------------- lensy_ghost_detect
+ * Add the branch 'br', absorbed at the point q[3] of surface j, to the
+ * results.
+ */
+static void lensy_ghost_detect(struct lensy_ghost_struct *gh,
+				struct lensy_branch_struct *br, int32_t j, double q[3])
+{
+	int32_t x, y;
+
+	if ((j != gh->detector) || !lensy_ccd_pixel(gh->ccd, q, &x, &y)) {
+		gh->w_absorbed += br->weight;
+		return;
+	}
+	if (br->reflections == 0) {
+		gh->direct[y * gh->ccd->x_nmax + x] += br->weight;
+		gh->w_direct += br->weight;
+	} else {
+		gh->ghost[y * gh->ccd->x_nmax + x] += br->weight;
+		gh->w_ghost += br->weight;
+	}
+}
+
+
+/*------------------------------------------------------- lensy_trace_ghosts
+ * Trace the rays of bundle 'b' non-sequentially, with Fresnel reflected
+ * branches. The branches not yet traced are kept on a stack; each
+ * interaction of a branch adds at most one, so the stack is never deeper
+ * than ns->max_events.
+ */
+int32_t lensy_trace_ghosts(struct lensy_nonseq_struct *ns,
+				struct lensy_bundle_struct *b,
+				struct lensy_ghost_struct *gh)
+{
+	struct lensy_branch_struct *stack, br, rf;
+	struct lensy_element_struct *e;
+	double q[3], n[3], t, m, r, *axis;
+	int32_t i, j, n_stack, rc, rule;
+	bool front;
+
+	if ((gh->direct == NULL) || (gh->ghost == NULL)) {
+		fprintf(stderr, "%s: no image layers\n", __func__);
+		return -1;
+	}
+	stack = (struct lensy_branch_struct *) malloc((ns->max_events + 1) * sizeof(*stack));
+	if (stack == NULL) {
+		fprintf(stderr, "%s: malloc failed\n", __func__);
+		return -1;
+	}
+
+	memset(ns->absorbed, 0, sizeof(ns->absorbed));
+	ns->escaped = ns->lost = ns->events = ns->tests = 0;
+	gh->split = gh->killed = 0;
+	gh->w_direct = gh->w_ghost = gh->w_absorbed = gh->w_escaped = gh->w_lost = 0.0;
+
+	for (i = 0; i < b->n; i++) {
+		memset(&stack[0], 0, sizeof(stack[0]));
+		lensy_bundle_get(b, i, &stack[0].ray);
+		stack[0].weight = b->weight[i];
+		stack[0].last = -1;
+		n_stack = 1;
+
+		while (n_stack > 0) {
+			memcpy(&br, &stack[--n_stack], sizeof(br));
+
+			for (;;) {
+				if (br.events >= ns->max_events) {
+					gh->w_lost += br.weight;
+					ns->lost++;
+					break;
+				}
+				j = lensy_nonseq_nearest(ns, &br.ray, br.last, &t);
+				if (j < 0) {
+					gh->w_escaped += br.weight;
+					ns->escaped++;
+					break;
+				}
+
+				e = &ns->sys.e[j];
+				lensy_ray_at(&br.ray, t, q);
+				axis = lensy_element_axis(e);
+				if ((axis == NULL) || (lensy_element_normal(e, q, n) < 0)) {
+					gh->w_lost += br.weight;
+					ns->lost++;
+					break;
+				}
+				front = (lensy_dot3(br.ray.d, axis) * ns->side[j] >= 0.0);
+				rule = front ? e->redirect : ns->back[j];
+
+				if (ns->sys.line != NULL)
+					ns->sys.line(br.ray.p, q, br.ray.red, br.ray.green, br.ray.blue);
+				ns->events++;
+				br.events++;
+				br.last = j;
+
+				if (rule != LENSY_REFRACT) {
+					rc = lensy_nonseq_redirect(e, rule, front, &br.ray, q, n);
+					if (rc == 0) continue;
+					if (rc == 1) {
+						ns->absorbed[j]++;
+						lensy_ghost_detect(gh, &br, j, q);
+					} else {
+						gh->w_lost += br.weight;
+						ns->lost++;
+					}
+					break;
+				}
+
+				//--- split off the Fresnel reflected branch
+				m = lensy_nonseq_ratio(e, front, br.ray.wavelength);
+				r = lensy_fresnel_reflectance(&br.ray, n, m);
+				if ((r > 0.0) && (r < 1.0)) {
+					memcpy(&rf, &br, sizeof(rf));
+					rf.weight *= r;
+					rf.reflections++;
+					lensy_redirect_reflect(&rf.ray, q, n);
+					if (lensy_ghost_roulette(gh, &rf.weight)) {
+						memcpy(&stack[n_stack++], &rf, sizeof(rf));
+						gh->split++;
+					}
+					br.weight *= 1.0 - r;
+				}
+				if (lensy_redirect_refract(&br.ray, q, n, m) == -1)
+					lensy_redirect_reflect(&br.ray, q, n);
+				if (!lensy_ghost_roulette(gh, &br.weight)) break;
+			}
+		}
+	}
+
+	free(stack);
+	return 0;
+}
@@ -0,0 +1,394 @@
+/*
+ * lensy_packed.c - v1.4 (codename FlamingMarshmallow)
+ *
+ * Library functions for a packed (quantized) form of a ray bundle, which
+ * uses less than half of the memory of a bundle.
+ *
+ *-----------------------------------------------------------------------
+ * Copyright (C) 2013 - 2015 FSF
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *-----------------------------------------------------------------------
+ *
+ * A ray of a bundle takes 91 bytes, and a packed ray 37 bytes:
+ *
+ *	position	The rays are grouped in chunks of LENSY_PACK_CHUNK rays.
+ *			Each chunk has an origin (double), at the middle of
+ *			the box around its rays, and the positions are float
+ *			offsets from the origin. The error is at most 2^-25
+ *			times the size of the box, along each axis (3 nm for
+ *			a chunk that is 10 cm across).
+ *
+ *	direction	The unit vector is projected on the octahedron
+ *			|x| + |y| + |z| = 1, which is unfolded to the square
+ *			[-1, 1] x [-1, 1], and the two coordinates are stored
+ *			as 32 bit fixed point numbers. The angle between the
+ *			direction and the unpacked direction is less than
+ *			1.5e-9 radians.
+ *
+ *	wavelength	A 16 bit index into a table of the wavelengths of the
+ *			bundle (at most LENSY_NMAX_WAVELENGTHS), so there is
+ *			no error.
+ *
+ *	weight		A float, with a relative error of at most 2^-24.
+ *
+ *	path, colors	Not changed.
+ *
+ * For a telescope with a focal length of some meters, the errors are a few
+ * nanometers at the focal plane, far below the size of a pixel or a spot.
+ * The loops of lensy_pack() and lensy_unpack() work on whole columns, so
+ * that the compiler can vectorize them.
+ *
+ * Send questions or contributions to me at <michael.h.williamson@gmail.com>.
+ *
+ * History:
+ *
+ *  2026-10-16  A packed bundle in a mapped file is not freed or realloced.
+ *  2026-10-16  Added the weight column.
+ *  2026-10-16  This file is created.
+ */
+
+
+#include <ctype.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <lensy.h>
+
+
+#define	LENSY_OCTA_SCALE	2147483647.5	// (2^32 - 1) / 2
+
+
+/*------------------------------------------------------- lensy_packed_init
+ * Initialize an empty packed bundle.
+ */
+void lensy_packed_init(struct lensy_packed_struct *pk)
+{
+	memset(pk, 0, sizeof(*pk));
+}
+
+
+/*------------------------------------------------------- lensy_packed_reserve
+ * Make sure that the packed bundle has room for at least 'nmax' rays.
+ * The rays are not kept, and a packed bundle in a mapped file gets
+ * columns of its own.
+ *
+ * A return value of zero means OK.
+ * A return value of -1 means that realloc failed.
+ */
+static int32_t lensy_packed_reserve(struct lensy_packed_struct *pk, int32_t nmax)
+{
+	int32_t k, n_chunks;
+	void *pv;
+
+	// the rays are not kept, so the columns of a mapped file are dropped
+	if (pk->borrowed) memset(pk, 0, sizeof(*pk));
+
+	if (nmax <= pk->nmax) return 0;
+	if (nmax < 2 * pk->nmax) nmax = 2 * pk->nmax;
+	if (nmax < LENSY_PACK_CHUNK) nmax = LENSY_PACK_CHUNK;
+	n_chunks = (nmax + LENSY_PACK_CHUNK - 1) / LENSY_PACK_CHUNK;
+
+	for (k = 0; k < 3; k++) {
+		pv = realloc(pk->origin[k], n_chunks * sizeof(double));
+		if (pv == NULL) return -1;
+		pk->origin[k] = (double *) pv;
+
+		pv = realloc(pk->p[k], nmax * sizeof(float));
+		if (pv == NULL) return -1;
+		pk->p[k] = (float *) pv;
+	}
+	for (k = 0; k < 2; k++) {
+		pv = realloc(pk->d[k], nmax * sizeof(uint32_t));
+		if (pv == NULL) return -1;
+		pk->d[k] = (uint32_t *) pv;
+	}
+
+	pv = realloc(pk->wl, nmax * sizeof(uint16_t));
+	if (pv == NULL) return -1;
+	pk->wl = (uint16_t *) pv;
+
+	pv = realloc(pk->path, nmax * sizeof(uint64_t));
+	if (pv == NULL) return -1;
+	pk->path = (uint64_t *) pv;
+
+	pv = realloc(pk->weight, nmax * sizeof(float));
+	if (pv == NULL) return -1;
+	pk->weight = (float *) pv;
+
+	pv = realloc(pk->red, nmax);
+	if (pv == NULL) return -1;
+	pk->red = (char *) pv;
+
+	pv = realloc(pk->green, nmax);
+	if (pv == NULL) return -1;
+	pk->green = (char *) pv;
+
+	pv = realloc(pk->blue, nmax);
+	if (pv == NULL) return -1;
+	pk->blue = (char *) pv;
+
+	pk->nmax = nmax;
+	return 0;
+}
+
+
+/*------------------------------------------------------- lensy_packed_free
+ * Free the columns of a packed bundle. The columns in a mapped file are
+ * only forgotten.
+ */
+void lensy_packed_free(struct lensy_packed_struct *pk)
+{
+	int32_t k;
+
+	if (pk->borrowed) {
+		memset(pk, 0, sizeof(*pk));
+		return;
+	}
+	for (k = 0; k < 3; k++) {
+		free(pk->origin[k]);
+		free(pk->p[k]);
+	}
+	free(pk->d[0]);
+	free(pk->d[1]);
+	free(pk->wl);
+	free(pk->wl_table);
+	free(pk->path);
+	free(pk->weight);
+	free(pk->red);
+	free(pk->green);
+	free(pk->blue);
+	memset(pk, 0, sizeof(*pk));
+}
+
+
+/*------------------------------------------------------- lensy_octa_encode
+ * Pack the unit vector (x, y, z) into the octahedral coordinates q[2].
+ */
+static inline void lensy_octa_encode(double x, double y, double z, uint32_t q[2])
+{
+	double s, u, v, t;
+
+	s = fabs(x) + fabs(y) + fabs(z);
+	u = x / s;
+	v = y / s;
+	if (z < 0.0) {
+		t = (1.0 - fabs(v)) * copysign(1.0, u);
+		v = (1.0 - fabs(u)) * copysign(1.0, v);
+		u = t;
+	}
+	q[0] = (uint32_t) lrint((u + 1.0) * LENSY_OCTA_SCALE);
+	q[1] = (uint32_t) lrint((v + 1.0) * LENSY_OCTA_SCALE);
+}
+
+
+/*------------------------------------------------------- lensy_octa_decode
+ * Unpack the octahedral coordinates q0, q1 into the unit vector d[3].
+ */
+static inline void lensy_octa_decode(uint32_t q0, uint32_t q1, double d[3])
+{
+	double u, v, z, t, s;
+
+	u = q0 / LENSY_OCTA_SCALE - 1.0;
+	v = q1 / LENSY_OCTA_SCALE - 1.0;
+	z = 1.0 - fabs(u) - fabs(v);
+	if (z < 0.0) {
+		t = (1.0 - fabs(v)) * copysign(1.0, u);
+		v = (1.0 - fabs(u)) * copysign(1.0, v);
+		u = t;
+	}
+	s = 1.0 / sqrt(u * u + v * v + z * z);
+	d[0] = u * s;
+	d[1] = v * s;
+	d[2] = z * s;
+}
+
+
+/*------------------------------------------------------- lensy_wavelength_index
+ * Return the index of the wavelength 'wl' in the table of the packed
+ * bundle, adding it if needed, or -1 if the table is full. The index
+ * of the last wavelength found is tried first.
+ */
+static int32_t lensy_wavelength_index(struct lensy_packed_struct *pk,
+				double wl, int32_t last)
+{
+	int32_t k;
+	void *pv;
+
+	if ((last < pk->n_wl) && (pk->wl_table[last] == wl)) return last;
+	for (k = 0; k < pk->n_wl; k++)
+		if (pk->wl_table[k] == wl) return k;
+
+	if (pk->n_wl == LENSY_NMAX_WAVELENGTHS) return -1;
+	if ((pk->n_wl & (pk->n_wl - 1)) == 0) {
+		pv = realloc(pk->wl_table, (pk->n_wl ? 2 * pk->n_wl : 16) * sizeof(double));
+		if (pv == NULL) return -1;
+		pk->wl_table = (double *) pv;
+	}
+	pk->wl_table[pk->n_wl] = wl;
+	return pk->n_wl++;
+}
+
+
+/*------------------------------------------------------- lensy_pack
+ * Pack the rays of bundle 'b' into the packed bundle 'pk', replacing the
+ * rays that were in it.
+ *
+ * A return value of zero means OK.
+ * A return value of -1 means that realloc failed.
+ * A return value of -2 means that there are more than
+ * LENSY_NMAX_WAVELENGTHS wavelengths.
+ */
+int32_t lensy_pack(struct lensy_packed_struct *pk, struct lensy_bundle_struct *b)
+{
+	int32_t i, i0, i1, c, k, w;
+	double lo, hi, o;
+	uint32_t q[2];
+
+	pk->n = pk->n_wl = 0;
+	if (lensy_packed_reserve(pk, b->n) < 0) {
+		fprintf(stderr, "%s: realloc failed\n", __func__);
+		return -1;
+	}
+
+	//------ positions, as offsets from the middle of each chunk
+	for (i0 = c = 0; i0 < b->n; i0 += LENSY_PACK_CHUNK, c++) {
+		i1 = (i0 + LENSY_PACK_CHUNK < b->n) ? i0 + LENSY_PACK_CHUNK : b->n;
+		for (k = 0; k < 3; k++) {
+			lo = hi = b->p[k][i0];
+			for (i = i0 + 1; i < i1; i++) {
+				lo = fmin(lo, b->p[k][i]);
+				hi = fmax(hi, b->p[k][i]);
+			}
+			o = pk->origin[k][c] = 0.5 * (lo + hi);
+			for (i = i0; i < i1; i++)
+				pk->p[k][i] = (float) (b->p[k][i] - o);
+		}
+	}
+
+	//------ directions
+	for (i = 0; i < b->n; i++) {
+		lensy_octa_encode(b->d[0][i], b->d[1][i], b->d[2][i], q);
+		pk->d[0][i] = q[0];
+		pk->d[1][i] = q[1];
+	}
+
+	//------ wavelengths
+	for (i = w = 0; i < b->n; i++) {
+		w = lensy_wavelength_index(pk, b->wavelength[i], w);
+		if (w < 0) {
+			fprintf(stderr, "%s: more than %d wavelengths\n", __func__,
+				LENSY_NMAX_WAVELENGTHS);
+			return -2;
+		}
+		pk->wl[i] = w;
+	}
+
+	memcpy(pk->path, b->path, b->n * sizeof(uint64_t));
+	for (i = 0; i < b->n; i++)
+		pk->weight[i] = (float) b->weight[i];
+	memcpy(pk->red, b->red, b->n);
+	memcpy(pk->green, b->green, b->n);
+	memcpy(pk->blue, b->blue, b->n);
+	pk->n = b->n;
+	return 0;
+}
+
+
+/*------------------------------------------------------- lensy_unpack
+ * Unpack the rays of the packed bundle 'pk' into the bundle 'b',
+ * replacing the rays that were in it.
+ *
+ * A return value of zero means OK.
+ * A return value of -1 means that realloc failed.
+ */
+int32_t lensy_unpack(struct lensy_bundle_struct *b, struct lensy_packed_struct *pk)
+{
+	int32_t i, i0, i1, c, k;
+	double o, d[3];
+
+	b->n = 0;
+	if (lensy_bundle_reserve(b, pk->n) < 0) {
+		fprintf(stderr, "%s: realloc failed\n", __func__);
+		return -1;
+	}
+
+	for (i0 = c = 0; i0 < pk->n; i0 += LENSY_PACK_CHUNK, c++) {
+		i1 = (i0 + LENSY_PACK_CHUNK < pk->n) ? i0 + LENSY_PACK_CHUNK : pk->n;
+		for (k = 0; k < 3; k++) {
+			o = pk->origin[k][c];
+			for (i = i0; i < i1; i++)
+				b->p[k][i] = o + pk->p[k][i];
+		}
+	}
+
+	for (i = 0; i < pk->n; i++) {
+		lensy_octa_decode(pk->d[0][i], pk->d[1][i], d);
+		b->d[0][i] = d[0];
+		b->d[1][i] = d[1];
+		b->d[2][i] = d[2];
+	}
+
+	for (i = 0; i < pk->n; i++)
+		b->wavelength[i] = pk->wl_table[pk->wl[i]];
+
+	memcpy(b->path, pk->path, pk->n * sizeof(uint64_t));
+	for (i = 0; i < pk->n; i++)
+		b->weight[i] = (pk->weight != NULL) ? pk->weight[i] : 1.0;
+	memcpy(b->red, pk->red, pk->n);
+	memcpy(b->green, pk->green, pk->n);
+	memcpy(b->blue, pk->blue, pk->n);
+	b->n = pk->n;
+	return 0;
+}
+
+
+/*------------------------------------------------------- lensy_pack_error
+ * Compare the packed bundle 'pk' with the bundle 'b' it was packed from.
+ * The largest position error (meters) is returned in err[0], and the
+ * largest direction error (radians) in err[1].
+ */
+void lensy_pack_error(struct lensy_packed_struct *pk, struct lensy_bundle_struct *b,
+				double err[2])
+{
+	int32_t i, k, c;
+	double d[3], e, s;
+
+	err[0] = err[1] = 0.0;
+	for (i = 0; (i < pk->n) && (i < b->n); i++) {
+		c = i / LENSY_PACK_CHUNK;
+		for (k = 0; k < 3; k++) {
+			e = fabs(pk->origin[k][c] + pk->p[k][i] - b->p[k][i]);
+			if (e > err[0]) err[0] = e;
+		}
+
+		// the angle, from the length of the cross product
+		lensy_octa_decode(pk->d[0][i], pk->d[1][i], d);
+		s = d[1] * b->d[2][i] - d[2] * b->d[1][i];
+		e = s * s;
+		s = d[2] * b->d[0][i] - d[0] * b->d[2][i];
+		e += s * s;
+		s = d[0] * b->d[1][i] - d[1] * b->d[0][i];
+		e += s * s;
+		e = asin(fmin(sqrt(e), 1.0));
+		if (e > err[1]) err[1] = e;
+	}
+}
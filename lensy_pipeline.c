@@ -0,0 +1,495 @@
+/*
+ * lensy_pipeline.c - v1.4 (codename FlamingMarshmallow)
+ *
+ * Library functions for a streaming trace (see lensy_stream.c) in which
+ * making the rays, tracing them and adding them to the results are done
+ * at the same time, by threads connected with lock-free queues.
+ *
+ *-----------------------------------------------------------------------
+ * Copyright (C) 2013 - 2015 FSF
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *-----------------------------------------------------------------------
+ *
+ * The pipeline has a fixed pool of chunk bundles, and four queues:
+ *
+ *	free -> generator -> trace -> tracers -> ccd   -> CCD thread
+ *	                                      \-> spots -> spot thread
+ *
+ * The generator thread takes a chunk from the free queue, fills it with
+ * the source function and puts it in the trace queue. The tracer threads
+ * trace the chunks and pass them to both of the accumulator threads, and
+ * the last accumulator to finish with a chunk puts it back in the free
+ * queue. When all of the chunks are in use, the generator waits: this is
+ * the back pressure that keeps the memory bounded.
+ *
+ * The accumulators add the chunks in the order that they were made (a
+ * chunk that arrives early waits until the ones before it are added), so
+ * the results are the same as those of lensy_stream(), whatever the
+ * number of tracer threads.
+ *
+ * The queues are bounded multi-producer multi-consumer rings, in which
+ * each cell has a sequence number (D. Vyukov's design). A thread that
+ * finds a queue full or empty yields the processor and tries again; these
+ * waits, and the number of chunks in each queue, are counted in the
+ * queue statistics, to show which stage holds up the others.
+ *
+ * Send questions or contributions to me at <michael.h.williamson@gmail.com>.
+ *
+ * History:
+ *
+ *  2026-10-16  The tracer threads do not sum a throughput budget
+ *              (sys->budget), since the sums are not locked.
+ *  2026-10-16  This file is created.
+ */
+
+
+#include <ctype.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <lensy.h>
+
+
+/*------------------------------------------------------- queue structures
+ */
+struct lensy_cell_struct {
+	uint64_t seq;
+	void *p;
+};
+
+struct lensy_queue_struct {
+	uint64_t head __attribute__ ((aligned (64)));	// next cell to put
+	uint64_t tail __attribute__ ((aligned (64)));	// next cell to get
+	uint64_t mask __attribute__ ((aligned (64)));
+	struct lensy_cell_struct *cell;
+	struct lensy_queue_stats_struct *stats;
+};
+
+//------ a chunk of rays, on its way through the pipeline
+struct lensy_chunk_struct {
+	struct lensy_bundle_struct b;
+	uint64_t seq;			// order in which the chunks were made
+	int32_t refs;			// accumulators still to add it
+};
+
+//------ what the threads share
+struct lensy_pipeline_struct {
+	struct lensy_system_struct sys;		// the system, without line() and reject
+	int32_t (*source)(void *arg, struct lensy_bundle_struct *b, int32_t nmax);
+	void *arg;
+	int32_t chunk;
+	int32_t n_tracers;
+	int32_t n_chunks;
+	struct lensy_stream_struct *st;
+	struct lensy_queue_struct q[LENSY_PIPE_NQUEUES];
+	int32_t n_accumulators;
+	int32_t tracers_left;
+	int32_t abort;				// set to stop all threads
+	int32_t rc;
+};
+
+
+/*------------------------------------------------------- lensy_queue_init
+ * Initialize a queue with room for at least 'n' items.
+ *
+ * A return value of zero means OK, and -1 means that malloc failed.
+ */
+static int32_t lensy_queue_init(struct lensy_queue_struct *q, int32_t n,
+				struct lensy_queue_stats_struct *stats)
+{
+	uint64_t i, size;
+
+	for (size = 2; size < n; size *= 2);
+
+	memset(q, 0, sizeof(*q));
+	q->cell = (struct lensy_cell_struct *) malloc(size * sizeof(*q->cell));
+	if (q->cell == NULL) return -1;
+	for (i = 0; i < size; i++)
+		q->cell[i].seq = i;
+	q->mask = size - 1;
+	q->stats = stats;
+	memset(stats, 0, sizeof(*stats));
+	return 0;
+}
+
+
+/*------------------------------------------------------- lensy_queue_try_put
+ * Put the item 'p' in the queue, unless it is full.
+ */
+static bool lensy_queue_try_put(struct lensy_queue_struct *q, void *p)
+{
+	struct lensy_cell_struct *c;
+	uint64_t pos, seq;
+
+	pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	for (;;) {
+		c = &q->cell[pos & q->mask];
+		seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, true,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if ((int64_t) (seq - pos) < 0) {
+			return false;
+		} else {
+			pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+		}
+	}
+	c->p = p;
+	__atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+
+/*------------------------------------------------------- lensy_queue_try_get
+ * Get an item from the queue into '*p', unless it is empty.
+ */
+static bool lensy_queue_try_get(struct lensy_queue_struct *q, void **p)
+{
+	struct lensy_cell_struct *c;
+	uint64_t pos, seq;
+
+	pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	for (;;) {
+		c = &q->cell[pos & q->mask];
+		seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos + 1) {
+			if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, true,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if ((int64_t) (seq - (pos + 1)) < 0) {
+			return false;
+		} else {
+			pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+		}
+	}
+	*p = c->p;
+	__atomic_store_n(&c->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+
+/*------------------------------------------------------- lensy_queue_put
+ * Put the item 'p' in the queue, waiting while it is full. The number of
+ * items in the queue is added to the statistics.
+ *
+ * A return value of false means that the pipeline was aborted.
+ */
+static bool lensy_queue_put(struct lensy_pipeline_struct *w,
+				struct lensy_queue_struct *q, void *p)
+{
+	struct lensy_queue_stats_struct *s;
+	int64_t n;
+
+	s = q->stats;
+	if (!lensy_queue_try_put(q, p)) {
+		__atomic_fetch_add(&s->n_full, 1, __ATOMIC_RELAXED);
+		do {
+			if (__atomic_load_n(&w->abort, __ATOMIC_RELAXED)) return false;
+			sched_yield();
+		} while (!lensy_queue_try_put(q, p));
+	}
+
+	n = __atomic_load_n(&q->head, __ATOMIC_RELAXED) -
+		__atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	if (n < 0) n = 0;
+	__atomic_fetch_add(&s->n_put, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s->occupancy_sum, n, __ATOMIC_RELAXED);
+	if (n > __atomic_load_n(&s->max, __ATOMIC_RELAXED))
+		__atomic_store_n(&s->max, n, __ATOMIC_RELAXED);
+	return true;
+}
+
+
+/*------------------------------------------------------- lensy_queue_get
+ * Get an item from the queue, waiting while it is empty.
+ *
+ * A return value of false means that the pipeline was aborted.
+ */
+static bool lensy_queue_get(struct lensy_pipeline_struct *w,
+				struct lensy_queue_struct *q, void **p)
+{
+	if (lensy_queue_try_get(q, p)) return true;
+
+	__atomic_fetch_add(&q->stats->n_empty, 1, __ATOMIC_RELAXED);
+	do {
+		if (__atomic_load_n(&w->abort, __ATOMIC_RELAXED)) return false;
+		sched_yield();
+	} while (!lensy_queue_try_get(q, p));
+	return true;
+}
+
+
+/*------------------------------------------------------- lensy_pipeline_fail
+ * Stop the pipeline after an error.
+ */
+static void lensy_pipeline_fail(struct lensy_pipeline_struct *w)
+{
+	__atomic_store_n(&w->rc, -1, __ATOMIC_RELAXED);
+	__atomic_store_n(&w->abort, 1, __ATOMIC_RELAXED);
+}
+
+
+/*------------------------------------------------------- lensy_generator_thread
+ * Fill free chunks with rays from the source, until it has no more. Then
+ * send one NULL to each tracer, to stop it.
+ */
+static void *lensy_generator_thread(void *arg)
+{
+	struct lensy_pipeline_struct *w = arg;
+	struct lensy_chunk_struct *c;
+	uint64_t seq;
+	int32_t i, n;
+
+	for (seq = 0; ; seq++) {
+		if (!lensy_queue_get(w, &w->q[LENSY_PIPE_FREE], (void **) &c)) return NULL;
+
+		c->b.n = 0;
+		if (lensy_bundle_reserve(&c->b, w->chunk) < 0) {
+			fprintf(stderr, "%s: realloc failed\n", __func__);
+			lensy_pipeline_fail(w);
+			return NULL;
+		}
+		n = w->source(w->arg, &c->b, w->chunk);
+		if (n < 0) {
+			lensy_pipeline_fail(w);
+			return NULL;
+		}
+		if (n == 0) break;
+
+		c->seq = seq;
+		w->st->n_in += c->b.n;
+		if (!lensy_queue_put(w, &w->q[LENSY_PIPE_TRACE], c)) return NULL;
+	}
+
+	for (i = 0; i < w->n_tracers; i++)
+		if (!lensy_queue_put(w, &w->q[LENSY_PIPE_TRACE], NULL)) return NULL;
+	return NULL;
+}
+
+
+/*------------------------------------------------------- lensy_tracer_thread
+ * Trace chunks, and pass them to the accumulators. The last tracer to stop
+ * sends a NULL to each accumulator, to stop it.
+ */
+static void *lensy_tracer_thread(void *arg)
+{
+	struct lensy_pipeline_struct *w = arg;
+	struct lensy_chunk_struct *c;
+
+	for (;;) {
+		if (!lensy_queue_get(w, &w->q[LENSY_PIPE_TRACE], (void **) &c)) return NULL;
+		if (c == NULL) break;
+
+		if (lensy_trace(&w->sys, &c->b) < 0) {
+			fprintf(stderr, "%s: ray trace failed\n", __func__);
+			lensy_pipeline_fail(w);
+			return NULL;
+		}
+		__atomic_fetch_add(&w->st->n_out, c->b.n, __ATOMIC_RELAXED);
+
+		c->refs = w->n_accumulators;
+		if (w->st->ccd != NULL)
+			if (!lensy_queue_put(w, &w->q[LENSY_PIPE_CCD], c)) return NULL;
+		if (w->st->spots != NULL)
+			if (!lensy_queue_put(w, &w->q[LENSY_PIPE_SPOTS], c)) return NULL;
+		if (w->n_accumulators == 0)
+			if (!lensy_queue_put(w, &w->q[LENSY_PIPE_FREE], c)) return NULL;
+	}
+
+	if (__atomic_sub_fetch(&w->tracers_left, 1, __ATOMIC_ACQ_REL) == 0) {
+		if (w->st->ccd != NULL) lensy_queue_put(w, &w->q[LENSY_PIPE_CCD], NULL);
+		if (w->st->spots != NULL) lensy_queue_put(w, &w->q[LENSY_PIPE_SPOTS], NULL);
+	}
+	return NULL;
+}
+
+
+/*------------------------------------------------------- lensy_accumulate
+ * Add the traced chunks from the queue 'k' (LENSY_PIPE_CCD or
+ * LENSY_PIPE_SPOTS) to the results, in the order that they were made.
+ * Chunks that arrive early are held in 'early', by sequence number.
+ */
+static void lensy_accumulate(struct lensy_pipeline_struct *w, int32_t k)
+{
+	struct lensy_chunk_struct *c, **early;
+	uint64_t next;
+	int32_t slot;
+
+	early = (struct lensy_chunk_struct **) calloc(w->n_chunks, sizeof(*early));
+	if (early == NULL) {
+		fprintf(stderr, "%s: calloc failed\n", __func__);
+		lensy_pipeline_fail(w);
+		return;
+	}
+
+	for (next = 0; ; ) {
+		if (!lensy_queue_get(w, &w->q[k], (void **) &c)) break;
+		if (c == NULL) break;
+
+		early[c->seq % w->n_chunks] = c;
+		for (;;) {
+			slot = next % w->n_chunks;
+			c = early[slot];
+			if ((c == NULL) || (c->seq != next)) break;
+			early[slot] = NULL;
+			next++;
+
+			if (k == LENSY_PIPE_CCD) {
+				lensy_ccd_add(w->st->ccd, &c->b, w->st->ccd_value);
+			} else if (lensy_spotsum_add(w->st->spots, &c->b) < 0) {
+				lensy_pipeline_fail(w);
+				free(early);
+				return;
+			}
+
+			if ((__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) == 0) &&
+			    !lensy_queue_put(w, &w->q[LENSY_PIPE_FREE], c)) {
+				free(early);
+				return;
+			}
+		}
+	}
+	free(early);
+}
+
+
+/*------------------------------------------------------- lensy_ccd_thread
+ * The CCD accumulator.
+ */
+static void *lensy_ccd_thread(void *arg)
+{
+	lensy_accumulate((struct lensy_pipeline_struct *) arg, LENSY_PIPE_CCD);
+	return NULL;
+}
+
+
+/*------------------------------------------------------- lensy_spots_thread
+ * The spot statistics accumulator.
+ */
+static void *lensy_spots_thread(void *arg)
+{
+	lensy_accumulate((struct lensy_pipeline_struct *) arg, LENSY_PIPE_SPOTS);
+	return NULL;
+}
+
+
+/*------------------------------------------------------- lensy_stream_pipeline
+ * Do the same as lensy_stream(), with a generator thread that calls the
+ * source, 'n_tracers' threads (one for each processor if n_tracers <= 0)
+ * that trace the chunks, and one thread each for adding the chunks to
+ * st->ccd and to st->spots. The source is only called from the generator
+ * thread. The line() function of the system is not called.
+ *
+ * The statistics of the queues are returned in st->queue[]. The chunks
+ * are allocated for the run, and st->b is not used.
+ *
+ * A return value of zero means OK.
+ * A return value of -1 means an error in the source, the trace, malloc,
+ * or pthread_create.
+ */
+int32_t lensy_stream_pipeline(struct lensy_system_struct *sys,
+				int32_t (*source)(void *arg, struct lensy_bundle_struct *b,
+						int32_t nmax),
+				void *arg, int32_t chunk, int32_t n_tracers,
+				struct lensy_stream_struct *st)
+{
+	struct lensy_pipeline_struct *w;
+	struct lensy_chunk_struct *chunks;
+	pthread_t *threads;
+	int32_t i, n, n_threads;
+
+	if (chunk <= 0) chunk = LENSY_STREAM_CHUNK;
+	if (n_tracers <= 0) n_tracers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n_tracers < 1) n_tracers = 1;
+	n_threads = n_tracers + 1 + (st->ccd != NULL) + (st->spots != NULL);
+
+	w = (struct lensy_pipeline_struct *) calloc(1, sizeof(*w));
+	threads = (pthread_t *) malloc(n_threads * sizeof(pthread_t));
+	chunks = NULL;
+	if ((w == NULL) || (threads == NULL)) {
+		fprintf(stderr, "%s: malloc failed\n", __func__);
+		free(w);
+		free(threads);
+		return -1;
+	}
+
+	memcpy(&w->sys, sys, sizeof(w->sys));
+	w->sys.line = NULL;
+	w->sys.reject = NULL;	// several tracers, and the counts are not locked
+	w->sys.budget = NULL;
+	w->source = source;
+	w->arg = arg;
+	w->chunk = chunk;
+	w->n_tracers = n_tracers;
+	w->n_chunks = 2 * n_tracers + 4;
+	w->st = st;
+	w->n_accumulators = (st->ccd != NULL) + (st->spots != NULL);
+	w->tracers_left = n_tracers;
+
+	//------ the queues, and the chunks in the free queue
+	n = w->n_chunks + n_tracers + 1;
+	for (i = 0; i < LENSY_PIPE_NQUEUES; i++)
+		if (lensy_queue_init(&w->q[i], n, &st->queue[i]) < 0) w->rc = -1;
+	chunks = (struct lensy_chunk_struct *) calloc(w->n_chunks, sizeof(*chunks));
+	if ((w->rc < 0) || (chunks == NULL)) {
+		fprintf(stderr, "%s: malloc failed\n", __func__);
+		w->rc = -1;
+		goto done;
+	}
+	for (i = 0; i < w->n_chunks; i++)
+		lensy_queue_try_put(&w->q[LENSY_PIPE_FREE], &chunks[i]);
+
+	//------ start the threads
+	n = 0;
+	if (pthread_create(&threads[n], NULL, lensy_generator_thread, w) == 0) n++;
+	if ((st->ccd != NULL) &&
+	    (pthread_create(&threads[n], NULL, lensy_ccd_thread, w) == 0)) n++;
+	if ((st->spots != NULL) &&
+	    (pthread_create(&threads[n], NULL, lensy_spots_thread, w) == 0)) n++;
+	for (i = 0; i < n_tracers; i++)
+		if (pthread_create(&threads[n], NULL, lensy_tracer_thread, w) == 0) n++;
+	if (n < n_threads) {
+		fprintf(stderr, "%s: pthread_create failed\n", __func__);
+		lensy_pipeline_fail(w);
+	}
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+
+done:
+	for (i = 0; i < LENSY_PIPE_NQUEUES; i++) {
+		if (st->queue[i].n_put > 0)
+			st->queue[i].occupancy = (double) st->queue[i].occupancy_sum /
+							st->queue[i].n_put;
+		free(w->q[i].cell);
+	}
+	if (chunks != NULL)
+		for (i = 0; i < w->n_chunks; i++)
+			lensy_bundle_free(&chunks[i].b);
+	free(chunks);
+	free(threads);
+	n = w->rc;
+	free(w);
+	return n;
+}
@@ -0,0 +1,438 @@
+/*
+ * lensy_rayfile.c - v1.4 (codename FlamingMarshmallow)
+ *
+ * Library functions for saving a ray bundle to a binary file, and for
+ * loading it back with mmap.
+ *
+ *-----------------------------------------------------------------------
+ * Copyright (C) 2013 - 2015 FSF
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *-----------------------------------------------------------------------
+ *
+ * A ray file holds the rays of a bundle at some stage of a trace (e.g.,
+ * at the focal plane of a telescope), so that they can be the input of
+ * another system, or kept as a reference. The file is the 128 byte
+ * header, followed by the columns of the bundle. Each column starts at a
+ * multiple of 64 bytes, and the numbers are in the byte order of the
+ * machine that wrote the file (the header field 'byte_order' tells which).
+ *
+ *	offset	size	header field
+ *	0	8	magic, "LENSYRAY"
+ *	8	4	version (2; version 1 files have no weight column)
+ *	12	4	byte_order, 0x01020304 as written
+ *	16	8	n, the number of rays
+ *	24	4	units, LENSY_UNITS_METERS: positions and wavelengths
+ *			in meters, directions are unit vectors
+ *	28	4	path_schema, LENSY_PATH_SCHEMA_ORDER8: the path
+ *			identifier is the source number, shifted left by 8
+ *			bits for each grating with more than one order, and
+ *			the order added (see LENSY_PATH_ORDER)
+ *	32	4	format, LENSY_RAYFILE_BUNDLE (0) or LENSY_RAYFILE_PACKED
+ *	36	4	n_wl, the number of wavelengths (packed)
+ *	40	24	reserved (zero)
+ *	64	64	comment, a 0 terminated text
+ *
+ * The columns of a LENSY_RAYFILE_BUNDLE file, in order, are p[0], p[1],
+ * p[2], d[0], d[1], d[2] and wavelength (n doubles each), path (n
+ * uint64_t), weight (n doubles), and red, green and blue (n bytes each).
+ *
+ * A LENSY_RAYFILE_PACKED file has the columns of a packed bundle (see
+ * lensy_packed.c): wl_table (n_wl doubles), origin[0], origin[1] and
+ * origin[2] (a double for each chunk of LENSY_PACK_CHUNK rays), p[0],
+ * p[1] and p[2] (n floats each), d[0] and d[1] (n uint32_t each), wl
+ * (n uint16_t), path (n uint64_t), weight (n floats), and red, green
+ * and blue.
+ *
+ * lensy_rayfile_map() maps a ray file without reading or converting it,
+ * and gives a bundle whose columns point into the mapped file. The rays
+ * of a packed file are unpacked into a bundle of their own. The rays of a
+ * version 1 file get a weight of 1.
+ *
+ * Send questions or contributions to me at <michael.h.williamson@gmail.com>.
+ *
+ * History:
+ *
+ *  2026-10-16  The mapped bundle is borrowed, so it can be traced through
+ *              a fan of grating orders.
+ *  2026-10-16  Version 2, with the weight column.
+ *  2026-10-16  This file is created.
+ */
+
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <lensy.h>
+
+
+#define	LENSY_RAYFILE_MAGIC	"LENSYRAY"
+#define	LENSY_RAYFILE_VERSION	2
+#define	LENSY_BYTE_ORDER	0x01020304
+
+
+/*------------------------------------------------------- ray file header
+ */
+struct lensy_rayfile_header_struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint64_t n;
+	uint32_t units;
+	uint32_t path_schema;
+	uint32_t format;
+	uint32_t n_wl;
+	char reserved[24];
+	char comment[64];
+};
+
+
+/*------------------------------------------------------- lensy_rayfile_columns
+ * Set the number of bytes of each of the columns of a ray file with the
+ * header 'h', and return the number of columns.
+ */
+static int32_t lensy_rayfile_columns(struct lensy_rayfile_header_struct *h,
+				size_t len[LENSY_RAYFILE_NMAX_COLUMNS])
+{
+	uint64_t n, n_chunks;
+	int32_t k;
+
+	n = h->n;
+	k = 0;
+	if (h->format == LENSY_RAYFILE_PACKED) {
+		n_chunks = (n + LENSY_PACK_CHUNK - 1) / LENSY_PACK_CHUNK;
+		len[k++] = h->n_wl * sizeof(double);
+		len[k++] = n_chunks * sizeof(double);
+		len[k++] = n_chunks * sizeof(double);
+		len[k++] = n_chunks * sizeof(double);
+		len[k++] = n * sizeof(float);
+		len[k++] = n * sizeof(float);
+		len[k++] = n * sizeof(float);
+		len[k++] = n * sizeof(uint32_t);
+		len[k++] = n * sizeof(uint32_t);
+		len[k++] = n * sizeof(uint16_t);
+	} else {
+		while (k < 7) len[k++] = n * sizeof(double);
+	}
+	len[k++] = n * sizeof(uint64_t);
+	if (h->version >= 2)
+		len[k++] = n * ((h->format == LENSY_RAYFILE_PACKED) ? sizeof(float) : sizeof(double));
+	len[k++] = n;
+	len[k++] = n;
+	len[k++] = n;
+	return k;
+}
+
+
+/*------------------------------------------------------- lensy_rayfile_offsets
+ * Find the offsets of the 'n_cols' columns of 'len' bytes in a ray file,
+ * and return the size of the file.
+ */
+static size_t lensy_rayfile_offsets(int32_t n_cols, size_t *len, size_t *off)
+{
+	size_t size;
+	int32_t k;
+
+	size = sizeof(struct lensy_rayfile_header_struct);
+	for (k = 0; k < n_cols; k++) {
+		off[k] = size;
+		size += len[k];
+		size = (size + 63) & ~(size_t) 63;
+	}
+	return size;
+}
+
+
+/*------------------------------------------------------- lensy_rayfile_header
+ * Fill in the header of a ray file.
+ */
+static void lensy_rayfile_header(struct lensy_rayfile_header_struct *h,
+				uint64_t n, uint32_t format, uint32_t n_wl,
+				const char *comment)
+{
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, LENSY_RAYFILE_MAGIC, sizeof(h->magic));
+	h->version = LENSY_RAYFILE_VERSION;
+	h->byte_order = LENSY_BYTE_ORDER;
+	h->n = n;
+	h->units = LENSY_UNITS_METERS;
+	h->path_schema = LENSY_PATH_SCHEMA_ORDER8;
+	h->format = format;
+	h->n_wl = n_wl;
+	if (comment != NULL) strncpy(h->comment, comment, sizeof(h->comment) - 1);
+}
+
+
+/*------------------------------------------------------- lensy_rayfile_put
+ * Write the header 'h' and the columns 'col' to the ray file 'path'.
+ *
+ * A return value of zero means OK, and -1 means that the file could not
+ * be written.
+ */
+static int32_t lensy_rayfile_put(const char *path,
+				struct lensy_rayfile_header_struct *h, void **col)
+{
+	static const char zeros[64];
+	size_t len[LENSY_RAYFILE_NMAX_COLUMNS], off[LENSY_RAYFILE_NMAX_COLUMNS];
+	size_t pos, size, k_len;
+	int32_t k, n_cols, rc;
+	FILE *fp;
+
+	n_cols = lensy_rayfile_columns(h, len);
+	size = lensy_rayfile_offsets(n_cols, len, off);
+
+	fp = fopen(path, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "%s: fopen %s failed\n", __func__, path);
+		return -1;
+	}
+
+	rc = (fwrite(h, sizeof(*h), 1, fp) == 1) ? 0 : -1;
+	pos = sizeof(*h);
+	for (k = 0; (k <= n_cols) && (rc == 0); k++) {
+		while ((pos < ((k < n_cols) ? off[k] : size)) && (rc == 0)) {
+			k_len = ((k < n_cols) ? off[k] : size) - pos;
+			if (k_len > sizeof(zeros)) k_len = sizeof(zeros);
+			rc = (fwrite(zeros, 1, k_len, fp) == k_len) ? 0 : -1;
+			pos += k_len;
+		}
+		if ((k < n_cols) && (len[k] > 0) && (fwrite(col[k], 1, len[k], fp) != len[k]))
+			rc = -1;
+		if (k < n_cols) pos += len[k];
+	}
+
+	if (fclose(fp) != 0) rc = -1;
+	if (rc < 0) fprintf(stderr, "%s: write %s failed\n", __func__, path);
+	return rc;
+}
+
+
+/*------------------------------------------------------- lensy_rayfile_write
+ * Write the rays of bundle 'b' to the ray file 'path', with the text
+ * 'comment' (may be NULL) in the header.
+ *
+ * A return value of zero means OK, and -1 means that the file could not
+ * be written.
+ */
+int32_t lensy_rayfile_write(const char *path, struct lensy_bundle_struct *b,
+				const char *comment)
+{
+	struct lensy_rayfile_header_struct h;
+	void *col[LENSY_RAYFILE_NMAX_COLUMNS];
+
+	lensy_rayfile_header(&h, b->n, LENSY_RAYFILE_BUNDLE, 0, comment);
+	col[0] = b->p[0];
+	col[1] = b->p[1];
+	col[2] = b->p[2];
+	col[3] = b->d[0];
+	col[4] = b->d[1];
+	col[5] = b->d[2];
+	col[6] = b->wavelength;
+	col[7] = b->path;
+	col[8] = b->weight;
+	col[9] = b->red;
+	col[10] = b->green;
+	col[11] = b->blue;
+	return lensy_rayfile_put(path, &h, col);
+}
+
+
+/*------------------------------------------------------- lensy_rayfile_write_packed
+ * Write the rays of the packed bundle 'pk' to the ray file 'path', with
+ * the text 'comment' (may be NULL) in the header.
+ *
+ * A return value of zero means OK, and -1 means that the file could not
+ * be written.
+ */
+int32_t lensy_rayfile_write_packed(const char *path, struct lensy_packed_struct *pk,
+				const char *comment)
+{
+	struct lensy_rayfile_header_struct h;
+	void *col[LENSY_RAYFILE_NMAX_COLUMNS];
+
+	lensy_rayfile_header(&h, pk->n, LENSY_RAYFILE_PACKED, pk->n_wl, comment);
+	col[0] = pk->wl_table;
+	col[1] = pk->origin[0];
+	col[2] = pk->origin[1];
+	col[3] = pk->origin[2];
+	col[4] = pk->p[0];
+	col[5] = pk->p[1];
+	col[6] = pk->p[2];
+	col[7] = pk->d[0];
+	col[8] = pk->d[1];
+	col[9] = pk->wl;
+	col[10] = pk->path;
+	col[11] = pk->weight;
+	col[12] = pk->red;
+	col[13] = pk->green;
+	col[14] = pk->blue;
+	return lensy_rayfile_put(path, &h, col);
+}
+
+
+/*------------------------------------------------------- lensy_rayfile_map
+ * Map the ray file 'path'. The bundle rf->b then has the rays of the
+ * file, with its columns in the mapped memory. The mapping is private
+ * (copy on write), so the rays can be changed in place.
+ *
+ * The rays of a packed file are in rf->pk, in the mapped memory, and
+ * they are unpacked into rf->b, which then belongs to rf. The rays of a
+ * bundle file stay in the mapped memory, and rf->b is borrowed (see
+ * lensy_bundle_reserve()), so that it is copied before it grows. A version 1
+ * bundle file has no weight column, so rf->b gets one of its own, with
+ * all of the weights 1.
+ *
+ * A return value of zero means OK.
+ * A return value of -1 means that the file could not be opened or mapped.
+ * A return value of -2 means that it is not a ray file of this machine.
+ */
+int32_t lensy_rayfile_map(const char *path, struct lensy_rayfile_struct *rf)
+{
+	struct lensy_rayfile_header_struct *h;
+	struct lensy_packed_struct *pk;
+	struct stat st;
+	size_t len[LENSY_RAYFILE_NMAX_COLUMNS], off[LENSY_RAYFILE_NMAX_COLUMNS];
+	uint32_t w;
+	int32_t i, k;
+	char *p;
+	int fd;
+
+	memset(rf, 0, sizeof(*rf));
+
+	fd = open(path, O_RDONLY);
+	if ((fd < 0) || (fstat(fd, &st) < 0)) {
+		fprintf(stderr, "%s: open %s failed\n", __func__, path);
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+	if (st.st_size < sizeof(*h)) {
+		close(fd);
+		fprintf(stderr, "%s: %s is not a ray file\n", __func__, path);
+		return -2;
+	}
+
+	p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap %s failed\n", __func__, path);
+		return -1;
+	}
+	rf->map = p;
+	rf->size = st.st_size;
+
+	h = (struct lensy_rayfile_header_struct *) p;
+	if ((memcmp(h->magic, LENSY_RAYFILE_MAGIC, sizeof(h->magic)) != 0) ||
+	    (h->version < 1) || (h->version > LENSY_RAYFILE_VERSION) ||
+	    (h->byte_order != LENSY_BYTE_ORDER) || (h->n > INT32_MAX) ||
+	    ((h->format != LENSY_RAYFILE_BUNDLE) && (h->format != LENSY_RAYFILE_PACKED)) ||
+	    (h->n_wl > LENSY_NMAX_WAVELENGTHS) ||
+	    (lensy_rayfile_offsets(lensy_rayfile_columns(h, len), len, off) > st.st_size)) {
+		fprintf(stderr, "%s: %s is not a ray file of this machine\n", __func__, path);
+		lensy_rayfile_unmap(rf);
+		return -2;
+	}
+
+	rf->units = h->units;
+	rf->path_schema = h->path_schema;
+	memcpy(rf->comment, h->comment, sizeof(rf->comment));
+	rf->comment[sizeof(rf->comment) - 1] = 0;
+	rf->format = h->format;
+
+	if (h->format == LENSY_RAYFILE_PACKED) {
+		pk = &rf->pk;
+		pk->n = pk->nmax = h->n;
+		pk->borrowed = true;
+		pk->n_wl = h->n_wl;
+		pk->wl_table = (double *) (p + off[0]);
+		pk->origin[0] = (double *) (p + off[1]);
+		pk->origin[1] = (double *) (p + off[2]);
+		pk->origin[2] = (double *) (p + off[3]);
+		pk->p[0] = (float *) (p + off[4]);
+		pk->p[1] = (float *) (p + off[5]);
+		pk->p[2] = (float *) (p + off[6]);
+		pk->d[0] = (uint32_t *) (p + off[7]);
+		pk->d[1] = (uint32_t *) (p + off[8]);
+		pk->wl = (uint16_t *) (p + off[9]);
+		pk->path = (uint64_t *) (p + off[10]);
+		k = 11;
+		pk->weight = (h->version >= 2) ? (float *) (p + off[k++]) : NULL;
+		pk->red = p + off[k++];
+		pk->green = p + off[k++];
+		pk->blue = p + off[k++];
+
+		for (w = 0; w < pk->n; w++) {
+			if (pk->wl[w] < pk->n_wl) continue;
+			fprintf(stderr, "%s: %s has a bad wavelength index\n", __func__, path);
+			lensy_rayfile_unmap(rf);
+			return -2;
+		}
+		if (lensy_unpack(&rf->b, pk) < 0) {
+			lensy_rayfile_unmap(rf);
+			return -1;
+		}
+		return 0;
+	}
+
+	rf->b.n = rf->b.nmax = h->n;
+	rf->b.borrowed = true;
+	rf->b.p[0] = (double *) (p + off[0]);
+	rf->b.p[1] = (double *) (p + off[1]);
+	rf->b.p[2] = (double *) (p + off[2]);
+	rf->b.d[0] = (double *) (p + off[3]);
+	rf->b.d[1] = (double *) (p + off[4]);
+	rf->b.d[2] = (double *) (p + off[5]);
+	rf->b.wavelength = (double *) (p + off[6]);
+	rf->b.path = (uint64_t *) (p + off[7]);
+	k = 8;
+	if (h->version >= 2) {
+		rf->b.weight = (double *) (p + off[k++]);
+	} else {
+		rf->weight = (double *) malloc((h->n > 0 ? h->n : 1) * sizeof(double));
+		if (rf->weight == NULL) {
+			fprintf(stderr, "%s: malloc failed\n", __func__);
+			lensy_rayfile_unmap(rf);
+			return -1;
+		}
+		for (i = 0; i < h->n; i++) rf->weight[i] = 1.0;
+		rf->b.weight = rf->weight;
+	}
+	rf->b.red = p + off[k++];
+	rf->b.green = p + off[k++];
+	rf->b.blue = p + off[k++];
+	return 0;
+}
+
+
+/*------------------------------------------------------- lensy_rayfile_unmap
+ * Unmap a ray file. The bundle rf->b, borrowed or not, must not be used
+ * after this.
+ */
+void lensy_rayfile_unmap(struct lensy_rayfile_struct *rf)
+{
+	lensy_bundle_free(&rf->b);
+	free(rf->weight);
+	if (rf->map != NULL) munmap(rf->map, rf->size);
+	memset(rf, 0, sizeof(*rf));
+}
@@ -0,0 +1,495 @@
+/*
+ * lensy_server.c - v1.4 (codename FlamingMarshmallow)
+ *
+ * Library functions for a trace server on a UNIX domain socket, and for
+ * the clients that send it trace jobs.
+ *
+ *-----------------------------------------------------------------------
+ * Copyright (C) 2013 - 2015 FSF
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *-----------------------------------------------------------------------
+ *
+ * A server program sets up its optical systems, and the rays for each of
+ * them, once, adds them to the server with lensy_server_add(), and then
+ * calls lensy_server_run(). A client connects with lensy_client_open()
+ * and sends jobs with lensy_client_trace(). A job names a system, and
+ * may move surfaces of it (parameter overrides) and use fewer rays.
+ *
+ * The server keeps, for each system, the rays traced up to the first
+ * element that the last job changed. A following job that only changes
+ * the same element, or later ones, starts from there, e.g., in a focus
+ * search.
+ *
+ * The results (the spot table, and the CCD frame if the system has a
+ * CCD) are written to a shared memory object, which is passed to the
+ * client with the reply (SCM_RIGHTS), and mapped by the client.
+ *
+ * The server handles one connection at a time, and traces the jobs one
+ * after the other in the calling thread (there is no thread pool); to
+ * trace jobs in parallel, run several servers. It does not change the
+ * signal handling of the program: a write to a closed connection fails
+ * with EPIPE instead of raising SIGPIPE. Client and server must run on
+ * the same machine, from the same build of the library, since the job
+ * structure is sent as it is.
+ *
+ * Send questions or contributions to me at <michael.h.williamson@gmail.com>.
+ *
+ * History:
+ *
+ *  2026-10-16  SIGPIPE is avoided with MSG_NOSIGNAL, instead of being
+ *              ignored for the whole program.
+ *  2026-10-16  A job does not sum a throughput budget (sys->budget) of
+ *              the served system.
+ *  2026-10-16  This file is created.
+ */
+
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <lensy.h>
+
+
+/*------------------------------------------------------- reply structure
+ * The reply to a job, sent before the shared memory object.
+ */
+struct lensy_reply_struct {
+	int32_t rc;
+	int32_t n_rays;
+	int32_t n_spots;
+	int32_t x_nmax, y_nmax;
+	uint64_t size;			// size of the shared memory object
+};
+
+
+/*------------------------------------------------------- lensy_io
+ * Read or write exactly 'len' bytes. Writing to a connection that the
+ * other side closed fails (MSG_NOSIGNAL) instead of raising SIGPIPE. The
+ * return value is zero, or -1 if the connection is closed or failed.
+ */
+static int32_t lensy_io(int fd, void *p, size_t len, bool out)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = out ? send(fd, p, len, MSG_NOSIGNAL) : recv(fd, p, len, 0);
+		if (n <= 0) return -1;
+		p = (char *) p + n;
+		len -= n;
+	}
+	return 0;
+}
+
+
+/*------------------------------------------------------- lensy_shm_create
+ * Create an unnamed shared memory object of 'size' bytes, and map it.
+ * The return value is the file descriptor, or -1 on error.
+ */
+static int lensy_shm_create(size_t size, void **map)
+{
+	char name[64];
+	static int32_t seq;
+	int fd;
+
+	snprintf(name, sizeof(name), "/lensy.%d.%d", (int) getpid(), seq++);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) return -1;
+	shm_unlink(name);
+
+	if (ftruncate(fd, size) < 0) {
+		close(fd);
+		return -1;
+	}
+	*map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (*map == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+
+/*------------------------------------------------------- lensy_server_init
+ * Create the server socket at 'path' (an old socket file there is
+ * removed). No systems are added yet.
+ *
+ * A return value of zero means OK, and -1 means an error.
+ */
+int32_t lensy_server_init(struct lensy_server_struct *srv, const char *path)
+{
+	struct sockaddr_un addr;
+
+	memset(srv, 0, sizeof(*srv));
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: socket path too long\n", __func__);
+		return -1;
+	}
+	strcpy(srv->path, path);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	unlink(path);
+	srv->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if ((srv->fd < 0) ||
+	    (bind(srv->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) ||
+	    (listen(srv->fd, 8) < 0)) {
+		fprintf(stderr, "%s: socket %s failed\n", __func__, path);
+		if (srv->fd >= 0) close(srv->fd);
+		srv->fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+
+/*------------------------------------------------------- lensy_server_add
+ * Add the system 'sys', with the rays of bundle 'b', to the server. If
+ * 'ccd' is not NULL, a frame of the impact positions on that CCD is also
+ * returned for each job. The structures are used by the server as they
+ * are, so they must be kept by the caller.
+ *
+ * The return value is the system ID for the jobs, or -1 if the server is
+ * full.
+ */
+int32_t lensy_server_add(struct lensy_server_struct *srv,
+				struct lensy_system_struct *sys,
+				struct lensy_bundle_struct *b, struct lensy_ccd_struct *ccd)
+{
+	struct lensy_served_struct *ps;
+
+	if (srv->n >= LENSY_NMAX_SERVED) {
+		fprintf(stderr, "%s: too many systems\n", __func__);
+		return -1;
+	}
+	ps = &srv->s[srv->n];
+	memset(ps, 0, sizeof(*ps));
+	ps->sys = sys;
+	ps->b = b;
+	ps->ccd = ccd;
+	ps->i0 = -1;
+	return srv->n++;
+}
+
+
+/*------------------------------------------------------- lensy_server_apply
+ * Apply the parameter overrides of 'job' to the system 'sys'. The return
+ * value is the first element that is changed (sys->n if none), or -1 if
+ * an override is invalid.
+ */
+static int32_t lensy_server_apply(struct lensy_system_struct *sys,
+				struct lensy_job_struct *job)
+{
+	struct lensy_override_struct *o;
+	struct lensy_element_struct *e;
+	double *v;
+	int32_t i, i0;
+
+	// the count comes from the client
+	if ((job->n_overrides < 0) || (job->n_overrides > LENSY_NMAX_OVERRIDES))
+		return -1;
+
+	i0 = sys->n;
+	for (i = 0; i < job->n_overrides; i++) {
+		o = &job->o[i];
+		if ((o->element < 0) || (o->element >= sys->n)) return -1;
+		e = &sys->e[o->element];
+
+		switch (o->what) {
+		case LENSY_OVERRIDE_VERTEX:	v = e->s.plane.v;	break;
+		case LENSY_OVERRIDE_AXIS:	v = lensy_element_axis(e); break;
+		case LENSY_OVERRIDE_RULING:	v = e->a;		break;
+		default:			v = NULL;
+		}
+		if (v == NULL) return -1;
+
+		v[0] = o->value[0];
+		v[1] = o->value[1];
+		v[2] = o->value[2];
+		if (o->element < i0) i0 = o->element;
+	}
+	return i0;
+}
+
+
+/*------------------------------------------------------- lensy_server_job
+ * Trace one job, and send the reply to the client 'fd'.
+ * The return value is zero, or -1 if the connection failed.
+ */
+static int32_t lensy_server_job(struct lensy_server_struct *srv, int fd,
+				struct lensy_job_struct *job)
+{
+	struct lensy_reply_struct reply;
+	struct lensy_served_struct *ps;
+	struct lensy_system_struct *sys;
+	struct lensy_bundle_struct b;
+	struct lensy_spot_struct *spots;
+	struct lensy_ccd_struct ccd;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	void *map;
+	int32_t i, i0, n;
+	int shm;
+
+	memset(&reply, 0, sizeof(reply));
+	memset(&b, 0, sizeof(b));
+	spots = NULL;
+	shm = -1;
+	reply.rc = -1;
+
+	sys = (struct lensy_system_struct *) malloc(sizeof(*sys));
+	if ((sys == NULL) || (job->system < 0) || (job->system >= srv->n))
+		goto reply;
+	ps = &srv->s[job->system];
+
+	memcpy(sys, ps->sys, sizeof(*sys));
+	sys->line = NULL;
+	sys->reject = NULL;	// a changed copy, traced from element i0 on
+	sys->budget = NULL;
+	i0 = lensy_server_apply(sys, job);
+	if (i0 < 0) goto reply;
+
+	//------ the rays traced up to the first changed element
+	if ((ps->i0 != i0) || (ps->n_rays != job->n_rays)) {
+		if (lensy_bundle_clone(&ps->prefix, ps->b) < 0) goto reply;
+		if ((job->n_rays > 0) && (job->n_rays < ps->prefix.n))
+			ps->prefix.n = job->n_rays;
+
+		ps->i0 = -1;
+		n = sys->n;
+		sys->n = i0;
+		i = lensy_trace(sys, &ps->prefix);
+		sys->n = n;
+		if (i < 0) goto reply;
+		ps->i0 = i0;
+		ps->n_rays = job->n_rays;
+	}
+
+	if (lensy_bundle_clone(&b, &ps->prefix) < 0) goto reply;
+	reply.n_rays = lensy_trace_elements(sys, i0, sys->n, &b);
+	if (reply.n_rays < 0) goto reply;
+
+	reply.n_spots = lensy_spots(&b, &spots);
+	if (reply.n_spots < 0) goto reply;
+
+	//------ the spot table and the frame, in shared memory
+	reply.size = reply.n_spots * sizeof(*spots);
+	if (ps->ccd != NULL) {
+		reply.x_nmax = ps->ccd->x_nmax;
+		reply.y_nmax = ps->ccd->y_nmax;
+		reply.size += ps->ccd->b_size;
+	}
+	if (reply.size > 0) {
+		shm = lensy_shm_create(reply.size, &map);
+		if (shm < 0) goto reply;
+
+		memcpy(map, spots, reply.n_spots * sizeof(*spots));
+		if (ps->ccd != NULL) {
+			memcpy(&ccd, ps->ccd, sizeof(ccd));
+			ccd.b = (uint16_t *) ((char *) map + reply.n_spots * sizeof(*spots));
+			lensy_ccd_add(&ccd, &b, 100);
+		}
+		munmap(map, reply.size);
+	}
+	reply.rc = 0;
+
+reply:
+	if (reply.rc < 0) reply.size = 0;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &reply;
+	iov.iov_len = sizeof(reply);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (shm >= 0) {
+		memset(cbuf, 0, sizeof(cbuf));
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &shm, sizeof(int));
+	}
+	n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+
+	if (shm >= 0) close(shm);
+	free(spots);
+	lensy_bundle_free(&b);
+	free(sys);
+	return (n == sizeof(reply)) ? 0 : -1;
+}
+
+
+/*------------------------------------------------------- lensy_server_run
+ * Accept connections, and trace the jobs sent on them, until a job with
+ * the system ID LENSY_JOB_QUIT is received.
+ *
+ * A return value of zero means OK, and -1 means that the socket failed.
+ */
+int32_t lensy_server_run(struct lensy_server_struct *srv)
+{
+	struct lensy_job_struct job;
+	int fd;
+
+	for (;;) {
+		fd = accept(srv->fd, NULL, NULL);
+		if (fd < 0) {
+			fprintf(stderr, "%s: accept failed\n", __func__);
+			return -1;
+		}
+
+		while (lensy_io(fd, &job, sizeof(job), false) == 0) {
+			if (job.system == LENSY_JOB_QUIT) {
+				close(fd);
+				return 0;
+			}
+			if (lensy_server_job(srv, fd, &job) < 0) break;
+		}
+		close(fd);
+	}
+}
+
+
+/*------------------------------------------------------- lensy_server_close
+ * Close the server socket, and free the rays kept for the systems.
+ */
+void lensy_server_close(struct lensy_server_struct *srv)
+{
+	int32_t i;
+
+	for (i = 0; i < srv->n; i++)
+		lensy_bundle_free(&srv->s[i].prefix);
+	if (srv->fd >= 0) {
+		close(srv->fd);
+		unlink(srv->path);
+	}
+	srv->fd = -1;
+	srv->n = 0;
+}
+
+
+/*------------------------------------------------------- lensy_client_open
+ * Connect to the trace server at 'path'. The return value is the
+ * connection file descriptor, or -1 on error.
+ */
+int lensy_client_open(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) return -1;
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+
+/*------------------------------------------------------- lensy_client_trace
+ * Send the job 'job' to the trace server on the connection 'fd', and wait
+ * for the result. The spot table and the frame in 'r' are mapped shared
+ * memory, and must be released with lensy_result_free().
+ *
+ * A return value of zero means OK.
+ * A return value of -1 means that the connection failed.
+ * A return value of -2 means that the server could not trace the job.
+ */
+int32_t lensy_client_trace(int fd, struct lensy_job_struct *job,
+				struct lensy_result_struct *r)
+{
+	struct lensy_reply_struct reply;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	void *map;
+	int shm;
+
+	memset(r, 0, sizeof(*r));
+	if (lensy_io(fd, job, sizeof(*job), true) < 0) return -1;
+	if (job->system == LENSY_JOB_QUIT) return 0;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &reply;
+	iov.iov_len = sizeof(reply);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	if (recvmsg(fd, &msg, MSG_WAITALL) != sizeof(reply)) return -1;
+
+	shm = -1;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if ((cmsg != NULL) && (cmsg->cmsg_type == SCM_RIGHTS))
+		memcpy(&shm, CMSG_DATA(cmsg), sizeof(int));
+
+	r->rc = reply.rc;
+	r->n_rays = reply.n_rays;
+	r->n_spots = reply.n_spots;
+	r->x_nmax = reply.x_nmax;
+	r->y_nmax = reply.y_nmax;
+	if (reply.rc < 0) {
+		if (shm >= 0) close(shm);
+		return -2;
+	}
+
+	if ((shm >= 0) && (reply.size > 0)) {
+		map = mmap(NULL, reply.size, PROT_READ, MAP_SHARED, shm, 0);
+		close(shm);
+		if (map == MAP_FAILED) return -1;
+		r->map = map;
+		r->size = reply.size;
+		r->spots = (struct lensy_spot_struct *) map;
+		if (reply.x_nmax > 0)
+			r->frame = (uint16_t *) (r->spots + reply.n_spots);
+	}
+	return 0;
+}
+
+
+/*------------------------------------------------------- lensy_result_free
+ * Release the shared memory of a trace server result.
+ */
+void lensy_result_free(struct lensy_result_struct *r)
+{
+	if (r->map != NULL) munmap(r->map, r->size);
+	r->map = NULL;
+	r->spots = NULL;
+	r->frame = NULL;
+}
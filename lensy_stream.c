@@ -0,0 +1,244 @@
+/*
+ * lensy_stream.c - v1.4 (codename FlamingMarshmallow)
+ *
+ * Library functions for tracing any number of rays with a fixed amount of
+ * memory: the rays are made in chunks, and the results are accumulated
+ * chunk by chunk.
+ *
+ *-----------------------------------------------------------------------
+ * Copyright (C) 2013 - 2015 FSF
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *-----------------------------------------------------------------------
+ *
+ * lensy_trace() needs all of the rays in one bundle, and lensy_spots()
+ * needs all of the traced rays. For a simulation with a realistic number
+ * of photons, that is too much memory. lensy_stream() instead asks a
+ * source function for a chunk of rays at a time, traces the chunk, adds
+ * the rays to a CCD image and to the spot sums, and reuses the bundle
+ * for the next chunk. The memory needed is that of one chunk (times the
+ * number of grating orders) and of the spot sums, however many rays are
+ * traced.
+ *
+ * The spot sums use Welford's method (the running mean and the sum of
+ * squared distances from it), so that the RMS of a spot with very many
+ * rays does not lose precision.
+ *
+ * Send questions or contributions to me at <michael.h.williamson@gmail.com>.
+ *
+ * History:
+ *
+ *  2026-10-16  lensy_mix64() is shared, from lensy_hash.h.
+ *  2026-10-16  This file is created.
+ */
+
+
+#include <ctype.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <lensy.h>
+#include <lensy_hash.h>
+
+
+/*------------------------------------------------------- lensy_spotsum_init
+ * Initialize empty spot sums.
+ */
+void lensy_spotsum_init(struct lensy_spotsum_struct *s)
+{
+	memset(s, 0, sizeof(*s));
+}
+
+
+/*------------------------------------------------------- lensy_spotsum_free
+ * Free the memory of the spot sums.
+ */
+void lensy_spotsum_free(struct lensy_spotsum_struct *s)
+{
+	free(s->sum);
+	free(s->slot);
+	memset(s, 0, sizeof(*s));
+}
+
+
+/*------------------------------------------------------- lensy_spotsum_grow
+ * Double the size of the hash table of the spot sums.
+ *
+ * A return value of zero means OK, and -1 means that malloc failed.
+ */
+static int32_t lensy_spotsum_grow(struct lensy_spotsum_struct *s)
+{
+	int32_t i, n_hash, *slot;
+	uint64_t h;
+	void *pv;
+
+	n_hash = (s->n_hash > 0) ? 2 * s->n_hash : 64;
+
+	pv = realloc(s->sum, (n_hash / 2) * sizeof(*s->sum));
+	if (pv == NULL) return -1;
+	s->sum = (struct lensy_spot_struct *) pv;
+
+	slot = (int32_t *) malloc(n_hash * sizeof(int32_t));
+	if (slot == NULL) return -1;
+	memset(slot, 0xff, n_hash * sizeof(int32_t));
+
+	for (i = 0; i < s->n; i++) {
+		h = lensy_mix64(s->sum[i].path) & (n_hash - 1);
+		while (slot[h] >= 0) h = (h + 1) & (n_hash - 1);
+		slot[h] = i;
+	}
+
+	free(s->slot);
+	s->slot = slot;
+	s->n_hash = n_hash;
+	return 0;
+}
+
+
+/*------------------------------------------------------- lensy_spotsum_add
+ * Add the rays of bundle 'b' to the spot sums. Rays with the same path
+ * identifier belong to the same spot. In the sums, p[] is the running
+ * centroid, and rms_v[] the running sum of squared distances from it,
+ * both weighted by the ray weights (West's form of Welford's update), and
+ * 'weight' is the running sum of the weights.
+ *
+ * A return value of zero means OK, and -1 means that malloc failed.
+ */
+int32_t lensy_spotsum_add(struct lensy_spotsum_struct *s, struct lensy_bundle_struct *b)
+{
+	struct lensy_spot_struct *ps;
+	int32_t i, k;
+	uint64_t h;
+	double x, w, delta;
+
+	for (i = 0; i < b->n; i++) {
+		if ((2 * s->n >= s->n_hash) && (lensy_spotsum_grow(s) < 0)) {
+			fprintf(stderr, "%s: malloc failed\n", __func__);
+			return -1;
+		}
+
+		h = lensy_mix64(b->path[i]) & (s->n_hash - 1);
+		while ((s->slot[h] >= 0) && (s->sum[s->slot[h]].path != b->path[i]))
+			h = (h + 1) & (s->n_hash - 1);
+
+		if (s->slot[h] < 0) {
+			s->slot[h] = s->n;
+			memset(&s->sum[s->n], 0, sizeof(s->sum[s->n]));
+			s->sum[s->n++].path = b->path[i];
+		}
+		ps = &s->sum[s->slot[h]];
+
+		ps->n++;
+		w = b->weight[i];
+		if (w <= 0.0) continue;
+		ps->weight += w;
+		for (k = 0; k < 3; k++) {
+			x = b->p[k][i];
+			delta = x - ps->p[k];
+			ps->p[k] += w * delta / ps->weight;
+			ps->rms_v[k] += w * delta * (x - ps->p[k]);
+		}
+	}
+	return 0;
+}
+
+
+/*------------------------------------------------------- lensy_spotsum_spots
+ * Calculate the spot sizes from the spot sums, like lensy_spots(). An
+ * array of spot structures is allocated and returned in '*ps', and must
+ * be freed by the caller.
+ *
+ * The return value is the number of spots, or -1 if malloc failed.
+ */
+int32_t lensy_spotsum_spots(struct lensy_spotsum_struct *s, struct lensy_spot_struct **ps)
+{
+	struct lensy_spot_struct *spots;
+	int32_t i, k;
+	double m2;
+
+	*ps = NULL;
+	spots = (struct lensy_spot_struct *) malloc((s->n > 0 ? s->n : 1) * sizeof(*spots));
+	if (spots == NULL) return -1;
+
+	for (i = 0; i < s->n; i++) {
+		spots[i] = s->sum[i];
+		if (s->sum[i].weight <= 0.0) continue;
+		m2 = 0.0;
+		for (k = 0; k < 3; k++) {
+			m2 += s->sum[i].rms_v[k];
+			spots[i].rms_v[k] = sqrt(s->sum[i].rms_v[k] / s->sum[i].weight);
+		}
+		spots[i].rms = sqrt(m2 / s->sum[i].weight);
+	}
+
+	*ps = spots;
+	return s->n;
+}
+
+
+/*------------------------------------------------------- lensy_stream
+ * Trace the rays from the function source(arg, b, nmax) through the
+ * system 'sys', 'chunk' rays at a time. The source function must add at
+ * most nmax rays to the (empty) bundle b, and return the number of rays
+ * it added, zero when there are no more rays, or -1 on error.
+ *
+ * The rays that reach the end of the system are added to the CCD image
+ * st->ccd with st->ccd_value counts per ray (if st->ccd is not NULL), and
+ * to the spot sums st->spots (if it is not NULL). The numbers of rays made
+ * and traced are added to st->n_in and st->n_out. The bundle st->b is used
+ * for the chunks, and must be freed with lensy_bundle_free() when done.
+ *
+ * A return value of zero means OK.
+ * A return value of -1 means an error in the source, the trace or malloc.
+ */
+int32_t lensy_stream(struct lensy_system_struct *sys,
+				int32_t (*source)(void *arg, struct lensy_bundle_struct *b,
+						int32_t nmax),
+				void *arg, int32_t chunk, struct lensy_stream_struct *st)
+{
+	int32_t n;
+
+	if (chunk <= 0) chunk = LENSY_STREAM_CHUNK;
+
+	for (;;) {
+		st->b.n = 0;
+		if (lensy_bundle_reserve(&st->b, chunk) < 0) {
+			fprintf(stderr, "%s: realloc failed\n", __func__);
+			return -1;
+		}
+
+		n = source(arg, &st->b, chunk);
+		if (n < 0) return -1;
+		if (n == 0) break;
+		st->n_in += st->b.n;
+
+		if (lensy_trace(sys, &st->b) < 0) {
+			fprintf(stderr, "%s: ray trace failed\n", __func__);
+			return -1;
+		}
+		st->n_out += st->b.n;
+
+		if (st->ccd != NULL) lensy_ccd_add(st->ccd, &st->b, st->ccd_value);
+		if ((st->spots != NULL) && (lensy_spotsum_add(st->spots, &st->b) < 0))
+			return -1;
+	}
+	return 0;
+}
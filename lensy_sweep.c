@@ -0,0 +1,336 @@
+/*
+ * lensy_sweep.c - v1.4 (codename FlamingMarshmallow)
+ *
+ * Library functions for running a parameter sweep in a pool of worker
+ * processes, with the results collected in a shared memory mapped file.
+ *
+ *-----------------------------------------------------------------------
+ * Copyright (C) 2013 - 2015 FSF
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *-----------------------------------------------------------------------
+ *
+ * A sweep is a grid of 'n_points' points, numbered 0 to n_points - 1.
+ * For each point, a function supplied by the program sets up the optical
+ * system for that point, traces it, and writes a fixed size result
+ * record (for example, a spot table and a CCD frame) directly into the
+ * sweep file. The sweep file is mapped (mmap) by all of the processes:
+ *
+ *	header | status of each point | result record of each point
+ *
+ * The points are handed out to the worker processes (fork) one at a
+ * time. If a worker crashes, the point it was working on is marked as
+ * failed, and a new worker is started in its place. A point is marked
+ * done only after its result has been written to the file (msync), so
+ * the sweep file is also the checkpoint: opening it again and running
+ * the sweep again only does the points that are not done yet, e.g., after
+ * a reboot.
+ *
+ * The point function runs in a child process, so it must not use the SDL
+ * windows of the program.
+ *
+ * Send questions or contributions to me at <michael.h.williamson@gmail.com>.
+ *
+ * History:
+ *
+ *  2026-10-16  The pointers into the sweep file are made after it is
+ *              mapped, and only the worker processes are waited for.
+ *  2026-10-16  This file is created.
+ */
+
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <signal.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <lensy.h>
+
+
+#define	LENSY_SWEEP_MAGIC	"lensysw1"
+
+
+/*------------------------------------------------------- sweep file header
+ * The first part of the sweep file, shared by all of the processes.
+ */
+struct lensy_sweep_header_struct {
+	char magic[8];
+	int32_t n_points;
+	int32_t pad;
+	uint64_t result_size;
+	int32_t next;					// next point to hand out
+	int32_t current[LENSY_NMAX_WORKERS];		// point of each worker
+};
+
+
+/*------------------------------------------------------- lensy_sweep_layout
+ * Calculate the offsets of the parts of the sweep file, and set its size.
+ * The pointers into the map are made from the offsets once it is mapped.
+ */
+static void lensy_sweep_layout(struct lensy_sweep_struct *s,
+				size_t *status_off, size_t *result_off)
+{
+	*status_off = (sizeof(struct lensy_sweep_header_struct) + 63) & ~(size_t) 63;
+	*result_off = (*status_off + s->n_points + 63) & ~(size_t) 63;
+	s->size = *result_off + s->n_points * s->result_size;
+}
+
+
+/*------------------------------------------------------- lensy_sweep_sync
+ * Write the part of the mapped sweep file at 'p', of 'len' bytes, to the
+ * disk.
+ */
+static void lensy_sweep_sync(void *p, size_t len)
+{
+	uintptr_t a, page;
+
+	page = sysconf(_SC_PAGESIZE);
+	a = (uintptr_t) p & ~(page - 1);
+	msync((void *) a, (uintptr_t) p + len - a, MS_SYNC);
+}
+
+
+/*------------------------------------------------------- lensy_sweep_open
+ * Open the sweep file 'path' for a sweep of 'n_points' points with result
+ * records of 'result_size' bytes. If the file exists, it must have been
+ * made for the same n_points and result_size, and the points that are
+ * done in it are kept. Otherwise, a new file is made with no points done.
+ *
+ * A return value of zero means OK.
+ * A return value of -1 means that the file could not be opened or mapped.
+ * A return value of -2 means that the file is for a different sweep.
+ */
+int32_t lensy_sweep_open(struct lensy_sweep_struct *s, const char *path,
+				int32_t n_points, size_t result_size)
+{
+	struct lensy_sweep_header_struct *h;
+	struct stat st;
+	size_t status_off, result_off;
+	bool fresh;
+
+	memset(s, 0, sizeof(*s));
+	s->fd = -1;
+	s->n_points = n_points;
+	s->result_size = result_size;
+	lensy_sweep_layout(s, &status_off, &result_off);
+
+	s->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if ((s->fd < 0) || (fstat(s->fd, &st) < 0)) {
+		fprintf(stderr, "%s: open %s failed\n", __func__, path);
+		lensy_sweep_close(s);
+		return -1;
+	}
+
+	fresh = (st.st_size == 0);
+	if (fresh && (ftruncate(s->fd, s->size) < 0)) {
+		fprintf(stderr, "%s: ftruncate %s failed\n", __func__, path);
+		lensy_sweep_close(s);
+		return -1;
+	}
+	if (!fresh && (st.st_size != s->size)) {
+		fprintf(stderr, "%s: %s is for a different sweep\n", __func__, path);
+		lensy_sweep_close(s);
+		return -2;
+	}
+
+	s->map = mmap(NULL, s->size, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+	if (s->map == MAP_FAILED) {
+		s->map = NULL;
+		fprintf(stderr, "%s: mmap %s failed\n", __func__, path);
+		lensy_sweep_close(s);
+		return -1;
+	}
+	s->status = (uint8_t *) s->map + status_off;
+	s->results = (char *) s->map + result_off;
+	h = (struct lensy_sweep_header_struct *) s->map;
+
+	if (fresh) {
+		memcpy(h->magic, LENSY_SWEEP_MAGIC, sizeof(h->magic));
+		h->n_points = n_points;
+		h->result_size = result_size;
+		lensy_sweep_sync(h, sizeof(*h));
+	} else if ((memcmp(h->magic, LENSY_SWEEP_MAGIC, sizeof(h->magic)) != 0) ||
+		   (h->n_points != n_points) || (h->result_size != result_size)) {
+		fprintf(stderr, "%s: %s is for a different sweep\n", __func__, path);
+		lensy_sweep_close(s);
+		return -2;
+	}
+
+	return 0;
+}
+
+
+/*------------------------------------------------------- lensy_sweep_close
+ * Unmap and close the sweep file. The results stay in the file.
+ */
+void lensy_sweep_close(struct lensy_sweep_struct *s)
+{
+	if (s->map != NULL) {
+		msync(s->map, s->size, MS_SYNC);
+		munmap(s->map, s->size);
+	}
+	if (s->fd >= 0) close(s->fd);
+	s->map = NULL;
+	s->fd = -1;
+}
+
+
+/*------------------------------------------------------- lensy_sweep_result
+ * Return a pointer to the result record of point 'k' in the mapped sweep
+ * file, or NULL if the point is not done.
+ */
+void *lensy_sweep_result(struct lensy_sweep_struct *s, int32_t k)
+{
+	if ((k < 0) || (k >= s->n_points) || (s->status[k] != LENSY_SWEEP_DONE))
+		return NULL;
+	return s->results + (size_t) k * s->result_size;
+}
+
+
+/*------------------------------------------------------- lensy_sweep_worker
+ * The loop of a worker process: take the next point that is not done,
+ * and call the point function for it, until there are no points left.
+ */
+static void lensy_sweep_worker(struct lensy_sweep_struct *s, int32_t w,
+				int32_t (*point)(int32_t k, void *arg, void *result),
+				void *arg)
+{
+	struct lensy_sweep_header_struct *h;
+	char *result;
+	int32_t k;
+
+	h = (struct lensy_sweep_header_struct *) s->map;
+
+	for (;;) {
+		k = __sync_fetch_and_add(&h->next, 1);
+		if (k >= s->n_points) break;
+		if (s->status[k] == LENSY_SWEEP_DONE) continue;
+
+		h->current[w] = k;
+		result = s->results + (size_t) k * s->result_size;
+		memset(result, 0, s->result_size);
+
+		if (point(k, arg, result) == 0) {
+			lensy_sweep_sync(result, s->result_size);
+			s->status[k] = LENSY_SWEEP_DONE;
+		} else {
+			s->status[k] = LENSY_SWEEP_FAILED;
+		}
+		lensy_sweep_sync(&s->status[k], 1);
+		h->current[w] = -1;
+	}
+	_exit(0);
+}
+
+
+/*------------------------------------------------------- lensy_sweep_run
+ * Run the sweep in 'n_workers' worker processes (one for each processor if
+ * n_workers <= 0). For each point k that is not done yet, the function
+ * point(k, arg, result) is called in a worker, and it must fill in the
+ * result record (which is zeroed first) and return zero, or return
+ * non-zero if the point failed.
+ *
+ * The return value is the number of points that are done, or -1 if no
+ * worker could be started.
+ */
+int32_t lensy_sweep_run(struct lensy_sweep_struct *s, int32_t n_workers,
+				int32_t (*point)(int32_t k, void *arg, void *result),
+				void *arg)
+{
+	struct lensy_sweep_header_struct *h;
+	pid_t pid, workers[LENSY_NMAX_WORKERS];
+	int32_t i, k, w, n, status;
+
+	h = (struct lensy_sweep_header_struct *) s->map;
+
+	for (k = n = 0; k < s->n_points; k++)
+		if (s->status[k] != LENSY_SWEEP_DONE) n++;
+
+	if (n_workers <= 0) n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n_workers > LENSY_NMAX_WORKERS) n_workers = LENSY_NMAX_WORKERS;
+	if (n_workers > n) n_workers = n;
+
+	h->next = 0;
+	for (w = 0; w < LENSY_NMAX_WORKERS; w++)
+		h->current[w] = -1;
+
+	fflush(stdout);
+	fflush(stderr);
+
+	//------ start the workers
+	for (w = n = 0; w < n_workers; w++) {
+		workers[w] = fork();
+		if (workers[w] == 0) lensy_sweep_worker(s, w, point, arg);
+		if (workers[w] > 0) n++;
+	}
+	if ((n_workers > 0) && (n == 0)) {
+		fprintf(stderr, "%s: fork failed\n", __func__);
+		return -1;
+	}
+
+	/*------ wait for them, and replace the ones that crash. Only the
+	 * workers are waited for (polled), since the program may have other
+	 * children of its own.
+	 */
+	while (n > 0) {
+		pid = 0;
+		for (w = 0; w < n_workers; w++) {
+			if (workers[w] <= 0) continue;
+			pid = waitpid(workers[w], &status, WNOHANG);
+			if (pid != 0) break;
+		}
+		if (w == n_workers) {
+			usleep(10000);
+			continue;
+		}
+
+		n--;
+		workers[w] = -1;
+		if ((pid < 0) || (WIFEXITED(status) && (WEXITSTATUS(status) == 0)))
+			continue;
+
+		k = h->current[w];
+		h->current[w] = -1;
+		if ((k >= 0) && (k < s->n_points)) {
+			s->status[k] = LENSY_SWEEP_FAILED;
+			lensy_sweep_sync(&s->status[k], 1);
+		}
+		fprintf(stderr, "%s: worker crashed at point %d\n", __func__, k);
+
+		if (h->next < s->n_points) {
+			fflush(stdout);
+			fflush(stderr);
+			workers[w] = fork();
+			if (workers[w] == 0) lensy_sweep_worker(s, w, point, arg);
+			if (workers[w] > 0) n++;
+		}
+	}
+
+	msync(s->map, s->size, MS_SYNC);
+
+	for (i = k = 0; i < s->n_points; i++)
+		if (s->status[i] == LENSY_SWEEP_DONE) k++;
+	return k;
+}
@@ -0,0 +1,197 @@
+/*
+ * lensy_throughput.c - v1.4 (codename FlamingMarshmallow)
+ *
+ * Library functions for the throughput of an optical system: curves of
+ * coating and grating efficiency, and of glass absorption, against the
+ * wavelength, which set the weights of the rays.
+ *
+ *-----------------------------------------------------------------------
+ * Copyright (C) 2013 - 2015 FSF
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *-----------------------------------------------------------------------
+ *
+ * Each ray of a bundle has a weight, its share of the light, which is 1
+ * when the ray is made. Instead of dropping rays in proportion to the
+ * losses, lensy_trace() multiplies the weight at each element by
+ *
+ *	e(wl) * exp(-alpha(wl) * L)
+ *
+ * where e is the efficiency curve of the element (the reflectivity of a
+ * mirror, the transmission of an AR coated surface, or the efficiency of
+ * a grating), alpha the absorption curve (per meter) of the medium the
+ * ray crossed to reach the element, and L the length of the path in it.
+ * The medium before a refracting element is its incident medium m0, and
+ * before any other element the transmission medium m1 of the last
+ * refracting element ahead of it (none before the first one, where the
+ * rays start).
+ *
+ * A curve is looked up in constant time: the wavelength range is divided
+ * into LENSY_CURVE_NTABLE even cells, and the table gives the first
+ * segment of the curve in each cell. The tracers also keep the factors of
+ * the last wavelength (see lensy_kernel_throughput()), so a curve is
+ * only looked up when the wavelength changes from one ray to the next.
+ *
+ * The weights are applied by lensy_trace() in double precision, with the
+ * reference and fast kernel tiers. With a curve or a budget, it takes
+ * every ray through the elements itself, instead of sharing the achromatic
+ * prefix, and the orders of a fanned out grating share the weight of the
+ * ray. The other tracers do not apply the curves:
+ *
+ *	lensy_trace_fastest()	traces a weighted system with the fast tier,
+ *				instead of in single precision
+ *	lensy_trace_float()	passes the weights on unchanged, when it is
+ *				called directly
+ *	lensy_codegen_load()	refuse a weighted system, which must then be
+ *	lensy_frames_prepare()	traced by lensy_trace()
+ *	lensy_trace_nonseq()	passes the weights on unchanged
+ *	lensy_trace_ghosts()	weights the branches by the Fresnel
+ *				reflectance only
+ *
+ * Send questions or contributions to me at <michael.h.williamson@gmail.com>.
+ *
+ * History:
+ *
+ *  2026-10-16  This file is created.
+ */
+
+
+#include <ctype.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <lensy.h>
+
+
+/*------------------------------------------------------- lensy_curve_init
+ * Make 'c' the curve of the 'n' points (wl[i], v[i]), with the wavelengths
+ * in meters and increasing. The arrays are not copied, and must be kept
+ * while the curve is used.
+ *
+ * A return value of zero means OK, and -1 that the points are not valid.
+ */
+int32_t lensy_curve_init(struct lensy_curve_struct *c, int32_t n,
+				double *wl, double *v)
+{
+	int32_t i, s;
+	double x;
+
+	memset(c, 0, sizeof(*c));
+	if (n < 1) {
+		fprintf(stderr, "%s: a curve needs at least one point\n", __func__);
+		return -1;
+	}
+	for (i = 1; i < n; i++) {
+		if (wl[i] > wl[i - 1]) continue;
+		fprintf(stderr, "%s: the wavelengths must increase\n", __func__);
+		return -1;
+	}
+
+	c->n = n;
+	c->wl = wl;
+	c->v = v;
+	c->wl0 = wl[0];
+	c->scale = (n > 1) ? LENSY_CURVE_NTABLE / (wl[n - 1] - wl[0]) : 0.0;
+
+	//------ the segment at the start of each cell
+	for (i = s = 0; i < LENSY_CURVE_NTABLE; i++) {
+		x = (n > 1) ? c->wl0 + i / c->scale : c->wl0;
+		while ((s < n - 2) && (wl[s + 1] <= x)) s++;
+		c->seg[i] = s;
+	}
+	return 0;
+}
+
+
+/*------------------------------------------------------- lensy_curve_value
+ * Return the value of the curve 'c' at the wavelength 'wl' (meters).
+ */
+double lensy_curve_value(struct lensy_curve_struct *c, double wl)
+{
+	int32_t i, s;
+	double x;
+
+	if (wl <= c->wl[0]) return c->v[0];
+	if (wl >= c->wl[c->n - 1]) return c->v[c->n - 1];
+
+	x = (wl - c->wl0) * c->scale;
+	i = (x < LENSY_CURVE_NTABLE) ? (int32_t) x : LENSY_CURVE_NTABLE - 1;
+	s = c->seg[i];
+
+	// rounding may put the wavelength just outside of its cell
+	while ((s > 0) && (wl < c->wl[s])) s--;
+	while (wl > c->wl[s + 1]) s++;
+
+	return c->v[s] + (c->v[s + 1] - c->v[s]) * (wl - c->wl[s]) /
+			(c->wl[s + 1] - c->wl[s]);
+}
+
+
+/*------------------------------------------------------- lensy_element_medium
+ * Return the medium that the rays cross to reach element 'j' of the
+ * system, or NULL before the first refracting element.
+ */
+struct lensy_medium_struct *lensy_element_medium(struct lensy_system_struct *sys,
+				int32_t j)
+{
+	int32_t i;
+
+	if (sys->e[j].redirect == LENSY_REFRACT) return sys->e[j].m0;
+	for (i = j - 1; i >= 0; i--)
+		if (sys->e[i].redirect == LENSY_REFRACT) return sys->e[i].m1;
+	return NULL;
+}
+
+
+/*------------------------------------------------------- lensy_throughput_init
+ * Set up 't' for the throughput of element 'j' of the system.
+ */
+void lensy_throughput_init(struct lensy_throughput_struct *t,
+				struct lensy_system_struct *sys, int32_t j)
+{
+	struct lensy_medium_struct *m;
+
+	m = lensy_element_medium(sys, j);
+	t->efficiency = sys->e[j].efficiency;
+	t->absorption = (m != NULL) ? m->absorption : NULL;
+	t->on = (t->efficiency != NULL) || (t->absorption != NULL);
+	t->wl = -1.0;
+	t->f = 1.0;
+	t->alpha = 0.0;
+}
+
+
+/*------------------------------------------------------- lensy_system_weighted
+ * Return true if tracing the system changes the ray weights, or sums them
+ * (sys->budget).
+ */
+bool lensy_system_weighted(struct lensy_system_struct *sys)
+{
+	struct lensy_throughput_struct t;
+	int32_t j;
+
+	if (sys->budget != NULL) return true;
+	for (j = 0; j < sys->n; j++) {
+		lensy_throughput_init(&t, sys, j);
+		if (t.on) return true;
+	}
+	return false;
+}
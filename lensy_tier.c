@@ -0,0 +1,348 @@
+/*
+ * lensy_tier.c - v1.4 (codename FlamingMarshmallow)
+ *
+ * Library functions for the kernel tiers, which trade accuracy for speed,
+ * and for checking what a tier costs in accuracy for a given system.
+ *
+ *-----------------------------------------------------------------------
+ * Copyright (C) 2013 - 2015 FSF
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *-----------------------------------------------------------------------
+ *
+ * The tier of a system (sys->tier) selects the kernels of lensy_trace(),
+ * lensy_trace_elements() and lensy_trace_configs() (the last two use the
+ * fast tier for LENSY_TIER_FASTEST):
+ *
+ *	LENSY_TIER_REFERENCE	the lensy_intersect_X() and lensy_redirect_Y()
+ *				math of lensy.c (and the fused functions,
+ *				which agree with it to rounding).
+ *
+ *	LENSY_TIER_FAST		the same intersections, in double. Refraction
+ *				uses the vector form of Snell's law, and
+ *				diffraction solves the grating equation for
+ *				the sine directly, without asin(), atan2(),
+ *				sin() and cos(). The dispersion formula of
+ *				lensy_index_of_refraction() is in Horner form,
+ *				without pow(). This file is compiled with
+ *				TIERFLAGS (see the Makefile), which allow the
+ *				compiler to contract a * b + c into an FMA
+ *				where the target has one.
+ *
+ *	LENSY_TIER_FASTEST	single precision (lensy_trace_float(), see
+ *				lensy_float.c), with the index of LENSY_TIER_FAST.
+ *
+ * The fast tier is the same math as the reference, in another order, so
+ * its rays differ by rounding: for the telescope and the spectrograph,
+ * a few femtometers at the focal plane. The fastest tier differs by the
+ * rounding of floats, which is about 1e-7 of the size of the system for
+ * positions and 1e-7 radians for directions: well under a micron for the
+ * spectrograph, and up to a few microns for a long focal length telescope.
+ *
+ * For a system and a bundle, lensy_tier_report() measures the largest
+ * spot centroid shift and RMS change of a tier, and lensy_tier_select()
+ * picks the fastest tier that is within a tolerance.
+ *
+ * Send questions or contributions to me at <michael.h.williamson@gmail.com>.
+ *
+ * History:
+ *
+ *  2026-10-16  This file is created.
+ */
+
+
+#include <ctype.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <lensy.h>
+#include <lensy_kernel.h>
+
+
+/*------------------------------------------------------- lensy_tier_name
+ * Return the name of the kernel tier 'tier'.
+ */
+const char *lensy_tier_name(int32_t tier)
+{
+	switch (tier) {
+	case LENSY_TIER_REFERENCE:	return "reference";
+	case LENSY_TIER_FAST:		return "fast";
+	case LENSY_TIER_FASTEST:	return "fastest";
+	}
+	return "unknown";
+}
+
+
+/*------------------------------------------------------- lensy_tier_diffract
+ * Diffract the ray 'r' at the intersect point 'q' (with the unit normal
+ * 'n') from a grating with the ruling vector 'a', in the order 'order', as
+ * lensy_redirect_diffract().
+ */
+static int32_t lensy_tier_diffract(struct lensy_ray_struct *r, double q[3], double n[3],
+				double a[3], int32_t order)
+{
+	double d0, d1, d2, d4, d5, d6, sd, cd;
+	double n1[3], a1[3], t1[3], w0[3];
+
+	r->p[0] = q[0];
+	r->p[1] = q[1];
+	r->p[2] = q[2];
+
+	d2 = lensy_norm3(n);
+	if (d2 == 0.0) return -2;
+	n1[0] = n[0] / d2;
+	n1[1] = n[1] / d2;
+	n1[2] = n[2] / d2;
+
+	d0 = lensy_norm3(r->d);
+	if (d0 == 0.0) return -2;
+	w0[0] = r->d[0] / d0;
+	w0[1] = r->d[1] / d0;
+	w0[2] = r->d[2] / d0;
+
+	d1 = lensy_norm3(a);			// the ruling spacing
+	d2 = lensy_dot3(a, n1);
+	a1[0] = a[0] - d2 * n1[0];
+	a1[1] = a[1] - d2 * n1[1];
+	a1[2] = a[2] - d2 * n1[2];
+
+	d2 = lensy_norm3(a1);
+	if (d2 == 0.0) return -2;
+	a1[0] /= d2;
+	a1[1] /= d2;
+	a1[2] /= d2;
+
+	lensy_vcross3(a1, n1, t1);
+
+	d4 = lensy_dot3(w0, n1);
+	d5 = lensy_dot3(w0, a1);
+	d6 = lensy_dot3(w0, t1);
+	if ((d4 == 0.0) || (d6 == 1.0)) return -2;
+
+	sd = d5 + order * r->wavelength / d1;
+	cd = 1.0 - d6 * d6 - sd * sd;
+	if (cd <= 0.0) return -2;
+	cd = sqrt(cd);
+
+	r->d[0] = d0 * (d6 * t1[0] + cd * n1[0] + sd * a1[0]);
+	r->d[1] = d0 * (d6 * t1[1] + cd * n1[1] + sd * a1[1]);
+	r->d[2] = d0 * (d6 * t1[2] + cd * n1[2] + sd * a1[2]);
+	return 0;
+}
+
+
+/*------------------------------------------------------- lensy_element_redirect_fast
+ * Redirect the ray 'r' at the intersect point 'q' (with the unit normal
+ * 'n') of element 'e', as lensy_element_redirect().
+ */
+int32_t lensy_element_redirect_fast(struct lensy_element_struct *e,
+				struct lensy_ray_struct *r, double q[3], double n[3],
+				double m, int32_t order)
+{
+	switch (e->redirect) {
+	case LENSY_REFRACT:
+		r->p[0] = q[0];
+		r->p[1] = q[1];
+		r->p[2] = q[2];
+		if (lensy_norm3(r->d) == 0.0) return -2;
+		return (lensy_kernel_refract_fast(r->d, n, m) < 0) ? -1 : 0;
+	case LENSY_DIFFRACT:
+		return lensy_tier_diffract(r, q, n, e->a, order);
+	}
+	return lensy_element_redirect(e, r, q, n, m, order);
+}
+
+
+/*------------------------------------------------------- lensy_element_trace_fast
+ * Take the ray 'r' through element 'e', which must have a fused function
+ * (see lensy_element_fused()), with the fast kernels.
+ */
+int32_t lensy_element_trace_fast(struct lensy_element_struct *e,
+				struct lensy_ray_struct *r, double m)
+{
+	switch (e->type) {
+	case LENSY_SPHERE:
+		return lensy_kernel_sphere_refract_tier(r, &e->s.sphere, m, true);
+	case LENSY_PARABOLOID:
+		return lensy_kernel_paraboloid_reflect(r, &e->s.paraboloid);
+	case LENSY_HYPERBOLOID:
+		return lensy_kernel_hyperboloid_reflect(r, &e->s.hyperboloid);
+	case LENSY_PLANE:
+		switch (e->redirect) {
+		case LENSY_REFRACT:
+			return lensy_kernel_plane_refract_tier(r, &e->s.plane, m, true);
+		case LENSY_DIFFRACT:
+			return lensy_kernel_plane_diffract_tier(r, &e->s.plane, e->a,
+								e->order0, true);
+		case LENSY_IMPACT:
+			return lensy_kernel_plane_impact(r, &e->s.plane);
+		}
+	}
+	return -2;
+}
+
+
+/*------------------------------------------------------- lensy_index_medium_fast
+ * Return the index of refraction of the medium 'm' for the wavelength wl
+ * in meters, as lensy_index_medium().
+ */
+double lensy_index_medium_fast(double wl, struct lensy_medium_struct *m)
+{
+	double *a, w2, u;
+
+	if ((m == NULL) || (m->s != NULL) || (m->a == NULL))
+		return lensy_index_medium(wl, m);
+
+	if ((wl < 0.3e-6) || (wl > 2.0e-6)) {
+		fprintf(stderr, "%s: wavelength outside limits\n", __func__);
+		exit(-1);
+	}
+
+	a = m->a;
+	w2 = (wl * 1.0e6) * (wl * 1.0e6);
+	u = 1.0 / w2;
+	return sqrt(a[0] + a[1] * w2 + u * (a[2] + u * (a[3] + u * (a[4] + u * a[5]))));
+}
+
+
+/*------------------------------------------------------- lensy_trace_fastest
+ * Take the rays of bundle 'b' through the system in single precision. A
+ * system that changes or sums the ray weights (see lensy_system_weighted())
+ * is traced with the fast tier, since lensy_trace_float() passes the
+ * weights on unchanged, without the throughput curves or the budget.
+ */
+int32_t lensy_trace_fastest(struct lensy_system_struct *sys, struct lensy_bundle_struct *b)
+{
+	struct lensy_float_struct *fl;
+	struct lensy_system_struct *s;
+	int32_t rc;
+
+	fl = malloc(sizeof(*fl));
+	s = malloc(sizeof(*s));
+	if ((fl == NULL) || (s == NULL)) {
+		fprintf(stderr, "%s: malloc failed\n", __func__);
+		free(fl);
+		free(s);
+		return -1;
+	}
+
+	if (!lensy_system_weighted(sys) && (lensy_float_prepare(sys, fl) == 0)) {
+		rc = lensy_trace_float(sys, fl, b);
+	} else {
+		//------ the fast tier instead, in a copy of the system
+		memcpy(s, sys, sizeof(*s));
+		s->tier = LENSY_TIER_FAST;
+		rc = lensy_trace(s, b);
+	}
+	free(fl);
+	free(s);
+	return rc;
+}
+
+
+/*------------------------------------------------------- lensy_tier_report
+ * Trace the rays of bundle 'b' (which is not changed) with the reference
+ * tier and with the tier 'tier', and compare the spots in 'rep'.
+ */
+int32_t lensy_tier_report(struct lensy_system_struct *sys, int32_t tier,
+				struct lensy_bundle_struct *b, struct lensy_tier_report_struct *rep)
+{
+	struct lensy_system_struct *s;
+	struct lensy_bundle_struct b0, b1;
+	struct lensy_spot_struct *s0, *s1;
+	double d0, w[3];
+	int32_t n0, n1, i, j, k, rc;
+
+	memset(rep, 0, sizeof(*rep));
+	memset(&b0, 0, sizeof(b0));
+	memset(&b1, 0, sizeof(b1));
+	rep->tier = tier;
+	s0 = s1 = NULL;
+	rc = -1;
+
+	s = malloc(2 * sizeof(*s));
+	if (s == NULL) {
+		fprintf(stderr, "%s: malloc failed\n", __func__);
+		return -1;
+	}
+	memcpy(&s[0], sys, sizeof(*s));
+	memcpy(&s[1], sys, sizeof(*s));
+	s[0].tier = LENSY_TIER_REFERENCE;
+	s[1].tier = tier;
+	s[0].line = s[1].line = NULL;
+
+	if ((lensy_bundle_clone(&b0, b) < 0) || (lensy_bundle_clone(&b1, b) < 0)) goto done;
+	rep->n_reference = lensy_trace(&s[0], &b0);
+	rep->n_tier = lensy_trace(&s[1], &b1);
+	if ((rep->n_reference < 0) || (rep->n_tier < 0)) goto done;
+
+	n0 = lensy_spots(&b0, &s0);
+	n1 = lensy_spots(&b1, &s1);
+	if ((n0 < 0) || (n1 < 0)) goto done;
+
+	//------ the spots with the same path in both
+	for (i = 0; i < n0; i++) {
+		for (j = 0; (j < n1) && (s1[j].path != s0[i].path); j++);
+		if (j == n1) continue;
+
+		for (k = 0; k < 3; k++) w[k] = s1[j].p[k] - s0[i].p[k];
+		d0 = lensy_norm3(w);
+		rep->centroid = fmax(rep->centroid, d0);
+		rep->centroid_mean += d0;
+		d0 = fabs(s1[j].rms - s0[i].rms);
+		rep->rms = fmax(rep->rms, d0);
+		rep->rms_mean += d0;
+		rep->n_spots++;
+	}
+	if (rep->n_spots > 0) {
+		rep->centroid_mean /= rep->n_spots;
+		rep->rms_mean /= rep->n_spots;
+	}
+	rc = 0;
+
+done:
+	free(s0);
+	free(s1);
+	free(s);
+	lensy_bundle_free(&b0);
+	lensy_bundle_free(&b1);
+	return rc;
+}
+
+
+/*------------------------------------------------------- lensy_tier_select
+ * Return the fastest kernel tier that is within 'tolerance' (meters) of
+ * the reference, for the system 'sys' and the bundle 'b'.
+ */
+int32_t lensy_tier_select(struct lensy_system_struct *sys, struct lensy_bundle_struct *b,
+				double tolerance)
+{
+	struct lensy_tier_report_struct rep;
+	int32_t tier;
+
+	for (tier = LENSY_NMAX_TIERS - 1; tier > LENSY_TIER_REFERENCE; tier--) {
+		if (lensy_tier_report(sys, tier, b, &rep) < 0) return -1;
+		if ((rep.n_tier == rep.n_reference) && (rep.centroid <= tolerance) &&
+		    (rep.rms <= tolerance))
+			return tier;
+	}
+	return LENSY_TIER_REFERENCE;
+}
@@ -0,0 +1,439 @@
+/*
+ * lensy_tolerance.c - v1.4 (codename FlamingMarshmallow)
+ *
+ * Library functions for Monte Carlo tolerance analysis of an optical
+ * system (see lensy_trace.c).
+ *
+ *-----------------------------------------------------------------------
+ * Copyright (C) 2013 - 2015 FSF
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *-----------------------------------------------------------------------
+ *
+ * For each element, a tolerance structure gives the standard deviations
+ * of the errors of that element (decenter, tilt, vertex shift, radius and
+ * grating ruling spacing). The function lensy_tolerance() draws a number
+ * of perturbed copies of the system, with normally distributed errors,
+ * traces the same rays through each of them, and records the spot sizes
+ * and the image shift (compared to the nominal system) for each sample.
+ *
+ * The random numbers for sample k only depend on the seed and on k, so
+ * any sample can be made again with lensy_tolerance_perturb(), and the
+ * results do not depend on the number of threads.
+ *
+ * Send questions or contributions to me at <michael.h.williamson@gmail.com>.
+ *
+ * History:
+ *
+ *  2026-10-16  The perturbed samples do not sum a throughput budget
+ *              (sys->budget) of the system.
+ *  2026-10-16  This file is created.
+ */
+
+
+#include <ctype.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <lensy.h>
+#include <lensy_hash.h>
+
+
+/*------------------------------------------------------- lensy_random_normal
+ * Return a normally distributed random number, with a mean of zero and a
+ * standard deviation of one (Box-Muller).
+ */
+static double lensy_random_normal(uint64_t *state)
+{
+	double u0, u1;
+
+	u0 = ((lensy_random64(state) >> 11) + 0.5) / 9007199254740992.0;
+	u1 = ((lensy_random64(state) >> 11) + 0.5) / 9007199254740992.0;
+	return sqrt(-2.0 * log(u0)) * cos(2.0 * PI * u1);
+}
+
+
+/*------------------------------------------------------- lensy_rotate
+ * Rotate the vector 'v' by the angle |r| about the axis r (Rodrigues'
+ * formula).
+ */
+static void lensy_rotate(double v[3], double r[3])
+{
+	double d0, c, s, k[3], w0[3], w1[3];
+	int32_t i;
+
+	d0 = lensy_norm3(r);
+	if (d0 == 0.0) return;
+
+	k[0] = r[0] / d0;
+	k[1] = r[1] / d0;
+	k[2] = r[2] / d0;
+	c = cos(d0);
+	s = sin(d0);
+
+	lensy_vcross3(k, v, w0);
+	d0 = lensy_dot3(k, v) * (1.0 - c);
+	for (i = 0; i < 3; i++)
+		w1[i] = v[i] * c + w0[i] * s + k[i] * d0;
+	v[0] = w1[0];
+	v[1] = w1[1];
+	v[2] = w1[2];
+}
+
+
+/*------------------------------------------------------- lensy_tolerance_perturb
+ * Apply random errors, as given by the 'n_tol' tolerance structures in
+ * tol[], to the elements of the system 'sys'. The random numbers are those
+ * of sample number 'k' for the seed 'seed', so the same perturbed system
+ * can be made again.
+ */
+void lensy_tolerance_perturb(struct lensy_system_struct *sys,
+				struct lensy_tolerance_struct tol[], int32_t n_tol,
+				uint64_t seed, int32_t k)
+{
+	int32_t i, j;
+	uint64_t state;
+	double d0, g[7], w[3], e0[3], e1[3], r[3];
+	double *v, *axis;
+	struct lensy_element_struct *e;
+
+	state = seed ^ ((uint64_t) k * 0xd1b54a32d192ed03ULL);
+
+	for (i = 0; i < n_tol; i++) {
+		//------ always draw the same count, so that the streams line up
+		for (j = 0; j < 7; j++)
+			g[j] = lensy_random_normal(&state);
+
+		if ((tol[i].element < 0) || (tol[i].element >= sys->n)) continue;
+		e = &sys->e[tol[i].element];
+		axis = lensy_element_axis(e);
+		if (axis == NULL) continue;
+		v = e->s.plane.v;		// the vertex is first in all surfaces
+
+		//------ unit vectors: w along the axis, e0 and e1 across it
+		d0 = lensy_norm3(axis);
+		if (d0 == 0.0) continue;
+		w[0] = axis[0] / d0;
+		w[1] = axis[1] / d0;
+		w[2] = axis[2] / d0;
+
+		e0[0] = e0[1] = e0[2] = 0.0;
+		j = (fabs(w[0]) < fabs(w[1])) ? 0 : 1;
+		if (fabs(w[2]) < fabs(w[j])) j = 2;
+		e0[j] = 1.0;
+		lensy_vcross3(w, e0, e1);
+		d0 = lensy_norm3(e1);
+		e1[0] /= d0;
+		e1[1] /= d0;
+		e1[2] /= d0;
+		lensy_vcross3(e1, w, e0);
+
+		//------ decenter and vertex shift
+		for (j = 0; j < 3; j++)
+			v[j] += tol[i].decenter * (g[0] * e0[j] + g[1] * e1[j]) +
+				tol[i].despace * g[2] * w[j];
+
+		//------ tilt about the vertex
+		for (j = 0; j < 3; j++)
+			r[j] = tol[i].tilt * (g[3] * e0[j] + g[4] * e1[j]);
+		lensy_rotate(axis, r);
+		if (e->type == LENSY_CYLINDER) lensy_rotate(e->s.cylinder.a, r);
+		if (e->redirect == LENSY_DIFFRACT) lensy_rotate(e->a, r);
+
+		//------ radius (or focal length) error
+		if (e->type != LENSY_PLANE) {
+			d0 = 1.0 + tol[i].radius * g[5];
+			axis[0] *= d0;
+			axis[1] *= d0;
+			axis[2] *= d0;
+		}
+
+		//------ grating ruling spacing error
+		if (e->redirect == LENSY_DIFFRACT) {
+			d0 = 1.0 + tol[i].ruling * g[6];
+			e->a[0] *= d0;
+			e->a[1] *= d0;
+			e->a[2] *= d0;
+		}
+	}
+}
+
+
+/*------------------------------------------------------- tolerance work
+ * The state shared by the worker threads.
+ */
+struct lensy_tolerance_work_struct {
+	struct lensy_system_struct *sys;	// the nominal system
+	struct lensy_tolerance_struct *tol;
+	int32_t n_tol;
+	int32_t i0;				// first perturbed element
+	struct lensy_bundle_struct *b;		// rays traced up to element i0
+	struct lensy_spot_struct *spots;	// nominal spots, sorted by path
+	int32_t n_spots;
+	uint64_t seed;
+	int32_t n_samples;
+	struct lensy_sample_struct *samples;
+
+	pthread_mutex_t lock;
+	int32_t next;				// next sample to do
+	int32_t rc;
+};
+
+
+/*------------------------------------------------------- lensy_spot_compare
+ * Compare the path identifiers of two spots, for qsort() and bsearch().
+ */
+static int lensy_spot_compare(const void *p0, const void *p1)
+{
+	const struct lensy_spot_struct *s0 = p0, *s1 = p1;
+
+	return (s0->path > s1->path) - (s0->path < s1->path);
+}
+
+
+/*------------------------------------------------------- lensy_tolerance_sample
+ * Trace sample 'k' and fill in its sample structure. The system 'sys' and
+ * the bundle 'b' are the thread's own work space.
+ */
+static int32_t lensy_tolerance_sample(struct lensy_tolerance_work_struct *w,
+				int32_t k, struct lensy_system_struct *sys,
+				struct lensy_bundle_struct *b)
+{
+	int32_t i, j, n, rc;
+	double w0[3];
+	struct lensy_spot_struct *spots, *ps;
+	struct lensy_sample_struct *s;
+
+	s = &w->samples[k];
+	memset(s, 0, sizeof(*s));
+
+	memcpy(sys, w->sys, sizeof(*sys));
+	sys->line = NULL;
+	sys->reject = NULL;	// a perturbed sample, traced by several threads
+	sys->budget = NULL;
+	lensy_tolerance_perturb(sys, w->tol, w->n_tol, w->seed, k);
+
+	if (lensy_bundle_clone(b, w->b) < 0) return -1;
+	rc = lensy_trace_elements(sys, w->i0, sys->n, b);
+	if (rc < 0) return -1;
+	s->n = rc;
+
+	n = lensy_spots(b, &spots);
+	if (n < 0) return -1;
+
+	for (i = 0; i < n; i++) {
+		if (spots[i].n <= 1) continue;
+		ps = bsearch(&spots[i], w->spots, w->n_spots, sizeof(*spots),
+				lensy_spot_compare);
+
+		s->rms += spots[i].rms;
+		if (ps != NULL) {
+			for (j = 0; j < 3; j++) {
+				w0[j] = spots[i].p[j] - ps->p[j];
+				s->shift_v[j] += w0[j];
+			}
+			s->shift += lensy_norm3(w0);
+		}
+		s->n_spots++;
+	}
+	if (s->n_spots > 0) {
+		s->rms /= s->n_spots;
+		s->shift /= s->n_spots;
+		for (j = 0; j < 3; j++)
+			s->shift_v[j] /= s->n_spots;
+	}
+
+	free(spots);
+	return 0;
+}
+
+
+/*------------------------------------------------------- lensy_tolerance_thread
+ * Worker thread: take the next sample to do, until there are none left.
+ */
+static void *lensy_tolerance_thread(void *arg)
+{
+	struct lensy_tolerance_work_struct *w = arg;
+	struct lensy_system_struct *sys;
+	struct lensy_bundle_struct b;
+	int32_t k, rc;
+
+	sys = (struct lensy_system_struct *) malloc(sizeof(*sys));
+	rc = ((sys == NULL) || (lensy_bundle_init(&b, w->b->n) < 0)) ? -1 : 0;
+
+	while (rc == 0) {
+		pthread_mutex_lock(&w->lock);
+		k = (w->rc == 0) ? w->next++ : w->n_samples;
+		pthread_mutex_unlock(&w->lock);
+		if (k >= w->n_samples) break;
+
+		rc = lensy_tolerance_sample(w, k, sys, &b);
+	}
+
+	if (rc < 0) {
+		pthread_mutex_lock(&w->lock);
+		w->rc = -1;
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	if (sys != NULL) lensy_bundle_free(&b);
+	free(sys);
+	return NULL;
+}
+
+
+/*------------------------------------------------------- lensy_tolerance
+ * Monte Carlo tolerance analysis. 'n_samples' perturbed copies of the
+ * system 'sys' are made with lensy_tolerance_perturb(), the rays of bundle
+ * 'b' are traced through each of them, and the results are put in
+ * samples[0], ..., samples[n_samples - 1]. The bundle 'b' is not changed.
+ *
+ * The elements before the first one with a tolerance are the same in all
+ * of the samples, so the rays are traced through them only once. The
+ * samples are spread over 'n_threads' threads (if n_threads <= 0, one for
+ * each processor).
+ *
+ * A return value of zero means OK, and -1 means an error.
+ */
+int32_t lensy_tolerance(struct lensy_system_struct *sys,
+				struct lensy_tolerance_struct tol[], int32_t n_tol,
+				struct lensy_bundle_struct *b, int32_t n_samples,
+				uint64_t seed, int32_t n_threads,
+				struct lensy_sample_struct samples[])
+{
+	struct lensy_tolerance_work_struct w;
+	struct lensy_system_struct *prefix;
+	struct lensy_bundle_struct nb, pb;
+	pthread_t *threads;
+	int32_t i, n;
+
+	memset(&w, 0, sizeof(w));
+	w.sys = sys;
+	w.tol = tol;
+	w.n_tol = n_tol;
+	w.seed = seed;
+	w.n_samples = n_samples;
+	w.samples = samples;
+
+	w.i0 = sys->n;
+	for (i = 0; i < n_tol; i++)
+		if ((tol[i].element >= 0) && (tol[i].element < w.i0))
+			w.i0 = tol[i].element;
+
+	if (n_threads <= 0) n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n_threads > n_samples) n_threads = n_samples;
+	if (n_threads < 1) n_threads = 1;
+
+	prefix = (struct lensy_system_struct *) malloc(sizeof(*prefix));
+	threads = (pthread_t *) malloc(n_threads * sizeof(pthread_t));
+	memset(&nb, 0, sizeof(nb));
+	memset(&pb, 0, sizeof(pb));
+	w.rc = -1;
+	if ((prefix == NULL) || (threads == NULL)) goto done;
+
+	//------ trace the rays up to the first perturbed element, once
+	memcpy(prefix, sys, sizeof(*prefix));
+	prefix->n = w.i0;
+	prefix->line = NULL;
+	if (lensy_bundle_clone(&pb, b) < 0) goto done;
+	if (lensy_trace(prefix, &pb) < 0) goto done;
+	w.b = &pb;
+
+	//------ the nominal spots, to measure the image shift
+	if (lensy_bundle_clone(&nb, &pb) < 0) goto done;
+	memcpy(prefix, sys, sizeof(*prefix));
+	prefix->line = NULL;
+	if (lensy_trace_elements(prefix, w.i0, prefix->n, &nb) < 0) goto done;
+	w.n_spots = lensy_spots(&nb, &w.spots);
+	if (w.n_spots < 0) goto done;
+	qsort(w.spots, w.n_spots, sizeof(*w.spots), lensy_spot_compare);
+
+	//------ the samples
+	w.rc = 0;
+	pthread_mutex_init(&w.lock, NULL);
+	for (n = 0; n < n_threads; n++)
+		if (pthread_create(&threads[n], NULL, lensy_tolerance_thread, &w) != 0)
+			break;
+	if (n == 0) {
+		w.rc = -1;
+		fprintf(stderr, "%s: pthread_create failed\n", __func__);
+	}
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&w.lock);
+
+done:
+	free(w.spots);
+	lensy_bundle_free(&nb);
+	lensy_bundle_free(&pb);
+	free(threads);
+	free(prefix);
+	return w.rc;
+}
+
+
+/*------------------------------------------------------- lensy_double_compare
+ * Compare two doubles, for qsort().
+ */
+static int lensy_double_compare(const void *p0, const void *p1)
+{
+	double d0 = *(const double *) p0, d1 = *(const double *) p1;
+
+	return (d0 > d1) - (d0 < d1);
+}
+
+
+/*------------------------------------------------------- lensy_sample_quantiles
+ * Find the quantiles q[0], ..., q[n_q - 1] (from 0.0 to 1.0) of the RMS
+ * spot size and of the image shift of the 'n' samples s[], and put them in
+ * rms[] and shift[].
+ *
+ * A return value of zero means OK, and -1 means that malloc failed.
+ */
+int32_t lensy_sample_quantiles(struct lensy_sample_struct s[], int32_t n,
+				double q[], int32_t n_q, double rms[], double shift[])
+{
+	double *d;
+	int32_t i, j;
+
+	if (n <= 0) return -1;
+	d = (double *) malloc(2 * n * sizeof(double));
+	if (d == NULL) return -1;
+
+	for (i = 0; i < n; i++) {
+		d[i] = s[i].rms;
+		d[n + i] = s[i].shift;
+	}
+	qsort(d, n, sizeof(double), lensy_double_compare);
+	qsort(d + n, n, sizeof(double), lensy_double_compare);
+
+	for (i = 0; i < n_q; i++) {
+		j = floor(q[i] * (n - 1) + 0.5);
+		if (j < 0) j = 0;
+		if (j > n - 1) j = n - 1;
+		rms[i] = d[j];
+		shift[i] = d[n + j];
+	}
+
+	free(d);
+	return 0;
+}
@@ -0,0 +1,1356 @@
+/*
+ * lensy_trace.c - v1.4 (codename FlamingMarshmallow)
+ *
+ * Library functions for tracing bundles of rays through an optical system
+ * that is described as a sequence of elements.
+ *
+ *-----------------------------------------------------------------------
+ * Copyright (C) 2013 - 2015 FSF
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *-----------------------------------------------------------------------
+ *
+ * Instead of calling the lensy_intersect_X() and lensy_redirect_Y()
+ * functions for each surface in the program code, the surfaces can be
+ * listed, in order, in a lensy_system_struct. Each element of the system
+ * is a surface together with what happens to a ray there (reflect,
+ * refract, diffract or impact). The function lensy_trace() then takes a
+ * bundle of rays through all of the elements. Rays that miss a surface,
+ * or that cannot be redirected, are removed from the bundle.
+ *
+ * The same rules apply as for calling the functions directly: the sequence
+ * of surfaces is the sequence of the elements, and there is no check for
+ * interference.
+ *
+ * Send questions or contributions to me at <michael.h.williamson@gmail.com>.
+ *
+ * History:
+ *
+ *  2026-10-16  The orders of a fanned out grating share the weight.
+ *  2026-10-16  The rays are not shared when the rejects are counted.
+ *  2026-10-16  lensy_trace_configs() compares the elements field by field.
+ *  2026-10-16  The ray weights are multiplied by the throughput of each
+ *              element, and lensy_spots() and lensy_focus() weight the
+ *              rays.
+ *  2026-10-16  Added lensy_element_hit_t(), lensy_element_normal() and
+ *              lensy_element_hit_t_bundle(), for distance-only queries.
+ *  2026-10-16  Added lensy_focus(), for through-focus spot sizes from a
+ *              single trace.
+ *  2026-10-16  Added lensy_trace_configs(), for tracing several
+ *              configurations of a system in one pass.
+ *  2026-10-16  This file is created.
+ */
+
+
+#include <ctype.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <lensy.h>
+#include <lensy_hash.h>
+#include <lensy_kernel.h>
+
+
+/*------------------------------------------------------- lensy_index_medium
+ * Return the index of refraction of the medium 'm' for the wavelength wl
+ * in meters.
+ */
+double lensy_index_medium(double wl, struct lensy_medium_struct *m)
+{
+	if (m == NULL) return 1.0;
+	if (m->s != NULL) return lensy_index_sellmeier(wl, m->s);
+	if (m->a != NULL) return lensy_index_of_refraction(wl, m->a);
+	return m->n;
+}
+
+
+/*------------------------------------------------------- lensy_system_init
+ * Initialize an empty optical system.
+ */
+void lensy_system_init(struct lensy_system_struct *sys)
+{
+	memset(sys, 0, sizeof(*sys));
+	sys->chunk = LENSY_TRACE_CHUNK;
+}
+
+
+/*------------------------------------------------------- lensy_surface_size
+ * Return the size of the surface structure for the surface type 'type',
+ * or zero for an unknown type.
+ */
+size_t lensy_surface_size(int32_t type)
+{
+	switch (type) {
+	case LENSY_PARABOLOID:	return sizeof(struct lensy_paraboloid_struct);
+	case LENSY_SPHERE:	return sizeof(struct lensy_sphere_struct);
+	case LENSY_CYLINDER:	return sizeof(struct lensy_cylinder_struct);
+	case LENSY_PLANE:	return sizeof(struct lensy_plane_struct);
+	case LENSY_HYPERBOLOID:	return sizeof(struct lensy_hyperboloid_struct);
+	}
+	return 0;
+}
+
+
+/*------------------------------------------------------- lensy_system_add
+ * Append an element to the system 's', with a copy of the surface
+ * structure 'surface' of type 'type', and the interaction 'redirect'.
+ *
+ * The return value is the element index, or -1 if the system is full or
+ * the type is unknown.
+ */
+static int32_t lensy_system_add(struct lensy_system_struct *sys, int32_t type,
+				void *surface, int32_t redirect)
+{
+	struct lensy_element_struct *e;
+	size_t size;
+
+	size = lensy_surface_size(type);
+	if ((size == 0) || (sys->n >= LENSY_NMAX_ELEMENTS)) {
+		fprintf(stderr, "%s: invalid element\n", __func__);
+		return -1;
+	}
+
+	e = &sys->e[sys->n];
+	memset(e, 0, sizeof(*e));
+	e->type = type;
+	memcpy(&e->s, surface, size);
+	e->redirect = redirect;
+
+	return sys->n++;
+}
+
+
+/*------------------------------------------------------- lensy_add_reflect
+ * Append a reflecting surface to the system.
+ */
+int32_t lensy_add_reflect(struct lensy_system_struct *sys, int32_t type,
+				void *surface)
+{
+	return lensy_system_add(sys, type, surface, LENSY_REFLECT);
+}
+
+
+/*------------------------------------------------------- lensy_add_refract
+ * Append a refracting surface to the system. 'm0' is the incident medium
+ * and 'm1' the transmission medium.
+ */
+int32_t lensy_add_refract(struct lensy_system_struct *sys, int32_t type,
+				void *surface, struct lensy_medium_struct *m0,
+				struct lensy_medium_struct *m1)
+{
+	int32_t i;
+
+	i = lensy_system_add(sys, type, surface, LENSY_REFRACT);
+	if (i >= 0) {
+		sys->e[i].m0 = m0;
+		sys->e[i].m1 = m1;
+	}
+	return i;
+}
+
+
+/*------------------------------------------------------- lensy_add_diffract
+ * Append a diffraction grating to the system. 'a' is the ruling vector
+ * (see lensy_redirect_diffract). If order0 < order1, each incident ray is
+ * replaced by one ray for each order from order0 to order1, and the order
+ * is added to the ray path identifier.
+ */
+int32_t lensy_add_diffract(struct lensy_system_struct *sys, int32_t type,
+				void *surface, double a[3],
+				int32_t order0, int32_t order1)
+{
+	int32_t i;
+
+	i = lensy_system_add(sys, type, surface, LENSY_DIFFRACT);
+	if (i >= 0) {
+		sys->e[i].a[0] = a[0];
+		sys->e[i].a[1] = a[1];
+		sys->e[i].a[2] = a[2];
+		sys->e[i].order0 = order0;
+		sys->e[i].order1 = (order1 > order0) ? order1 : order0;
+	}
+	return i;
+}
+
+
+/*------------------------------------------------------- lensy_add_impact
+ * Append a final (focal plane) surface to the system.
+ */
+int32_t lensy_add_impact(struct lensy_system_struct *sys, int32_t type,
+				void *surface)
+{
+	return lensy_system_add(sys, type, surface, LENSY_IMPACT);
+}
+
+
+/*------------------------------------------------------- lensy_element_dispersive
+ * Return true if the path of a ray at the element 'e' depends on the
+ * wavelength. Reflection and impact never do, and refraction only does
+ * if one of the media has a wavelength dependent index of refraction.
+ */
+bool lensy_element_dispersive(struct lensy_element_struct *e)
+{
+	switch (e->redirect) {
+	case LENSY_REFRACT:
+		return ((e->m0 != NULL) && ((e->m0->a != NULL) || (e->m0->s != NULL))) ||
+		       ((e->m1 != NULL) && ((e->m1->a != NULL) || (e->m1->s != NULL)));
+	case LENSY_DIFFRACT:
+		return (e->order0 != 0) || (e->order1 != 0);
+	}
+	return false;
+}
+
+
+/*------------------------------------------------------- lensy_element_axis
+ * Return a pointer to the axis vector of the surface of element 'e' (the
+ * vector from the vertex to the focus, or center, or the normal vector of
+ * a plane), or NULL for an unknown surface type.
+ */
+double *lensy_element_axis(struct lensy_element_struct *e)
+{
+	switch (e->type) {
+	case LENSY_PARABOLOID:	return e->s.paraboloid.f;
+	case LENSY_SPHERE:	return e->s.sphere.vr;
+	case LENSY_CYLINDER:	return e->s.cylinder.va;
+	case LENSY_PLANE:	return e->s.plane.n;
+	case LENSY_HYPERBOLOID:	return e->s.hyperboloid.a;
+	}
+	return NULL;
+}
+
+
+/*------------------------------------------------------- lensy_element_bound
+ * Make the bound 'bd' of the clear aperture of element 'e'. The surface
+ * within the aperture radius r is between the vertex plane and the plane
+ * at the sag of the rim: for a sphere (or a cylinder) of radius k on its
+ * vertex side, k - sqrt(k^2 - r^2); for a paraboloid, r^2 / 4f; for a
+ * hyperboloid with the center k from the vertex, sqrt(k^2 + r^2 / (e^2 - 1))
+ * - k; and for a plane, zero.
+ */
+bool lensy_element_bound(struct lensy_element_struct *e, struct lensy_bound_struct *bd)
+{
+	double *axis, k, r, e2;
+	int32_t i;
+
+	axis = lensy_element_axis(e);
+	if (axis == NULL) return false;
+	k = lensy_norm3(axis);
+	if (k == 0.0) return false;
+
+	switch (e->type) {
+	case LENSY_SPHERE:
+		r = e->s.sphere.aperture / 2.0;
+		bd->sag = (r < k) ? k - sqrt(k * k - r * r) : k;
+		break;
+	case LENSY_CYLINDER:
+		r = e->s.cylinder.aperture / 2.0;
+		bd->sag = (r < k) ? k - sqrt(k * k - r * r) : k;
+		break;
+	case LENSY_PARABOLOID:
+		r = e->s.paraboloid.aperture / 2.0;
+		bd->sag = r * r / (4 * k);
+		break;
+	case LENSY_HYPERBOLOID:
+		r = e->s.hyperboloid.aperture / 2.0;
+		e2 = e->s.hyperboloid.e * e->s.hyperboloid.e - 1.0;
+		if (e2 <= 0.0) return false;
+		bd->sag = sqrt(k * k + r * r / e2) - k;
+		break;
+	case LENSY_PLANE:
+		r = e->s.plane.aperture / 2.0;
+		bd->sag = 0.0;
+		break;
+	default:
+		return false;
+	}
+	if (!(r >= 0.0)) return false;
+
+	bd->r = r;
+	for (i = 0; i < 3; i++) {
+		bd->v[i] = e->s.sphere.v[i];	// the vertex is first in all surfaces
+		bd->a[i] = axis[i] / k;
+	}
+	return true;
+}
+
+
+/*------------------------------------------------------- lensy_element_intersect
+ * Calculate where the ray 'r' intersects the surface of element 'e'. The
+ * return values are those of the lensy_intersect_X() functions.
+ */
+int32_t lensy_element_intersect(struct lensy_element_struct *e,
+				struct lensy_ray_struct *r, double q[3], double n[3])
+{
+	switch (e->type) {
+	case LENSY_PARABOLOID:
+		return lensy_intersect_paraboloid(r, &e->s.paraboloid, q, n);
+	case LENSY_SPHERE:
+		return lensy_intersect_sphere(r, &e->s.sphere, q, n);
+	case LENSY_CYLINDER:
+		return lensy_intersect_cylinder(r, &e->s.cylinder, q, n);
+	case LENSY_PLANE:
+		return lensy_intersect_plane(r, &e->s.plane, q, n);
+	case LENSY_HYPERBOLOID:
+		return lensy_intersect_hyperboloid(r, &e->s.hyperboloid, q, n);
+	}
+	q[0] = r->p[0];
+	q[1] = r->p[1];
+	q[2] = r->p[2];
+	return -2;
+}
+
+
+/*------------------------------------------------------- lensy_element_hit_t
+ * Calculate only where along the ray 'r' the surface of element 'e' is
+ * intersected (see lensy_hit_t_X()).
+ */
+int32_t lensy_element_hit_t(struct lensy_element_struct *e,
+				struct lensy_ray_struct *r, double *t)
+{
+	switch (e->type) {
+	case LENSY_PARABOLOID:
+		return lensy_hit_t_paraboloid(r, &e->s.paraboloid, t);
+	case LENSY_SPHERE:
+		return lensy_hit_t_sphere(r, &e->s.sphere, t);
+	case LENSY_CYLINDER:
+		return lensy_hit_t_cylinder(r, &e->s.cylinder, t);
+	case LENSY_PLANE:
+		return lensy_hit_t_plane(r, &e->s.plane, t);
+	case LENSY_HYPERBOLOID:
+		return lensy_hit_t_hyperboloid(r, &e->s.hyperboloid, t);
+	}
+	*t = 0.0;
+	return -2;
+}
+
+
+/*------------------------------------------------------- lensy_element_normal
+ * Calculate the unit normal vector n[3] to the surface of element 'e' at
+ * the point q[3] (see lensy_normal_X()).
+ */
+int32_t lensy_element_normal(struct lensy_element_struct *e,
+				double q[3], double n[3])
+{
+	switch (e->type) {
+	case LENSY_PARABOLOID:
+		return lensy_normal_paraboloid(&e->s.paraboloid, q, n);
+	case LENSY_SPHERE:
+		return lensy_normal_sphere(&e->s.sphere, q, n);
+	case LENSY_CYLINDER:
+		return lensy_normal_cylinder(&e->s.cylinder, q, n);
+	case LENSY_PLANE:
+		return lensy_normal_plane(&e->s.plane, q, n);
+	case LENSY_HYPERBOLOID:
+		return lensy_normal_hyperboloid(&e->s.hyperboloid, q, n);
+	}
+	return -2;
+}
+
+
+/*------------------------------------------------------- lensy_element_hit_t_bundle
+ * Calculate where along each ray of the bundle 'b' the surface of element
+ * 'e' is intersected, without changing the rays. Rays outside the bound of
+ * the aperture are not intersected, and have rc[i] = -1.
+ *
+ * The return value is the number of rays that hit the surface inside the
+ * aperture.
+ */
+int32_t lensy_element_hit_t_bundle(struct lensy_element_struct *e,
+				struct lensy_bundle_struct *b, double *t, int32_t *rc)
+{
+	struct lensy_ray_struct ray;
+	struct lensy_bound_struct bd;
+	int32_t i, k, n_hit;
+	bool bound;
+
+	bound = lensy_element_bound(e, &bd);
+	n_hit = 0;
+	for (i = 0; i < b->n; i++) {
+		for (k = 0; k < 3; k++) {
+			ray.p[k] = b->p[k][i];
+			ray.d[k] = b->d[k][i];
+		}
+		if (bound && lensy_kernel_bound_miss(&bd, &ray)) {
+			t[i] = 0.0;
+			rc[i] = -1;
+			continue;
+		}
+		rc[i] = lensy_element_hit_t(e, &ray, &t[i]);
+		if (rc[i] == 0) n_hit++;
+	}
+	return n_hit;
+}
+
+
+/*------------------------------------------------------- lensy_element_redirect
+ * Redirect the ray 'r' at the intersect point 'q' (with the unit normal
+ * 'n') of element 'e'. 'm' is the index of refraction ratio for a
+ * refracting element, and 'order' is the grating order for a diffracting
+ * element.
+ *
+ * A return value of zero means OK. A negative value means that the ray
+ * cannot continue (see the lensy_redirect_Y() functions).
+ */
+int32_t lensy_element_redirect(struct lensy_element_struct *e,
+				struct lensy_ray_struct *r, double q[3], double n[3],
+				double m, int32_t order)
+{
+	switch (e->redirect) {
+	case LENSY_REFLECT:
+		lensy_redirect_reflect(r, q, n);
+		return 0;
+	case LENSY_REFRACT:
+		return lensy_redirect_refract(r, q, n, m);
+	case LENSY_DIFFRACT:
+		return lensy_redirect_diffract(r, q, n, e->a,
+					r->wavelength, r->wavelength, order);
+	case LENSY_IMPACT:
+		lensy_redirect_impact(r, q, n);
+		return 0;
+	}
+	return -2;
+}
+
+
+/*------------------------------------------------------- lensy_step_redirect
+ * lensy_element_redirect(), with the kernels of the tier of the system.
+ */
+static inline int32_t lensy_step_redirect(struct lensy_system_struct *sys,
+				struct lensy_element_struct *e, struct lensy_ray_struct *r,
+				double q[3], double n[3], double m, int32_t order)
+{
+	if (sys->tier == LENSY_TIER_REFERENCE)
+		return lensy_element_redirect(e, r, q, n, m, order);
+	return lensy_element_redirect_fast(e, r, q, n, m, order);
+}
+
+
+/*
+ * Intersections that are shared by rays with the same geometry. Row
+ * map[i] of the table is the intersection for ray i of the bundle.
+ */
+struct lensy_hits_struct {
+	int32_t *map;
+	double *q[3], *n[3];
+	int32_t *rc;
+};
+
+
+/*------------------------------------------------------- lensy_trace_step
+ * Take the rays of bundle 'b' through element 'j' of the system. If 'h'
+ * is not NULL, the intersections are taken from it instead of being
+ * calculated. An element with a fused function (see lensy_fused.c) is
+ * traced with it. A fanned out grating uses the bundle 'tmp' for the new
+ * rays, and the two bundles are then exchanged. Without sys->line, the
+ * rays that miss the bound of the aperture (see lensy_element_bound())
+ * are removed before the intersection. The weights of the rays are
+ * multiplied by the throughput of the element (see lensy_throughput.c),
+ * and summed in sys->budget, if it is not NULL. In a weighted system, the
+ * orders of a fanned out grating share the weight of the ray evenly, and
+ * the share of an order that cannot leave the grating is lost.
+ *
+ * The return value is the number of rays left, or -1 if realloc failed.
+ */
+static int32_t lensy_trace_step(struct lensy_system_struct *sys, int32_t j,
+				struct lensy_bundle_struct *b,
+				struct lensy_bundle_struct *tmp,
+				struct lensy_hits_struct *h)
+{
+	int32_t i, k, m, u, w, rc;
+	double wl, ratio, f, share, in, lost, out;
+	double q[3], n[3];
+	struct lensy_ray_struct ray, ray0;
+	struct lensy_bundle_struct swap;
+	struct lensy_element_struct *e;
+	struct lensy_bound_struct bd;
+	struct lensy_throughput_struct tp;
+	int32_t n_rejected;
+	bool fan, bound;
+
+	e = &sys->e[j];
+	if ((h == NULL) && lensy_element_fused(e)) return lensy_fused_bundle(sys, j, b);
+
+	fan = (e->redirect == LENSY_DIFFRACT) && (e->order0 < e->order1);
+	if (fan) tmp->n = 0;
+
+	// unweighted, each order is a ray of its own, with the weight of 1
+	share = 1.0;
+	if (fan && lensy_system_weighted(sys)) share = 1.0 / (e->order1 - e->order0 + 1);
+
+	// the rays are drawn to the intersect point, so none are rejected early
+	bound = (h == NULL) && (sys->line == NULL) && lensy_element_bound(e, &bd);
+	n_rejected = 0;
+	if ((h == NULL) && (sys->reject != NULL)) sys->reject->n[j] += b->n;
+
+	wl = -1.0;
+	ratio = 1.0;
+	w = 0;
+	lensy_throughput_init(&tp, sys, j);
+	in = lost = out = 0.0;
+
+	for (i = 0; i < b->n; i++) {
+		lensy_bundle_get(b, i, &ray);
+		in += b->weight[i];
+
+		if (h != NULL) {
+			u = h->map[i];
+			rc = h->rc[u];
+			for (k = 0; k < 3; k++) {
+				q[k] = h->q[k][u];
+				n[k] = h->n[k][u];
+			}
+		} else if (bound && lensy_kernel_bound_miss(&bd, &ray)) {
+			n_rejected++;
+			lost += b->weight[i];
+			continue;
+		} else {
+			rc = lensy_element_intersect(e, &ray, q, n);
+			if ((sys->line != NULL) && (rc >= -1))
+				sys->line(ray.p, q, ray.red, ray.green, ray.blue);
+		}
+		if (rc < 0) {
+			lost += b->weight[i];
+			continue;
+		}
+
+		if (e->redirect == LENSY_REFRACT)
+			lensy_kernel_ratio(e, sys->tier, ray.wavelength, &wl, &ratio);
+		f = lensy_kernel_throughput(&tp, ray.wavelength, ray.p, q);
+
+		if (!fan) {
+			rc = lensy_step_redirect(sys, e, &ray, q, n, ratio, e->order0);
+			if (rc < 0) {
+				lost += b->weight[i];
+				continue;
+			}
+
+			lensy_bundle_set(b, w, &ray);
+			b->path[w] = b->path[i];
+			b->weight[w] = b->weight[i] * f;
+			out += b->weight[w];
+			w++;
+			continue;
+		}
+
+		//--- one new ray for each grating order
+		memcpy(&ray0, &ray, sizeof(ray));
+
+		if (lensy_bundle_reserve(tmp, tmp->n + e->order1 - e->order0 + 1) < 0)
+			return -1;
+
+		for (m = e->order0; m <= e->order1; m++) {
+			memcpy(&ray, &ray0, sizeof(ray));
+			rc = lensy_step_redirect(sys, e, &ray, q, n, ratio, m);
+			if (rc < 0) {
+				lost += b->weight[i] * share;
+				continue;
+			}
+
+			lensy_bundle_set(tmp, tmp->n, &ray);
+			tmp->path[tmp->n] = LENSY_PATH_ORDER(b->path[i], m);
+			tmp->weight[tmp->n] = b->weight[i] * share * f;
+			out += tmp->weight[tmp->n];
+			tmp->n++;
+		}
+	}
+	if (sys->reject != NULL) sys->reject->rejected[j] += n_rejected;
+	if (sys->budget != NULL) {
+		sys->budget->in[j] += in;
+		sys->budget->lost[j] += lost;
+		sys->budget->out[j] += out;
+	}
+
+	if (!fan) {
+		b->n = w;
+		return w;
+	}
+
+	memcpy(&swap, b, sizeof(swap));
+	memcpy(b, tmp, sizeof(swap));
+	memcpy(tmp, &swap, sizeof(swap));
+	return b->n;
+}
+
+
+/*------------------------------------------------------- lensy_bundle_view
+ * Make 'v' a bundle of the 'n' rays of bundle 'b' from ray i0 on, which
+ * uses the memory of 'b'. The view is borrowed, and is not traced through
+ * a fan of grating orders.
+ */
+static void lensy_bundle_view(struct lensy_bundle_struct *v,
+				struct lensy_bundle_struct *b, int32_t i0, int32_t n)
+{
+	int32_t k;
+
+	for (k = 0; k < 3; k++) {
+		v->p[k] = b->p[k] + i0;
+		v->d[k] = b->d[k] + i0;
+	}
+	v->wavelength = b->wavelength + i0;
+	v->path = b->path + i0;
+	v->weight = b->weight + i0;
+	v->red = b->red + i0;
+	v->green = b->green + i0;
+	v->blue = b->blue + i0;
+	v->n = v->nmax = n;
+	v->borrowed = true;
+}
+
+
+/*------------------------------------------------------- lensy_bundle_span
+ * Copy the 'n' rays of bundle 'src' from ray i on to bundle 'dst' from
+ * ray j on. The bundles may be the same, and the rays may overlap.
+ */
+static void lensy_bundle_span(struct lensy_bundle_struct *dst, int32_t j,
+				struct lensy_bundle_struct *src, int32_t i, int32_t n)
+{
+	int32_t k;
+
+	if ((n <= 0) || ((dst->p[0] == src->p[0]) && (i == j))) return;
+	for (k = 0; k < 3; k++) {
+		memmove(dst->p[k] + j, src->p[k] + i, n * sizeof(double));
+		memmove(dst->d[k] + j, src->d[k] + i, n * sizeof(double));
+	}
+	memmove(dst->wavelength + j, src->wavelength + i, n * sizeof(double));
+	memmove(dst->path + j, src->path + i, n * sizeof(uint64_t));
+	memmove(dst->weight + j, src->weight + i, n * sizeof(double));
+	memmove(dst->red + j, src->red + i, n);
+	memmove(dst->green + j, src->green + i, n);
+	memmove(dst->blue + j, src->blue + i, n);
+}
+
+
+/*------------------------------------------------------- lensy_trace_range
+ * Take the rays of bundle 'b' through the elements j0, ..., j1 - 1 of the
+ * system, using 'tmp' for fanned out gratings.
+ *
+ * If the system has a chunk size (sys->chunk > 0), the rays are taken
+ * through all of the elements a chunk at a time, so that a chunk stays in
+ * the processor cache from one element to the next, instead of the whole
+ * bundle going through memory once for each element. The rays that are
+ * left are in the same order either way. Without a grating fan out, each
+ * chunk is traced in place in the bundle; with one, the chunk is copied
+ * to a bundle of its own, and the results collected in a new bundle.
+ *
+ * The return value is the number of rays left, or -1 if realloc failed.
+ */
+static int32_t lensy_trace_range(struct lensy_system_struct *sys,
+				int32_t j0, int32_t j1,
+				struct lensy_bundle_struct *b,
+				struct lensy_bundle_struct *tmp)
+{
+	int32_t i0, j, n, w, rc;
+	struct lensy_bundle_struct v, out;
+	struct lensy_element_struct *e;
+	bool fan;
+
+	rc = b->n;
+	if ((sys->chunk <= 0) || (b->n <= sys->chunk)) {
+		for (j = j0; (j < j1) && (rc >= 0); j++)
+			rc = lensy_trace_step(sys, j, b, tmp, NULL);
+		return rc;
+	}
+
+	for (fan = false, j = j0; j < j1; j++) {
+		e = &sys->e[j];
+		if ((e->redirect == LENSY_DIFFRACT) && (e->order0 < e->order1)) fan = true;
+	}
+
+	//------ traced in place, and moved down over the lost rays
+	if (!fan) {
+		for (i0 = w = 0; i0 < b->n; i0 += sys->chunk) {
+			n = (i0 + sys->chunk < b->n) ? sys->chunk : b->n - i0;
+			lensy_bundle_view(&v, b, i0, n);
+			for (j = j0; (j < j1) && (v.n > 0); j++)
+				lensy_trace_step(sys, j, &v, tmp, NULL);
+			lensy_bundle_span(b, w, &v, 0, v.n);
+			w += v.n;
+		}
+		b->n = w;
+		return w;
+	}
+
+	//------ traced in a chunk bundle, and collected in 'out'
+	memset(&v, 0, sizeof(v));
+	memset(&out, 0, sizeof(out));
+	rc = -1;
+	for (i0 = 0; i0 < b->n; i0 += sys->chunk) {
+		n = (i0 + sys->chunk < b->n) ? sys->chunk : b->n - i0;
+		if (lensy_bundle_reserve(&v, n) < 0) goto done;
+		lensy_bundle_span(&v, 0, b, i0, n);
+		v.n = n;
+
+		for (j = j0; (j < j1) && (v.n > 0); j++)
+			if (lensy_trace_step(sys, j, &v, tmp, NULL) < 0) goto done;
+
+		if (lensy_bundle_reserve(&out, out.n + v.n) < 0) goto done;
+		lensy_bundle_span(&out, out.n, &v, 0, v.n);
+		out.n += v.n;
+	}
+
+	// the old rays end up in 'out', which is freed below
+	lensy_bundle_free(&v);
+	memcpy(&v, b, sizeof(v));
+	memcpy(b, &out, sizeof(out));
+	memcpy(&out, &v, sizeof(v));
+	memset(&v, 0, sizeof(v));
+	rc = b->n;
+
+done:
+	lensy_bundle_free(&v);
+	lensy_bundle_free(&out);
+	return rc;
+}
+
+
+/*------------------------------------------------------- lensy_trace_elements
+ * Take the rays of bundle 'b' through the elements i0, ..., i1 - 1 of the
+ * system. Rays that miss a surface, or cannot be redirected, are removed
+ * from the bundle.
+ *
+ * The return value is the number of rays left, or -1 if realloc failed.
+ */
+int32_t lensy_trace_elements(struct lensy_system_struct *sys,
+				int32_t i0, int32_t i1,
+				struct lensy_bundle_struct *b)
+{
+	int32_t rc;
+	struct lensy_bundle_struct tmp;
+
+	memset(&tmp, 0, sizeof(tmp));
+
+	if (i1 > sys->n) i1 = sys->n;
+	rc = lensy_trace_range(sys, i0, i1, b, &tmp);
+
+	lensy_bundle_free(&tmp);
+	return rc;
+}
+
+
+/*------------------------------------------------------- lensy_geometry_hash
+ * Hash the start position and direction of ray 'i' of the bundle.
+ */
+static uint64_t lensy_geometry_hash(struct lensy_bundle_struct *b, int32_t i)
+{
+	uint64_t h, x;
+	int32_t k;
+
+	h = 0;
+	for (k = 0; k < 3; k++) {
+		memcpy(&x, &b->p[k][i], sizeof(x));
+		h = lensy_mix64(h ^ x);
+		memcpy(&x, &b->d[k][i], sizeof(x));
+		h = lensy_mix64(h ^ x);
+	}
+	return h;
+}
+
+
+/*------------------------------------------------------- lensy_same_geometry
+ * Return true if rays 'i' of bundle 'a' and 'j' of bundle 'b' have the
+ * same start position and direction.
+ */
+static inline bool lensy_same_geometry(struct lensy_bundle_struct *a, int32_t i,
+				struct lensy_bundle_struct *b, int32_t j)
+{
+	return (a->p[0][i] == b->p[0][j]) && (a->p[1][i] == b->p[1][j]) &&
+	       (a->p[2][i] == b->p[2][j]) && (a->d[0][i] == b->d[0][j]) &&
+	       (a->d[1][i] == b->d[1][j]) && (a->d[2][i] == b->d[2][j]);
+}
+
+
+/*------------------------------------------------------- lensy_trace_shared
+ * Take the bundle 'b' through the leading 'k' non-dispersive elements of
+ * the system, tracing each distinct ray geometry (start position and
+ * direction) only once, and then through the intersection with element
+ * 'k' (if any), which is also shared. The rays of the bundle are then
+ * redirected at element 'k' individually.
+ *
+ * If there are too few shared geometries to be worth it, '*shared' is set
+ * to false and the bundle is not changed. The rejected rays are not
+ * counted here (lensy_trace() does not share when they are).
+ *
+ * The return value is the number of rays left, or -1 if malloc failed.
+ */
+static int32_t lensy_trace_shared(struct lensy_system_struct *sys, int32_t k,
+				struct lensy_bundle_struct *b,
+				struct lensy_bundle_struct *tmp, bool *shared)
+{
+	int32_t i, j, u, w, n_uniq, n_hash, rc;
+	int32_t *map, *slot, *where;
+	uint64_t h;
+	double *hq;
+	double q[3], n[3];
+	struct lensy_bundle_struct g;
+	struct lensy_ray_struct ray;
+	struct lensy_hits_struct hits;
+	struct lensy_bound_struct bd;
+	bool bound;
+
+	rc = -1;
+	*shared = false;
+	n_hash = 64;
+	while (n_hash < 2 * b->n) n_hash *= 2;
+
+	memset(&g, 0, sizeof(g));
+	memset(&hits, 0, sizeof(hits));
+	map = (int32_t *) malloc(b->n * sizeof(int32_t));
+	slot = (int32_t *) malloc(n_hash * sizeof(int32_t));
+	where = NULL;
+	hq = NULL;
+	if ((map == NULL) || (slot == NULL)) goto done;
+	memset(slot, 0xff, n_hash * sizeof(int32_t));
+
+	//------ find the distinct geometries, g.path[u] is the row number u
+	for (i = 0; i < b->n; i++) {
+		h = lensy_geometry_hash(b, i) & (n_hash - 1);
+		while ((slot[h] >= 0) && !lensy_same_geometry(b, i, &g, slot[h]))
+			h = (h + 1) & (n_hash - 1);
+
+		if (slot[h] < 0) {
+			lensy_bundle_get(b, i, &ray);
+			if (lensy_bundle_add(&g, &ray, g.n) < 0) goto done;
+			slot[h] = g.n - 1;
+		} else {
+			// the last ray of a group gives the color for drawing
+			g.red[slot[h]] = b->red[i];
+			g.green[slot[h]] = b->green[i];
+			g.blue[slot[h]] = b->blue[i];
+		}
+		map[i] = slot[h];
+	}
+
+	if (2 * g.n > b->n) {		// not worth it
+		rc = b->n;
+		goto done;
+	}
+	*shared = true;
+	n_uniq = g.n;
+
+	//------ trace the distinct geometries through the shared elements
+	if (lensy_trace_elements(sys, 0, k, &g) < 0) goto done;
+
+	where = (int32_t *) malloc(n_uniq * sizeof(int32_t));
+	if (where == NULL) goto done;
+	for (u = 0; u < n_uniq; u++) where[u] = -1;
+	for (j = 0; j < g.n; j++) where[g.path[j]] = j;
+
+	//------ the shared intersections with element k
+	if (k < sys->n) {
+		hq = (double *) malloc(6 * (g.n > 0 ? g.n : 1) * sizeof(double));
+		hits.rc = (int32_t *) malloc((g.n > 0 ? g.n : 1) * sizeof(int32_t));
+		if ((hq == NULL) || (hits.rc == NULL)) goto done;
+		for (j = 0; j < 3; j++) {
+			hits.q[j] = hq + j * g.n;
+			hits.n[j] = hq + (3 + j) * g.n;
+		}
+
+		bound = (sys->line == NULL) && lensy_element_bound(&sys->e[k], &bd);
+		for (j = 0; j < g.n; j++) {
+			lensy_bundle_get(&g, j, &ray);
+			if (bound && lensy_kernel_bound_miss(&bd, &ray)) {
+				hits.rc[j] = -1;
+				memcpy(q, ray.p, sizeof(q));
+				memset(n, 0, sizeof(n));
+			} else {
+				hits.rc[j] = lensy_element_intersect(&sys->e[k], &ray, q, n);
+				if ((sys->line != NULL) && (hits.rc[j] >= -1))
+					sys->line(ray.p, q, ray.red, ray.green, ray.blue);
+			}
+			for (i = 0; i < 3; i++) {
+				hits.q[i][j] = q[i];
+				hits.n[i][j] = n[i];
+			}
+		}
+	}
+
+	//------ give the rays their traced geometry, and drop the lost ones
+	w = 0;
+	for (i = 0; i < b->n; i++) {
+		j = where[map[i]];
+		if (j < 0) continue;
+
+		b->p[0][w] = g.p[0][j];
+		b->p[1][w] = g.p[1][j];
+		b->p[2][w] = g.p[2][j];
+		b->d[0][w] = g.d[0][j];
+		b->d[1][w] = g.d[1][j];
+		b->d[2][w] = g.d[2][j];
+		b->wavelength[w] = b->wavelength[i];
+		b->path[w] = b->path[i];
+		b->weight[w] = b->weight[i];
+		b->red[w] = b->red[i];
+		b->green[w] = b->green[i];
+		b->blue[w] = b->blue[i];
+		map[w] = j;
+		w++;
+	}
+	b->n = w;
+
+	rc = b->n;
+	if (k < sys->n) {
+		hits.map = map;
+		rc = lensy_trace_step(sys, k, b, tmp, &hits);
+	}
+
+done:
+	free(hits.rc);
+	free(hq);
+	free(where);
+	free(slot);
+	free(map);
+	lensy_bundle_free(&g);
+	return rc;
+}
+
+
+/*------------------------------------------------------- lensy_trace
+ * Take the rays of bundle 'b' through all of the elements of the system.
+ * Rays that miss a surface, or cannot be redirected, are removed from the
+ * bundle, and a fanned out grating replaces each ray by one ray per order.
+ *
+ * The path of a ray only depends on the wavelength from the first
+ * dispersive element on (see lensy_element_dispersive()). Up to that
+ * element, the rays that share a start position and direction (for
+ * example, the same cone of rays at several wavelengths) are traced once,
+ * and are only separated at the first dispersive element. That is not
+ * done when the ray weights change or are summed (see
+ * lensy_system_weighted()), since the curves depend on the wavelength,
+ * or when the rejected rays are counted, since the counts are of rays,
+ * not of geometries.
+ *
+ * The return value is the number of rays left, or -1 if malloc failed.
+ */
+int32_t lensy_trace(struct lensy_system_struct *sys,
+				struct lensy_bundle_struct *b)
+{
+	int32_t j, k, rc;
+	struct lensy_bundle_struct tmp;
+	bool shared;
+
+	if (sys->tier == LENSY_TIER_FASTEST) return lensy_trace_fastest(sys, b);
+
+	memset(&tmp, 0, sizeof(tmp));
+
+	for (k = 0; k < sys->n; k++)
+		if (lensy_element_dispersive(&sys->e[k])) break;
+
+	rc = b->n;
+	shared = false;
+	if ((k > 0) && (b->n > 1) && !lensy_system_weighted(sys) && (sys->reject == NULL))
+		rc = lensy_trace_shared(sys, k, b, &tmp, &shared);
+
+	j = shared ? k + 1 : 0;
+
+	if (rc >= 0) rc = lensy_trace_range(sys, j, sys->n, b, &tmp);
+
+	lensy_bundle_free(&tmp);
+	return rc;
+}
+
+
+/*------------------------------------------------------- lensy_path_groups
+ * Group the rays of bundle 'b' by path identifier, in the order that the
+ * paths first appear. The group of ray i is returned in row[i], and the
+ * path identifier of group g in path[g]. Both arrays must have room for
+ * b->n entries.
+ *
+ * The return value is the number of groups, or -1 if malloc failed.
+ */
+static int32_t lensy_path_groups(struct lensy_bundle_struct *b, int32_t *row,
+				uint64_t *path)
+{
+	int32_t i, n, n_hash;
+	int32_t *slot;
+	uint64_t h;
+
+	n_hash = 64;
+	while (n_hash < 2 * b->n) n_hash *= 2;
+
+	slot = (int32_t *) malloc(n_hash * sizeof(int32_t));
+	if (slot == NULL) return -1;
+	memset(slot, 0xff, n_hash * sizeof(int32_t));
+
+	n = 0;
+	for (i = 0; i < b->n; i++) {
+		h = lensy_mix64(b->path[i]) & (n_hash - 1);
+		while ((slot[h] >= 0) && (path[slot[h]] != b->path[i]))
+			h = (h + 1) & (n_hash - 1);
+
+		if (slot[h] < 0) {
+			slot[h] = n;
+			path[n++] = b->path[i];
+		}
+		row[i] = slot[h];
+	}
+
+	free(slot);
+	return n;
+}
+
+
+/*------------------------------------------------------- lensy_spots
+ * Calculate the spot sizes for the rays of bundle 'b' (normally, after
+ * they have impacted the focal plane). Rays with the same path identifier
+ * belong to the same spot. The centroid and the RMS sizes are weighted by
+ * the ray weights; with all of the weights 1, the sums are the plain ones.
+ *
+ * An array of spot structures is allocated and returned in '*ps', and must
+ * be freed by the caller. The return value is the number of spots, or -1
+ * if malloc failed.
+ */
+int32_t lensy_spots(struct lensy_bundle_struct *b, struct lensy_spot_struct **ps)
+{
+	int32_t i, k, n;
+	int32_t *row;
+	uint64_t *path;
+	double w, w0[3];
+	struct lensy_spot_struct *spots, *pspot;
+
+	*ps = NULL;
+	row = (int32_t *) malloc((b->n > 0 ? b->n : 1) * sizeof(int32_t));
+	path = (uint64_t *) malloc((b->n > 0 ? b->n : 1) * sizeof(uint64_t));
+	spots = (struct lensy_spot_struct *) malloc((b->n > 0 ? b->n : 1) * sizeof(*spots));
+	n = -1;
+	if ((row != NULL) && (path != NULL) && (spots != NULL))
+		n = lensy_path_groups(b, row, path);
+	if (n < 0) {
+		free(row);
+		free(path);
+		free(spots);
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		memset(&spots[i], 0, sizeof(spots[i]));
+		spots[i].path = path[i];
+	}
+
+	//------ sum the weighted positions for each path
+	for (i = 0; i < b->n; i++) {
+		pspot = &spots[row[i]];
+		w = b->weight[i];
+		for (k = 0; k < 3; k++)
+			pspot->p[k] += w * b->p[k][i];
+		pspot->weight += w;
+		pspot->n++;
+	}
+
+	//---------------- find the centroid of the spots
+	for (i = 0; i < n; i++) {
+		if (spots[i].weight <= 0.0) continue;
+		for (k = 0; k < 3; k++)
+			spots[i].p[k] /= spots[i].weight;
+	}
+
+	//------------- calculate the sum of squares
+	for (i = 0; i < b->n; i++) {
+		pspot = &spots[row[i]];
+		w = b->weight[i];
+
+		for (k = 0; k < 3; k++) {
+			w0[k] = b->p[k][i] - pspot->p[k];
+			pspot->rms_v[k] += w * (w0[k] * w0[k]);
+		}
+		pspot->rms += w * lensy_dot3(w0, w0);
+	}
+
+	//---------------- calculate the RMS
+	for (i = 0; i < n; i++) {
+		if (spots[i].weight <= 0.0) continue;
+		for (k = 0; k < 3; k++)
+			spots[i].rms_v[k] = sqrt(spots[i].rms_v[k] / spots[i].weight);
+		spots[i].rms = sqrt(spots[i].rms / spots[i].weight);
+	}
+
+	free(row);
+	free(path);
+	*ps = spots;
+	return n;
+}
+
+
+/*------------------------------------------------------- lensy_focus
+ * Through-focus analysis of the rays of bundle 'b', after they have
+ * impacted a (detector) plane with the normal vector 'n'. Rays with the
+ * same path identifier belong to the same spot.
+ *
+ * Past the last surface the rays travel in straight lines, so if the
+ * plane is moved a distance t along 'n', ray i lands at
+ *
+ *	p_i + t * d_i / (d_i . n)
+ *
+ * and the squared RMS spot size is a quadratic in t. Its coefficients are
+ * calculated for each spot, so the spot size at any defocus (see
+ * lensy_focus_rms()), and the defocus t with the smallest RMS spot, are
+ * known without tracing the rays again. The sums are weighted by the ray
+ * weights, and rays parallel to the plane are left out.
+ *
+ * An array of focus structures is allocated and returned in '*pf', and
+ * must be freed by the caller. The return value is the number of spots,
+ * or -1 on error.
+ */
+int32_t lensy_focus(struct lensy_bundle_struct *b, double n[3],
+				struct lensy_focus_struct **pf)
+{
+	int32_t i, k, m;
+	int32_t *row;
+	uint64_t *path;
+	double d0, d1, w, w0[3], w1[3], nn[3];
+	struct lensy_focus_struct *focus, *pfocus;
+
+	*pf = NULL;
+	d0 = lensy_norm3(n);
+	if (d0 == 0.0) {
+		fprintf(stderr, "%s: invalid plane normal vector\n", __func__);
+		return -1;
+	}
+	nn[0] = n[0] / d0;
+	nn[1] = n[1] / d0;
+	nn[2] = n[2] / d0;
+
+	row = (int32_t *) malloc((b->n > 0 ? b->n : 1) * sizeof(int32_t));
+	path = (uint64_t *) malloc((b->n > 0 ? b->n : 1) * sizeof(uint64_t));
+	focus = (struct lensy_focus_struct *) malloc((b->n > 0 ? b->n : 1) * sizeof(*focus));
+	m = -1;
+	if ((row != NULL) && (path != NULL) && (focus != NULL))
+		m = lensy_path_groups(b, row, path);
+	if (m < 0) {
+		free(row);
+		free(path);
+		free(focus);
+		return -1;
+	}
+
+	for (i = 0; i < m; i++) {
+		memset(&focus[i], 0, sizeof(focus[i]));
+		focus[i].path = path[i];
+	}
+
+	//------ sum the positions, and the displacements per unit of defocus
+	for (i = 0; i < b->n; i++) {
+		w0[0] = b->d[0][i];
+		w0[1] = b->d[1][i];
+		w0[2] = b->d[2][i];
+		d0 = lensy_dot3(w0, nn);
+		if (fabs(d0) <= DBL_EPSILON * lensy_norm3(w0)) {
+			row[i] = -1;
+			continue;
+		}
+
+		pfocus = &focus[row[i]];
+		w = b->weight[i];
+		for (k = 0; k < 3; k++) {
+			pfocus->p[k] += w * b->p[k][i];
+			pfocus->u[k] += w * (w0[k] / d0);
+		}
+		pfocus->weight += w;
+		pfocus->n++;
+	}
+
+	//---------------- find the centroids
+	for (i = 0; i < m; i++) {
+		if (focus[i].weight <= 0.0) continue;
+		for (k = 0; k < 3; k++) {
+			focus[i].p[k] /= focus[i].weight;
+			focus[i].u[k] /= focus[i].weight;
+		}
+	}
+
+	//------------- sum the coefficients of the quadratics
+	for (i = 0; i < b->n; i++) {
+		if (row[i] < 0) continue;
+		pfocus = &focus[row[i]];
+		w = b->weight[i];
+
+		d0 = b->d[0][i] * nn[0] + b->d[1][i] * nn[1] + b->d[2][i] * nn[2];
+		for (k = 0; k < 3; k++) {
+			w0[k] = b->p[k][i] - pfocus->p[k];
+			w1[k] = b->d[k][i] / d0 - pfocus->u[k];
+			pfocus->c[k][0] += w * (w0[k] * w0[k]);
+			pfocus->c[k][1] += w * (w0[k] * w1[k]);
+			pfocus->c[k][2] += w * (w1[k] * w1[k]);
+		}
+	}
+
+	//---------------- the best focus of each spot
+	for (i = 0; i < m; i++) {
+		if (focus[i].weight <= 0.0) continue;
+
+		d0 = d1 = 0.0;
+		for (k = 0; k < 3; k++) {
+			focus[i].c[k][0] /= focus[i].weight;
+			focus[i].c[k][1] /= focus[i].weight;
+			focus[i].c[k][2] /= focus[i].weight;
+			d0 += focus[i].c[k][1];
+			d1 += focus[i].c[k][2];
+		}
+		focus[i].t = (d1 > 0.0) ? -d0 / d1 : 0.0;
+		focus[i].rms = lensy_focus_rms(&focus[i], focus[i].t, NULL);
+	}
+
+	free(row);
+	free(path);
+	*pf = focus;
+	return m;
+}
+
+
+/*------------------------------------------------------- lensy_focus_rms
+ * Return the RMS spot size of 'f' when the plane is moved the distance
+ * 't' along its normal vector. The RMS sizes for x, y, z are returned in
+ * rms_v[], unless it is NULL. The centroid is then at f->p + t * f->u.
+ */
+double lensy_focus_rms(struct lensy_focus_struct *f, double t, double rms_v[3])
+{
+	int32_t k;
+	double d0, d1;
+
+	d1 = 0.0;
+	for (k = 0; k < 3; k++) {
+		d0 = f->c[k][0] + t * (2.0 * f->c[k][1] + t * f->c[k][2]);
+		if (d0 < 0.0) d0 = 0.0;		// rounding
+		if (rms_v != NULL) rms_v[k] = sqrt(d0);
+		d1 += d0;
+	}
+	return sqrt(d1);
+}
+
+
+/*------------------------------------------------------- lensy_focus_best
+ * Return the plane position t (along the normal vector given to
+ * lensy_focus()) where the mean square spot size of the 'n' spots in
+ * f[] is the smallest. Spots of fewer than two rays are not counted. The
+ * RMS spot size there is returned in '*rms', unless it is NULL.
+ */
+double lensy_focus_best(struct lensy_focus_struct f[], int32_t n, double *rms)
+{
+	int32_t i, k, m;
+	double d0, d1, t;
+
+	m = 0;
+	d0 = d1 = 0.0;
+	for (i = 0; i < n; i++) {
+		if (f[i].n <= 1) continue;
+		for (k = 0; k < 3; k++) {
+			d0 += f[i].c[k][1];
+			d1 += f[i].c[k][2];
+		}
+		m++;
+	}
+	t = (d1 > 0.0) ? -d0 / d1 : 0.0;
+
+	if (rms != NULL) {
+		d0 = 0.0;
+		for (i = 0; i < n; i++) {
+			if (f[i].n <= 1) continue;
+			d1 = lensy_focus_rms(&f[i], t, NULL);
+			d0 += d1 * d1;
+		}
+		*rms = (m > 0) ? sqrt(d0 / m) : 0.0;
+	}
+	return t;
+}
+
+
+/*------------------------------------------------------- lensy_element_equal
+ * Return true if the elements 'e0' and 'e1' are the same, field by field
+ * (a memcmp() of the whole structures would compare the padding too).
+ * The surface structures are all doubles, without padding.
+ */
+static bool lensy_element_equal(struct lensy_element_struct *e0,
+				struct lensy_element_struct *e1)
+{
+	return (e0->type == e1->type) && (e0->redirect == e1->redirect) &&
+	       (memcmp(&e0->s, &e1->s, lensy_surface_size(e0->type)) == 0) &&
+	       (e0->m0 == e1->m0) && (e0->m1 == e1->m1) &&
+	       (memcmp(e0->a, e1->a, sizeof(e0->a)) == 0) &&
+	       (e0->order0 == e1->order0) && (e0->order1 == e1->order1) &&
+	       (e0->efficiency == e1->efficiency);
+}
+
+
+/*------------------------------------------------------- lensy_trace_configs
+ * Trace the rays of bundle 'b' through 'k' configurations of an optical
+ * system at once, for example the steps of a focus sweep. The systems
+ * sys[0], ..., sys[k - 1] must have the same number of elements.
+ *
+ * The leading elements that are identical in all of the configurations
+ * are traced once (with lensy_trace(), so the sharing of the achromatic
+ * prefix applies as well). From the first element that differs, the
+ * rays are copied into one bundle per configuration, out[0], ...,
+ * out[k - 1], which are traced separately. The output bundles must be
+ * initialized (they may be empty), and the bundle 'b' is not changed.
+ * Only sys[0].line is used for drawing the shared elements, and each
+ * configuration uses its own for the rest.
+ *
+ * The return value is the number of shared elements, or -1 on error.
+ */
+int32_t lensy_trace_configs(struct lensy_system_struct sys[], int32_t k,
+				struct lensy_bundle_struct *b,
+				struct lensy_bundle_struct out[])
+{
+	int32_t i, j, c, rc;
+	struct lensy_system_struct *shared;
+	struct lensy_bundle_struct sb;
+
+	if (k <= 0) return -1;
+	for (j = 1; j < k; j++) {
+		if (sys[j].n != sys[0].n) {
+			fprintf(stderr, "%s: configurations differ in length\n", __func__);
+			return -1;
+		}
+	}
+
+	//------ the number of leading elements common to all configurations
+	for (c = 0; c < sys[0].n; c++) {
+		for (j = 1; j < k; j++)
+			if (!lensy_element_equal(&sys[j].e[c], &sys[0].e[c]))
+				break;
+		if (j < k) break;
+	}
+
+	shared = (struct lensy_system_struct *) malloc(sizeof(*shared));
+	if ((shared == NULL) || (lensy_bundle_init(&sb, b->n) < 0)) {
+		free(shared);
+		return -1;
+	}
+	memcpy(shared, &sys[0], sizeof(*shared));
+	shared->n = c;
+
+	for (i = 0; i < b->n; i++)
+		lensy_bundle_copy(&sb, i, b, i);
+	sb.n = b->n;
+
+	rc = lensy_trace(shared, &sb);
+
+	for (j = 0; (j < k) && (rc >= 0); j++) {
+		if (lensy_bundle_clone(&out[j], &sb) < 0) {
+			rc = -1;
+			break;
+		}
+		rc = lensy_trace_elements(&sys[j], c, sys[j].n, &out[j]);
+	}
+
+	lensy_bundle_free(&sb);
+	free(shared);
+	return (rc < 0) ? -1 : c;
+}
@@ -0,0 +1,163 @@
+/*
+ * lensy_vec3.h - v1.4 (codename FlamingMarshmallow)
+ *
+ * Inline 3-D vector functions, for the arrays double[3] that the library
+ * uses for positions and directions, and for the value type lensy_vec3.
+ *
+ *-----------------------------------------------------------------------
+ * Copyright (C) 2013 - 2015 FSF
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *-----------------------------------------------------------------------
+ *
+ * lensy_inner3(), lensy_mag3() and lensy_cross3() are functions in
+ * liblensy.a, and a call to them from another file cannot be inlined.
+ * The functions here are the same calculations (in the same order, so
+ * the results are identical), as static inline functions. The library
+ * functions are kept, and call these.
+ *
+ * The pointer arguments are restrict: the result of lensy_vcross3() must
+ * not be one of its inputs.
+ *
+ * Send questions or contributions to me at <michael.h.williamson@gmail.com>.
+ *
+ * History:
+ *
+ *  2026-10-16  This file is created.
+ */
+
+#ifndef LENSY_VEC3_H
+#define LENSY_VEC3_H	1
+
+#include <math.h>
+
+
+//------------------------------ 3-D vector value type
+typedef struct {
+	double x, y, z;
+} lensy_vec3;
+
+
+//--------------------------------------------------- lensy_dot3
+static inline double lensy_dot3(const double *restrict a, const double *restrict b)
+{
+	return (a[0]*b[0] + a[1]*b[1] + a[2]*b[2]);
+}
+
+
+//--------------------------------------------------- lensy_norm3
+static inline double lensy_norm3(const double *restrict a)
+{
+	return (sqrt(lensy_dot3(a, a)));
+}
+
+
+//--------------------------------------------------- lensy_vcross3
+static inline void lensy_vcross3(const double *restrict a, const double *restrict b,
+				double *restrict r)
+{
+	r[0] =   a[1]*b[2] - b[1]*a[2];
+	r[1] = -(a[0]*b[2] - b[0]*a[2]);
+	r[2] =   a[0]*b[1] - b[0]*a[1];
+}
+
+
+//--------------------------------------------------- lensy_v3
+static inline lensy_vec3 lensy_v3(double x, double y, double z)
+{
+	lensy_vec3 v = { x, y, z };
+	return v;
+}
+
+
+//--------------------------------------------------- lensy_v3_load
+static inline lensy_vec3 lensy_v3_load(const double *restrict a)
+{
+	return lensy_v3(a[0], a[1], a[2]);
+}
+
+
+//--------------------------------------------------- lensy_v3_store
+static inline void lensy_v3_store(double *restrict a, lensy_vec3 v)
+{
+	a[0] = v.x;
+	a[1] = v.y;
+	a[2] = v.z;
+}
+
+
+//--------------------------------------------------- lensy_v3_add
+static inline lensy_vec3 lensy_v3_add(lensy_vec3 a, lensy_vec3 b)
+{
+	return lensy_v3(a.x + b.x, a.y + b.y, a.z + b.z);
+}
+
+
+//--------------------------------------------------- lensy_v3_sub
+static inline lensy_vec3 lensy_v3_sub(lensy_vec3 a, lensy_vec3 b)
+{
+	return lensy_v3(a.x - b.x, a.y - b.y, a.z - b.z);
+}
+
+
+//--------------------------------------------------- lensy_v3_scale
+static inline lensy_vec3 lensy_v3_scale(double s, lensy_vec3 a)
+{
+	return lensy_v3(s * a.x, s * a.y, s * a.z);
+}
+
+
+//--------------------------------------------------- lensy_v3_div
+static inline lensy_vec3 lensy_v3_div(lensy_vec3 a, double s)
+{
+	return lensy_v3(a.x / s, a.y / s, a.z / s);
+}
+
+
+//--------------------------------------------------- lensy_v3_madd
+// a + s * b
+static inline lensy_vec3 lensy_v3_madd(lensy_vec3 a, double s, lensy_vec3 b)
+{
+	return lensy_v3(a.x + s * b.x, a.y + s * b.y, a.z + s * b.z);
+}
+
+
+//--------------------------------------------------- lensy_v3_neg
+static inline lensy_vec3 lensy_v3_neg(lensy_vec3 a)
+{
+	return lensy_v3(-a.x, -a.y, -a.z);
+}
+
+
+//--------------------------------------------------- lensy_v3_dot
+static inline double lensy_v3_dot(lensy_vec3 a, lensy_vec3 b)
+{
+	return (a.x*b.x + a.y*b.y + a.z*b.z);
+}
+
+
+//--------------------------------------------------- lensy_v3_mag
+static inline double lensy_v3_mag(lensy_vec3 a)
+{
+	return (sqrt(lensy_v3_dot(a, a)));
+}
+
+
+//--------------------------------------------------- lensy_v3_cross
+static inline lensy_vec3 lensy_v3_cross(lensy_vec3 a, lensy_vec3 b)
+{
+	return lensy_v3(a.y*b.z - b.y*a.z, -(a.x*b.z - b.x*a.z), a.x*b.y - b.x*a.y);
+}
+
+#endif
@@ -71,12 +71,34 @@
  * Viewing the FITS file can be done with the display program 'ds9', for
  * example.
  *
+ * With the environment variable LENSY_CODEGEN set to a directory, the
+ * program also compiles a trace function for the system into it (see
+ * lensy_codegen.c), and compares it with lensy_trace().
+ *
  * Send questions or contributions to me at <michael.h.williamson@gmail.com>.
  *
  *
  *
  * Change log:
  *
+ *   2026-10-16  The generated trace function is only tried when
+ *               LENSY_CODEGEN names a directory for it.
+ *   2026-10-16  Draw the surfaces with lensy_hit_t_X(), which leaves out the
+ *               surface normal.
+ *   2026-10-16  Show the rays rejected early by the aperture bound of each
+ *               element.
+ *   2026-10-16  Show the throughput budget of the first focus step, with
+ *               the mirror, grating and detector efficiency curves.
+ *   2026-10-16  Validate the kernel tiers against the reference tier.
+ *   2026-10-16  Time the single precision trace, and report its accuracy.
+ *   2026-10-16  Time and check the trace in surface-local frames.
+ *   2026-10-16  Time and check the trace function that is generated for
+ *               the system.
+ *   2026-10-16  Show the ray trace throughput with and without chunks.
+ *   2026-10-16  All of the focus steps are traced in one pass, with
+ *               lensy_trace_configs().
+ *   2026-10-16  The surfaces are listed in a lensy_system_struct, and the
+ *               rays are traced as a bundle with lensy_trace().
  *   2015-07-01  Modified for use with separate library functions & SDL2.
  *   2011-03-13  Added functions ray_cone() and ray_beam().
  *   2010-10-28  Added a line list for 3-D rendering in the graphic window.
@@ -137,8 +159,26 @@ float focus_scale = 80.0e-3/640;	// meter/pixel for display
  * through the optics.
  */
 
-double in_air		= 1.000293;	// index of refraction for air
-double in_vacuum	= 1.000;	// index of refraction for vacuum
+struct lensy_medium_struct air = { 1.000293, NULL, NULL };	// index of refraction for air
+struct lensy_medium_struct vacuum = { 1.000, NULL, NULL };	// index of refraction for vacuum
+
+//---------------------------- camera lens glasses
+struct lensy_medium_struct caf2 = { 0.0, CaF2, NULL };
+struct lensy_medium_struct glass2 = { 0.0, tsu2, NULL };
+struct lensy_medium_struct glass4 = { 0.0, tsu4, NULL };
+struct lensy_medium_struct glass5 = { 0.0, tsu5, NULL };
+struct lensy_medium_struct glass6 = { 0.0, tsu6, NULL };
+struct lensy_medium_struct glass7 = { 0.0, tsu7, NULL };
+struct lensy_medium_struct silica = { 0.0, fsilica, NULL };
+
+//---------------------------- efficiency curves, against the wavelength in meters
+double eff_wl[5] = { 450e-9, 500e-9, 550e-9, 650e-9, 750e-9 };
+double silver_r[5] = { 0.950, 0.965, 0.970, 0.975, 0.980 };	// protected silver mirrors
+double echelle_e[5] = { 0.60, 0.65, 0.68, 0.67, 0.63 };		// echelle, at the blaze
+double crossdisp_e[5] = { 0.55, 0.68, 0.75, 0.73, 0.66 };	// cross disperser, order +1
+double ccd_qe[5] = { 0.70, 0.80, 0.85, 0.88, 0.80 };		// detector quantum efficiency
+
+struct lensy_curve_struct silver, echelle, crossdisp_eff, quantum_eff;
 
 //---------------------------- point source list
 struct ptsource_struct {
@@ -197,25 +237,32 @@ struct ptsource_struct pts[NMAX_PTS] = {
 int32_t n_pts;
 
 
-LIST_HEAD(raylist);
+#define	NMAX_CONFIGS	6	// the number of focus steps
+
+struct lensy_bundle_struct rays;	// the rays being traced
+struct lensy_system_struct sys[NMAX_CONFIGS];	// the optical elements, for each focus step
+struct lensy_bundle_struct lanes[NMAX_CONFIGS];	// the traced rays, for each focus step
 
 #define	NMAX_ASS	1000
 
 double ass[3][NMAX_ASS];	// array of spot sizes
 int32_t n_ass;
 
+struct lensy_spot_struct *spots;
+int32_t n_spots;
 
-LIST_HEAD(spotsize_list);
+struct lensy_focus_struct *focus;
+int32_t n_focus;
 
-struct spotsize_struct {
-	double p[3];
-	int32_t n;
-	double rms, rms_v[3];
-	struct list_head spotsize_list;
-} spotsize, *pspotsize;
-
-
-ENTRY he, *phe;
+struct lensy_system_struct bench;	// for timing the ray trace
+struct lensy_bundle_struct bench_rays, bench_ref;
+struct lensy_codegen_struct codegen;	// generated trace function
+char *codegen_dir;			// its modules ($LENSY_CODEGEN), or NULL
+struct lensy_frames_struct frames;	// surface-local frames
+struct lensy_tier_report_struct tier_report;	// kernel tier accuracy
+struct lensy_reject_struct reject;	// rays rejected early, per element
+struct lensy_budget_struct budget;	// ray weights at each element
+int64_t n_segments;			// ray segments traced
 
 
 LIST_HEAD(line_list);		// list for rendering in 3-D in graphic window
@@ -245,6 +292,15 @@ void plot(double x, double y, char red, char green, char blue)
 }
 
 
+/*---------------------------------------------------- count_segment
+ * Count the ray segments of a trace (instead of drawing them).
+ */
+void count_segment(double p0[3], double p1[3], char red, char green, char blue)
+{
+	n_segments++;
+}
+
+
 /*---------------------------------------------------- line
  * Plot a line on the graphics window.
  *
@@ -286,21 +342,22 @@ void line(double p0[3], double p1[3], char red, char green, char blue)
 //---------------------------------------------------- main
 int main(int argc, char *argv[])
 {
-	int32_t i, j, k, i0;
+	int32_t i, j, k, n, i0;
 	FILE *fp;
-	struct lensy_ray_struct ray, *pray;
+	struct lensy_ray_struct ray;
 	struct list_head *pos, *pos0;
 	char s80[80], s100[100], s200[200];
 //	char red, green, blue;
 	bool draw;
 //	double wavelength, best_focus;
-	double d0, d1, d2;
+	double d0, d1, d2, t;
 	double dd0, dd1, dd2;
-	double w0[3], w1[3], w2[3], u0[3], u1[3], u2[3];
+	struct timespec t0, t1;
+	double w0[3], w1[3], w2[3], w3[3], u0[3], u1[3], u2[3];
 	struct lensy_paraboloid_struct pm;
-	struct lensy_sphere_struct sp[12];
-	struct lensy_cylinder_struct cyl;
-	struct lensy_plane_struct pl;
+	struct lensy_sphere_struct sp[NMAX_CONFIGS][12];
+	struct lensy_cylinder_struct cyl[NMAX_CONFIGS];
+	struct lensy_plane_struct pl[NMAX_CONFIGS];
 	int32_t nr_hdr;
 	char hdr[180][80], zeros[2880];
 	int x0, y0;
@@ -379,6 +436,10 @@ int main(int argc, char *argv[])
 	lensy_init_ccd(&ccd1);
 	memset(ccd1.b, 0, ccd1.b_size);
 
+	if (lensy_bundle_init(&rays, 100000) < 0) {
+		fprintf(stderr, "malloc ray bundle failed\n");
+		exit(-1);
+	}
 
 	memset(zeros, 0, sizeof(zeros));
 	strcpy(s80, "");
@@ -441,26 +502,7 @@ int main(int argc, char *argv[])
 	dd1 =  0.0e-3;
 	dd2 =  0.0e-3;
 
-ray_trace_loop:
-	SDL_SetRenderDrawColor(optic_ren, 0, 0, 0, 255);
-	SDL_RenderClear(optic_ren);
-
-	SDL_SetRenderDrawColor(focus_ren, 0, 0, 0, 255);
-	SDL_RenderClear(focus_ren);
-
 	memcpy(&pm, &collimator2, sizeof(pm));
-	memcpy(&sp, &sp1, sizeof(sp));
-	memcpy(&cyl, &cyl1, sizeof(cyl));
-	memcpy(&pl, &ccd1.p, sizeof(pl));
-
-	sp[9].v[0] 	+= dd0;
-	sp[10].v[0] 	+= dd0;
-	sp[11].v[0] 	+= dd0 + dd1;
-	if (sp[11].v[0] - sp[10].v[0] < 4.0e-3) return (-1);	// minimum spacing
-
-	cyl.v[0] 	+= dd0 + dd1;
-	pl.v[0] 	+= dd0 + dd1 + dd2;
-	if (pl.v[0] - cyl.v[0] < 4.0e-3) return (-1);		// minimum spacing
 
 #if 0
 	/*------------------------ realignment test
@@ -482,20 +524,17 @@ ray_trace_loop:
 	pm.f[2] +=  0.0;
 #endif
 
-	n_ass = 0;
-
 	/*
-	 * Create a cone of rays, in a linked list.
-	 * The raylist is generated and erased for each iteration of the ray
-	 * trace loop.
+	 * Create a cone of rays, in a ray bundle. Each point source is a
+	 * separate path, for the spot size calculation.
+	 * The bundle is filled once, and the rays are traced through all of
+	 * the focus steps.
 	 *
 	 * The source for the spectrograph is a polished optic fiber. To model
 	 * that accurately here would require multiple cones with slightly
 	 * different positions (ray.p[]) to account for the fiber diameter.
 	 * A simplification is to use a point source.
 	 */
-	j = 0;
-
 	for (i = 0; i < n_pts; i++) {
 		ray.p[0] = pts[i].p[0];
 		ray.p[1] = pts[i].p[1];
@@ -510,23 +549,7 @@ ray_trace_loop:
 		ray.green	= pts[i].green;
 		ray.blue	= pts[i].blue;
 
-		j += lensy_cone(&raylist, &ray, pts[i].cone_dia, pts[i].cone_step);
-	}
-	printf("rays %d\n", j);
-
-	//--------------- collimator1
-	list_for_each_safe(pos, pos0, &raylist) {
-		pray = list_entry(pos, struct lensy_ray_struct, raylist);
-
-		i = lensy_intersect_paraboloid(pray, &collimator1, w0, w1);
-		if (draw)
-			line(pray->p, w0, pray->red, pray->green, pray->blue);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-		lensy_redirect_reflect(pray, w0, w1);
+		lensy_cone_bundle(&rays, &ray, pts[i].cone_dia, pts[i].cone_step, i);
 	}
 
 	/*---------------- echelle grating
@@ -547,362 +570,96 @@ ray_trace_loop:
 	w2[1] = d1*w2[1]/d0;
 	w2[2] = d1*w2[2]/d0;
 
-	list_for_each_safe(pos, pos0, &raylist) {
-		pray = list_entry(pos, struct lensy_ray_struct, raylist);
-
-		i = lensy_intersect_plane(pray, &echelleg, w0, w1);
-		if (draw)
-			line(pray->p, w0, pray->red, pray->green, pray->blue);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-
-		/*--------------------------------
-		 * The original ray is deleted and here a bunch of new rays are created
-		 * and added to the raylist for a range of reflected orders off of the
-		 * grating.
-		 */
-		memcpy(&ray, pray, sizeof(struct lensy_ray_struct));
-		list_del(pos);
-		free(pray);
-
-		for (j = 40; j < 100; j++) {
-			pray = (struct lensy_ray_struct *) malloc (sizeof(struct lensy_ray_struct));
-			if (pray == NULL) continue;
-
-			memcpy(pray, &ray, sizeof(struct lensy_ray_struct));
-			sprintf (s100, "%d", j);
-			i = sizeof(pray->pathkey) - strlen(pray->pathkey) - 1;
-			strncat (pray->pathkey, s100, i);
-
-			i = lensy_redirect_diffract(pray, w0, w1, w2, pray->wavelength, pray->wavelength, j);
-			if (i < 0) {
-				free(pray);
-				continue;
-			}
-			list_add(&(pray->raylist), &raylist);
-		}
-	}
-
-	//--------------- collimator1 again
-	list_for_each_safe(pos, pos0, &raylist) {
-		pray = list_entry(pos, struct lensy_ray_struct, raylist);
-
-		i = lensy_intersect_paraboloid(pray, &collimator1, w0, w1);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-		if (draw)
-			line(pray->p, w0, pray->red, pray->green, pray->blue);
-		lensy_redirect_reflect(pray, w0, w1);
-	}
-
-	//--------------- fold mirror
-	list_for_each_safe(pos, pos0, &raylist) {
-		pray = list_entry(pos, struct lensy_ray_struct, raylist);
-
-		i = lensy_intersect_plane(pray, &foldm, w0, w1);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-		if (draw)
-			line(pray->p, w0, pray->red, pray->green, pray->blue);
-		lensy_redirect_reflect(pray, w0, w1);
-	}
-
-	//--------------- collimator2
-	list_for_each_safe(pos, pos0, &raylist) {
-		pray = list_entry(pos, struct lensy_ray_struct, raylist);
-
-		i = lensy_intersect_paraboloid(pray, &pm, w0, w1);	// &collimator2
-		if (draw)
-			line(pray->p, w0, pray->red, pray->green, pray->blue);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-		lensy_redirect_reflect(pray, w0, w1);
-	}
-
 	//---------------- cross-dispersion grating
-	w2[0] = +0.00000;
-	w2[1] = -1.00000;
-	w2[2] =     0.00;
+	w3[0] = +0.00000;
+	w3[1] = -1.00000;
+	w3[2] =     0.00;
 
-	d0 = lensy_mag3(w2);
+	d0 = lensy_mag3(w3);
 	d1 = 4.0e-6;		// the ruling spacing
 
-	w2[0] = d1*w2[0]/d0;
-	w2[1] = d1*w2[1]/d0;
-	w2[2] = d1*w2[2]/d0;
+	w3[0] = d1*w3[0]/d0;
+	w3[1] = d1*w3[1]/d0;
+	w3[2] = d1*w3[2]/d0;
 
-	list_for_each_safe(pos, pos0, &raylist) {
-		pray = list_entry(pos, struct lensy_ray_struct, raylist);
-
-		i = lensy_intersect_plane(pray, &crossdisp, w0, w1);
-		if (draw)
-			line(pray->p, w0, pray->red, pray->green, pray->blue);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-		i = lensy_redirect_diffract(pray, w0, w1, w2, pray->wavelength, pray->wavelength, +1);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
+	/*----------------------------------------- the optical system
+	 * The elements are listed in the order that the rays reach them.
+	 * Each ray reaching the echelle grating is replaced by a bunch of
+	 * new rays, for a range of reflected orders off of the grating.
+	 *
+	 * There is one system for each step of the focus adjustment dd0.
+	 * Only the last lenses move, so lensy_trace_configs() traces the rays
+	 * through the elements before them (and the echelle orders) just once.
+	 */
+	for (j = 0; j < NMAX_CONFIGS; j++) {
+		memcpy(&sp[j], &sp1, sizeof(sp[j]));
+		memcpy(&cyl[j], &cyl1, sizeof(cyl[j]));
+		memcpy(&pl[j], &ccd1.p, sizeof(pl[j]));
+
+		sp[j][9].v[0] 	+= dd0;
+		sp[j][10].v[0] 	+= dd0;
+		sp[j][11].v[0] 	+= dd0 + dd1;
+		if (sp[j][11].v[0] - sp[j][10].v[0] < 4.0e-3) return (-1);	// minimum spacing
+
+		cyl[j].v[0] 	+= dd0 + dd1;
+		pl[j].v[0] 	+= dd0 + dd1 + dd2;
+		if (pl[j].v[0] - cyl[j].v[0] < 4.0e-3) return (-1);		// minimum spacing
+
+		lensy_system_init(&sys[j]);
+		lensy_add_reflect(&sys[j], LENSY_PARABOLOID, &collimator1);
+		lensy_add_diffract(&sys[j], LENSY_PLANE, &echelleg, w2, 40, 99);
+		lensy_add_reflect(&sys[j], LENSY_PARABOLOID, &collimator1);
+		lensy_add_reflect(&sys[j], LENSY_PLANE, &foldm);
+		lensy_add_reflect(&sys[j], LENSY_PARABOLOID, &pm);		// collimator2
+		lensy_add_diffract(&sys[j], LENSY_PLANE, &crossdisp, w3, +1, +1);
+
+		//------------- camera lens
+		lensy_add_refract(&sys[j], LENSY_SPHERE, &sp[j][0], &air, &caf2);
+		lensy_add_refract(&sys[j], LENSY_SPHERE, &sp[j][1], &caf2, &air);
+		lensy_add_refract(&sys[j], LENSY_SPHERE, &sp[j][2], &air, &glass2);
+		lensy_add_refract(&sys[j], LENSY_SPHERE, &sp[j][3], &glass2, &caf2);
+		lensy_add_refract(&sys[j], LENSY_SPHERE, &sp[j][4], &caf2, &glass4);
+		lensy_add_refract(&sys[j], LENSY_SPHERE, &sp[j][5], &glass4, &air);
+		lensy_add_refract(&sys[j], LENSY_SPHERE, &sp[j][6], &air, &glass5);
+		lensy_add_refract(&sys[j], LENSY_SPHERE, &sp[j][7], &glass5, &glass6);
+		lensy_add_refract(&sys[j], LENSY_SPHERE, &sp[j][8], &glass6, &air);
+		lensy_add_refract(&sys[j], LENSY_SPHERE, &sp[j][9], &air, &glass7);
+		lensy_add_refract(&sys[j], LENSY_SPHERE, &sp[j][10], &glass7, &air);
+		lensy_add_refract(&sys[j], LENSY_SPHERE, &sp[j][11], &air, &silica);
+		lensy_add_refract(&sys[j], LENSY_CYLINDER, &cyl[j], &silica, &vacuum);
+		lensy_add_impact(&sys[j], LENSY_PLANE, &ccd1.p);
+
+		if (lensy_bundle_init(&lanes[j], 0) < 0) {
+			fprintf(stderr, "malloc ray bundle failed\n");
+			exit(-1);
 		}
+		dd0 += 0.1e-3;
 	}
+	// only the first focus step is drawn (and added to the line list)
+	if (draw) sys[0].line = line;
 
-	//------------- camera lens
-	list_for_each_safe(pos, pos0, &raylist) {
-		pray = list_entry(pos, struct lensy_ray_struct, raylist);
-
-		i = lensy_intersect_sphere(pray, &sp[0], w0, w1);
-		if (draw)
-			line(pray->p, w0, pray->red, pray->green, pray->blue);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-		d0 = in_air / lensy_index_of_refraction(pray->wavelength, CaF2);
-		i = lensy_redirect_refract(pray, w0, w1, d0);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-
-		i = lensy_intersect_sphere(pray, &sp[1], w0, w1);
-		if (draw)
-			line(pray->p, w0, pray->red, pray->green, pray->blue);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-		d0 = lensy_index_of_refraction(pray->wavelength, CaF2) / in_air;
-		i = lensy_redirect_refract(pray, w0, w1, d0);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-
-		i = lensy_intersect_sphere(pray, &sp[2], w0, w1);
-		if (draw) line(pray->p, w0, pray->red, pray->green, pray->blue);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-		d0 = in_air / lensy_index_of_refraction(pray->wavelength, tsu2);
-		i = lensy_redirect_refract(pray, w0, w1, d0);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-
-		i = lensy_intersect_sphere(pray, &sp[3], w0, w1);
-		if (draw)
-			line(pray->p, w0, pray->red, pray->green, pray->blue);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-		d0 = lensy_index_of_refraction(pray->wavelength, tsu2) /
-			lensy_index_of_refraction(pray->wavelength, CaF2);
-		i = lensy_redirect_refract(pray, w0, w1, d0);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-
-		i = lensy_intersect_sphere(pray, &sp[4], w0, w1);
-		if (draw)
-			line(pray->p, w0, pray->red, pray->green, pray->blue);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-		d0 = lensy_index_of_refraction(pray->wavelength, CaF2) /
-			lensy_index_of_refraction(pray->wavelength, tsu4);
-		i = lensy_redirect_refract(pray, w0, w1, d0);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-
-		i = lensy_intersect_sphere(pray, &sp[5], w0, w1);
-		if (draw)
-			line(pray->p, w0, pray->red, pray->green, pray->blue);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-		d0 = lensy_index_of_refraction(pray->wavelength, tsu4) / in_air;
-		i = lensy_redirect_refract(pray, w0, w1, d0);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-
-		i = lensy_intersect_sphere(pray, &sp[6], w0, w1);
-		if (draw)
-			line(pray->p, w0, pray->red, pray->green, pray->blue);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-		d0 = in_air / lensy_index_of_refraction(pray->wavelength, tsu5);
-		i = lensy_redirect_refract(pray, w0, w1, d0);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-
-		i = lensy_intersect_sphere(pray, &sp[7], w0, w1);
-		if (draw)
-			line(pray->p, w0, pray->red, pray->green, pray->blue);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-		d0 = lensy_index_of_refraction(pray->wavelength, tsu5) /
-			lensy_index_of_refraction(pray->wavelength, tsu6);
-		i = lensy_redirect_refract(pray, w0, w1, d0);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-
-		i = lensy_intersect_sphere(pray, &sp[8], w0, w1);
-		if (draw)
-			line(pray->p, w0, pray->red, pray->green, pray->blue);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-		d0 = lensy_index_of_refraction(pray->wavelength, tsu6)/in_air;
-		i = lensy_redirect_refract(pray, w0, w1, d0);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-
-		i = lensy_intersect_sphere(pray, &sp[9], w0, w1);
-		if (draw)
-			line(pray->p, w0, pray->red, pray->green, pray->blue);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-		d0 = in_air / lensy_index_of_refraction(pray->wavelength, tsu7);
-		i = lensy_redirect_refract(pray, w0, w1, d0);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-
-		i = lensy_intersect_sphere(pray, &sp[10], w0, w1);
-		if (draw)
-			line(pray->p, w0, pray->red, pray->green, pray->blue);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-		d0 = lensy_index_of_refraction(pray->wavelength, tsu7) / in_air;
-		i = lensy_redirect_refract(pray, w0, w1, d0);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-
-		i = lensy_intersect_sphere(pray, &sp[11], w0, w1);
-		if (draw)
-			line(pray->p, w0, pray->red, pray->green, pray->blue);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-		d0 = in_air / lensy_index_of_refraction(pray->wavelength, fsilica);
-		i = lensy_redirect_refract(pray, w0, w1, d0);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-
-		i = lensy_intersect_cylinder(pray, &cyl, w0, w1);
-		if (draw)
-			line(pray->p, w0, pray->red, pray->green, pray->blue);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-		d0 = lensy_index_of_refraction(pray->wavelength, fsilica) / in_vacuum;
-		i = lensy_redirect_refract(pray, w0, w1, d0);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-
-		i = lensy_intersect_plane(pray, &ccd1.p, w0, w1);
-		if (draw)
-			line(pray->p, w0, pray->red, pray->green, pray->blue);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-		lensy_redirect_impact (pray, w0, w1);
+	if (lensy_trace_configs(sys, NMAX_CONFIGS, &rays, lanes) < 0) {
+		fprintf(stderr, "ray trace failed\n");
+		exit(-1);
 	}
 
-	//------- add the impact positions to the focal plane picture
-	list_for_each_safe(pos, pos0, &raylist) {
-		pray = list_entry(pos, struct lensy_ray_struct, raylist);
+ray_trace_loop:
+	SDL_SetRenderDrawColor(optic_ren, 0, 0, 0, 255);
+	SDL_RenderClear(optic_ren);
 
-		w1[0] = pray->p[0] - ccd1.v[0];
-		w1[1] = pray->p[1] - ccd1.v[1];
-		w1[2] = pray->p[2] - ccd1.v[2];
+	SDL_SetRenderDrawColor(focus_ren, 0, 0, 0, 255);
+	SDL_RenderClear(focus_ren);
 
-		i = floor(lensy_inner3(w1, ccd1.vx) / lensy_inner3(ccd1.vx, ccd1.vx));
-		j = floor(lensy_inner3(w1, ccd1.vy) / lensy_inner3(ccd1.vy, ccd1.vy));
+	n_ass = 0;
+	printf("rays %d\n", rays.n);
 
-		i += ccd1.x_nmax/2;
-		j += ccd1.y_nmax/2;
+	//------- add the impact positions of this focus step to the focal plane picture
+	for (n = 0; n < lanes[i0].n; n++) {
+		w1[0] = lanes[i0].p[0][n];
+		w1[1] = lanes[i0].p[1][n];
+		w1[2] = lanes[i0].p[2][n];
 
-		if ((i >= 0) && (i < ccd1.x_nmax) &&
-		    (j >= 0) && (j < ccd1.y_nmax)) {
+		if (lensy_ccd_pixel(&ccd1, w1, &i, &j)) {
 			k = ccd1.b[j * ccd1.x_nmax + i];
 			k += (k < 65000) ? 100 : 0;
 			ccd1.b[j*ccd1.x_nmax + i] = k;
@@ -910,119 +667,29 @@ ray_trace_loop:
 			x0 =  i * lensy_mag3(ccd1.vx) / focus_scale;
 			y0 =  j * lensy_mag3(ccd1.vy) / focus_scale;
 
-			SDL_SetRenderDrawColor(focus_ren, pray->red, pray->green, pray->blue, 255);
+			SDL_SetRenderDrawColor(focus_ren, lanes[i0].red[n], lanes[i0].green[n], lanes[i0].blue[n], 255);
 			SDL_RenderDrawPoint(focus_ren, x0, y0);
 		}
 	}
 
 
 	/*---------------- perform the average spot size calculation
-	 * The idea behind using the hash table and 'pathkey' is to identify
-	 * rays with identical parameters (start position, wavelength, grating
-	 * reflection order), for the purpose of calculating a spot size (for
-	 * example, for a spectrograph).
+	 * Rays with the same path identifier (start position, wavelength,
+	 * grating reflection order) belong to the same spot.
 	 */
-	hcreate(100);
-
-	list_for_each_safe(pos, pos0, &raylist) {
-		pray = list_entry(pos, struct lensy_ray_struct, raylist);
-
-		he.key = (char *) pray->pathkey;
-		phe = hsearch(he, FIND);
-		if (phe == NULL) {
-			pspotsize = (struct spotsize_struct *) malloc(sizeof(struct spotsize_struct));
-			pspotsize->p[0] 	= pray->p[0];
-			pspotsize->p[1] 	= pray->p[1];
-			pspotsize->p[2] 	= pray->p[2];
-			pspotsize->n 		= 1;
-			pspotsize->rms_v[0] 	= 0.0;
-			pspotsize->rms_v[1] 	= 0.0;
-			pspotsize->rms_v[2] 	= 0.0;
-			pspotsize->rms 		= 0.0;
-			list_add(&(pspotsize->spotsize_list), &spotsize_list);
-			he.key = (char *) pray->pathkey;
-			he.data = (void *) pspotsize;
-			if (hsearch (he, ENTER) == NULL) {
-				fprintf (stderr, "hash action ENTER failed: \"%s\"\n", he.key);
-				exit(-1);
-			}
-		} else {
-			pspotsize = (struct spotsize_struct *) phe->data;
-			pspotsize->p[0] += pray->p[0];
-			pspotsize->p[1] += pray->p[1];
-			pspotsize->p[2] += pray->p[2];
-			pspotsize->n++;
-		}
-	}
-
-	//---------------- find the centroid of the spots
-	list_for_each_safe(pos, pos0, &spotsize_list) {
-		pspotsize = list_entry(pos, struct spotsize_struct, spotsize_list);
-		pspotsize->p[0] /= pspotsize->n;
-		pspotsize->p[1] /= pspotsize->n;
-		pspotsize->p[2] /= pspotsize->n;
-	}
-
-	//------------- calculate the sum of squares
-	list_for_each_safe(pos, pos0, &raylist) {
-		pray = list_entry(pos, struct lensy_ray_struct, raylist);
-
-		he.key = (char *) pray->pathkey;
-		phe = hsearch(he, FIND);
-		if (phe == NULL) {
-			fprintf(stderr, "hash action FIND failed: \"%s\"\n", he.key);
-//			exit(-1);
-		} else {
-			pspotsize = (struct spotsize_struct *) phe->data;
+	n_spots = lensy_spots(&lanes[i0], &spots);
 
-			w0[0] = pray->p[0] - pspotsize->p[0];
-			w0[1] = pray->p[1] - pspotsize->p[1];
-			w0[2] = pray->p[2] - pspotsize->p[2];
-
-			pspotsize->rms_v[0] += w0[0] * w0[0];
-			pspotsize->rms_v[1] += w0[1] * w0[1];
-			pspotsize->rms_v[2] += w0[2] * w0[2];
-
-			pspotsize->rms += lensy_inner3(w0, w0);
-		}
-	}
-
-	//---------------- calculate the RMS
-	list_for_each_safe(pos, pos0, &spotsize_list) {
-		pspotsize = list_entry(pos, struct spotsize_struct, spotsize_list);
-
-		pspotsize->rms_v[0] = sqrt(pspotsize->rms_v[0] / pspotsize->n);
-		pspotsize->rms_v[1] = sqrt(pspotsize->rms_v[1] / pspotsize->n);
-		pspotsize->rms_v[2] = sqrt(pspotsize->rms_v[2] / pspotsize->n);
-
-		pspotsize->rms = sqrt(pspotsize->rms / pspotsize->n);
-	}
-	hdestroy ();
-
-	//------------- store in an array and free the spotsize_list
-	list_for_each_safe(pos, pos0, &spotsize_list) {
-		pspotsize = list_entry(pos, struct spotsize_struct, spotsize_list);
-
-		if (pspotsize->n <= 1) continue;
+	for (i = 0; i < n_spots; i++) {
+		if (spots[i].n <= 1) continue;
 
 		if (n_ass < NMAX_ASS) {
-			ass[0][n_ass] = pspotsize->rms_v[0];
-			ass[1][n_ass] = pspotsize->rms_v[1];
-			ass[2][n_ass] = pspotsize->rms_v[2];
+			ass[0][n_ass] = spots[i].rms_v[0];
+			ass[1][n_ass] = spots[i].rms_v[1];
+			ass[2][n_ass] = spots[i].rms_v[2];
 			n_ass++;
 		}
-		// pspotsize->rms is not used?
-
-		list_del(pos);
-		free(pspotsize);
-	}
-
-	//---------------- free the raylist
-	list_for_each_safe(pos, pos0, &raylist) {
-		pray = list_entry(pos, struct lensy_ray_struct, raylist);
-		list_del(pos);
-		free(pray);
 	}
+	free(spots);
 
 	if (make_ll_picture) {
 		//------------- write a FITS file showing the focal plane
@@ -1103,11 +770,13 @@ ray_trace_loop:
       ray.d[1] 	= -1.0;
       ray.d[2] 	=  0.0;
 
-      i = lensy_intersect_paraboloid(&ray, &collimator1, w0, w1);
+      i = lensy_hit_t_paraboloid(&ray, &collimator1, &t);
+      lensy_ray_at(&ray, t, w0);
       j = (i == 0) ? 255 : 100;
       line(w0, w0, j, j, j);
 
-      i = lensy_intersect_paraboloid(&ray, &pm, w0, w1);		// &collimator2
+      i = lensy_hit_t_paraboloid(&ray, &pm, &t);		// &collimator2
+      lensy_ray_at(&ray, t, w0);
       j = (i == 0) ? 255 : 100;
       line(w0, w0, j, j, j);
 
@@ -1116,15 +785,18 @@ ray_trace_loop:
       ray.d[1] 	=  1.0;
       ray.d[2] 	=  0.0;
 
-      i = lensy_intersect_plane(&ray, &echelleg, w0, w1);
+      i = lensy_hit_t_plane(&ray, &echelleg, &t);
+      lensy_ray_at(&ray, t, w0);
       j = (i == 0) ? 255 : 100;
       line(w0, w0, j, j, j);
 
-      i = lensy_intersect_plane(&ray, &foldm, w0, w1);
+      i = lensy_hit_t_plane(&ray, &foldm, &t);
+      lensy_ray_at(&ray, t, w0);
       j = (i == 0) ? 255 : 100;
       line(w0, w0, j, j, j);
 
-      i = lensy_intersect_plane(&ray, &crossdisp, w0, w1);
+      i = lensy_hit_t_plane(&ray, &crossdisp, &t);
+      lensy_ray_at(&ray, t, w0);
       j = (i == 0) ? 255 : 100;
       line(w0, w0, j, j, j);
    }
@@ -1138,16 +810,19 @@ ray_trace_loop:
       ray.d[1] 	=  0.0;
       ray.d[2] 	=  0.0;
       for (k = 0; k < 12; k++) {
-         i = lensy_intersect_sphere(&ray, &sp[k], w0, w1);
+         i = lensy_hit_t_sphere(&ray, &sp[i0][k], &t);
+         lensy_ray_at(&ray, t, w0);
          j = (i < 0) ? 64 : 255;
          if (i != -2) line(w0, w0, j, j, j);
       }
 
-      i = lensy_intersect_cylinder(&ray, &cyl, w0, w1);
+      i = lensy_hit_t_cylinder(&ray, &cyl[i0], &t);
+      lensy_ray_at(&ray, t, w0);
       j = (i < 0) ? 64 : 255;
       if (i != -2) line(w0, w0, j, j, j);
 
-      i = lensy_intersect_plane(&ray, &pl, w0, w1);
+      i = lensy_hit_t_plane(&ray, &pl[i0], &t);
+      lensy_ray_at(&ray, t, w0);
       j = (i < 0) ? 64 : 255;
       if (i != -2) line(w0, w0, j, j, j);
    }
@@ -1174,15 +849,186 @@ ray_trace_loop:
 
 	printf ("spotsize x = %5.0lfum, y = %5.0lfum, z = %5.0lfum\n",
 		 2 * w0[0] * 1e6, 2 * w0[1] * 1e6, 2 * w0[2] * 1e6);
+
+	/*---------------- find the best focus
+	 * The detector position with the smallest spots (RMS), for this focus
+	 * step, is found from the same rays, without tracing them again.
+	 */
+	n_focus = lensy_focus(&lanes[i0], ccd1.p.n, &focus);
+	if (n_focus > 0) {
+		d0 = lensy_focus_best(focus, n_focus, &d1);
+		printf ("best focus at %+.3lfmm, spotsize = %5.0lfum\n",
+			 d0 * 1e3, 2 * d1 * 1e6);
+	}
+	free(focus);
 	SDL_PumpEvents();
 	SDL_Delay(1);
 
-	if (i0++ < 5) {
-		dd0 += 0.1e-3;
+	if (++i0 < NMAX_CONFIGS) {
 		// do not add to list subsequent calls to the line() function
 		make_ll_picture = false;
 		goto ray_trace_loop;
 	}
+
+	/*---------------- ray trace throughput
+	 * Time the trace of the first focus step, with the whole bundle going
+	 * through one element at a time, and in chunks that stay in the cache.
+	 */
+	memcpy(&bench, &sys[0], sizeof(bench));
+	bench.line = count_segment;
+	n_segments = 0;
+	if (lensy_bundle_clone(&bench_rays, &rays) == 0)
+		lensy_trace(&bench, &bench_rays);
+
+	bench.line = NULL;
+	for (i = 0; i < 2; i++) {
+		bench.chunk = (i == 0) ? 0 : LENSY_TRACE_CHUNK;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if (lensy_bundle_clone(&bench_rays, &rays) < 0) break;
+		if (lensy_trace(&bench, &bench_rays) < 0) break;
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		d0 = (t1.tv_sec - t0.tv_sec) + 1e-9 * (t1.tv_nsec - t0.tv_nsec);
+		printf("trace throughput, %s: %.2lf million segments/s\n",
+			(i == 0) ? "one element at a time" : "in chunks",
+			n_segments / d0 * 1e-6);
+	}
+
+	/*---------------- generated trace function
+	 * The same trace with the code generated for the system, checked
+	 * against lensy_trace(). It runs the compiler, so it is only done when
+	 * the environment variable LENSY_CODEGEN names a directory for the
+	 * modules (each system is compiled once, and kept there), with the
+	 * headers in LENSY_CODEGEN_INCLUDE if the build tree of the library
+	 * is gone.
+	 */
+	codegen_dir = getenv("LENSY_CODEGEN");
+	if ((codegen_dir != NULL) && (lensy_codegen_init(&codegen, codegen_dir) < 0))
+		codegen_dir = NULL;
+	if ((codegen_dir != NULL) && (getenv("LENSY_CODEGEN_INCLUDE") != NULL))
+		codegen.include = getenv("LENSY_CODEGEN_INCLUDE");
+	if ((codegen_dir != NULL) &&
+	    (lensy_codegen_load(&codegen, &bench) == 0) &&
+	    (lensy_bundle_clone(&bench_rays, &rays) == 0) &&
+	    (lensy_bundle_clone(&bench_ref, &rays) == 0)) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		lensy_codegen_trace(&codegen, &bench, &bench_rays);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		d0 = (t1.tv_sec - t0.tv_sec) + 1e-9 * (t1.tv_nsec - t0.tv_nsec);
+		printf("trace throughput, generated code: %.2lf million segments/s\n",
+			n_segments / d0 * 1e-6);
+
+		lensy_trace(&bench, &bench_ref);
+		d1 = 0.0;
+		for (i = 0; (i < bench_ref.n) && (bench_rays.n == bench_ref.n); i++)
+			for (j = 0; j < 3; j++)
+				d1 = fmax(d1, fabs(bench_rays.p[j][i] - bench_ref.p[j][i]));
+		printf("generated code: %d of %d rays, largest difference %.1lfnm\n",
+			bench_rays.n, bench_ref.n, d1 * 1e9);
+	}
+	lensy_codegen_close(&codegen);
+
+	/*---------------- surface-local frames
+	 * The same trace with the surfaces in their own frames, where the
+	 * camera lenses share one frame.
+	 */
+	k = lensy_frames_prepare(&bench, &frames);
+	if ((k >= 0) && (lensy_bundle_clone(&bench_rays, &rays) == 0) &&
+	    (lensy_bundle_clone(&bench_ref, &rays) == 0)) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		lensy_trace_frames(&bench, &frames, &bench_rays);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		d0 = (t1.tv_sec - t0.tv_sec) + 1e-9 * (t1.tv_nsec - t0.tv_nsec);
+		printf("trace throughput, local frames: %.2lf million segments/s\n",
+			n_segments / d0 * 1e-6);
+
+		lensy_trace(&bench, &bench_ref);
+		d1 = 0.0;
+		for (i = 0; (i < bench_ref.n) && (bench_rays.n == bench_ref.n); i++)
+			for (j = 0; j < 3; j++)
+				d1 = fmax(d1, fabs(bench_rays.p[j][i] - bench_ref.p[j][i]));
+		printf("local frames: %d frames, %d of %d rays, largest difference %.1le nm\n",
+			k, bench_rays.n, bench_ref.n, d1 * 1e9);
+	}
+
+	/*---------------- kernel tiers
+	 * The trace with each kernel tier, and the largest spot centroid shift
+	 * and RMS change from the reference tier.
+	 */
+	for (k = LENSY_TIER_REFERENCE; k < LENSY_NMAX_TIERS; k++) {
+		bench.tier = k;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if (lensy_bundle_clone(&bench_rays, &rays) < 0) break;
+		if (lensy_trace(&bench, &bench_rays) < 0) break;
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		d0 = (t1.tv_sec - t0.tv_sec) + 1e-9 * (t1.tv_nsec - t0.tv_nsec);
+		printf("trace throughput, %s tier: %.2lf million segments/s\n",
+			lensy_tier_name(k), n_segments / d0 * 1e-6);
+
+		if ((k == LENSY_TIER_REFERENCE) ||
+		    (lensy_tier_report(&bench, k, &rays, &tier_report) < 0)) continue;
+		printf("%s tier: %d of %d rays, %d spots, centroid shift %.3lfum "
+			"(mean %.3lfum), RMS change %.3lfum (mean %.3lfum)\n",
+			lensy_tier_name(k), tier_report.n_tier, tier_report.n_reference,
+			tier_report.n_spots, tier_report.centroid * 1e6,
+			tier_report.centroid_mean * 1e6, tier_report.rms * 1e6,
+			tier_report.rms_mean * 1e6);
+	}
+	bench.tier = LENSY_TIER_REFERENCE;
+	k = lensy_tier_select(&bench, &rays, 0.1e-6);
+	if (k >= 0) printf("fastest tier within 0.1um: %s\n", lensy_tier_name(k));
+
+	/*---------------- early rejection
+	 * The rays of the first focus step that the aperture bounds reject at
+	 * each element, before the intersection is calculated.
+	 */
+	memcpy(&bench, &sys[0], sizeof(bench));
+	bench.line = NULL;
+	bench.reject = &reject;
+	memset(&reject, 0, sizeof(reject));
+	if ((lensy_bundle_clone(&bench_rays, &rays) == 0) &&
+	    (lensy_trace(&bench, &bench_rays) >= 0)) {
+		for (i = 0; i < bench.n; i++) {
+			if (reject.n[i] == 0) continue;
+			printf("element %2d: %7" PRId64 " of %7" PRId64 " rays rejected early (%.1lf%%)\n",
+				i, reject.rejected[i], reject.n[i],
+				100.0 * reject.rejected[i] / reject.n[i]);
+		}
+	}
+	bench.reject = NULL;
+	lensy_bundle_free(&bench_rays);
+
+	/*---------------- throughput budget
+	 * The first focus step again, with the efficiency of the mirrors, the
+	 * gratings and the detector. The orders of the echelle share the
+	 * light of a ray; the orders that are lost later show up as lost there.
+	 */
+	if ((lensy_curve_init(&silver, 5, eff_wl, silver_r) == 0) &&
+	    (lensy_curve_init(&echelle, 5, eff_wl, echelle_e) == 0) &&
+	    (lensy_curve_init(&crossdisp_eff, 5, eff_wl, crossdisp_e) == 0) &&
+	    (lensy_curve_init(&quantum_eff, 5, eff_wl, ccd_qe) == 0)) {
+		for (i = 0; i < bench.n; i++) {
+			if (bench.e[i].redirect == LENSY_REFLECT) bench.e[i].efficiency = &silver;
+		}
+		bench.e[1].efficiency = &echelle;
+		bench.e[5].efficiency = &crossdisp_eff;
+		bench.e[bench.n - 1].efficiency = &quantum_eff;
+		memset(&budget, 0, sizeof(budget));
+		bench.budget = &budget;
+		if ((lensy_bundle_clone(&bench_rays, &rays) == 0) &&
+		    (lensy_trace(&bench, &bench_rays) >= 0)) {
+			for (i = 0; i < bench.n; i++)
+				printf("budget element %2d: %10.1lf in, %10.1lf lost, %10.1lf out\n",
+					i, budget.in[i], budget.lost[i], budget.out[i]);
+			d0 = 0.0;
+			for (i = 0; i < bench_rays.n; i++) d0 += bench_rays.weight[i];
+			printf("budget: %d rays detected, with a total weight of %.1lf\n",
+				bench_rays.n, d0);
+		}
+		bench.budget = NULL;
+		lensy_bundle_free(&bench_rays);
+	}
+	lensy_bundle_free(&bench_ref);
+
 	SDL_Delay(500);
 /*
 	printf ("press enter...");
@@ -67,14 +67,39 @@
  * The program uses the SDL library for graphic display, so it must be
  * installed, including the development files.
  *
- * The program creates an image of the focal plane in a file "lensy.fits".
- * Viewing the FITS file can be done with the display program 'ds9', for
+ * The program creates an image of the focal plane in a file "lensy.fits",
+ * and, if the environment variable LENSY_RAYS names a file, saves the
+ * rays at the focal plane in that ray file. Viewing the FITS file can be done with the display program 'ds9', for
  * example.
  *
  * Send questions or contributions to me at <michael.h.williamson@gmail.com>.
  *
  * History:
  *
+ *  2026-10-16  The focal plane rays are only saved if LENSY_RAYS names a
+ *              ray file.
+ *  2026-10-16  The analyses after the focus steps use the step with the
+ *              best focus nearest to the detector, not the first step.
+ *  2026-10-16  Show the throughput budget of the first focus step, with
+ *              coating and glass absorption curves, and the weighted spots.
+ *  2026-10-16  Show the ghost images of the glass surfaces, with Fresnel
+ *              reflected branches of the rays.
+ *  2026-10-16  Trace the first focus step non-sequentially, and compare it
+ *              with the sequential trace.
+ *  2026-10-16  Draw the surfaces with lensy_hit_t_X(), which leaves out the
+ *              surface normal.
+ *  2026-10-16  Show the rays rejected early by the aperture bound of each
+ *              element.
+ *  2026-10-16  Validate the kernel tiers against the reference tier.
+ *  2026-10-16  Trace a million photons with lensy_stream_pipeline().
+ *  2026-10-16  Show the errors of the packed form of the focal plane rays.
+ *  2026-10-16  The rays at the focal plane are saved in a ray file
+ *              "lensy.rays".
+ *  2026-10-16  Added a Monte Carlo tolerance analysis of the secondary.
+ *  2026-10-16  All of the focus steps are traced in one pass, with
+ *              lensy_trace_configs().
+ *  2026-10-16  The surfaces are listed in a lensy_system_struct, and the
+ *              rays are traced as a bundle with lensy_trace().
  *  2015-06-11  Change to use SDL2 library
  *
  */
@@ -117,11 +142,31 @@ float focus_scale = 4.0e-3/640;		// meter/pixel for display
  * through the optics.
  */
 
-double in_air		= 1.000293;	// index of refraction for air
-double in_vacuum	= 1.000;	// index of refraction for vacuum
+struct lensy_medium_struct air = { 1.000293, NULL, NULL };	// index of refraction for air
+struct lensy_medium_struct vacuum = { 1.000, NULL, NULL };	// index of refraction for vacuum
+struct lensy_medium_struct bk7 = { 0.0, NULL, &N_BK7 };
+
+/*
+ * Throughput curves, against the wavelength in meters: the reflectivity of
+ * the aluminium mirrors, the transmission of a glass surface with a single
+ * layer MgF2 AR coating, and the absorption coefficient (1/m) of BK7.
+ */
+double al_wl[7] = { 350e-9, 400e-9, 500e-9, 600e-9, 700e-9, 800e-9, 900e-9 };
+double al_r[7] = { 0.920, 0.922, 0.915, 0.905, 0.890, 0.865, 0.885 };
+double ar_wl[4] = { 400e-9, 550e-9, 700e-9, 850e-9 };
+double ar_t[4] = { 0.978, 0.987, 0.983, 0.976 };
+double bk7_wl[6] = { 350e-9, 380e-9, 400e-9, 500e-9, 600e-9, 800e-9 };
+double bk7_alpha[6] = { 7.3, 1.0, 0.30, 0.20, 0.10, 0.10 };
+
+struct lensy_curve_struct aluminium, ar_coating, bk7_absorption;
+struct lensy_medium_struct bk7_absorbing = { 0.0, NULL, &N_BK7, &bk7_absorption };
 
 
-LIST_HEAD(raylist);
+#define	NMAX_CONFIGS	26	// the number of focus steps
+
+struct lensy_bundle_struct rays;	// the rays being traced
+struct lensy_system_struct sys[NMAX_CONFIGS];	// the optical elements, for each focus step
+struct lensy_bundle_struct lanes[NMAX_CONFIGS];	// the traced rays, for each focus step
 
 
 #define	NMAX_ASS	1000
@@ -129,17 +174,32 @@ LIST_HEAD(raylist);
 double ass[3][NMAX_ASS];		// array of spot sizes for x, y, z axes
 int32_t n_ass;
 
-LIST_HEAD(spotsize_list);
+struct lensy_spot_struct *spots;
+int32_t n_spots;
+
+struct lensy_focus_struct *focus;
+int32_t n_focus;
+
+#define	NMAX_SAMPLES	200
+
+struct lensy_sample_struct samples[NMAX_SAMPLES];	// tolerance analysis results
 
-struct spotsize_struct {
-	double p[3];
-	int32_t n;
-	double rms, rms_v[3];
-	struct list_head spotsize_list;
-} spotsize, *pspotsize;
+struct lensy_packed_struct packed;	// packed copy of the focal plane rays
 
+struct lensy_tier_report_struct tier_report;	// kernel tier accuracy
 
-ENTRY he, *phe;
+struct lensy_system_struct bench;	// a copy of the best focus step
+struct lensy_bundle_struct bench_rays, bench_ref;
+struct lensy_reject_struct reject;	// rays rejected early, per element
+struct lensy_nonseq_struct nonseq;	// the surfaces, for a non-sequential trace
+struct lensy_ghost_struct ghosts;	// ghost image layers of the CCD
+struct lensy_budget_struct budget;	// ray weights at each element
+
+#define	NMAX_PHOTONS	1000000
+
+struct lensy_stream_struct stream;	// streaming trace of single photons
+struct lensy_spotsum_struct spotsum;
+int64_t n_photons;			// photons left to make
 
 
 LIST_HEAD(line_list);			// list for showing ray paths
@@ -170,6 +230,39 @@ void plot(double x, double y, char red, char green, char blue)
 }
 
 
+/*---------------------------------------------------- photon_source
+ * Make up to 'nmax' photons at random positions in the aperture of the
+ * telescope, with one of the three wavelengths of the beam, for
+ * lensy_stream(). The path identifier is the wavelength number, as for the
+ * beam.
+ */
+int32_t photon_source(void *arg, struct lensy_bundle_struct *b, int32_t nmax)
+{
+	static const double wl[3] = { 800e-9, 600e-9, 400e-9 };
+	struct lensy_ray_struct ray;
+	int32_t n, k;
+	double r;
+
+	for (n = 0; (n < nmax) && (n_photons > 0); n++, n_photons--) {
+		do {
+			ray.p[1] = 1.05 * (2.0 * drand48() - 1.0);
+			ray.p[2] = 1.05 * (2.0 * drand48() - 1.0);
+			r = hypot(ray.p[1], ray.p[2]);
+		} while ((r > 1.05) || (r < 0.254));
+		k = n_photons % 3;
+
+		ray.p[0] = 1.0;
+		ray.d[0] = -1.0;
+		ray.d[1] = 0.0;
+		ray.d[2] = 0.0;
+		ray.wavelength = wl[k];
+		ray.red = ray.green = ray.blue = 0;
+		if (lensy_bundle_add(b, &ray, k) < 0) return -1;
+	}
+	return n;
+}
+
+
 /*---------------------------------------------------- line
  * Plot a line on the graphics window.
  *
@@ -211,20 +304,26 @@ void line(double p0[3], double p1[3], char red, char green, char blue)
 //---------------------------------------------------- main
 int main(int argc, char *argv[])
 {
-	int32_t i, j, k, i0;
+	int32_t i, j, k, n, i0, i_best, n_beam;
 	FILE *fp;
-	struct lensy_ray_struct ray, *pray;
+	struct lensy_ray_struct ray;
 	struct list_head *pos, *pos0;
 	char s80[80], s100[100], s200[200];
 //	char red, green, blue;
         bool draw;
 //	double wavelength;
-	double d0, d1, d2;
+	double d0, d1, d2, t, best_shift;
 	double w0[3], w1[3], w2[3];
 	double u0[3], u1[3], u2[3];
 	int32_t nr_hdr;
 	char hdr[180][80], zeros[2880];
 	int x0, y0;
+	struct lensy_hyperboloid_struct sec[NMAX_CONFIGS];
+	struct lensy_tolerance_struct tol[1];
+	double q[3] = { 0.5, 0.9, 1.0 }, rms_q[3], shift_q[3];
+	struct lensy_element_struct *e;
+	struct lensy_ccd_struct ccd2;
+	int64_t counts;
 
 	/*----------------------------------------- surface parameters
 	 * Define the optical elements of the system.
@@ -267,6 +366,11 @@ int main(int argc, char *argv[])
 	lensy_init_ccd(&ccd1);
 	memset(ccd1.b, 0, ccd1.b_size);
 
+	if (lensy_bundle_init(&rays, 10000) < 0) {
+		fprintf(stderr, "malloc ray bundle failed\n");
+		exit(-1);
+	}
+
 	memset(zeros, 0, sizeof(zeros));
 	strcpy(s80, "");
 	strcpy(s100, "");
@@ -318,20 +422,14 @@ int main(int argc, char *argv[])
 	make_ll_picture = true;
 	draw = true;
 	i0 = 0;
-
-ray_trace_loop:
-	SDL_SetRenderDrawColor(optic_ren, 0, 0, 0, 255);
-	SDL_RenderClear(optic_ren);
-
-	SDL_SetRenderDrawColor(focus_ren, 0, 0, 0, 255);
-	SDL_RenderClear(focus_ren);
-
-	n_ass = 0;
+	i_best = 0;
+	best_shift = HUGE_VAL;
 
 	/*
-	 * Create a beam of rays, in a linked list.
-	 * The raylist is generated and erased for each iteration of the ray
-	 * trace loop.
+	 * Create a beam of rays, in a ray bundle. Each wavelength is a
+	 * separate path, for the spot size calculation.
+	 * The bundle is filled once, and the rays are traced through all of
+	 * the focus steps.
 	 */
 	ray.p[0] =  1.0;
 	ray.p[1] =  0.0;
@@ -340,165 +438,84 @@ ray_trace_loop:
 	ray.d[1] =  0.0; // + 2.0e-4;
 	ray.d[2] =  0.0;
 
-	i = 0;
-
 	ray.wavelength	= 800e-9;
 	ray.red		= 200;
 	ray.green	= 40;
 	ray.blue	= 0;
-	i += lensy_beam(&raylist, &ray, 2.1, 0.07);
+	lensy_beam_bundle(&rays, &ray, 2.1, 0.07, 0);
 
 	ray.wavelength	= 600e-9;
 	ray.red		= 40;
 	ray.green	= 200;
 	ray.blue	= 0;
-	i += lensy_beam(&raylist, &ray, 2.1, 0.07);
+	lensy_beam_bundle(&rays, &ray, 2.1, 0.07, 1);
 
 	ray.wavelength	= 400e-9;
 	ray.red		= 0;
 	ray.green	= 40;
 	ray.blue	= 200;
-	i += lensy_beam(&raylist, &ray, 2.1, 0.07);
+	lensy_beam_bundle(&rays, &ray, 2.1, 0.07, 2);
 
-	printf("rays in the beam %d\n", i);
+	n_beam = rays.n;
 
 	//---- eliminate rays in the center (for the central hole)
-	list_for_each_safe(pos, pos0, &raylist) {
-		pray = list_entry(pos, struct lensy_ray_struct, raylist);
-
-		d0 = hypot(pray->p[1], pray->p[2]);
-		if (d0 < 0.254) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-	}
-
-	//--------------- primary mirror
-	list_for_each_safe(pos, pos0, &raylist) {
-		pray = list_entry(pos, struct lensy_ray_struct, raylist);
-
-		i = lensy_intersect_paraboloid(pray, &primary, w0, w1);
-		if (draw)
-			line(pray->p, w0, pray->red, pray->green, pray->blue);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-		lensy_redirect_reflect(pray, w0, w1);
-	}
-
-	//--------------- secondary mirror
-	list_for_each_safe(pos, pos0, &raylist) {
-		pray = list_entry(pos, struct lensy_ray_struct, raylist);
-
-		i = lensy_intersect_hyperboloid(pray, &secondary, w0, w1);
-		if (draw)
-			line(pray->p, w0, pray->red, pray->green, pray->blue);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-		lensy_redirect_reflect(pray, w0, w1);
-	}
-
-	//----------------- flat1
-	list_for_each_safe(pos, pos0, &raylist) {
-		pray = list_entry(pos, struct lensy_ray_struct, raylist);
-
-		i = lensy_intersect_plane(pray, &flat1, w0, w1);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-		if (draw)
-			line(pray->p, w0, pray->red, pray->green, pray->blue);
-		d0 = in_air / lensy_index_sellmeier(pray->wavelength, &N_BK7);
-		i = lensy_redirect_refract(pray, w0, w1, d0);
-	}
-
-	//----------------- sphere1
-	list_for_each_safe(pos, pos0, &raylist) {
-		pray = list_entry(pos, struct lensy_ray_struct, raylist);
-
-		i = lensy_intersect_sphere(pray, &sphere1, w0, w1);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-		if (draw)
-			line(pray->p, w0, pray->red, pray->green, pray->blue);
-		d0 = lensy_index_sellmeier(pray->wavelength, &N_BK7) / in_air;
-		i = lensy_redirect_refract(pray, w0, w1, d0);
+	for (i = j = 0; i < rays.n; i++) {
+		d0 = hypot(rays.p[1][i], rays.p[2][i]);
+		if (d0 < 0.254) continue;
+		lensy_bundle_copy(&rays, j++, &rays, i);
 	}
-
-	//----------------- cube0
-	list_for_each_safe(pos, pos0, &raylist) {
-		pray = list_entry(pos, struct lensy_ray_struct, raylist);
-
-		i = lensy_intersect_plane(pray, &cube0, w0, w1);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-		if (draw)
-			line(pray->p, w0, pray->red, pray->green, pray->blue);
-		d0 = in_air / lensy_index_sellmeier(pray->wavelength, &N_BK7);
-		i = lensy_redirect_refract (pray, w0, w1, d0);
-	}
-
-	//----------------- cube1
-	list_for_each_safe(pos, pos0, &raylist) {
-		pray = list_entry(pos, struct lensy_ray_struct, raylist);
-
-		i = lensy_intersect_plane(pray, &cube1, w0, w1);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
+	rays.n = j;
+
+	/*----------------------------------------- the optical system
+	 * The elements are listed in the order that the rays reach them.
+	 *
+	 * There is one system for each focus step, with the secondary moved
+	 * along the axis. The rays are traced through all of them at once
+	 * with lensy_trace_configs().
+	 */
+	for (j = 0; j < NMAX_CONFIGS; j++) {
+		memcpy(&sec[j], &secondary, sizeof(sec[j]));
+
+		lensy_system_init(&sys[j]);
+		lensy_add_reflect(&sys[j], LENSY_PARABOLOID, &primary);
+		lensy_add_reflect(&sys[j], LENSY_HYPERBOLOID, &sec[j]);
+		lensy_add_refract(&sys[j], LENSY_PLANE, &flat1, &air, &bk7);
+		lensy_add_refract(&sys[j], LENSY_SPHERE, &sphere1, &bk7, &air);
+		lensy_add_refract(&sys[j], LENSY_PLANE, &cube0, &air, &bk7);
+		lensy_add_refract(&sys[j], LENSY_PLANE, &cube1, &bk7, &air);
+		lensy_add_impact(&sys[j], LENSY_PLANE, &ccd1.p);
+
+		if (lensy_bundle_init(&lanes[j], 0) < 0) {
+			fprintf(stderr, "malloc ray bundle failed\n");
+			exit(-1);
 		}
-		if (draw)
-			line(pray->p, w0, pray->red, pray->green, pray->blue);
-		d0 = lensy_index_sellmeier(pray->wavelength, &N_BK7) / in_air;
-		i = lensy_redirect_refract(pray, w0, w1, d0);
+		secondary.v[0] += 0.015e-3;
 	}
+	// only the first focus step is drawn (and added to the line list)
+	if (draw) sys[0].line = line;
 
-	//---------------- focal plane
-	list_for_each_safe(pos, pos0, &raylist) {
-		pray = list_entry(pos, struct lensy_ray_struct, raylist);
-
-		i = lensy_intersect_plane(pray, &ccd1.p, w0, w1);
-		if (draw)
-			line(pray->p, w0, pray->red, pray->green, pray->blue);
-		if (i < 0) {
-			list_del(pos);
-			free(pray);
-			continue;
-		}
-		lensy_redirect_impact(pray, w0, w1);
+	if (lensy_trace_configs(sys, NMAX_CONFIGS, &rays, lanes) < 0) {
+		fprintf(stderr, "ray trace failed\n");
+		exit(-1);
 	}
 
-	//------- add the impact positions to the focal plane picture
-	list_for_each_safe(pos, pos0, &raylist) {
-		pray = list_entry(pos, struct lensy_ray_struct, raylist);
+ray_trace_loop:
+	SDL_SetRenderDrawColor(optic_ren, 0, 0, 0, 255);
+	SDL_RenderClear(optic_ren);
 
-		w1[0] = pray->p[0] - ccd1.v[0];
-		w1[1] = pray->p[1] - ccd1.v[1];
-		w1[2] = pray->p[2] - ccd1.v[2];
+	SDL_SetRenderDrawColor(focus_ren, 0, 0, 0, 255);
+	SDL_RenderClear(focus_ren);
 
-		i = floor(lensy_inner3(w1, ccd1.vx) / lensy_inner3(ccd1.vx, ccd1.vx));
-		j = floor(lensy_inner3(w1, ccd1.vy) / lensy_inner3(ccd1.vy, ccd1.vy));
+	n_ass = 0;
+	printf("rays in the beam %d\n", n_beam);
 
-		i += ccd1.x_nmax/2;
-		j += ccd1.y_nmax/2;
+	//------- add the impact positions of this focus step to the focal plane picture
+	for (n = 0; n < lanes[i0].n; n++) {
+		w1[0] = lanes[i0].p[0][n];
+		w1[1] = lanes[i0].p[1][n];
+		w1[2] = lanes[i0].p[2][n];
 
-		if ((i >= 0) && (i < ccd1.x_nmax) &&
-		    (j >= 0) && (j < ccd1.y_nmax)) {
+		if (lensy_ccd_pixel(&ccd1, w1, &i, &j)) {
 			k = ccd1.b[j * ccd1.x_nmax + i];
 			k += (k < 65000) ? 100 : 0;
 			ccd1.b[j*ccd1.x_nmax + i] = k;
@@ -506,119 +523,29 @@ ray_trace_loop:
 			x0 =  i * lensy_mag3(ccd1.vx) / focus_scale;
 			y0 =  j * lensy_mag3(ccd1.vy) / focus_scale;
 
-			SDL_SetRenderDrawColor(focus_ren, pray->red, pray->green, pray->blue, 255);
+			SDL_SetRenderDrawColor(focus_ren, lanes[i0].red[n], lanes[i0].green[n], lanes[i0].blue[n], 255);
 			SDL_RenderDrawPoint(focus_ren, x0, y0);
 		}
 	}
 
 
 	/*---------------- perform the average spot size calculation
-	 * The idea behind using the hash table and 'pathkey' is to identify
-	 * rays with identical parameters (start position, wavelength, grating
-	 * reflection order), for the purpose of calculating a spot size (for
-	 * example, for a spectrograph).
+	 * Rays with the same path identifier (start position, wavelength,
+	 * grating reflection order) belong to the same spot.
 	 */
-	hcreate(100);
-
-	list_for_each_safe(pos, pos0, &raylist) {
-		pray = list_entry(pos, struct lensy_ray_struct, raylist);
-
-		he.key = (char *) pray->pathkey;
-		phe = hsearch(he, FIND);
-		if (phe == NULL) {
-			pspotsize = (struct spotsize_struct *) malloc(sizeof(struct spotsize_struct));
-			pspotsize->p[0] 	= pray->p[0];
-			pspotsize->p[1] 	= pray->p[1];
-			pspotsize->p[2] 	= pray->p[2];
-			pspotsize->n 		= 1;
-			pspotsize->rms_v[0] 	= 0.0;
-			pspotsize->rms_v[1] 	= 0.0;
-			pspotsize->rms_v[2] 	= 0.0;
-			pspotsize->rms 		= 0.0;
-			list_add(&(pspotsize->spotsize_list), &spotsize_list);
-			he.key = (char *) pray->pathkey;
-			he.data = (void *) pspotsize;
-			if (hsearch (he, ENTER) == NULL) {
-				fprintf (stderr, "hash action ENTER failed: \"%s\"\n", he.key);
-				exit(-1);
-			}
-		} else {
-			pspotsize = (struct spotsize_struct *) phe->data;
-			pspotsize->p[0] += pray->p[0];
-			pspotsize->p[1] += pray->p[1];
-			pspotsize->p[2] += pray->p[2];
-			pspotsize->n++;
-		}
-	}
-
-	//---------------- find the centroid of the spots
-	list_for_each_safe(pos, pos0, &spotsize_list) {
-		pspotsize = list_entry(pos, struct spotsize_struct, spotsize_list);
-		pspotsize->p[0] /= pspotsize->n;
-		pspotsize->p[1] /= pspotsize->n;
-		pspotsize->p[2] /= pspotsize->n;
-	}
-
-	//------------- calculate the sum of squares
-	list_for_each_safe(pos, pos0, &raylist) {
-		pray = list_entry(pos, struct lensy_ray_struct, raylist);
-
-		he.key = (char *) pray->pathkey;
-		phe = hsearch(he, FIND);
-		if (phe == NULL) {
-			fprintf(stderr, "hash action FIND failed: \"%s\"\n", he.key);
-//			exit(-1);
-		} else {
-			pspotsize = (struct spotsize_struct *) phe->data;
-
-			w0[0] = pray->p[0] - pspotsize->p[0];
-			w0[1] = pray->p[1] - pspotsize->p[1];
-			w0[2] = pray->p[2] - pspotsize->p[2];
-
-			pspotsize->rms_v[0] += w0[0] * w0[0];
-			pspotsize->rms_v[1] += w0[1] * w0[1];
-			pspotsize->rms_v[2] += w0[2] * w0[2];
-
-			pspotsize->rms += lensy_inner3(w0, w0);
-		}
-	}
+	n_spots = lensy_spots(&lanes[i0], &spots);
 
-	//---------------- calculate the RMS
-	list_for_each_safe(pos, pos0, &spotsize_list) {
-		pspotsize = list_entry(pos, struct spotsize_struct, spotsize_list);
-
-		pspotsize->rms_v[0] = sqrt(pspotsize->rms_v[0] / pspotsize->n);
-		pspotsize->rms_v[1] = sqrt(pspotsize->rms_v[1] / pspotsize->n);
-		pspotsize->rms_v[2] = sqrt(pspotsize->rms_v[2] / pspotsize->n);
-
-		pspotsize->rms = sqrt(pspotsize->rms / pspotsize->n);
-	}
-	hdestroy ();
-
-	//------------- store in an array and free the spotsize_list
-	list_for_each_safe(pos, pos0, &spotsize_list) {
-		pspotsize = list_entry(pos, struct spotsize_struct, spotsize_list);
-
-		if (pspotsize->n <= 1) continue;
+	for (i = 0; i < n_spots; i++) {
+		if (spots[i].n <= 1) continue;
 
 		if (n_ass < NMAX_ASS) {
-			ass[0][n_ass] = pspotsize->rms_v[0];
-			ass[1][n_ass] = pspotsize->rms_v[1];
-			ass[2][n_ass] = pspotsize->rms_v[2];
+			ass[0][n_ass] = spots[i].rms_v[0];
+			ass[1][n_ass] = spots[i].rms_v[1];
+			ass[2][n_ass] = spots[i].rms_v[2];
 			n_ass++;
 		}
-		// pspotsize->rms is not used?
-
-		list_del(pos);
-		free(pspotsize);
-	}
-
-	//---------------- free the raylist
-	list_for_each_safe(pos, pos0, &raylist) {
-		pray = list_entry(pos, struct lensy_ray_struct, raylist);
-		list_del(pos);
-		free (pray);
 	}
+	free(spots);
 
 	if (make_ll_picture) {
 		//------------- write a FITS file showing the focal plane
@@ -654,6 +581,21 @@ ray_trace_loop:
 		// undo byte swap/sign
 		for (i = 0; i < (ccd1.x_nmax * ccd1.y_nmax); i++)
 			ccd1.b[i] = ntohs(ccd1.b[i]) ^ 0x8000;
+
+		//------------- save the rays at the focal plane, e.g., as the
+		// input of an instrument behind the telescope
+		if (getenv("LENSY_RAYS") != NULL)
+			lensy_rayfile_write(getenv("LENSY_RAYS"), &lanes[i0],
+						"telescope focal plane");
+
+		//------------- and check the errors of the packed form of them
+		lensy_packed_init(&packed);
+		if (lensy_pack(&packed, &lanes[i0]) == 0) {
+			lensy_pack_error(&packed, &lanes[i0], w2);
+			printf ("packed rays: position error %.3lfnm, direction error %.1le rad\n",
+				 w2[0] * 1e9, w2[1]);
+		}
+		lensy_packed_free(&packed);
 	}
 
 	//------ draw x, y axes
@@ -698,16 +640,20 @@ ray_trace_loop:
 		ray.d[1] =  0.0;
 		ray.d[2] =  0.0;
 
-		i = lensy_intersect_paraboloid(&ray, &primary, w0, w2);
+		i = lensy_hit_t_paraboloid(&ray, &primary, &t);
+		lensy_ray_at(&ray, t, w0);
 		ray.p[1] = d0 + optic_scale;
-		i = lensy_intersect_paraboloid(&ray, &primary, w1, w2);
+		i = lensy_hit_t_paraboloid(&ray, &primary, &t);
+		lensy_ray_at(&ray, t, w1);
 		j = (i == 0) ? 255 : 100;
 		line(w0, w1, j, j, j);
 
 		ray.p[1] = d0;
-		i = lensy_intersect_plane(&ray, &ccd1.p, w0, w2);	// &collimator2
+		i = lensy_hit_t_plane(&ray, &ccd1.p, &t);	// &collimator2
+		lensy_ray_at(&ray, t, w0);
 		ray.p[1] =  d0 + optic_scale;
-		i = lensy_intersect_plane(&ray, &ccd1.p, w1, w2);	// &collimator2
+		i = lensy_hit_t_plane(&ray, &ccd1.p, &t);	// &collimator2
+		lensy_ray_at(&ray, t, w1);
 		j = (i == 0) ? 255 : 100;
 		line(w0, w1, j, j, j);
 
@@ -716,9 +662,11 @@ ray_trace_loop:
 		ray.d[2] =  0.0;
 
 		ray.p[1] = d0;
-		i = lensy_intersect_hyperboloid (&ray, &secondary, w0, w2);
+		i = lensy_hit_t_hyperboloid (&ray, &sec[i0], &t);
+		lensy_ray_at(&ray, t, w0);
 		ray.p[1] = d0 + optic_scale;
-		i = lensy_intersect_hyperboloid (&ray, &secondary, w1, w2);
+		i = lensy_hit_t_hyperboloid (&ray, &sec[i0], &t);
+		lensy_ray_at(&ray, t, w1);
 		j = (i == 0) ? 255 : 100;
 		line(w0, w1, j, j, j);
 	}
@@ -745,15 +693,223 @@ ray_trace_loop:
 
 	printf ("spotsize x = %5.0lfum, y = %5.0lfum, z = %5.0lfum\n",
 		 2 * w0[0] * 1e6, 2 * w0[1] * 1e6, 2 * w0[2] * 1e6);
+
+	/*---------------- find the best focus
+	 * The detector position with the smallest spots (RMS), for this focus
+	 * step, is found from the same rays, without tracing them again. The
+	 * focus step with the best focus nearest to the detector is kept for
+	 * the analyses below.
+	 */
+	n_focus = lensy_focus(&lanes[i0], ccd1.p.n, &focus);
+	if (n_focus > 0) {
+		d0 = lensy_focus_best(focus, n_focus, &d1);
+		printf ("best focus at %+.3lfmm, spotsize = %5.0lfum\n",
+			 d0 * 1e3, 2 * d1 * 1e6);
+		if (fabs(d0) < best_shift) {
+			best_shift = fabs(d0);
+			i_best = i0;
+		}
+	}
+	free(focus);
 	SDL_Delay(1);
 	SDL_PumpEvents();
 
-	if (i0++ < 25) {
-		secondary.v[0] += 0.015e-3;
+	if (++i0 < NMAX_CONFIGS) {
 		// do not add to list subsequent calls to the line() function
 		make_ll_picture = false;
 		goto ray_trace_loop;
 	}
+
+	/*---------------- tolerance analysis
+	 * Decenter, tilt and shift the secondary mirror at random (for the
+	 * best focus step), and see how much the spots grow and move.
+	 */
+	memset(tol, 0, sizeof(tol));
+	tol[0].element	= 1;		// the secondary
+	tol[0].decenter	= 0.1e-3;
+	tol[0].tilt	= 0.1e-3;
+	tol[0].despace	= 0.01e-3;
+
+	if ((lensy_tolerance(&sys[i_best], tol, 1, &rays, NMAX_SAMPLES, 1, 0, samples) == 0) &&
+	    (lensy_sample_quantiles(samples, NMAX_SAMPLES, q, 3, rms_q, shift_q) == 0)) {
+		printf ("tolerance spotsize 50%% = %5.0lfum, 90%% = %5.0lfum, max = %5.0lfum\n",
+			 2 * rms_q[0] * 1e6, 2 * rms_q[1] * 1e6, 2 * rms_q[2] * 1e6);
+		printf ("tolerance image shift 50%% = %5.0lfum, 90%% = %5.0lfum, max = %5.0lfum\n",
+			 shift_q[0] * 1e6, shift_q[1] * 1e6, shift_q[2] * 1e6);
+	}
+
+	/*---------------- kernel tiers
+	 * The largest spot centroid shift and RMS change of each kernel tier
+	 * from the reference tier (for the best focus step).
+	 */
+	for (i = LENSY_TIER_FAST; i < LENSY_NMAX_TIERS; i++) {
+		if (lensy_tier_report(&sys[i_best], i, &rays, &tier_report) < 0) continue;
+		printf ("%s tier: %d of %d rays, %d spots, centroid shift %.3lfum, "
+			"RMS change %.3lfum\n", lensy_tier_name(i), tier_report.n_tier,
+			tier_report.n_reference, tier_report.n_spots,
+			tier_report.centroid * 1e6, tier_report.rms * 1e6);
+	}
+	i = lensy_tier_select(&sys[i_best], &rays, 1e-6);
+	if (i >= 0) printf ("fastest tier within 1um: %s\n", lensy_tier_name(i));
+
+	/*---------------- early rejection
+	 * The rays of the best focus step that the aperture bounds reject at
+	 * each element, before the intersection is calculated.
+	 */
+	memcpy(&bench, &sys[i_best], sizeof(bench));
+	bench.line = NULL;
+	bench.reject = &reject;
+	memset(&reject, 0, sizeof(reject));
+	if ((lensy_bundle_clone(&bench_rays, &rays) == 0) &&
+	    (lensy_trace(&bench, &bench_rays) >= 0)) {
+		for (i = 0; i < bench.n; i++) {
+			if (reject.n[i] == 0) continue;
+			printf ("element %2d: %7" PRId64 " of %7" PRId64 " rays rejected early (%.1lf%%)\n",
+				 i, reject.rejected[i], reject.n[i],
+				 100.0 * reject.rejected[i] / reject.n[i]);
+		}
+	}
+	bench.reject = NULL;
+	lensy_bundle_free(&bench_rays);
+
+	/*---------------- non-sequential trace
+	 * The best focus step again, with each ray going to the nearest
+	 * surface it reaches. The primary has the central hole that the beam
+	 * leaves out. Rays that take the sequential path end on the CCD at
+	 * the same point.
+	 */
+	lensy_bundle_get(&rays, 0, &ray);
+	if ((lensy_nonseq_prepare(&nonseq, &bench, &ray) == 0) &&
+	    (lensy_bundle_clone(&bench_rays, &rays) == 0) &&
+	    (lensy_bundle_clone(&bench_ref, &rays) == 0) &&
+	    (lensy_trace(&bench, &bench_ref) >= 0)) {
+		nonseq.hole[0] = 0.254;
+		n = lensy_trace_nonseq(&nonseq, &bench_rays, NULL);
+
+		d0 = 0.0;
+		for (i = 0; (n == bench_ref.n) && (i < n); i++) {
+			for (k = 0; k < 3; k++)
+				w2[k] = bench_rays.p[k][i] - bench_ref.p[k][i];
+			d0 = fmax(d0, lensy_norm3(w2));
+		}
+		printf("non-sequential trace: %d of %d rays absorbed (%d sequential), "
+			"%" PRId64 " escaped, %" PRId64 " lost\n",
+			n, rays.n, bench_ref.n, nonseq.escaped, nonseq.lost);
+		printf("non-sequential trace: %.2lf surfaces intersected per "
+			"interaction, of %d\n",
+			(double) nonseq.tests / nonseq.events, nonseq.sys.n);
+		if (n == bench_ref.n)
+			printf("non-sequential trace: largest difference %.3g um\n", d0 * 1e6);
+	}
+	lensy_bundle_free(&bench_rays);
+	lensy_bundle_free(&bench_ref);
+
+	/*---------------- ghost images
+	 * The same, with the light reflected by the glass surfaces followed as
+	 * weighted branches of the rays, to a separate layer of the CCD.
+	 */
+	memset(&ghosts, 0, sizeof(ghosts));
+	ghosts.ccd = &ccd1;
+	ghosts.detector = nonseq.sys.n - 1;
+	ghosts.min_weight = 0.01;
+	ghosts.seed = 1;
+	if ((lensy_ghost_init(&ghosts) == 0) &&
+	    (lensy_trace_ghosts(&nonseq, &rays, &ghosts) == 0)) {
+		d0 = d1 = 0.0;
+		for (i = 0; i < ccd1.x_nmax * ccd1.y_nmax; i++) {
+			d0 = fmax(d0, ghosts.direct[i]);
+			d1 = fmax(d1, ghosts.ghost[i]);
+		}
+		printf("ghost trace: %.4lf of the light on the CCD directly, %.3g in "
+			"ghosts (%" PRId64 " reflected branches, %" PRId64 " ended by "
+			"roulette)\n", ghosts.w_direct / rays.n, ghosts.w_ghost / rays.n,
+			ghosts.split, ghosts.killed);
+		if (d0 > 0.0)
+			printf("ghost trace: brightest ghost pixel %.3g of the brightest "
+				"direct pixel\n", d1 / d0);
+	}
+	lensy_ghost_free(&ghosts);
+
+	/*---------------- throughput
+	 * The best focus step again, with the reflectivity of the mirrors,
+	 * the AR coated glass surfaces and the absorption of the BK7. The rays
+	 * carry the light that is left as their weights, and the spots and the
+	 * CCD counts are weighted by them.
+	 */
+	if ((lensy_curve_init(&aluminium, 7, al_wl, al_r) == 0) &&
+	    (lensy_curve_init(&ar_coating, 4, ar_wl, ar_t) == 0) &&
+	    (lensy_curve_init(&bk7_absorption, 6, bk7_wl, bk7_alpha) == 0)) {
+		for (i = 0; i < bench.n; i++) {
+			e = &bench.e[i];
+			if (e->redirect == LENSY_REFLECT) e->efficiency = &aluminium;
+			if (e->redirect != LENSY_REFRACT) continue;
+			e->efficiency = &ar_coating;
+			if (e->m0 == &bk7) e->m0 = &bk7_absorbing;
+			if (e->m1 == &bk7) e->m1 = &bk7_absorbing;
+		}
+		memset(&budget, 0, sizeof(budget));
+		bench.budget = &budget;
+		if ((lensy_bundle_clone(&bench_rays, &rays) == 0) &&
+		    (lensy_trace(&bench, &bench_rays) >= 0)) {
+			for (i = 0; i < bench.n; i++)
+				printf("throughput element %d: %.4lf in, %.4lf lost, %.4lf absorbed, "
+					"%.4lf out\n", i, budget.in[i] / rays.n,
+					budget.lost[i] / rays.n,
+					(budget.in[i] - budget.lost[i] - budget.out[i]) / rays.n,
+					budget.out[i] / rays.n);
+
+			n_spots = lensy_spots(&bench_rays, &spots);
+			for (i = 0; i < n_spots; i++)
+				printf("throughput spot %" PRIu64 ": mean ray weight %.4lf, "
+					"spotsize = %5.0lfum\n", spots[i].path,
+					spots[i].weight / spots[i].n, 2 * spots[i].rms * 1e6);
+			free(spots);
+
+			memcpy(&ccd2, &ccd1, sizeof(ccd2));
+			ccd2.b = (uint16_t *) calloc(1, ccd1.b_size);
+			if (ccd2.b != NULL) {
+				n = lensy_ccd_add(&ccd2, &bench_rays, 100);
+				for (i = 0, counts = 0; i < ccd2.x_nmax * ccd2.y_nmax; i++)
+					counts += ccd2.b[i];
+				printf("throughput: %" PRId64 " CCD counts from %d rays at 100 "
+					"counts per ray\n", counts, n);
+				free(ccd2.b);
+			}
+		}
+		bench.budget = NULL;
+		lensy_bundle_free(&bench_rays);
+	}
+
+	/*---------------- streaming trace
+	 * Trace a million single photons through the best focus step, in
+	 * chunks, without keeping them, and find the spot sizes from the
+	 * running sums. The photons are made, traced and added up in a
+	 * pipeline of threads.
+	 */
+	sys[i_best].line = NULL;
+	srand48(1);
+	n_photons = NMAX_PHOTONS;
+	lensy_spotsum_init(&spotsum);
+	memset(&stream, 0, sizeof(stream));
+	stream.spots = &spotsum;
+
+	if (lensy_stream_pipeline(&sys[i_best], photon_source, NULL, 0, 0, &stream) == 0) {
+		n_spots = lensy_spotsum_spots(&spotsum, &spots);
+		printf ("streamed %" PRIu64 " photons, %" PRIu64 " at the focal plane\n",
+			 stream.n_in, stream.n_out);
+		for (i = 0; i < n_spots; i++)
+			printf ("streamed spot %" PRIu64 ": spotsize = %5.0lfum\n",
+				 spots[i].path, 2 * spots[i].rms * 1e6);
+		free(spots);
+
+		for (i = 0; i < LENSY_PIPE_NQUEUES; i++)
+			printf ("pipeline queue %d: %.1lf chunks waiting, "
+				"%" PRIu64 " waits to get\n", i,
+				 stream.queue[i].occupancy, stream.queue[i].n_empty);
+	}
+	lensy_bundle_free(&stream.b);
+	lensy_spotsum_free(&spotsum);
+
 	SDL_Delay(500);
 /*
 	printf ("press enter...");
@@ -0,0 +1,122 @@
+/*
+ * test_budget.c - v1.4 (codename FlamingMarshmallow)
+ *
+ * Trace a beam onto a grating with several orders, some of which cannot
+ * leave it and some of which miss the detector, and check that the
+ * throughput budget balances at each element: no more weight leaves an
+ * element than reaches it, and what the grating passes on is its share
+ * of the orders times its efficiency.
+ *
+ *-----------------------------------------------------------------------
+ * Copyright (C) 2013 - 2015 FSF
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *-----------------------------------------------------------------------
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lensy.h"
+
+
+#define	EPS	1e-9		// relative tolerance of the sums
+
+
+int main(void)
+{
+	/*
+	 * A grating of 500 lines/mm at normal incidence, in the orders -5 to
+	 * +5 at 600 nm: the orders -3 to +3 leave it, and of those only -1,
+	 * 0 and +1 reach the detector.
+	 */
+	struct lensy_plane_struct grating = {
+		{ 0.0, 0.0, 0.0 }, { 1.0, 0.0, 0.0 }, 1.0 };
+	struct lensy_plane_struct detector = {
+		{ 0.5, 0.0, 0.0 }, { 1.0, 0.0, 0.0 }, 0.5 };
+	double a[3] = { 0.0, 2e-6, 0.0 };
+	double wl[2] = { 400e-9, 800e-9 };
+	double e_grating[2] = { 0.7, 0.7 };
+	double e_detector[2] = { 0.9, 0.9 };
+	struct lensy_curve_struct c_grating, c_detector;
+	struct lensy_system_struct sys;
+	struct lensy_budget_struct budget;
+	struct lensy_bundle_struct rays;
+	struct lensy_ray_struct ray;
+	double in, absorbed, sum;
+	int32_t i, j, n, fail;
+
+	lensy_system_init(&sys);
+	lensy_add_diffract(&sys, LENSY_PLANE, &grating, a, -5, +5);
+	lensy_add_impact(&sys, LENSY_PLANE, &detector);
+	if ((lensy_curve_init(&c_grating, 2, wl, e_grating) < 0) ||
+	    (lensy_curve_init(&c_detector, 2, wl, e_detector) < 0))
+		return 1;
+	sys.e[0].efficiency = &c_grating;
+	sys.e[1].efficiency = &c_detector;
+	memset(&budget, 0, sizeof(budget));
+	sys.budget = &budget;
+
+	memset(&ray, 0, sizeof(ray));
+	ray.p[0] = 1.0;
+	ray.d[0] = -1.0;
+	ray.wavelength = 600e-9;
+	ray.green = 200;
+	if (lensy_bundle_init(&rays, 1) < 0) return 1;
+	n = lensy_beam_bundle(&rays, &ray, 0.1, 0.005, 0);
+	if ((n <= 0) || (lensy_trace(&sys, &rays) < 0)) return 1;
+
+	fail = 0;
+	for (j = 0; j < sys.n; j++) {
+		in = budget.in[j];
+		absorbed = in - budget.lost[j] - budget.out[j];
+		if ((in <= 0.0) || (absorbed < -EPS * in)) {
+			printf("%s: element %d: %.3lf in, %.3lf lost, %.3lf out\n",
+				__FILE__, j, in, budget.lost[j], budget.out[j]);
+			fail = 1;
+		}
+	}
+
+	//------ the grating: 4 of 11 orders lost, 7 passed on at 0.7
+	if ((fabs(budget.in[0] - n) > EPS * n) ||
+	    (fabs(budget.lost[0] - n * 4.0 / 11.0) > EPS * n) ||
+	    (fabs(budget.out[0] - n * 7.0 / 11.0 * 0.7) > EPS * n)) {
+		printf("%s: grating: %.3lf in, %.3lf lost, %.3lf out of %d rays\n",
+			__FILE__, budget.in[0], budget.lost[0], budget.out[0], n);
+		fail = 1;
+	}
+
+	//------ what the grating passed on reached the detector
+	if (fabs(budget.in[1] - budget.out[0]) > EPS * n) {
+		printf("%s: %.3lf passed on, %.3lf reached the detector\n",
+			__FILE__, budget.out[0], budget.in[1]);
+		fail = 1;
+	}
+
+	//------ the detected weight is what the detector passed on
+	sum = 0.0;
+	for (i = 0; i < rays.n; i++) sum += rays.weight[i];
+	if ((rays.n != 3 * n) || (fabs(sum - budget.out[1]) > EPS * n)) {
+		printf("%s: %d rays detected (of %d), with %.3lf against %.3lf\n",
+			__FILE__, rays.n, 3 * n, sum, budget.out[1]);
+		fail = 1;
+	}
+
+	lensy_bundle_free(&rays);
+	lensy_pattern_flush();
+
+	printf("%s: %s\n", __FILE__, fail ? "FAILED" : "ok");
+	return fail;
+}
@@ -0,0 +1,138 @@
+/*
+ * test_cache.c - v1.4 (codename FlamingMarshmallow)
+ *
+ * Trace a telescope with the result cache, open the cache again (as a
+ * later run of a program would), and check that the second trace is a
+ * hit, and that its rays are the same as those of a fresh lensy_trace().
+ * The mirror has a reflectance curve, so the rays are weighted.
+ *
+ *-----------------------------------------------------------------------
+ * Copyright (C) 2013 - 2015 FSF
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *-----------------------------------------------------------------------
+ */
+
+#define _XOPEN_SOURCE 700
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "lensy.h"
+
+
+/*------------------------------------------------------- remove_entry
+ * nftw() callback that removes the cache directory.
+ */
+static int remove_entry(const char *path, const struct stat *st, int flag,
+				struct FTW *ftw)
+{
+	return remove(path);
+}
+
+
+/*------------------------------------------------------- same_rays
+ * Return true if the bundles hold the same rays, bit for bit.
+ */
+static bool same_rays(struct lensy_bundle_struct *a, struct lensy_bundle_struct *b)
+{
+	int32_t k;
+
+	if (a->n != b->n) return false;
+	for (k = 0; k < 3; k++) {
+		if (memcmp(a->p[k], b->p[k], a->n * sizeof(double)) != 0) return false;
+		if (memcmp(a->d[k], b->d[k], a->n * sizeof(double)) != 0) return false;
+	}
+	return (memcmp(a->wavelength, b->wavelength, a->n * sizeof(double)) == 0) &&
+	       (memcmp(a->path, b->path, a->n * sizeof(uint64_t)) == 0) &&
+	       (memcmp(a->weight, b->weight, a->n * sizeof(double)) == 0) &&
+	       (memcmp(a->red, b->red, a->n) == 0) &&
+	       (memcmp(a->green, b->green, a->n) == 0) &&
+	       (memcmp(a->blue, b->blue, a->n) == 0);
+}
+
+
+int main(void)
+{
+	char dir[] = "/tmp/lensy_test_cache.XXXXXX";
+	struct lensy_paraboloid_struct primary = {
+		{ 0.0, 0.0, 0.0 }, { 2.0, 0.0, 0.0 }, 2.2 };
+	struct lensy_plane_struct detector = {
+		{ 1.98, 0.0, 0.0 }, { 1.0, 0.0, 0.0 }, 0.5 };
+	double wl[2] = { 400e-9, 800e-9 };
+	double r[2] = { 0.9, 0.8 };
+	struct lensy_curve_struct reflectance;
+	struct lensy_system_struct sys;
+	struct lensy_bundle_struct rays, b0, b1, b2;
+	struct lensy_ray_struct ray;
+	struct lensy_cache_struct c;
+	bool hit0, hit1;
+	int32_t fail;
+
+	if (mkdtemp(dir) == NULL) return 1;
+
+	lensy_system_init(&sys);
+	lensy_add_reflect(&sys, LENSY_PARABOLOID, &primary);
+	lensy_add_impact(&sys, LENSY_PLANE, &detector);
+	if (lensy_curve_init(&reflectance, 2, wl, r) < 0) return 1;
+	sys.e[0].efficiency = &reflectance;
+
+	memset(&ray, 0, sizeof(ray));
+	ray.p[0] = 1.0;
+	ray.d[0] = -1.0;
+	ray.d[1] = 2e-4;
+	ray.wavelength = 600e-9;
+	ray.green = 200;
+	if (lensy_bundle_init(&rays, 1) < 0) return 1;
+	lensy_beam_bundle(&rays, &ray, 2.1, 0.07, 0);
+
+	if ((lensy_bundle_init(&b0, 1) < 0) || (lensy_bundle_init(&b1, 1) < 0) ||
+	    (lensy_bundle_init(&b2, 1) < 0) ||
+	    (lensy_bundle_clone(&b0, &rays) < 0) || (lensy_bundle_clone(&b1, &rays) < 0) ||
+	    (lensy_bundle_clone(&b2, &rays) < 0))
+		return 1;
+
+	//------ a miss that stores the entry, then a hit from a new cache
+	fail = 0;
+	if ((lensy_cache_init(&c, dir, 1 << 24) < 0) ||
+	    (lensy_cache_trace(&c, &sys, &b0, NULL, 0, &hit0) < 0))
+		fail = 1;
+	if ((lensy_cache_init(&c, dir, 1 << 24) < 0) ||
+	    (lensy_cache_trace(&c, &sys, &b1, NULL, 0, &hit1) < 0))
+		fail = 1;
+	if (hit0 || !hit1) {
+		printf("%s: first trace %s, second %s\n", __FILE__,
+			hit0 ? "hit" : "missed", hit1 ? "hit" : "missed");
+		fail = 1;
+	}
+
+	lensy_trace(&sys, &b2);
+	if ((b2.n == 0) || (b2.weight[0] == 1.0) ||
+	    !same_rays(&b1, &b2) || !same_rays(&b0, &b2)) {
+		printf("%s: the cached rays differ from a fresh trace (%d rays)\n",
+			__FILE__, b2.n);
+		fail = 1;
+	}
+
+	lensy_bundle_free(&rays);
+	lensy_bundle_free(&b0);
+	lensy_bundle_free(&b1);
+	lensy_bundle_free(&b2);
+	lensy_pattern_flush();
+	nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+	printf("%s: %s\n", __FILE__, fail ? "FAILED" : "ok");
+	return fail;
+}
@@ -0,0 +1,60 @@
+/*
+ * test_cone.c - v1.4 (codename FlamingMarshmallow)
+ *
+ * Check that lensy_cone_count() gives the number of rays that
+ * lensy_cone_bundle() makes, also for cones wider than 360 degrees,
+ * where the rings past 180 degrees have no rays.
+ *
+ *-----------------------------------------------------------------------
+ * Copyright (C) 2013 - 2015 FSF
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *-----------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lensy.h"
+
+
+int main(void)
+{
+	double dia[] = { 10.0, 90.0, 359.0, 361.0, 400.0, 540.0, 720.0 };
+	struct lensy_bundle_struct b;
+	struct lensy_ray_struct ray;
+	int32_t i, n, count, fail;
+
+	memset(&ray, 0, sizeof(ray));
+	ray.d[0] = 0.1;
+	ray.d[2] = 1.0;
+	ray.wavelength = 500e-9;
+
+	fail = 0;
+	for (i = 0; i < (int32_t) (sizeof(dia) / sizeof(dia[0])); i++) {
+		if (lensy_bundle_init(&b, 1) < 0) return 1;
+		count = lensy_cone_count(dia[i], 7.0);
+		n = lensy_cone_bundle(&b, &ray, dia[i], 7.0, 0);
+		if ((n != count) || (b.n != count)) {
+			printf("%s: cone of %.0lf degrees: %d rays, counted %d\n",
+				__FILE__, dia[i], n, count);
+			fail = 1;
+		}
+		lensy_bundle_free(&b);
+	}
+	lensy_pattern_flush();
+
+	printf("%s: %s\n", __FILE__, fail ? "FAILED" : "ok");
+	return fail;
+}
@@ -0,0 +1,113 @@
+/*
+ * test_sweep.c - v1.4 (codename FlamingMarshmallow)
+ *
+ * Run a sweep in worker processes, with one point that crashes its
+ * worker, and check the results, that the crashed point is done when the
+ * sweep file is opened and run again, and that a child of the program
+ * that is not a worker is left for the program to wait for.
+ *
+ *-----------------------------------------------------------------------
+ * Copyright (C) 2013 - 2015 FSF
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *-----------------------------------------------------------------------
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "lensy.h"
+
+#define	N_POINTS	50
+#define	CRASH_POINT	7
+
+
+/*------------------------------------------------------- point
+ * The result of point k is k * k, and CRASH_POINT kills its worker if
+ * '*arg' is set.
+ */
+static int32_t point(int32_t k, void *arg, void *result)
+{
+	double v;
+
+	if ((k == CRASH_POINT) && *(int *) arg) kill(getpid(), SIGKILL);
+	v = (double) k * k;
+	memcpy(result, &v, sizeof(v));
+	return 0;
+}
+
+
+int main(void)
+{
+	char path[] = "/tmp/lensy_test_sweep.XXXXXX";
+	struct lensy_sweep_struct s;
+	int32_t k, n, fail;
+	double *v;
+	int crash, status, fd;
+	pid_t child;
+
+	fd = mkstemp(path);
+	if (fd < 0) return 1;
+	close(fd);
+	fail = 0;
+
+	//------ a child of the program's own, which exits at once
+	child = fork();
+	if (child == 0) _exit(42);
+
+	crash = 1;
+	if (lensy_sweep_open(&s, path, N_POINTS, sizeof(double)) < 0) return 1;
+	n = lensy_sweep_run(&s, 4, point, &crash);
+	if ((n != N_POINTS - 1) || (lensy_sweep_result(&s, CRASH_POINT) != NULL)) {
+		printf("%s: %d points done with a crash\n", __FILE__, n);
+		fail = 1;
+	}
+	lensy_sweep_close(&s);
+
+	if ((waitpid(child, &status, 0) != child) || !WIFEXITED(status) ||
+	    (WEXITSTATUS(status) != 42)) {
+		printf("%s: the sweep waited for a child that is not a worker\n", __FILE__);
+		fail = 1;
+	}
+
+	//------ again, from the sweep file
+	crash = 0;
+	if (lensy_sweep_open(&s, path, N_POINTS, sizeof(double)) < 0) return 1;
+	n = lensy_sweep_run(&s, 4, point, &crash);
+	if (n != N_POINTS) {
+		printf("%s: %d points done after the restart\n", __FILE__, n);
+		fail = 1;
+	}
+	for (k = 0; k < N_POINTS; k++) {
+		v = (double *) lensy_sweep_result(&s, k);
+		if ((v == NULL) || (*v != (double) k * k)) {
+			printf("%s: wrong result for point %d\n", __FILE__, k);
+			fail = 1;
+		}
+	}
+	lensy_sweep_close(&s);
+
+	if (lensy_sweep_open(&s, path, N_POINTS + 1, sizeof(double)) != -2) {
+		printf("%s: the sweep file was taken for a different sweep\n", __FILE__);
+		fail = 1;
+	}
+	unlink(path);
+
+	printf("%s: %s\n", __FILE__, fail ? "FAILED" : "ok");
+	return fail;
+}